@@ -121,11 +121,21 @@ FFI_ReadResult_N_32 FFI_amo_0(AmoOperationType operation, uint32_t addr, uint32_
 }
 
 FFI_ReadResult_N_32 FFI_load_reserved_0(uint32_t addr) {
-    assert(false && "TODO: lr");
+    uint32_t data = 0;
+    int ret = mem_cb_vtable->lr_mem_4(mem_cb_data, addr, &data);
+    FFI_ReadResult_N_32 value = {
+        .success = !ret,
+        .data = data,
+    };
+    return value;
 }
 
 bool FFI_store_conditional_0(uint32_t addr, uint32_t data) {
-    assert(false && "TODO: sc");
+    uint32_t sc_result = 1;
+    int ret = mem_cb_vtable->sc_mem_4(mem_cb_data, addr, data, &sc_result);
+    // ASL model has no access fault path for SC,
+    // a faulted SC is reported as a failed SC.
+    return !ret && sc_result == 0;
 }
 
 unsigned _BitInt(1) FFI_machine_time_interrupt_pending_0() {
@@ -223,6 +233,7 @@ static void* model_create(
     cb_debug_log = info->debug_log;
     trace_buffer.valid = 0;
     ASL_ResetConfigAndState_0();
+    ASL_SetConfigHartId_0(info->hartid);
 
     // return something random non-null to indicate success
     return &instance_mutex;
@@ -19,6 +19,9 @@ fn main() {
         .write_to_file(out_path.join("pokedex_interface.rs"))
         .expect("can not write to pokedex_interface.rs");
 
+    // block compression of the trace uses the system libzstd
+    println!("cargo::rustc-link-lib=zstd");
+
     if std::env::var("CARGO_FEATURE_BUNDLED_MODEL_LIB").is_ok() {
         let env_name = "POKEDEX_MODEL_LIB";
         let pokedex_model_lib = std::env::var(env_name).unwrap();
@@ -9,7 +9,7 @@
 extern "C" {
 #endif
 
-#define POKEDEX_ABI_VERSION "2025-12-09"
+#define POKEDEX_ABI_VERSION "2026-10-19"
 
 #define POKEDEX_AMO_SWAP 0
 #define POKEDEX_AMO_ADD 1
@@ -49,6 +49,12 @@ struct pokedex_create_info {
     // following debug options only effectful if debug_log is not NULL
 
     uint8_t debug_inst_issue;
+
+    // value of mhartid CSR
+    //
+    // NOTE: the model uses global variables, one dylib could create only one instance at a time.
+    // Simulating multiple harts requires loading a separate copy of the dylib per hart.
+    uint32_t hartid;
 };
 
 struct pokedex_model_description {
@@ -158,8 +164,14 @@ struct pokedex_mem_callback_vtable {
     int (*write_mem_1)(void* cb_data, uint32_t addr, uint8_t value);
     int (*write_mem_2)(void* cb_data, uint32_t addr, uint16_t value);
     int (*write_mem_4)(void* cb_data, uint32_t addr, uint32_t value);
+    // AMO is performed atomically by the callee, ret is the old memory value.
     int (*amo_mem_4)(void* cb_data, uint32_t addr, uint8_t amo_op, uint32_t value, uint32_t* ret);
+
+    // LR loads the value and registers a reservation on addr.
     int (*lr_mem_4)(void* cb_data, uint32_t addr, uint32_t* ret);
+
+    // SC stores only if the reservation is still valid, and always invalidates it.
+    // ret is 0 if the store succeeds, 1 otherwise (the same as rd of sc.w).
     int (*sc_mem_4)(void* cb_data, uint32_t addr, uint32_t value, uint32_t* ret);
 };
 
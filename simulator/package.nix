@@ -1,6 +1,7 @@
 {
   lib,
   rustPlatform,
+  zstd,
   rust-analyzer,
   clippy,
 }:
@@ -23,6 +24,7 @@ rustPlatform.buildRustPackage (finalAttr: {
 
   buildInputs = [
     rustPlatform.bindgenHook
+    zstd
   ];
 
   passthru.shell = finalAttr.overrideAttrs (old: {
@@ -2,7 +2,10 @@ use std::{ops::Range, path::Path};
 
 use anyhow::{Context as _, bail};
 
-use crate::bus::{AddressSpaceDescNode, Addressable, Bus, MMIOAddrDecoder, NaiveMemory};
+use crate::bus::{
+    AddressSpaceDescNode, Addressable, Bus, MMIOAddrDecoder, NaiveMemory, ReservationSet,
+    shared::{SharedDevice, SharedMemory},
+};
 
 #[derive(Debug, knuffel::Decode)]
 struct MmapConfig {
@@ -41,6 +44,19 @@ struct PokedexConfig {
 }
 
 pub fn load_from_config_str(path: &str, content: &str) -> anyhow::Result<Bus> {
+    let mut buses = load_shared_from_config_str(path, content, 1)?;
+    Ok(buses.pop().unwrap())
+}
+
+// Build one bus per hart. When there are multiple harts,
+// SRAM and MMIO devices are shared among all buses.
+pub fn load_shared_from_config_str(
+    path: &str,
+    content: &str,
+    harts: usize,
+) -> anyhow::Result<Vec<Bus>> {
+    assert!(harts >= 1);
+
     let config: PokedexConfig = knuffel::parse(path, content)?;
 
     let configuration = [
@@ -61,7 +77,8 @@ pub fn load_from_config_str(path: &str, content: &str) -> anyhow::Result<Bus> {
         },
     ];
 
-    let mut segments = Vec::new();
+    let mut segments: Vec<Vec<(Range<u32>, Box<dyn Addressable>)>> =
+        (0..harts).map(|_| Vec::new()).collect();
     let mut exit_state = None;
     for node in configuration {
         match node {
@@ -70,22 +87,36 @@ pub fn load_from_config_str(path: &str, content: &str) -> anyhow::Result<Bus> {
                 base,
                 length,
             } => {
-                let naive_memory = NaiveMemory::new(length as usize);
-                let boxed: Box<dyn Addressable> = Box::new(naive_memory);
-                segments.push(((base..(base + length)), boxed))
+                let range = base..(base + length);
+                if harts == 1 {
+                    let naive_memory = NaiveMemory::new(length as usize);
+                    segments[0].push((range, Box::new(naive_memory)));
+                } else {
+                    let shared_memory = SharedMemory::new(length as usize);
+                    for hart_segments in &mut segments {
+                        hart_segments.push((range.clone(), Box::new(shared_memory.clone())));
+                    }
+                }
             }
             AddressSpaceDescNode::Mmio { base, length, mmap } => {
+                let range = base..base + length;
                 let (mmio_decoder, controllers) = MMIOAddrDecoder::try_build_from(&mmap)?;
                 exit_state = Some(controllers);
-                let boxed: Box<dyn Addressable> = Box::new(mmio_decoder);
-                segments.push(((base..base + length), boxed))
+                if harts == 1 {
+                    segments[0].push((range, Box::new(mmio_decoder)));
+                } else {
+                    let shared_mmio = SharedDevice::new(Box::new(mmio_decoder));
+                    for hart_segments in &mut segments {
+                        hart_segments.push((range.clone(), Box::new(shared_mmio.clone())));
+                    }
+                }
             }
         }
     }
 
     let mut overlapped_segment = None;
     let mut unchecked_index: Vec<Range<u32>> =
-        segments.iter().map(|(index, _)| index.clone()).collect();
+        segments[0].iter().map(|(index, _)| index.clone()).collect();
     unchecked_index.sort_by_key(|range| range.start);
     for window in unchecked_index.windows(2) {
         let addr1 = &window[0];
@@ -103,11 +134,17 @@ pub fn load_from_config_str(path: &str, content: &str) -> anyhow::Result<Bus> {
         )
     }
 
-    Ok(Bus {
-        address_space: segments,
-        exit_state: exit_state.unwrap(),
-        reset_vector: config.reset_vector,
-    })
+    let exit_state = exit_state.unwrap();
+    Ok(segments
+        .into_iter()
+        .zip(ReservationSet::for_harts(harts))
+        .map(|(address_space, reservation)| Bus {
+            address_space,
+            exit_state: exit_state.clone(),
+            reset_vector: config.reset_vector,
+            reservation,
+        })
+        .collect())
 }
 
 pub fn load_from_config_path(config_path: &Path) -> anyhow::Result<Bus> {
@@ -117,3 +154,11 @@ pub fn load_from_config_path(config_path: &Path) -> anyhow::Result<Bus> {
     load_from_config_str(&config_path_str, &config_content)
         .with_context(|| format!("in parsing {config_path_str}"))
 }
+
+pub fn load_shared_from_config_path(config_path: &Path, harts: usize) -> anyhow::Result<Vec<Bus>> {
+    let config_content = std::fs::read_to_string(config_path)
+        .with_context(|| format!("failed to read {config_path:?}"))?;
+    let config_path_str = config_path.display().to_string();
+    load_shared_from_config_str(&config_path_str, &config_content, harts)
+        .with_context(|| format!("in parsing {config_path_str}"))
+}
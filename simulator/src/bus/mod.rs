@@ -3,15 +3,17 @@ use std::{
     path::Path,
     sync::{
         Arc,
-        atomic::{AtomicU64, Ordering},
+        atomic::{AtomicU32, AtomicU64, Ordering},
     },
 };
 
 use anyhow::{bail, ensure};
 use tracing::debug;
+use zerocopy::IntoBytes;
 
 mod elf;
 mod loader;
+mod shared;
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub enum AtomicOp {
@@ -24,6 +26,8 @@ pub enum AtomicOp {
     Minu,
     Max,
     Maxu,
+    // used by SC, stores core_value only if memory still holds `expected`
+    CompareSwap { expected: u32 },
 }
 
 impl AtomicOp {
@@ -38,6 +42,107 @@ impl AtomicOp {
             AtomicOp::Max => i32::max(mem_value as i32, core_value as i32) as u32,
             AtomicOp::Minu => u32::min(mem_value, core_value),
             AtomicOp::Maxu => u32::max(mem_value, core_value),
+            AtomicOp::CompareSwap { expected } => {
+                if mem_value == expected {
+                    core_value
+                } else {
+                    mem_value
+                }
+            }
+        }
+    }
+
+    // Perform the operation with a host atomic instruction, return the old value.
+    // Results are the same as `do_arith_u32`.
+    pub fn do_atomic_u32(self, target: &AtomicU32, core_value: u32) -> u32 {
+        const ORD: Ordering = Ordering::AcqRel;
+
+        let signed = |f: fn(i32, i32) -> i32| {
+            target
+                .fetch_update(ORD, Ordering::Acquire, |x| {
+                    Some(f(x as i32, core_value as i32) as u32)
+                })
+                .unwrap()
+        };
+
+        match self {
+            AtomicOp::Swap => target.swap(core_value, ORD),
+            AtomicOp::Add => target.fetch_add(core_value, ORD),
+            AtomicOp::And => target.fetch_and(core_value, ORD),
+            AtomicOp::Or => target.fetch_or(core_value, ORD),
+            AtomicOp::Xor => target.fetch_xor(core_value, ORD),
+            AtomicOp::Min => signed(i32::min),
+            AtomicOp::Max => signed(i32::max),
+            AtomicOp::Minu => target.fetch_min(core_value, ORD),
+            AtomicOp::Maxu => target.fetch_max(core_value, ORD),
+            AtomicOp::CompareSwap { expected } => {
+                match target.compare_exchange(expected, core_value, ORD, Ordering::Acquire) {
+                    Ok(x) | Err(x) => x,
+                }
+            }
+        }
+    }
+}
+
+/// LR/SC reservations of the harts sharing one memory, a slot per hart.
+///
+/// A reservation is address based, as in Spike: SC succeeds if its hart still holds
+/// a reservation of the same word. It is broken by any SC and by a trap of its hart,
+/// and by a store of another hart to the word. Stores of the hart itself keep it.
+///
+/// Known deviation: SC reads the word, takes the reservation and then stores with
+/// a compare-and-swap against the read value. A store of another hart landing inside
+/// that window either fails the SC, or is lost if it wrote the value already there.
+#[derive(Debug, Clone)]
+pub struct ReservationSet {
+    // RESERVED | word address, or 0 if there is no reservation
+    slots: Arc<[AtomicU64]>,
+    hart: usize,
+}
+
+const RESERVED: u64 = 1 << 32;
+
+impl ReservationSet {
+    // One set per hart, all sharing the same slots
+    pub fn for_harts(harts: usize) -> Vec<Self> {
+        let slots: Arc<[AtomicU64]> = (0..harts).map(|_| AtomicU64::new(0)).collect();
+        (0..harts)
+            .map(|hart| Self {
+                slots: slots.clone(),
+                hart,
+            })
+            .collect()
+    }
+
+    pub fn reserve(&self, addr: u32) {
+        self.slots[self.hart].store(RESERVED | (addr & !3) as u64, Ordering::SeqCst);
+    }
+
+    // SC always invalidates the reservation, whether it succeeds or not.
+    // Returns whether addr was reserved.
+    pub fn take(&self, addr: u32) -> bool {
+        self.slots[self.hart].swap(0, Ordering::SeqCst) == RESERVED | addr as u64
+    }
+
+    pub fn clear(&self) {
+        self.slots[self.hart].store(0, Ordering::SeqCst);
+    }
+
+    // Break the reservations of other harts on words touched by a store.
+    // It should be called before the store, see the deviation above.
+    pub fn invalidate_others(&self, addr: u32, len: usize) {
+        for (hart, slot) in self.slots.iter().enumerate() {
+            let reserved = slot.load(Ordering::SeqCst);
+            if hart == self.hart || reserved == 0 {
+                continue;
+            }
+
+            let word = (reserved as u32) as u64;
+            let (start, end) = ((addr & !3) as u64, addr as u64 + len as u64);
+            if (start..end).contains(&word) {
+                // lost only to a newer reservation of that hart, which is not ours to break
+                let _ = slot.compare_exchange(reserved, 0, Ordering::SeqCst, Ordering::SeqCst);
+            }
         }
     }
 }
@@ -61,6 +166,8 @@ pub struct Bus {
     address_space: Vec<(Range<u32>, Box<dyn Addressable>)>,
     exit_state: Arc<AtomicU64>,
     reset_vector: Option<u32>,
+    // LR/SC reservation of the hart on this bus, shared with the other harts
+    reservation: ReservationSet,
 }
 
 impl Bus {
@@ -68,6 +175,11 @@ impl Bus {
         loader::load_from_config_path(config_path)
     }
 
+    // Load one bus per hart, all of them share the same SRAM and MMIO devices
+    pub fn load_shared_from_config(config_path: &Path, harts: usize) -> anyhow::Result<Vec<Self>> {
+        loader::load_shared_from_config_path(config_path, harts)
+    }
+
     pub fn load_from_default_config() -> Self {
         let default_config_content = include_str!("../../assets/configs.kdl");
         loader::load_from_config_str("embedded-default-config.kdl", default_config_content)
@@ -84,6 +196,18 @@ impl Bus {
         self.reset_vector
     }
 
+    pub fn reservation(&self) -> &ReservationSet {
+        &self.reservation
+    }
+
+    // Restore memory and devices to the power-on state, so that the bus could run another program
+    pub fn reset(&mut self) {
+        for (_, device) in &mut self.address_space {
+            device.do_reset();
+        }
+        self.exit_state.store(0, Ordering::Release);
+    }
+
     // None indicates it still runs
     pub fn try_get_exit_code(&self) -> Option<u32> {
         let raw_state = self.exit_state.load(Ordering::Acquire);
@@ -126,6 +250,22 @@ impl Bus {
         device.do_bus_write(offset, data)
     }
 
+    // addr must be 4-byte aligned, return the old value
+    pub fn atomic(&mut self, addr: u32, op: AtomicOp, value: u32) -> Result<u32, BusError> {
+        let result = self
+            .address_space
+            .iter_mut()
+            .find(|(addr_space, _)| addr_space.contains(&addr));
+
+        let Some((addr_space, device)) = result else {
+            return Err(BusError::DecodeError);
+        };
+
+        let offset = addr - addr_space.start;
+
+        device.do_atomic(offset, op, value)
+    }
+
     pub fn debugger_read(&self, addr: u32, data: &mut [u8]) -> usize {
         let result = self
             .address_space
@@ -166,65 +306,147 @@ pub trait Addressable: Send {
     fn do_bus_read(&mut self, offset: u32, dest: &mut [u8]) -> Result<(), BusError>;
     fn do_bus_write(&mut self, offset: u32, data: &[u8]) -> Result<(), BusError>;
 
+    // Atomically apply op to the aligned u32 at offset, return the old value.
+    // The default implementation is a plain read-modify-write, which is fine for MMIO.
+    fn do_atomic(&mut self, offset: u32, op: AtomicOp, value: u32) -> Result<u32, BusError> {
+        let mut read_bytes = [0; 4];
+        self.do_bus_read(offset, &mut read_bytes)?;
+        let read_value = u32::from_le_bytes(read_bytes);
+
+        let write_value = op.do_arith_u32(read_value, value);
+        self.do_bus_write(offset, &write_value.to_le_bytes())?;
+
+        Ok(read_value)
+    }
+
     // return the size of read data
     fn do_debugger_read(&self, offset: u32, dest: &mut [u8]) -> usize {
         let _ = (offset, dest);
         0
     }
+
+    // restore the power-on state
+    fn do_reset(&mut self) {}
+}
+
+// Zero the memory. Pages fully covered by the slice are given back to the OS,
+// so the cost is proportional to touched pages instead of the memory size.
+pub(crate) fn zero_memory(memory: &mut [u32]) {
+    #[cfg(target_os = "linux")]
+    {
+        const PAGE_SIZE: usize = 4096;
+
+        let start = memory.as_mut_ptr() as usize;
+        let end = start + std::mem::size_of_val(memory);
+        let page_start = start.next_multiple_of(PAGE_SIZE);
+        let page_end = end / PAGE_SIZE * PAGE_SIZE;
+
+        if page_start < page_end {
+            // SAFETY: the range is inside the exclusively borrowed slice.
+            // MADV_DONTNEED on private anonymous memory makes pages read as zero afterwards.
+            let ret = unsafe {
+                libc::madvise(
+                    page_start as *mut libc::c_void,
+                    page_end - page_start,
+                    libc::MADV_DONTNEED,
+                )
+            };
+            if ret == 0 {
+                let head = (page_start - start) / 4;
+                let tail = (page_end - start) / 4;
+                memory[..head].fill(0);
+                memory[tail..].fill(0);
+                return;
+            }
+        }
+    }
+
+    memory.fill(0);
 }
 
+// Atomic operations reinterpret memory words as host u32
+const _: () = assert!(cfg!(target_endian = "little"));
+
 #[derive(Debug)]
 pub struct NaiveMemory {
-    memory: Vec<u8>,
+    // backed by u32 words, so that aligned words could be accessed by host atomics
+    memory: Vec<u32>,
+    length: u32,
 }
 
 impl NaiveMemory {
     pub fn new(size: usize) -> Self {
         Self {
-            memory: vec![0u8; size],
+            memory: vec![0u32; size.div_ceil(4)],
+            length: size as u32,
         }
     }
+
+    fn bytes(&self) -> &[u8] {
+        &self.memory.as_bytes()[..self.length as usize]
+    }
+
+    fn bytes_mut(&mut self) -> &mut [u8] {
+        &mut self.memory.as_mut_bytes()[..self.length as usize]
+    }
 }
 
 impl Addressable for NaiveMemory {
     /// read return a slice of the inner memory. Caller should guarantee index and read length is
     /// valid. An out of range slicing will directly bail out.
     fn do_bus_read(&mut self, offset: u32, dest: &mut [u8]) -> Result<(), BusError> {
-        let length = self.memory.len() as u32;
+        let length = self.length;
         if offset >= length || offset + dest.len() as u32 > length {
             return Err(BusError::DeviceError {
                 id: "NaiveMemoryRead",
             });
         }
 
-        dest.copy_from_slice(&self.memory[offset as usize..offset as usize + dest.len()]);
+        dest.copy_from_slice(&self.bytes()[offset as usize..offset as usize + dest.len()]);
 
         Ok(())
     }
 
     fn do_bus_write(&mut self, offset: u32, data: &[u8]) -> Result<(), BusError> {
-        let length = self.memory.len() as u32;
+        let length = self.length;
         if offset >= length || offset + data.len() as u32 > length {
             return Err(BusError::DeviceError {
                 id: "NaiveMemoryWrite",
             });
         }
 
-        self.memory[offset as usize..offset as usize + data.len()].copy_from_slice(data);
+        self.bytes_mut()[offset as usize..offset as usize + data.len()].copy_from_slice(data);
 
         Ok(())
     }
 
+    fn do_atomic(&mut self, offset: u32, op: AtomicOp, value: u32) -> Result<u32, BusError> {
+        // misaligned AMOs are rejected by the core, a misaligned offset is a device fault
+        if offset % 4 != 0 || offset >= self.length || offset + 4 > self.length {
+            return Err(BusError::DeviceError {
+                id: "NaiveMemoryAtomic",
+            });
+        }
+
+        // SAFETY: the word is exclusively borrowed, and AtomicU32 has the same layout as u32
+        let word = unsafe { AtomicU32::from_ptr(&mut self.memory[offset as usize / 4]) };
+        Ok(op.do_atomic_u32(word, value))
+    }
+
     fn do_debugger_read(&self, offset: u32, dest: &mut [u8]) -> usize {
-        if (offset as usize) >= self.memory.len() {
+        if offset >= self.length {
             return 0;
         }
 
-        let data = &self.memory[offset as usize..];
+        let data = &self.bytes()[offset as usize..];
         let len = data.len().min(dest.len());
         dest[..len].copy_from_slice(&data[..len]);
         len
     }
+
+    fn do_reset(&mut self) {
+        zero_memory(&mut self.memory);
+    }
 }
 
 #[derive(Debug, Clone)]
@@ -310,3 +532,84 @@ impl Addressable for MMIOAddrDecoder {
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_atomic_matches_arith() {
+        let ops = [
+            AtomicOp::Swap,
+            AtomicOp::Add,
+            AtomicOp::And,
+            AtomicOp::Or,
+            AtomicOp::Xor,
+            AtomicOp::Min,
+            AtomicOp::Minu,
+            AtomicOp::Max,
+            AtomicOp::Maxu,
+            AtomicOp::CompareSwap { expected: 5 },
+            AtomicOp::CompareSwap {
+                expected: 0x8000_0000,
+            },
+        ];
+        let values = [0, 1, 5, 0x7fff_ffff, 0x8000_0000, 0xffff_ffff];
+
+        for op in ops {
+            for mem_value in values {
+                for core_value in values {
+                    let target = AtomicU32::new(mem_value);
+                    let old = op.do_atomic_u32(&target, core_value);
+                    assert_eq!(old, mem_value);
+                    assert_eq!(
+                        target.into_inner(),
+                        op.do_arith_u32(mem_value, core_value),
+                        "{op:?} mem={mem_value:#x} core={core_value:#x}"
+                    );
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_reservation() {
+        let [rs, other]: [ReservationSet; 2] = ReservationSet::for_harts(2).try_into().unwrap();
+
+        // a mismatched SC still breaks the reservation
+        rs.reserve(4);
+        assert!(!rs.take(8));
+        assert!(!rs.take(4));
+
+        // stores of the hart itself keep it, whatever value they write
+        rs.reserve(4);
+        rs.invalidate_others(4, 4);
+        assert!(rs.take(4));
+
+        // a store of another hart breaks it, even if the value is unchanged
+        rs.reserve(4);
+        other.invalidate_others(6, 1);
+        assert!(!rs.take(4));
+
+        // stores to other words, and reservations of other harts, are independent
+        rs.reserve(4);
+        other.reserve(4);
+        other.invalidate_others(0, 4);
+        other.invalidate_others(8, 4);
+        assert!(rs.take(4));
+        assert!(other.take(4));
+
+        // a trap clears it
+        rs.reserve(4);
+        rs.clear();
+        assert!(!rs.take(4));
+    }
+
+    #[test]
+    fn test_atomic_out_of_range() {
+        let mut mem = NaiveMemory::new(16);
+        assert!(mem.do_atomic(2, AtomicOp::Add, 1).is_err());
+        assert!(mem.do_atomic(16, AtomicOp::Add, 1).is_err());
+        assert_eq!(mem.do_atomic(12, AtomicOp::Add, 1).unwrap(), 0);
+    }
+}
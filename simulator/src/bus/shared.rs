@@ -0,0 +1,204 @@
+use std::sync::{
+    Arc, Mutex,
+    atomic::{AtomicU32, Ordering},
+};
+
+use crate::bus::{Addressable, AtomicOp, BusError, zero_memory};
+
+/// SRAM shared by harts running on different host threads.
+///
+/// Memory is stored as atomic words, so that no lock is required:
+/// - aligned full words are accessed by plain atomic load/store
+/// - partial words are updated by fetch_and/fetch_or on the touched bytes only,
+///   thus concurrent writes to different bytes of a word do not clobber each other
+/// - AMO and SC are performed by host atomic instructions
+#[derive(Debug, Clone)]
+pub struct SharedMemory {
+    words: Arc<Box<[AtomicU32]>>,
+    length: u32,
+}
+
+impl SharedMemory {
+    pub fn new(size: usize) -> Self {
+        // vec! of zeros is allocated lazily by the OS, which matters for a 512MiB SRAM
+        let words = vec![0u32; size.div_ceil(4)].into_boxed_slice();
+
+        // SAFETY: AtomicU32 has the same size and alignment as u32
+        let words = unsafe { Box::from_raw(Box::into_raw(words) as *mut [AtomicU32]) };
+
+        Self {
+            words: Arc::new(words),
+            length: size as u32,
+        }
+    }
+
+    fn check_range(&self, offset: u32, len: usize) -> bool {
+        offset < self.length && offset as u64 + len as u64 <= self.length as u64
+    }
+
+    // Split [offset, offset + len) into words,
+    // call f with (word index, byte offset in word, byte range in the access)
+    fn for_each_word(
+        offset: u32,
+        len: usize,
+        mut f: impl FnMut(usize, usize, std::ops::Range<usize>),
+    ) {
+        let mut pos = 0;
+        while pos < len {
+            let addr = offset as usize + pos;
+            let in_word = addr % 4;
+            let n = usize::min(4 - in_word, len - pos);
+            f(addr / 4, in_word, pos..pos + n);
+            pos += n;
+        }
+    }
+}
+
+impl Addressable for SharedMemory {
+    fn do_bus_read(&mut self, offset: u32, dest: &mut [u8]) -> Result<(), BusError> {
+        if !self.check_range(offset, dest.len()) {
+            return Err(BusError::DeviceError {
+                id: "SharedMemoryRead",
+            });
+        }
+
+        self.do_debugger_read(offset, dest);
+
+        Ok(())
+    }
+
+    fn do_bus_write(&mut self, offset: u32, data: &[u8]) -> Result<(), BusError> {
+        if !self.check_range(offset, data.len()) {
+            return Err(BusError::DeviceError {
+                id: "SharedMemoryWrite",
+            });
+        }
+
+        let words = &self.words;
+        Self::for_each_word(offset, data.len(), |index, in_word, range| {
+            let word = &words[index];
+            if range.len() == 4 {
+                word.store(
+                    u32::from_le_bytes(data[range].try_into().unwrap()),
+                    Ordering::Release,
+                );
+                return;
+            }
+
+            let mut mask = 0u32;
+            let mut bits = 0u32;
+            for (i, &byte) in data[range].iter().enumerate() {
+                let shift = 8 * (in_word + i);
+                mask |= 0xff << shift;
+                bits |= (byte as u32) << shift;
+            }
+            word.fetch_and(!mask, Ordering::AcqRel);
+            word.fetch_or(bits, Ordering::AcqRel);
+        });
+
+        Ok(())
+    }
+
+    fn do_atomic(&mut self, offset: u32, op: AtomicOp, value: u32) -> Result<u32, BusError> {
+        // the same device fault as NaiveMemory, misaligned AMOs are rejected by the core
+        if offset % 4 != 0 || !self.check_range(offset, 4) {
+            return Err(BusError::DeviceError {
+                id: "SharedMemoryAtomic",
+            });
+        }
+
+        Ok(op.do_atomic_u32(&self.words[offset as usize / 4], value))
+    }
+
+    fn do_debugger_read(&self, offset: u32, dest: &mut [u8]) -> usize {
+        if offset >= self.length {
+            return 0;
+        }
+
+        let len = dest.len().min((self.length - offset) as usize);
+        let words = &self.words;
+        Self::for_each_word(offset, len, |index, in_word, range| {
+            let bytes = words[index].load(Ordering::Acquire).to_le_bytes();
+            let n = range.len();
+            dest[range].copy_from_slice(&bytes[in_word..in_word + n]);
+        });
+        len
+    }
+
+    fn do_reset(&mut self) {
+        // Memory could only be reset when no other hart holds it
+        let words = Arc::get_mut(&mut self.words).expect("reset a memory in use by other harts");
+
+        // SAFETY: AtomicU32 has the same layout as u32, and the memory is exclusively borrowed
+        let words = unsafe { &mut *(&mut **words as *mut [AtomicU32] as *mut [u32]) };
+        zero_memory(words);
+    }
+}
+
+/// A device shared by all harts, accesses are serialized by a mutex.
+///
+/// It is used for MMIO, which is rare compared to memory accesses.
+/// Accesses are not deferred to quantum boundaries, the order of accesses by
+/// different harts is the order they take the lock in, see `run_multihart`.
+#[derive(Clone)]
+pub struct SharedDevice(Arc<Mutex<Box<dyn Addressable>>>);
+
+impl SharedDevice {
+    pub fn new(device: Box<dyn Addressable>) -> Self {
+        Self(Arc::new(Mutex::new(device)))
+    }
+}
+
+impl Addressable for SharedDevice {
+    fn do_bus_read(&mut self, offset: u32, dest: &mut [u8]) -> Result<(), BusError> {
+        self.0.lock().unwrap().do_bus_read(offset, dest)
+    }
+
+    fn do_bus_write(&mut self, offset: u32, data: &[u8]) -> Result<(), BusError> {
+        self.0.lock().unwrap().do_bus_write(offset, data)
+    }
+
+    fn do_atomic(&mut self, offset: u32, op: AtomicOp, value: u32) -> Result<u32, BusError> {
+        self.0.lock().unwrap().do_atomic(offset, op, value)
+    }
+
+    fn do_debugger_read(&self, offset: u32, dest: &mut [u8]) -> usize {
+        self.0.lock().unwrap().do_debugger_read(offset, dest)
+    }
+
+    fn do_reset(&mut self) {
+        self.0.lock().unwrap().do_reset()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_shared_memory_access() {
+        let mut mem = SharedMemory::new(10);
+        let mut other = mem.clone();
+
+        mem.do_bus_write(1, &[1, 2, 3, 4, 5, 6]).unwrap();
+        other.do_bus_write(0, &[0xaa]).unwrap();
+        other.do_bus_write(8, &[0xbb, 0xcc]).unwrap();
+        assert!(mem.do_bus_write(9, &[0, 0]).is_err());
+
+        let mut data = [0; 10];
+        other.do_bus_read(0, &mut data).unwrap();
+        assert_eq!(data, [0xaa, 1, 2, 3, 4, 5, 6, 0, 0xbb, 0xcc]);
+
+        assert!(mem.do_atomic(2, AtomicOp::Add, 1).is_err());
+        let old = mem.do_atomic(4, AtomicOp::Add, 1).unwrap();
+        assert_eq!(old, u32::from_le_bytes([4, 5, 6, 0]));
+
+        let mut data = [0; 3];
+        assert_eq!(other.do_debugger_read(7, &mut data), 3);
+        assert_eq!(data, [0, 0xbb, 0xcc]);
+
+        let mut data = [0; 2];
+        other.do_bus_read(4, &mut data).unwrap();
+        assert_eq!(data, [5, 5]);
+    }
+}
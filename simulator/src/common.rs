@@ -24,8 +24,143 @@ pub enum StateWrite {
     Xrf { rd: u8, value: u32 },
     Frf { rd: u8, value: u32 },
     Vrf { rd: u8, value: Vec<u8> },
+    // bytes of vector register rd starting at offset, the rest are unchanged
+    VrfPatch { rd: u8, offset: u16, value: Vec<u8> },
     Csr { name: String, value: u32 },
     // TODO : record load/store
     // Load { addr: u32 },
     // Store { addr: u32, data: Vec<u8> },
 }
+
+/// State writes of one commit, reused across steps so that tracing does not allocate.
+///
+/// It is serialized the same as `Vec<StateWrite>`.
+#[derive(Debug, Default)]
+pub struct CommitWrites {
+    pub xrf: Vec<(u8, u32)>,
+    pub frf: Vec<(u8, u32)>,
+    // written vector registers, their values are stored in vrf_data in order
+    pub vrf: Vec<VrfWrite>,
+    pub vrf_data: Vec<u8>,
+    pub csr: Vec<(u16, u32)>,
+}
+
+impl CommitWrites {
+    pub fn clear(&mut self) {
+        self.xrf.clear();
+        self.frf.clear();
+        self.vrf.clear();
+        self.vrf_data.clear();
+        self.csr.clear();
+    }
+
+    // Returns the zeroed slot for the value of vector register rd
+    pub fn push_vrf(&mut self, rd: u8, vlen_byte: usize) -> &mut [u8] {
+        self.push_vrf_slot(rd, None, vlen_byte)
+    }
+
+    // Returns the zeroed slot for len bytes of vector register rd starting at offset
+    pub fn push_vrf_patch(&mut self, rd: u8, offset: u16, len: usize) -> &mut [u8] {
+        self.push_vrf_slot(rd, Some(offset), len)
+    }
+
+    fn push_vrf_slot(&mut self, rd: u8, offset: Option<u16>, len: usize) -> &mut [u8] {
+        self.vrf.push(VrfWrite { rd, offset, len });
+        let start = self.vrf_data.len();
+        self.vrf_data.resize(start + len, 0);
+        &mut self.vrf_data[start..]
+    }
+
+    pub fn vrf_writes(&self) -> impl Iterator<Item = (VrfWrite, &[u8])> {
+        let mut rest = self.vrf_data.as_slice();
+        self.vrf.iter().map(move |&write| {
+            let (value, tail) = rest.split_at(write.len);
+            rest = tail;
+            (write, value)
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct VrfWrite {
+    pub rd: u8,
+    // None if the whole register is written
+    pub offset: Option<u16>,
+    pub len: usize,
+}
+
+// Borrowed counterparts of PokedexLog for serialization only,
+// they must produce exactly the same JSON.
+
+#[derive(Serialize)]
+#[serde(rename_all = "lowercase")]
+pub enum PokedexLogRef<'a> {
+    Reset { pc: u32 },
+    Exit { code: u32 },
+    Commit(CommitLogRef<'a>),
+}
+
+#[derive(Serialize)]
+pub struct CommitLogRef<'a> {
+    pub pc: u32,
+    pub is_compressed: bool,
+    pub instruction: u32,
+    pub states_changed: &'a CommitWrites,
+    // written by `run --trace-disasm` only, readers ignore it
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub disasm: Option<&'a str>,
+}
+
+#[derive(Serialize)]
+#[serde(tag = "dest", rename_all = "lowercase")]
+enum StateWriteRef<'a> {
+    Xrf {
+        rd: u8,
+        value: u32,
+    },
+    Frf {
+        rd: u8,
+        value: u32,
+    },
+    Vrf {
+        rd: u8,
+        value: &'a [u8],
+    },
+    VrfPatch {
+        rd: u8,
+        offset: u16,
+        value: &'a [u8],
+    },
+    Csr {
+        name: &'static str,
+        value: u32,
+    },
+}
+
+impl Serialize for CommitWrites {
+    fn serialize<S: serde::Serializer>(&self, serializer: S) -> Result<S::Ok, S::Error> {
+        use serde::ser::SerializeSeq;
+
+        let len = self.xrf.len() + self.frf.len() + self.vrf.len() + self.csr.len();
+        let mut seq = serializer.serialize_seq(Some(len))?;
+        for &(rd, value) in &self.xrf {
+            seq.serialize_element(&StateWriteRef::Xrf { rd, value })?;
+        }
+        for &(rd, value) in &self.frf {
+            seq.serialize_element(&StateWriteRef::Frf { rd, value })?;
+        }
+        for (VrfWrite { rd, offset, .. }, value) in self.vrf_writes() {
+            match offset {
+                None => seq.serialize_element(&StateWriteRef::Vrf { rd, value })?,
+                Some(offset) => {
+                    seq.serialize_element(&StateWriteRef::VrfPatch { rd, offset, value })?
+                }
+            }
+        }
+        for &(csr, value) in &self.csr {
+            let name = crate::pokedex::name_of_csr(csr);
+            seq.serialize_element(&StateWriteRef::Csr { name, value })?;
+        }
+        seq.end()
+    }
+}
@@ -0,0 +1,362 @@
+use std::{
+    path::{Path, PathBuf},
+    process::ExitCode,
+    sync::{
+        Mutex,
+        atomic::{AtomicUsize, Ordering},
+    },
+    time::Instant,
+};
+
+use anyhow::Context as _;
+use serde::Serialize;
+use tracing::{error, info};
+
+use crate::{
+    difftest::{DiffReport, SamePolicy, live::LiveModelBackend, run_diff, spike},
+    model::Loader,
+};
+
+/// Difftest a list of cases in one process with a pool of workers,
+/// each case runs on the model in lockstep with its Spike log
+#[derive(clap::Parser, Debug)]
+pub struct DiffTestBatchArgs {
+    /// Case manifest, one case per line: an ELF path and its Spike log path,
+    /// separated by whitespace and relative to the manifest file.
+    /// Empty lines and lines started with '#' are ignored.
+    manifest: PathBuf,
+
+    /// Path to KDL configuration file
+    #[arg(short = 'c', long)]
+    config_path: PathBuf,
+
+    /// Output path of the JSON report
+    #[arg(short = 'o', long)]
+    output_path: PathBuf,
+
+    /// Number of workers, defaults to the number of host cores
+    #[arg(short = 'j', long)]
+    jobs: Option<usize>,
+
+    /// Stop a case as a failure after executing this many instructions on the model
+    #[arg(long)]
+    max_insns: Option<u64>,
+
+    /// Control verbosity of pokedex output
+    #[arg(short, long, action = clap::ArgAction::Count)]
+    verbose: u8,
+}
+
+#[derive(Serialize)]
+pub struct BatchCaseResult {
+    name: String,
+    elf: PathBuf,
+    spike_log: PathBuf,
+    is_same: bool,
+    // instructions stepped on the model, and time spent in stepping them
+    insns: u64,
+    model_seconds: f64,
+    seconds: f64,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    error: Option<String>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    report: Option<DiffReport>,
+}
+
+#[derive(Serialize)]
+pub struct BatchSummary {
+    workers: usize,
+    seconds: f64,
+    passed: usize,
+    failed: usize,
+    cases: Vec<BatchCaseResult>,
+}
+
+struct Case {
+    name: String,
+    elf: PathBuf,
+    spike_log: PathBuf,
+}
+
+fn read_manifest(manifest: &Path) -> anyhow::Result<Vec<Case>> {
+    let content = std::fs::read_to_string(manifest)
+        .with_context(|| format!("failed to read {manifest:?}"))?;
+    let list_dir = manifest.parent().unwrap_or(Path::new("."));
+
+    let mut cases = vec![];
+    for (line_number, line) in content.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+
+        let fields: Vec<&str> = line.split_whitespace().collect();
+        let [elf, spike_log] = fields[..] else {
+            anyhow::bail!(
+                "{manifest:?} line {}: expected an ELF and a Spike log, got {line:?}",
+                line_number + 1
+            );
+        };
+        cases.push(Case {
+            name: elf.to_string(),
+            elf: list_dir.join(elf),
+            spike_log: list_dir.join(spike_log),
+        });
+    }
+
+    Ok(cases)
+}
+
+pub fn run_batch_subcommand(args: &DiffTestBatchArgs) -> anyhow::Result<ExitCode> {
+    crate::pokedex::setup_logging(args.verbose, false);
+
+    let cases = read_manifest(&args.manifest)?;
+
+    let jobs = args
+        .jobs
+        .unwrap_or_else(|| std::thread::available_parallelism().map_or(1, |n| n.get()));
+    let workers = jobs.clamp(1, cases.len().max(1));
+
+    info!("diffing {} cases with {workers} workers", cases.len());
+
+    let loaders = crate::model::get_loaders(workers)?;
+
+    let start = Instant::now();
+
+    // the same scheduling as `run-many`, idle workers take the next case
+    let cursor = AtomicUsize::new(0);
+    let results = Mutex::new(Vec::with_capacity(cases.len()));
+
+    std::thread::scope(|s| -> anyhow::Result<()> {
+        let mut handles = vec![];
+        for (worker_id, loader) in loaders.into_iter().enumerate() {
+            let (cursor, results, cases) = (&cursor, &results, &cases);
+            let handle = std::thread::Builder::new()
+                .name(format!("worker{worker_id}"))
+                .spawn_scoped(s, move || -> anyhow::Result<()> {
+                    run_worker(args, loader, cases, cursor, results)
+                })?;
+            handles.push(handle);
+        }
+
+        for handle in handles {
+            handle.join().expect("worker thread panicked")?;
+        }
+        Ok(())
+    })?;
+
+    let mut results = results.into_inner().unwrap();
+    results.sort_by(|a, b| a.name.cmp(&b.name));
+
+    let passed = results.iter().filter(|r| r.is_same).count();
+    let summary = BatchSummary {
+        workers,
+        seconds: start.elapsed().as_secs_f64(),
+        passed,
+        failed: results.len() - passed,
+        cases: results,
+    };
+
+    let raw_json = serde_json::to_string_pretty(&summary)?;
+    std::fs::write(&args.output_path, raw_json)
+        .with_context(|| format!("fail to write json: {:?}", args.output_path))?;
+
+    info!(
+        "{} passed, {} failed in {:.3}s, report store in {}",
+        summary.passed,
+        summary.failed,
+        summary.seconds,
+        args.output_path.display()
+    );
+
+    if summary.failed == 0 {
+        Ok(ExitCode::SUCCESS)
+    } else {
+        Ok(ExitCode::FAILURE)
+    }
+}
+
+fn run_worker(
+    args: &DiffTestBatchArgs,
+    loader: Loader,
+    cases: &[Case],
+    cursor: &AtomicUsize,
+    results: &Mutex<Vec<BatchCaseResult>>,
+) -> anyhow::Result<()> {
+    // model instance and bus are created once and reused by every case of this worker
+    let mut model =
+        LiveModelBackend::without_elf("pokedex-model".into(), loader, &args.config_path)?;
+    model.set_max_insns(args.max_insns);
+
+    loop {
+        let index = cursor.fetch_add(1, Ordering::Relaxed);
+        let Some(case) = cases.get(index) else {
+            return Ok(());
+        };
+
+        let start = Instant::now();
+        let outcome = diff_case(&mut model, case);
+        let seconds = start.elapsed().as_secs_f64();
+        let (insns, busy) = model.throughput();
+
+        let mut result = BatchCaseResult {
+            name: case.name.clone(),
+            elf: case.elf.clone(),
+            spike_log: case.spike_log.clone(),
+            is_same: false,
+            insns,
+            model_seconds: busy.as_secs_f64(),
+            seconds,
+            error: None,
+            report: None,
+        };
+        match outcome {
+            Ok(report) => {
+                result.is_same = report.is_same;
+                result.report = Some(report);
+            }
+            Err(e) => result.error = Some(format!("{e:#}")),
+        }
+
+        if result.is_same {
+            info!("case {} is same in {:.3}s", case.name, seconds);
+        } else if let Some(e) = &result.error {
+            error!("case {} failed: {e}", case.name);
+        } else {
+            error!("case {} differs from spike", case.name);
+        }
+
+        results.lock().unwrap().push(result);
+    }
+}
+
+fn diff_case(model: &mut LiveModelBackend, case: &Case) -> anyhow::Result<DiffReport> {
+    model.load_elf(&case.elf)?;
+    let pc = model.get_reset_pc();
+
+    // cases already run in parallel, each log is parsed on its worker
+    let mmap = spike::map_log(&case.spike_log)?;
+    let mut spike_log = spike::serial_backend(mmap, pc)
+        .with_context(|| format!("reading spike log {:?}", case.spike_log))?;
+
+    run_diff(&mut spike_log, model, pc, SamePolicy::SuccessSource2)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn temp_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("pokedex-batch-{name}-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        dir
+    }
+
+    #[test]
+    fn test_read_manifest() {
+        let dir = temp_dir("manifest");
+        let manifest = dir.join("cases.txt");
+
+        std::fs::write(
+            &manifest,
+            "# elf log\n\n  a.elf a.log\nsub/b.elf\t/abs/b.log  \n",
+        )
+        .unwrap();
+        let cases: Vec<(String, PathBuf, PathBuf)> = read_manifest(&manifest)
+            .unwrap()
+            .into_iter()
+            .map(|case| (case.name, case.elf, case.spike_log))
+            .collect();
+        // paths are relative to the manifest
+        assert_eq!(
+            cases,
+            [
+                ("a.elf".into(), dir.join("a.elf"), dir.join("a.log")),
+                (
+                    "sub/b.elf".into(),
+                    dir.join("sub/b.elf"),
+                    "/abs/b.log".into()
+                ),
+            ]
+        );
+
+        std::fs::write(&manifest, "a.elf a.log\nb.elf\n").unwrap();
+        let e = read_manifest(&manifest).err().unwrap();
+        assert!(e.to_string().contains("line 2"), "{e}");
+        std::fs::write(&manifest, "a.elf a.log c.log\n").unwrap();
+        assert!(read_manifest(&manifest).is_err());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+        assert!(read_manifest(&manifest).is_err());
+    }
+
+    // An ELF32 of the program at the start of SRAM, in one loaded segment
+    fn write_elf(path: &Path, program: &[u32]) {
+        const EHDR_SIZE: u32 = 52;
+        const PHDR_SIZE: u32 = 32;
+        const ENTRY: u32 = 0x8000_0000;
+
+        let code: Vec<u8> = program.iter().flat_map(|inst| inst.to_le_bytes()).collect();
+        let mut elf = vec![0x7f, b'E', b'L', b'F', 1, 1, 1];
+        elf.resize(16, 0);
+        // executable, RISC-V, version 1
+        elf.extend(2u16.to_le_bytes());
+        elf.extend(243u16.to_le_bytes());
+        elf.extend(1u32.to_le_bytes());
+        // entry, program headers, no section header, flags
+        for word in [ENTRY, EHDR_SIZE, 0, 0] {
+            elf.extend(word.to_le_bytes());
+        }
+        for half in [EHDR_SIZE, PHDR_SIZE, 1, 40, 0, 0] {
+            elf.extend((half as u16).to_le_bytes());
+        }
+        // PT_LOAD of the code, readable and executable
+        let size = code.len() as u32;
+        for word in [1, EHDR_SIZE + PHDR_SIZE, ENTRY, ENTRY, size, size, 5, 4] {
+            elf.extend(word.to_le_bytes());
+        }
+        elf.extend(code);
+        std::fs::write(path, elf).unwrap();
+    }
+
+    #[test]
+    #[ignore = "needs a model library in env POKEDEX_MODEL_DYLIB"]
+    fn test_diff_cases() {
+        let (_guard, loaders) =
+            crate::model::test_loaders(1).expect("no model library, set env POKEDEX_MODEL_DYLIB");
+        let dir = temp_dir("cases");
+        let config_path = Path::new(concat!(env!("CARGO_MANIFEST_DIR"), "/assets/configs.kdl"));
+
+        // lui t0, 0x40000; sw zero, 4(t0); j .
+        write_elf(
+            &dir.join("exit.elf"),
+            &[0x4000_02b7, 0x0002_a223, 0x0000_006f],
+        );
+        let spike_log = |t0: u32| {
+            format!(
+                "core   0: 3 0x80000000 (0x400002b7) x5  {t0:#010x}\n\
+                 core   0: 3 0x80000004 (0x0002a223) mem 0x40000004 0x00000000\n"
+            )
+        };
+        std::fs::write(dir.join("same.log"), spike_log(0x4000_0000)).unwrap();
+        std::fs::write(dir.join("differ.log"), spike_log(0x4000_1000)).unwrap();
+        std::fs::write(
+            dir.join("cases.txt"),
+            "exit.elf same.log\nexit.elf differ.log\n",
+        )
+        .unwrap();
+        let cases = read_manifest(&dir.join("cases.txt")).unwrap();
+
+        // the model is reused, each case starts over
+        let mut model =
+            LiveModelBackend::without_elf("pokedex-model".into(), loaders[0], config_path).unwrap();
+        let same: Vec<bool> = cases
+            .iter()
+            .chain(&cases)
+            .map(|case| diff_case(&mut model, case).unwrap().is_same)
+            .collect();
+        assert_eq!(same, [true, false, true, false]);
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
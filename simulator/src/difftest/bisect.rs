@@ -0,0 +1,101 @@
+use std::path::Path;
+
+use anyhow::Context as _;
+
+use crate::{
+    difftest::DiffReport,
+    disasm::Disassembler,
+    trace::{ArchState, Divergence, first_divergence},
+};
+
+/// Diff two pokedex traces by their rolling state hashes,
+/// only the instructions around the first differing hash are replayed
+pub fn diff_traces(trace_a: &Path, trace_b: &Path) -> anyhow::Result<DiffReport> {
+    let divergence = first_divergence(trace_a, trace_b)
+        .with_context(|| format!("bisecting {} and {}", trace_a.display(), trace_b.display()))?;
+
+    let mut report = DiffReport {
+        is_same: true,
+        source1: format!("trace-a:{}", trace_a.display()),
+        source2: format!("trace-b:{}", trace_b.display()),
+        exit1: None,
+        exit2: None,
+        diff_notes: vec![],
+        state1: None,
+        state2: None,
+        throughput: None,
+    };
+    if let Some(Divergence { state_a, state_b }) = divergence {
+        report.is_same = false;
+        report.diff_notes = diff_notes(&state_a, &state_b);
+        report.state1 = Some(state_a.to_string());
+        report.state2 = Some(state_b.to_string());
+    }
+    Ok(report)
+}
+
+// Same layout as `pretty_print_diff`
+fn diff_notes(a: &ArchState, b: &ArchState) -> Vec<String> {
+    let mut notes = vec![];
+    if a.commits != b.commits {
+        notes.push(format!("commits    : {} <-> {}", a.commits, b.commits));
+    } else {
+        notes.push(format!("commits    : {}", a.commits));
+    }
+
+    let disassembler = Disassembler::global();
+    let inst = |state: &ArchState| {
+        let asm = disassembler.disasm_string(state.last_pc, state.last_inst);
+        format!("{:#010x} ({asm})", state.last_inst)
+    };
+    let same_commit = (a.commits, a.last_pc, a.last_inst) == (b.commits, b.last_pc, b.last_inst);
+    if (a.last_pc, a.last_inst) != (b.last_pc, b.last_inst) {
+        notes.push(format!(
+            "pc         : {:#010x} <-> {:#010x}",
+            a.last_pc, b.last_pc
+        ));
+        notes.push(format!("inst       : {} <-> {}", inst(a), inst(b)));
+    } else {
+        notes.push(format!("pc         : {:#010x}", a.last_pc));
+        notes.push(format!("inst       : {}", inst(a)));
+    }
+
+    for (prefix, regs_a, regs_b) in [("x", &a.xregs, &b.xregs), ("f", &a.fregs, &b.fregs)] {
+        for (i, (va, vb)) in regs_a.iter().zip(regs_b).enumerate() {
+            if va != vb {
+                let name = format!("{prefix}{i}");
+                notes.push(format!("{name:<10} : {va:#010x} <-> {vb:#010x}"));
+            }
+        }
+    }
+
+    let vlen_byte = a.vlen_byte();
+    for (i, (va, vb)) in a
+        .vregs
+        .chunks_exact(vlen_byte)
+        .zip(b.vregs.chunks_exact(vlen_byte))
+        .enumerate()
+    {
+        if va != vb {
+            let name = format!("v{i}");
+            notes.push(format!("{name:<10} : {va:02x?} <-> {vb:02x?}"));
+        }
+    }
+
+    let names = a
+        .csrs
+        .keys()
+        .chain(b.csrs.keys().filter(|k| !a.csrs.contains_key(*k)));
+    for name in names {
+        let (va, vb) = (a.csrs.get(name), b.csrs.get(name));
+        if va != vb {
+            let show = |v: Option<&u32>| v.map_or("unwritten".into(), |v| format!("{v:#010x}"));
+            notes.push(format!("{name:<10} : {} <-> {}", show(va), show(vb)));
+        }
+    }
+
+    if same_commit && notes.len() == 3 {
+        notes.push("states are the same, the traces differ in a reset or exit record".into());
+    }
+    notes
+}
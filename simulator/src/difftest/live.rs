@@ -0,0 +1,299 @@
+use std::{
+    path::Path,
+    time::{Duration, Instant},
+};
+
+use anyhow::Context as _;
+use tracing::error;
+
+use crate::{
+    bus::Bus,
+    difftest::{
+        DiffBackend, Status,
+        replay::{CpuState, DiffRecord, VLEN_BYTE},
+    },
+    model::{Inst, Loader, StepDetail},
+    pokedex::{
+        name_of_csr,
+        simulator::{MemWrite, Simulator},
+    },
+};
+
+/// Drive the model in process, instead of replaying its trace log.
+/// The model is stepped only as far as the diff goes.
+pub struct LiveModelBackend {
+    name: String,
+    sim: Simulator,
+    reset_pc: u32,
+    // time spent in stepping the model
+    busy: Duration,
+    // the model stops as if it exits with u32::MAX after stepping this many times
+    max_insns: u64,
+
+    state: CpuState,
+}
+
+impl LiveModelBackend {
+    /// Each backend has its own bus, and a model of its own globals
+    pub fn new(
+        name: String,
+        model_loader: Loader,
+        config_path: &Path,
+        elf_path: &Path,
+    ) -> anyhow::Result<Self> {
+        let mut backend = Self::without_elf(name, model_loader, config_path)?;
+        backend.load_elf(elf_path)?;
+        Ok(backend)
+    }
+
+    /// A backend to load ELFs into later, the model and bus are reused by each of them
+    pub fn without_elf(
+        name: String,
+        model_loader: Loader,
+        config_path: &Path,
+    ) -> anyhow::Result<Self> {
+        let bus = Bus::load_from_config(config_path)?;
+        Ok(Self {
+            name,
+            sim: Simulator::new(model_loader, bus),
+            reset_pc: 0,
+            busy: Duration::ZERO,
+            max_insns: u64::MAX,
+            state: CpuState::new(),
+        })
+    }
+
+    /// Start over with another ELF, as a new backend does
+    pub fn load_elf(&mut self, elf_path: &Path) -> anyhow::Result<()> {
+        self.sim.recycle();
+        self.busy = Duration::ZERO;
+        self.state = CpuState::new();
+
+        let config_reset_vector = self.sim.global.bus.reset_vector();
+        let elf_entry = self
+            .sim
+            .global
+            .bus
+            .load_elf(elf_path)
+            .with_context(|| format!("loading {}", elf_path.display()))?;
+        // the same as `pokedex run`
+        self.reset_pc = config_reset_vector.unwrap_or(elf_entry);
+        Ok(())
+    }
+
+    pub fn get_reset_pc(&self) -> u32 {
+        self.reset_pc
+    }
+
+    /// Compare memory writes of each step as well
+    pub fn record_mem_writes(&mut self) {
+        self.sim.record_mem_writes();
+    }
+
+    /// Stop a case which does not exit after this many instructions, as `run --max-insns` does
+    pub fn set_max_insns(&mut self, max_insns: Option<u64>) {
+        self.max_insns = max_insns.unwrap_or(u64::MAX);
+    }
+
+    /// Instructions stepped, and time spent in stepping them
+    pub fn throughput(&self) -> (u64, Duration) {
+        (self.sim.stats().step_count, self.busy)
+    }
+}
+
+impl DiffBackend for LiveModelBackend {
+    fn description(&self) -> String {
+        self.name.clone()
+    }
+
+    fn diff_reset(&mut self, expected_pc: u32) -> anyhow::Result<()> {
+        self.sim.reset_core(expected_pc);
+        Ok(())
+    }
+
+    fn diff_step(&mut self) -> anyhow::Result<Status> {
+        let start = Instant::now();
+        self.sim.clear_mem_writes();
+        let status = loop {
+            if let Some(code) = self.sim.is_exited() {
+                break Status::Exit { code };
+            }
+            // also bounds a model trapping forever without committing any instruction
+            if self.sim.stats().step_count >= self.max_insns {
+                error!(
+                    "{} stopped after {} instructions without exit",
+                    self.name, self.max_insns
+                );
+                break Status::Exit { code: u32::MAX };
+            }
+
+            // steps without a committed instruction are not traced either
+            let detail = self.sim.step_trace();
+            if detail.inst.is_some() {
+                break Status::Running(update_state(&mut self.state, &detail)?);
+            }
+        };
+        self.busy += start.elapsed();
+        Ok(status)
+    }
+
+    fn state(&self) -> &CpuState {
+        &self.state
+    }
+
+    fn mem_writes(&self) -> Option<&[MemWrite]> {
+        self.sim.mem_writes()
+    }
+}
+
+// Same as replaying the commit the JSON tracer writes for detail
+fn update_state(state: &mut CpuState, detail: &StepDetail) -> anyhow::Result<DiffRecord> {
+    state.pc = detail.pc;
+    state.inst = match detail.inst {
+        Some(Inst::NC(inst)) => inst,
+        Some(Inst::C(inst)) => inst as u32,
+        None => unreachable!(),
+    };
+
+    let changes = detail.changes;
+    let mut dr = DiffRecord::default();
+    for (rd, value) in changes.xreg_changes() {
+        state.write_gpr(rd as usize, value, &mut dr);
+    }
+    for (rd, value) in changes.freg_changes() {
+        state.write_fpr(rd as usize, value, &mut dr);
+    }
+    for rd in changes.vreg_change_indices() {
+        let mut value = [0u8; VLEN_BYTE];
+        changes.core.read_vreg(rd, &mut value);
+        state.write_vreg(rd as usize, 0, &value, &mut dr);
+    }
+    for (csr, value) in changes.csr_changes() {
+        let name = name_of_csr(csr);
+        if state.write_csr(name, value, &mut dr).is_err() {
+            anyhow::bail!("pokedex replay error: CSR {name} = {value:#010x}");
+        }
+    }
+
+    Ok(dr)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::MutexGuard;
+
+    use super::*;
+    use crate::difftest::{DiffReport, SamePolicy, run_diff};
+
+    const SRAM_BASE: u32 = 0x8000_0000;
+
+    const NO_MODEL: &str = "no model library, set env POKEDEX_MODEL_DYLIB";
+
+    // A backend running the given instructions from the start of SRAM
+    fn load_program(loader: Loader, program: &[u32]) -> LiveModelBackend {
+        let config_path = Path::new(concat!(env!("CARGO_MANIFEST_DIR"), "/assets/configs.kdl"));
+        let mut backend =
+            LiveModelBackend::without_elf("test-model".into(), loader, config_path).unwrap();
+
+        let code: Vec<u8> = program.iter().flat_map(|inst| inst.to_le_bytes()).collect();
+        backend.sim.global.bus.write(SRAM_BASE, &code).unwrap();
+        backend.reset_pc = SRAM_BASE;
+        backend
+    }
+
+    fn backend_with_program(program: &[u32]) -> (MutexGuard<'static, ()>, LiveModelBackend) {
+        let (guard, loaders) = crate::model::test_loaders(1).expect(NO_MODEL);
+        (guard, load_program(loaders[0], program))
+    }
+
+    // Both models of a lockstep diff, from copies of the model library
+    fn lockstep(program_a: &[u32], program_b: &[u32]) -> (MutexGuard<'static, ()>, DiffReport) {
+        let (guard, loaders) = crate::model::test_loaders(2).expect(NO_MODEL);
+        let mut source_a = load_program(loaders[0], program_a);
+        let mut source_b = load_program(loaders[1], program_b);
+        source_a.record_mem_writes();
+        source_b.record_mem_writes();
+        source_a.set_max_insns(Some(100));
+        source_b.set_max_insns(Some(100));
+
+        let report = run_diff(&mut source_a, &mut source_b, SRAM_BASE, SamePolicy::Strict).unwrap();
+        (guard, report)
+    }
+
+    // lui t0, 0x40000; lui t1, 0x80001; sw t0, 0(t1); sw zero, 4(t0); j .
+    // Writes to SRAM, then exits with 0 through the exit MMIO register.
+    const STORE_AND_EXIT: [u32; 5] = [
+        0x4000_02b7,
+        0x8000_1337,
+        0x0053_2023,
+        0x0002_a223,
+        0x0000_006f,
+    ];
+
+    #[test]
+    #[ignore = "needs a model library in env POKEDEX_MODEL_DYLIB"]
+    fn test_max_insns_committed() {
+        // j .
+        let (_guard, mut backend) = backend_with_program(&[0x0000_006f]);
+        backend.set_max_insns(Some(10));
+        backend.diff_reset(SRAM_BASE).unwrap();
+
+        for _ in 0..10 {
+            let Status::Running(_) = backend.diff_step().unwrap() else {
+                panic!("stopped before the limit");
+            };
+            assert_eq!(backend.state().pc, SRAM_BASE);
+        }
+        let Status::Exit { code } = backend.diff_step().unwrap() else {
+            panic!("not stopped at the limit");
+        };
+        assert_eq!(code, u32::MAX);
+        assert_eq!(backend.throughput().0, 10);
+    }
+
+    #[test]
+    #[ignore = "needs a model library in env POKEDEX_MODEL_DYLIB"]
+    fn test_max_insns_trapping() {
+        // csrwi mtvec, 0; jr zero
+        // nothing is mapped at 0, each step then faults on fetch without committing
+        let program = [0x3050_5073, 0x0000_0067];
+        let (_guard, mut backend) = backend_with_program(&program);
+        backend.set_max_insns(Some(100));
+        backend.diff_reset(SRAM_BASE).unwrap();
+
+        for _ in &program {
+            assert!(matches!(backend.diff_step().unwrap(), Status::Running(_)));
+        }
+        let Status::Exit { code } = backend.diff_step().unwrap() else {
+            panic!("a fetch fault is committed");
+        };
+        assert_eq!(code, u32::MAX);
+        assert_eq!(backend.throughput().0, 100);
+    }
+
+    #[test]
+    #[ignore = "needs a model library in env POKEDEX_MODEL_DYLIB"]
+    fn test_lockstep_same() {
+        let (_guard, report) = lockstep(&STORE_AND_EXIT, &STORE_AND_EXIT);
+        assert!(report.is_same, "{:?}", report.diff_notes);
+        assert_eq!((report.exit1, report.exit2), (Some(0), Some(0)));
+    }
+
+    #[test]
+    #[ignore = "needs a model library in env POKEDEX_MODEL_DYLIB"]
+    fn test_lockstep_mem_writes() {
+        // sw t1, 0(t1) instead, registers are the same but the stored value is not
+        let mut program_b = STORE_AND_EXIT;
+        program_b[2] = 0x0063_2023;
+        let (_guard, report) = lockstep(&STORE_AND_EXIT, &program_b);
+        assert!(!report.is_same);
+        assert!(
+            report
+                .diff_notes
+                .iter()
+                .any(|note| note.starts_with("mem writes")),
+            "{:?}",
+            report.diff_notes
+        );
+    }
+}
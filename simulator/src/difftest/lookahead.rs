@@ -0,0 +1,68 @@
+//! Incremental log reading for difftest backends
+//!
+//! A backend parses its log while diffing, a window of records at a time,
+//! so diffing starts on the first records and memory does not grow with the log length.
+
+use std::collections::VecDeque;
+
+// Records parsed ahead of the diff loop in one go
+const WINDOW_SIZE: usize = 1024;
+
+/// Yields parsed records of a log in order
+pub trait LogSource {
+    type Item;
+
+    /// Returns None at the end of log
+    fn next_item(&mut self) -> anyhow::Result<Option<Self::Item>>;
+}
+
+/// Bounded window of records parsed ahead of the consumer.
+/// The window is refilled once it is drained,
+/// thus a parse error is reported when the window containing it is filled.
+pub struct Lookahead<S: LogSource> {
+    source: S,
+    window: VecDeque<S::Item>,
+    eof: bool,
+}
+
+impl<S: LogSource> Lookahead<S> {
+    pub fn new(source: S) -> Self {
+        Self {
+            source,
+            window: VecDeque::with_capacity(WINDOW_SIZE),
+            eof: false,
+        }
+    }
+
+    pub fn source(&self) -> &S {
+        &self.source
+    }
+
+    pub fn source_mut(&mut self) -> &mut S {
+        &mut self.source
+    }
+
+    fn fill(&mut self) -> anyhow::Result<()> {
+        while !self.eof && self.window.len() < WINDOW_SIZE {
+            match self.source.next_item()? {
+                Some(item) => self.window.push_back(item),
+                None => self.eof = true,
+            }
+        }
+        Ok(())
+    }
+
+    pub fn peek(&mut self) -> anyhow::Result<Option<&S::Item>> {
+        if self.window.is_empty() {
+            self.fill()?;
+        }
+        Ok(self.window.front())
+    }
+
+    pub fn next(&mut self) -> anyhow::Result<Option<S::Item>> {
+        if self.window.is_empty() {
+            self.fill()?;
+        }
+        Ok(self.window.pop_front())
+    }
+}
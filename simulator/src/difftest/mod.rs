@@ -1,42 +1,96 @@
-use std::{path::PathBuf, process::ExitCode};
+use std::{
+    path::{Path, PathBuf},
+    process::ExitCode,
+    time::Duration,
+};
 
 use anyhow::Context;
 use serde::Serialize;
 
 use replay::{CpuState, pretty_print_diff};
 
-use crate::difftest::replay::DiffRecord;
+use crate::{difftest::replay::DiffRecord, model::Loader, pokedex::simulator::MemWrite};
 
+mod batch;
+mod bisect;
+mod live;
+mod lookahead;
+mod parallel;
 mod pokedex;
 mod replay;
+mod segment;
 mod spike;
 
+pub use batch::{DiffTestBatchArgs, run_batch_subcommand};
+
 #[derive(clap::Parser, Debug)]
 #[command(version, about, long_about = None)]
 pub struct DiffTestArgs {
     /// Path to the Spike commit log
-    #[arg(short = 's', long)]
-    spike_log_path: PathBuf,
-    /// Path to the pokedex trace log
-    #[arg(short = 'p', long)]
-    pokedex_log_path: PathBuf,
+    #[arg(short = 's', long, required_unless_present_any = ["model_a", "trace_a"])]
+    spike_log_path: Option<PathBuf>,
+    /// Path to the pokedex trace log, either JSON lines or binary.
+    /// "unix:<path>" listens on a Unix socket for `run -o unix:<path>`
+    #[arg(
+        short = 'p',
+        long,
+        required_unless_present_any = ["elf_path", "trace_a"],
+        conflicts_with = "elf_path"
+    )]
+    pokedex_log_path: Option<PathBuf>,
+    /// Run the RISC-V ELF on the model in lockstep with the Spike log,
+    /// instead of reading a pokedex trace log
+    #[arg(long = "elf", requires = "config_path")]
+    elf_path: Option<PathBuf>,
+    /// Path to KDL configuration file, for running --elf
+    #[arg(short = 'c', long, requires = "elf_path")]
+    config_path: Option<PathBuf>,
+    /// Stop the model running --elf as a failure after executing this many instructions
+    #[arg(long, requires = "elf_path")]
+    max_insns: Option<u64>,
+    /// Model library to run --elf in lockstep with --model-b, instead of diffing a Spike log.
+    /// Registers, CSRs and memory writes are compared after each instruction.
+    #[arg(long, requires_all = ["model_b", "elf_path"], conflicts_with = "spike_log_path")]
+    model_a: Option<String>,
+    /// The other model library, see --model-a
+    #[arg(long, requires = "model_a")]
+    model_b: Option<String>,
+    /// Pokedex trace to diff with --trace-b, instead of diffing a Spike log.
+    /// Both are written with `run --trace-hash-interval`, their hash streams are compared
+    /// and the first differing instruction is replayed from the index keyframes.
+    #[arg(
+        long,
+        requires = "trace_b",
+        conflicts_with_all = ["spike_log_path", "pokedex_log_path", "elf_path"]
+    )]
+    trace_a: Option<PathBuf>,
+    /// The other pokedex trace, see --trace-a
+    #[arg(long, requires = "trace_a")]
+    trace_b: Option<PathBuf>,
+    /// Diff the Spike log with the pokedex trace in segments on worker threads.
+    /// The trace should be a file written with `run --trace-index-interval`,
+    /// each segment is replayed from the nearest keyframe.
+    #[arg(long, requires = "pokedex_log_path")]
+    segments: bool,
+    /// Replay both logs to their ends without comparing them,
+    /// for telling the time in parsing logs from the time in diffing
+    #[arg(long, requires = "pokedex_log_path", conflicts_with = "segments")]
+    parse_only: bool,
     /// Output path for writing difftest result
     #[arg(short = 'o', long)]
     output_path: PathBuf,
 }
 
 pub fn run_subcommand(args: &DiffTestArgs) -> anyhow::Result<ExitCode> {
-    let mut spike_log = spike::backend_from_log(&args.spike_log_path)?;
-    let mut pokedex_log = pokedex::backend_from_log(&args.pokedex_log_path)?;
-
-    let pc = pokedex_log.get_reset_pc();
-
-    let result = run_diff(
-        &mut spike_log,
-        &mut pokedex_log,
-        pc,
-        SamePolicy::SuccessSource2,
-    )?;
+    let result = if let (Some(trace_a), Some(trace_b)) = (&args.trace_a, &args.trace_b) {
+        bisect::diff_traces(trace_a, trace_b)?
+    } else {
+        match (&args.model_a, &args.model_b, &args.spike_log_path) {
+            (Some(model_a), Some(model_b), _) => diff_models(args, model_a, model_b)?,
+            (_, _, Some(spike_log_path)) => diff_spike_log(args, spike_log_path)?,
+            _ => unreachable!("checked by clap"),
+        }
+    };
 
     let raw_json = serde_json::to_string_pretty(&result)?;
     std::fs::write(&args.output_path, raw_json)
@@ -45,6 +99,118 @@ pub fn run_subcommand(args: &DiffTestArgs) -> anyhow::Result<ExitCode> {
     Ok(ExitCode::SUCCESS)
 }
 
+fn diff_spike_log(args: &DiffTestArgs, spike_log_path: &Path) -> anyhow::Result<DiffReport> {
+    if let (true, Some(pokedex_log_path)) = (args.segments, &args.pokedex_log_path) {
+        return segment::diff_segments(spike_log_path, pokedex_log_path);
+    }
+    if let (true, Some(pokedex_log_path)) = (args.parse_only, &args.pokedex_log_path) {
+        return parse_only(spike_log_path, pokedex_log_path);
+    }
+
+    let mut spike_log = spike::backend_from_log(spike_log_path)?;
+
+    let result = match (&args.elf_path, &args.config_path, &args.pokedex_log_path) {
+        (Some(elf_path), Some(config_path), _) => {
+            let loader = crate::model::get_loader()?;
+            let mut model =
+                live::LiveModelBackend::new("pokedex-model".into(), loader, config_path, elf_path)?;
+            model.set_max_insns(args.max_insns);
+            let pc = model.get_reset_pc();
+            run_diff(&mut spike_log, &mut model, pc, SamePolicy::SuccessSource2)?
+        }
+        (_, _, Some(pokedex_log_path)) => {
+            let mut pokedex_log = pokedex::backend_from_log(pokedex_log_path)?;
+            let pc = pokedex_log.get_reset_pc()?;
+            run_diff(
+                &mut spike_log,
+                &mut pokedex_log,
+                pc,
+                SamePolicy::SuccessSource2,
+            )?
+        }
+        _ => unreachable!("checked by clap"),
+    };
+    Ok(result)
+}
+
+// Each log is replayed alone, the report tells the instructions and exit of both
+fn parse_only(spike_log_path: &Path, pokedex_log_path: &Path) -> anyhow::Result<DiffReport> {
+    let mut pokedex_log = pokedex::backend_from_log(pokedex_log_path)?;
+    let pc = pokedex_log.get_reset_pc()?;
+    let mut spike_log = spike::backend_from_log(spike_log_path)?;
+
+    let mut report = DiffReport {
+        is_same: true,
+        source1: spike_log.description(),
+        source2: pokedex_log.description(),
+        exit1: None,
+        exit2: None,
+        diff_notes: vec![],
+        state1: None,
+        state2: None,
+        throughput: None,
+    };
+    let sources: [(&mut dyn DiffBackend, &mut Option<u32>); 2] = [
+        (&mut spike_log, &mut report.exit1),
+        (&mut pokedex_log, &mut report.exit2),
+    ];
+    for (source, exit) in sources {
+        let name = source.description();
+        source
+            .diff_reset(pc)
+            .with_context(|| format!("reset {name}"))?;
+
+        let mut steps = 0u64;
+        *exit = loop {
+            match source.diff_step().with_context(|| format!("step {name}"))? {
+                Status::Running(_) => steps += 1,
+                Status::Exit { code } => break Some(code),
+            }
+        };
+        report
+            .diff_notes
+            .push(format!("{name:<10} : {steps} instructions"));
+    }
+    Ok(report)
+}
+
+// Run the case on two model libraries in lockstep, both should behave the same
+fn diff_models(args: &DiffTestArgs, model_a: &str, model_b: &str) -> anyhow::Result<DiffReport> {
+    let (Some(elf_path), Some(config_path)) = (&args.elf_path, &args.config_path) else {
+        unreachable!("checked by clap");
+    };
+
+    let loader_a = Loader::from_dylib(model_a)?;
+    // A library is loaded once, even through another path to the same file.
+    // A private copy always gives the second model its own globals.
+    let loader_b = Loader::from_dylib_copy(model_b, 1)?;
+
+    let mut source_a = live::LiveModelBackend::new(
+        format!("model-a:{model_a}"),
+        loader_a,
+        config_path,
+        elf_path,
+    )?;
+    let mut source_b = live::LiveModelBackend::new(
+        format!("model-b:{model_b}"),
+        loader_b,
+        config_path,
+        elf_path,
+    )?;
+    source_a.record_mem_writes();
+    source_b.record_mem_writes();
+    source_a.set_max_insns(args.max_insns);
+    source_b.set_max_insns(args.max_insns);
+
+    let pc = source_a.get_reset_pc();
+    let mut result = run_diff(&mut source_a, &mut source_b, pc, SamePolicy::Strict)?;
+    result.throughput = Some(Throughput::new(
+        source_a.throughput(),
+        source_b.throughput(),
+    ));
+    Ok(result)
+}
+
 #[derive(Serialize)]
 pub struct DiffReport {
     // Nix relies on "is_same" field, others are for humans.
@@ -60,6 +226,35 @@ pub struct DiffReport {
 
     state1: Option<String>,
     state2: Option<String>,
+
+    #[serde(skip_serializing_if = "Option::is_none")]
+    throughput: Option<Throughput>,
+}
+
+/// Speed of two models compared in lockstep, time in diffing is excluded
+#[derive(Serialize)]
+pub struct Throughput {
+    steps1: u64,
+    steps2: u64,
+    // instructions per second
+    ips1: f64,
+    ips2: f64,
+    // speed of source 2 relative to source 1
+    ratio: f64,
+}
+
+impl Throughput {
+    fn new((steps1, busy1): (u64, Duration), (steps2, busy2): (u64, Duration)) -> Self {
+        let ips = |steps: u64, busy: Duration| steps as f64 / busy.as_secs_f64().max(1e-9);
+        let (ips1, ips2) = (ips(steps1, busy1), ips(steps2, busy2));
+        Self {
+            steps1,
+            steps2,
+            ips1,
+            ips2,
+            ratio: ips2 / ips1.max(1e-9),
+        }
+    }
 }
 
 fn run_diff(
@@ -79,7 +274,28 @@ fn run_diff(
         .diff_reset(reset_pc)
         .with_context(|| format!("reset source2={name2}"))?;
 
+    let report = diff_steps(source1, source2, None, same_policy)?;
+    Ok(report.expect("unlimited diff ends with a report"))
+}
+
+// Step both sources and compare them, until they differ or either exits.
+// Returns None if limit steps are the same.
+fn diff_steps(
+    source1: &mut dyn DiffBackend,
+    source2: &mut dyn DiffBackend,
+    limit: Option<u64>,
+    same_policy: SamePolicy,
+) -> anyhow::Result<Option<DiffReport>> {
+    let name1 = source1.description();
+    let name2 = source2.description();
+
+    let mut steps = 0;
     loop {
+        if limit == Some(steps) {
+            return Ok(None);
+        }
+        steps += 1;
+
         let status1 = source1
             .diff_step()
             .with_context(|| format!("step srouce1={name1}"))?;
@@ -95,14 +311,28 @@ fn run_diff(
 
                 let combined_dr = DiffRecord::combine(dr1, dr2);
 
-                if !combined_dr.compare(state1, state2) {
+                // compared only if both sides record them
+                let writes = source1.mem_writes().zip(source2.mem_writes());
+                let same_writes = writes.is_none_or(|(w1, w2)| w1 == w2);
+
+                if !combined_dr.compare(state1, state2) || !same_writes {
                     // difftest failed
 
                     let diff_string =
                         crate::util::fn_to_string(|f| pretty_print_diff(f, state1, state2));
-                    let diff_notes: Vec<String> = diff_string.lines().map(|x| x.into()).collect();
-
-                    return Ok(DiffReport {
+                    let mut diff_notes: Vec<String> =
+                        diff_string.lines().map(|x| x.into()).collect();
+                    if let Some((w1, w2)) = writes
+                        && w1 != w2
+                    {
+                        diff_notes.push(format!(
+                            "mem writes : {} <-> {}",
+                            format_mem_writes(w1),
+                            format_mem_writes(w2)
+                        ));
+                    }
+
+                    return Ok(Some(DiffReport {
                         is_same: false,
                         source1: name1,
                         source2: name2,
@@ -111,7 +341,8 @@ fn run_diff(
                         diff_notes,
                         state1: Some(state1.pretty_print_string()),
                         state2: Some(state2.pretty_print_string()),
-                    });
+                        throughput: None,
+                    }));
                 }
             }
 
@@ -128,7 +359,7 @@ fn run_diff(
                     state2 = Some(source2.state().pretty_print_string());
                 }
 
-                return Ok(DiffReport {
+                return Ok(Some(DiffReport {
                     is_same,
                     source1: name1,
                     source2: name2,
@@ -137,7 +368,8 @@ fn run_diff(
                     diff_notes: vec![],
                     state1,
                     state2,
-                });
+                    throughput: None,
+                }));
             }
         }
     }
@@ -196,4 +428,52 @@ pub trait DiffBackend {
     fn diff_step(&mut self) -> anyhow::Result<Status>;
 
     fn state(&self) -> &CpuState;
+
+    /// Memory writes of the last step, None if they are not recorded
+    fn mem_writes(&self) -> Option<&[MemWrite]> {
+        None
+    }
+}
+
+// `[0x80001000:4=0x00000001, ...]`
+fn format_mem_writes(writes: &[MemWrite]) -> String {
+    let writes: Vec<String> = writes
+        .iter()
+        .map(|w| format!("{:#010x}:{}={:#010x}", w.addr, w.len, w.value))
+        .collect();
+    format!("[{}]", writes.join(", "))
+}
+
+#[cfg(test)]
+mod tests {
+    use clap::Parser as _;
+
+    use super::*;
+
+    fn parse(args: &[&str]) -> Result<DiffTestArgs, clap::Error> {
+        DiffTestArgs::try_parse_from(["difftest", "-o", "report.json"].iter().chain(args))
+    }
+
+    #[test]
+    fn test_live_model_args() {
+        let args = parse(&["-s", "a.log", "--elf", "a.elf", "-c", "a.kdl"]).unwrap();
+        assert_eq!(args.max_insns, None);
+        let args = parse(&[
+            "-s",
+            "a.log",
+            "--elf",
+            "a.elf",
+            "-c",
+            "a.kdl",
+            "--max-insns",
+            "1000",
+        ])
+        .unwrap();
+        assert_eq!(args.max_insns, Some(1000));
+
+        // only a model run from --elf reads a configuration or stops on a limit
+        assert!(parse(&["-s", "a.log", "-p", "a.jsonl", "-c", "a.kdl"]).is_err());
+        assert!(parse(&["-s", "a.log", "-p", "a.jsonl", "--max-insns", "1000"]).is_err());
+        assert!(parse(&["-s", "a.log", "--elf", "a.elf"]).is_err());
+    }
 }
@@ -0,0 +1,198 @@
+//! Parsing a log in chunks on worker threads
+//!
+//! The log is cut at line boundaries into chunks of about `CHUNK_SIZE` bytes,
+//! which are parsed independently. Parsed chunks are received in log order,
+//! and at most a few chunks per worker are in flight, so memory stays bounded.
+
+use std::{
+    collections::VecDeque,
+    sync::{
+        Arc, Mutex,
+        mpsc::{Receiver, Sender, SyncSender},
+    },
+    thread::JoinHandle,
+};
+
+use crate::util::memchr;
+
+// A chunk is cut at the first line end after this size
+pub const CHUNK_SIZE: usize = 1 << 20;
+
+struct Job<J, R> {
+    chunk: J,
+    result_tx: SyncSender<R>,
+}
+
+/// Parse chunks on worker threads, results are received in submission order
+pub struct ChunkPool<J, R> {
+    // results of chunks being parsed, in log order
+    pending: VecDeque<Receiver<R>>,
+    max_pending: usize,
+
+    job_tx: Option<Sender<Job<J, R>>>,
+    workers: Vec<JoinHandle<()>>,
+}
+
+impl<J: Send + 'static, R: Send + 'static> ChunkPool<J, R> {
+    /// Each worker parses with its own clone of parse
+    pub fn new<P>(name: &str, parse: P) -> std::io::Result<Self>
+    where
+        P: FnMut(J) -> R + Clone + Send + 'static,
+    {
+        let workers = parse_workers();
+        let (job_tx, job_rx) = std::sync::mpsc::channel::<Job<J, R>>();
+        let job_rx = Arc::new(Mutex::new(job_rx));
+        let workers = (0..workers)
+            .map(|i| {
+                let job_rx = job_rx.clone();
+                let parse = parse.clone();
+                std::thread::Builder::new()
+                    .name(format!("{name}{i}"))
+                    .spawn(move || parse_loop(&job_rx, parse))
+            })
+            .collect::<Result<Vec<_>, _>>()?;
+
+        Ok(Self {
+            pending: VecDeque::new(),
+            max_pending: 2 * workers.len(),
+            job_tx: Some(job_tx),
+            workers,
+        })
+    }
+
+    /// No more chunks should be submitted until the oldest one is received
+    pub fn is_full(&self) -> bool {
+        self.pending.len() >= self.max_pending
+    }
+
+    pub fn submit(&mut self, chunk: J) -> anyhow::Result<()> {
+        let (result_tx, result_rx) = std::sync::mpsc::sync_channel(1);
+        self.job_tx
+            .as_ref()
+            .unwrap()
+            .send(Job { chunk, result_tx })
+            .map_err(|_| anyhow::anyhow!("log parse worker exited"))?;
+        self.pending.push_back(result_rx);
+        Ok(())
+    }
+
+    /// Result of the oldest chunk, None if no chunk is pending
+    pub fn recv(&mut self) -> anyhow::Result<Option<R>> {
+        let Some(result_rx) = self.pending.pop_front() else {
+            return Ok(None);
+        };
+        let result = result_rx
+            .recv()
+            .map_err(|_| anyhow::anyhow!("log parse worker panicked"))?;
+        Ok(Some(result))
+    }
+}
+
+impl<J, R> Drop for ChunkPool<J, R> {
+    fn drop(&mut self) {
+        // closing the channel stops workers, results of pending chunks are discarded
+        self.job_tx = None;
+        self.pending.clear();
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+}
+
+// Parsing scales with cores, the diff loop takes one of them
+fn parse_workers() -> usize {
+    std::thread::available_parallelism().map_or(1, |n| n.get().saturating_sub(1).max(1))
+}
+
+fn parse_loop<J, R>(job_rx: &Mutex<Receiver<Job<J, R>>>, mut parse: impl FnMut(J) -> R) {
+    loop {
+        let job = job_rx.lock().unwrap().recv();
+        let Ok(Job { chunk, result_tx }) = job else {
+            return;
+        };
+        // the pool may have been dropped meanwhile
+        let _ = result_tx.send(parse(chunk));
+    }
+}
+
+/// A line of a chunk failed to parse
+pub struct ChunkError {
+    /// Line number counted from the chunk start
+    pub line: usize,
+    pub error: anyhow::Error,
+}
+
+/// End of the chunk starting at start, after the first line end following size bytes
+pub fn chunk_end(data: &[u8], start: usize, size: usize) -> usize {
+    let cut = start + size;
+    match data.get(cut..).and_then(|rest| memchr(b'\n', rest)) {
+        Some(i) => cut + i + 1,
+        None => data.len(),
+    }
+}
+
+/// Lines of a chunk without line ends, the same as `str::lines` on bytes
+pub struct Lines<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Lines<'a> {
+    pub fn new(data: &'a [u8]) -> Self {
+        Self { data }
+    }
+}
+
+impl<'a> Iterator for Lines<'a> {
+    type Item = &'a [u8];
+
+    fn next(&mut self) -> Option<&'a [u8]> {
+        if self.data.is_empty() {
+            return None;
+        }
+        let line = match memchr(b'\n', self.data) {
+            Some(end) => {
+                let line = &self.data[..end];
+                self.data = &self.data[end + 1..];
+                line
+            }
+            None => std::mem::take(&mut self.data),
+        };
+        Some(line.strip_suffix(b"\r").unwrap_or(line))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_lines() {
+        let text = "a\r\n\nbc\nd";
+        let lines: Vec<&[u8]> = Lines::new(text.as_bytes()).collect();
+        let expected: Vec<&[u8]> = text.lines().map(str::as_bytes).collect();
+        assert_eq!(lines, expected);
+        assert_eq!(Lines::new(b"a\n").count(), 1);
+    }
+
+    #[test]
+    fn test_pool_order() {
+        let mut pool = ChunkPool::new("test-parse", |n: u32| {
+            // later chunks finish first
+            std::thread::sleep(std::time::Duration::from_micros(100 - n as u64));
+            n * 2
+        })
+        .unwrap();
+
+        let mut results = vec![];
+        for n in 0..100 {
+            if pool.is_full() {
+                results.push(pool.recv().unwrap().unwrap());
+            }
+            pool.submit(n).unwrap();
+        }
+        while let Some(result) = pool.recv().unwrap() {
+            results.push(result);
+        }
+        assert_eq!(results, (0..100).map(|n| n * 2).collect::<Vec<_>>());
+    }
+}
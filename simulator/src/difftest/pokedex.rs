@@ -1,4 +1,7 @@
-use std::path::Path;
+use std::{
+    io::{BufRead as _, BufReader, Cursor, Read},
+    path::{Path, PathBuf},
+};
 
 use anyhow::Context as _;
 
@@ -6,50 +9,212 @@ use crate::{
     common::{CommitLog, PokedexLog},
     difftest::{
         DiffBackend, Status,
+        lookahead::{LogSource, Lookahead},
+        parallel::{CHUNK_SIZE, ChunkError, ChunkPool, Lines},
         replay::{CpuState, DiffRecord},
     },
+    trace::{self, TraceCursor, TraceReader},
 };
 
+type Input = BufReader<Box<dyn Read + Send>>;
+
 pub fn backend_from_log(log_path: &Path) -> anyhow::Result<PokedexLogBackend> {
-    // FIXME: parse in stream
-
-    let raw_str = std::fs::read_to_string(log_path)
-        .with_context(|| format!("reading pokedex log {}", log_path.display()))?;
-
-    let mut pokedex_log = vec![];
-    for (line_number, line_str) in raw_str.lines().enumerate() {
-        let commit: PokedexLog = serde_json::from_str(line_str).with_context(|| {
-            format!(
-                "fail parse pokedex log {}, line {line_number}",
-                log_path.display(),
-            )
+    Ok(PokedexLogBackend::new(PokedexLogReader::open(log_path)?))
+}
+
+/// Parse a pokedex trace record by record, either binary or JSON lines
+pub enum PokedexLogReader {
+    // records are delta encoded against previous ones, thus decoded in order
+    Binary {
+        reader: TraceReader<Input>,
+        path: PathBuf,
+    },
+    Json(JsonLogReader),
+    // seeked from an index keyframe, for diffing a segment of the trace
+    Cursor(TraceCursor),
+}
+
+impl PokedexLogReader {
+    pub fn open(log_path: &Path) -> anyhow::Result<Self> {
+        let mut input = trace::open_input(log_path)?;
+        let (magic, filled) = trace::read_magic(input.as_mut())
+            .with_context(|| format!("reading pokedex log {}", log_path.display()))?;
+        let is_binary = filled == magic.len() && magic == trace::MAGIC;
+
+        // put the sniffed bytes back
+        let input: Box<dyn Read + Send> =
+            Box::new(Cursor::new(magic[..filled].to_vec()).chain(input));
+        let reader = BufReader::with_capacity(1 << 16, input);
+        let path = log_path.to_path_buf();
+
+        if is_binary {
+            let reader = TraceReader::new(reader)
+                .with_context(|| format!("fail parse pokedex trace {}", path.display()))?;
+            Ok(Self::Binary { reader, path })
+        } else {
+            Ok(Self::Json(JsonLogReader::new(reader, path)?))
+        }
+    }
+}
+
+impl LogSource for PokedexLogReader {
+    type Item = PokedexLog;
+
+    fn next_item(&mut self) -> anyhow::Result<Option<PokedexLog>> {
+        match self {
+            Self::Binary { reader, path } => reader
+                .next_log()
+                .with_context(|| format!("fail parse pokedex trace {}", path.display())),
+            Self::Json(reader) => reader.next_item(),
+            Self::Cursor(cursor) => cursor.next_log(),
+        }
+    }
+}
+
+/// Read a JSON lines trace in chunks, which are parsed on worker threads
+pub struct JsonLogReader {
+    reader: Input,
+    path: PathBuf,
+    eof: bool,
+    // lines before the current chunk
+    line_number: usize,
+
+    pool: ChunkPool<JsonJob, Result<JsonChunk, ChunkError>>,
+    // records of the current chunk, reversed
+    logs: Vec<PokedexLog>,
+    // drained buffers of chunks
+    free_data: Vec<Vec<u8>>,
+    free_logs: Vec<Vec<PokedexLog>>,
+}
+
+struct JsonJob {
+    data: Vec<u8>,
+    // empty, parsed records are pushed here
+    logs: Vec<PokedexLog>,
+}
+
+struct JsonChunk {
+    data: Vec<u8>,
+    // reversed, thus popped in log order
+    logs: Vec<PokedexLog>,
+    lines: usize,
+}
+
+impl JsonLogReader {
+    fn new(reader: Input, path: PathBuf) -> anyhow::Result<Self> {
+        Ok(Self {
+            reader,
+            path,
+            eof: false,
+            line_number: 0,
+            pool: ChunkPool::new("pokedex-parse", parse_json_chunk)?,
+            logs: Vec::new(),
+            free_data: Vec::new(),
+            free_logs: Vec::new(),
+        })
+    }
+
+    fn submit_chunks(&mut self) -> anyhow::Result<()> {
+        while !self.eof && !self.pool.is_full() {
+            let mut data = self.free_data.pop().unwrap_or_default();
+            read_chunk(&mut self.reader, &mut data)
+                .with_context(|| format!("reading pokedex log {}", self.path.display()))?;
+            if data.is_empty() {
+                self.eof = true;
+                break;
+            }
+            self.pool.submit(JsonJob {
+                data,
+                logs: self.free_logs.pop().unwrap_or_default(),
+            })?;
+        }
+        Ok(())
+    }
+
+    fn receive_chunk(&mut self) -> anyhow::Result<bool> {
+        self.submit_chunks()?;
+        let Some(result) = self.pool.recv()? else {
+            return Ok(false);
+        };
+
+        let chunk = result.map_err(|ChunkError { line, error }| {
+            error.context(format!(
+                "fail parse pokedex log {}, line {}",
+                self.path.display(),
+                self.line_number + line,
+            ))
+        })?;
+        self.line_number += chunk.lines;
+        self.free_data.push(chunk.data);
+        self.free_logs
+            .push(std::mem::replace(&mut self.logs, chunk.logs));
+        Ok(true)
+    }
+
+    fn next_item(&mut self) -> anyhow::Result<Option<PokedexLog>> {
+        loop {
+            if let Some(log) = self.logs.pop() {
+                return Ok(Some(log));
+            }
+            if !self.receive_chunk()? {
+                return Ok(None);
+            }
+        }
+    }
+}
+
+// Read about CHUNK_SIZE bytes of whole lines, empty at the end of input
+fn read_chunk(reader: &mut Input, data: &mut Vec<u8>) -> std::io::Result<()> {
+    data.clear();
+    reader.by_ref().take(CHUNK_SIZE as u64).read_to_end(data)?;
+    if !data.is_empty() && data.last() != Some(&b'\n') {
+        reader.read_until(b'\n', data)?;
+    }
+    Ok(())
+}
+
+fn parse_json_chunk(job: JsonJob) -> Result<JsonChunk, ChunkError> {
+    let JsonJob { data, mut logs } = job;
+    for (line, line_bytes) in Lines::new(&data).enumerate() {
+        let log = serde_json::from_slice(line_bytes).map_err(|e| ChunkError {
+            line,
+            error: e.into(),
         })?;
-        pokedex_log.push(commit);
+        logs.push(log);
     }
 
-    Ok(PokedexLogBackend::new(pokedex_log))
+    logs.reverse();
+    Ok(JsonChunk {
+        data,
+        lines: logs.len(),
+        logs,
+    })
 }
 
 pub struct PokedexLogBackend {
-    index: usize,
-    logs: Vec<PokedexLog>,
+    logs: Lookahead<PokedexLogReader>,
 
     state: CpuState,
 }
 
 impl PokedexLogBackend {
-    pub fn new(logs: Vec<PokedexLog>) -> Self {
+    pub fn new(reader: PokedexLogReader) -> Self {
+        Self::with_state(reader, CpuState::new())
+    }
+
+    /// Replay continues from state, for a reader not starting at the reset
+    pub fn with_state(reader: PokedexLogReader, state: CpuState) -> Self {
         Self {
-            index: 0,
-            logs,
-            state: CpuState::new(),
+            logs: Lookahead::new(reader),
+            state,
         }
     }
 
-    pub fn get_reset_pc(&self) -> u32 {
-        match &self.logs[0] {
-            &PokedexLog::Reset { pc } => pc,
-            _ => panic!("pokedex json log should start with reset"),
+    /// Peek the first record, which should be a reset
+    pub fn get_reset_pc(&mut self) -> anyhow::Result<u32> {
+        match self.logs.peek()? {
+            Some(&PokedexLog::Reset { pc }) => Ok(pc),
+            _ => anyhow::bail!("pokedex json log should start with reset"),
         }
     }
 }
@@ -60,8 +225,8 @@ impl DiffBackend for PokedexLogBackend {
     }
 
     fn diff_reset(&mut self, expected_pc: u32) -> anyhow::Result<()> {
-        match &self.logs[self.index] {
-            &PokedexLog::Reset { pc } => {
+        match self.logs.next()? {
+            Some(PokedexLog::Reset { pc }) => {
                 if pc != expected_pc {
                     anyhow::bail!(
                         "pokedex error at reset, expected_pc={expected_pc:#010x}, actual_pc={pc:#010x}"
@@ -71,16 +236,14 @@ impl DiffBackend for PokedexLogBackend {
             _ => anyhow::bail!("pokedex json log should start with reset"),
         }
 
-        self.index += 1;
         Ok(())
     }
 
     fn diff_step(&mut self) -> anyhow::Result<Status> {
-        match self.logs.get(self.index) {
-            Some(&PokedexLog::Exit { code }) => Ok(Status::Exit { code }),
+        match self.logs.next()? {
+            Some(PokedexLog::Exit { code }) => Ok(Status::Exit { code }),
             Some(PokedexLog::Commit(commit)) => {
-                let dr = update_state(&mut self.state, commit);
-                self.index += 1;
+                let dr = update_state(&mut self.state, &commit);
                 Ok(Status::Running(dr))
             }
 
@@ -96,6 +259,7 @@ impl DiffBackend for PokedexLogBackend {
 
 fn update_state(state: &mut CpuState, commit: &CommitLog) -> DiffRecord {
     state.pc = commit.pc;
+    state.inst = commit.instruction;
 
     let mut dr = DiffRecord::default();
     for write in &commit.states_changed {
@@ -109,12 +273,19 @@ fn update_state(state: &mut CpuState, commit: &CommitLog) -> DiffRecord {
                 state.write_fpr(rd as usize, value, &mut dr);
             }
             &Vrf { rd, ref value } => {
-                state.write_vreg(rd as usize, value, &mut dr);
+                state.write_vreg(rd as usize, 0, value, &mut dr);
+            }
+            &VrfPatch {
+                rd,
+                offset,
+                ref value,
+            } => {
+                state.write_vreg(rd as usize, offset as usize, value, &mut dr);
             }
             &Csr { ref name, value } => {
                 // FIXME: error handling
                 state
-                    .write_csr(name, value)
+                    .write_csr(name, value, &mut dr)
                     .unwrap_or_else(|_| panic!("pokedex replay error: CSR {name} = {value:#010x}"));
             }
         }
@@ -1,7 +1,10 @@
-use crate::util::{self, Bitmap32};
+use crate::{
+    disasm::Disassembler,
+    util::{self, Bitmap32},
+};
 
 const VLEN: usize = 256;
-const VLEN_BYTE: usize = VLEN / 8;
+pub(crate) const VLEN_BYTE: usize = VLEN / 8;
 
 #[derive(Clone, PartialEq, Eq)]
 pub struct CpuState {
@@ -10,6 +13,8 @@ pub struct CpuState {
     pub vregs: Vec<u8>,
 
     pub pc: u32,
+    // instruction committed at pc, in the lower 16 bits if compressed, for reports only
+    pub inst: u32,
 
     pub csr: CsrState,
 
@@ -66,6 +71,8 @@ pub struct DiffRecord {
     gpr_write_mask: Bitmap32,
     fpr_write_mask: Bitmap32,
     vreg_write_mask: Bitmap32,
+    // CSRs are few, any write compares all of them
+    csr_written: bool,
 }
 
 impl DiffRecord {
@@ -74,7 +81,7 @@ impl DiffRecord {
             && self.compare_gpr(x, y)
             && self.compare_fpr(x, y)
             && self.compare_vreg(x, y)
-            && Self::compare_csr_all(x, y)
+            && self.compare_csr(x, y)
     }
 
     pub fn combine(lhs: &DiffRecord, rhs: &DiffRecord) -> DiffRecord {
@@ -82,6 +89,7 @@ impl DiffRecord {
             gpr_write_mask: lhs.gpr_write_mask | rhs.gpr_write_mask,
             fpr_write_mask: lhs.fpr_write_mask | rhs.fpr_write_mask,
             vreg_write_mask: lhs.vreg_write_mask | rhs.vreg_write_mask,
+            csr_written: lhs.csr_written || rhs.csr_written,
         }
     }
 
@@ -99,8 +107,8 @@ impl DiffRecord {
             .all(|i| x.vreg_slice(i) == y.vreg_slice(i))
     }
 
-    fn compare_csr_all(x: &CpuState, y: &CpuState) -> bool {
-        x.csr == y.csr
+    fn compare_csr(&self, x: &CpuState, y: &CpuState) -> bool {
+        !self.csr_written || x.csr == y.csr
     }
 }
 
@@ -174,6 +182,17 @@ pub fn pretty_print_diff(
         writeln!(f, "pc         : {:#010x}", gold.pc)?;
     }
 
+    let disassembler = Disassembler::global();
+    let inst = |state: &CpuState| {
+        let asm = disassembler.disasm_string(state.pc, state.inst);
+        format!("{:#010x} ({asm})", state.inst)
+    };
+    if gold.inst != dut.inst {
+        writeln!(f, "inst       : {} <-> {}", inst(gold), inst(dut))?;
+    } else {
+        writeln!(f, "inst       : {}", inst(gold))?;
+    }
+
     // compare GPR
     for i in 0..32 {
         let (goldv, dutv) = (gold.gpr[i], dut.gpr[i]);
@@ -278,6 +297,7 @@ impl CpuState {
             fpr: [0; 32],
             vregs: vec![0; 32 * VLEN_BYTE],
             pc: 0,
+            inst: 0,
 
             csr: CsrState::default(),
 
@@ -299,10 +319,17 @@ impl CpuState {
         diff.fpr_write_mask.set(rd);
     }
 
-    pub(crate) fn write_vreg(&mut self, rd: usize, data: &[u8], diff: &mut DiffRecord) {
+    // data could be part of the register starting at byte offset, the rest is unchanged
+    pub(crate) fn write_vreg(
+        &mut self,
+        rd: usize,
+        offset: usize,
+        data: &[u8],
+        diff: &mut DiffRecord,
+    ) {
         assert!(rd < 32);
-        assert_eq!(data.len(), VLEN_BYTE);
-        self.vreg_slice_mut(rd).copy_from_slice(data);
+        assert!(offset + data.len() <= VLEN_BYTE);
+        self.vreg_slice_mut(rd)[offset..][..data.len()].copy_from_slice(data);
         diff.vreg_write_mask.set(rd);
     }
 
@@ -314,7 +341,12 @@ impl CpuState {
         &mut self.vregs[idx * VLEN_BYTE..][..VLEN_BYTE]
     }
 
-    pub(crate) fn write_csr(&mut self, name: &str, val: u32) -> Result<(), CsrValueError> {
+    pub(crate) fn write_csr(
+        &mut self,
+        name: &str,
+        val: u32,
+        diff: &mut DiffRecord,
+    ) -> Result<(), CsrValueError> {
         const MASK_FCSR: u32 = 0xFF;
         const MASK_FFLAGS: u32 = 0x1F;
         const MASK_FRM: u32 = 0x07;
@@ -334,6 +366,7 @@ impl CpuState {
             *src = (*src & !mask) | (value & mask);
         }
 
+        diff.csr_written = true;
         match name {
             "fcsr" => {
                 ensure!(val == val & MASK_FCSR);
@@ -0,0 +1,305 @@
+//! Diffing a long case in segments on worker threads
+//!
+//! The Spike log is cut into segments at line ends. Every line of a Spike log is a commit,
+//! thus the lines before a segment tell the instruction it starts at.
+//! For each segment, the pokedex trace is seeked there from the nearest index keyframe,
+//! and both sides are replayed from the state recorded in the trace.
+//!
+//! The first segment ending the diff gives the report, the same as diffing sequentially:
+//! all segments before it are the same on both sides, thus so is the state it starts from.
+//! The pokedex trace should be of the whole run, `run` writes no index for a filtered trace
+//! or a trace range, thus such a trace is rejected.
+
+use std::{path::Path, sync::Arc};
+
+use anyhow::Context as _;
+
+use crate::{
+    common::PokedexLog,
+    difftest::{
+        DiffBackend, DiffReport, SamePolicy, diff_steps,
+        parallel::{ChunkPool, Lines, chunk_end},
+        pokedex::{PokedexLogBackend, PokedexLogReader},
+        replay::{CpuState, DiffRecord, VLEN_BYTE},
+        spike::{SpikeSegmentBackend, find_entry, map_log},
+    },
+    trace::{ArchState, Keyframes, TraceCursor},
+    util::Mmap,
+};
+
+// Spike log bytes of a segment, cut at the first line end after it
+const SEGMENT_SIZE: usize = 64 << 20;
+
+struct SegmentJob {
+    start: usize,
+    end: usize,
+    // instructions before the segment, and the line number of its start
+    commits: u64,
+    line_number: usize,
+    lines: u64,
+    keyframe: Option<(ArchState, u64)>,
+    // the last segment runs until either side exits
+    is_last: bool,
+}
+
+/// Diff a Spike log with a pokedex trace file in segments on worker threads
+pub fn diff_segments(spike_log_path: &Path, pokedex_log_path: &Path) -> anyhow::Result<DiffReport> {
+    diff_segments_of_size(spike_log_path, pokedex_log_path, SEGMENT_SIZE)
+}
+
+fn diff_segments_of_size(
+    spike_log_path: &Path,
+    pokedex_log_path: &Path,
+    segment_size: usize,
+) -> anyhow::Result<DiffReport> {
+    let mmap = map_log(spike_log_path)?;
+
+    let Some(mut keyframes) = Keyframes::open(pokedex_log_path)? else {
+        anyhow::bail!(
+            "{} has no index, which is written by `run --trace-index-interval`",
+            pokedex_log_path.display()
+        );
+    };
+
+    let reset_pc = match TraceCursor::open_at(pokedex_log_path, 0)?.next_log()? {
+        Some(PokedexLog::Reset { pc }) => pc,
+        _ => anyhow::bail!("pokedex json log should start with reset"),
+    };
+    let entry = find_entry(&mmap, reset_pc)
+        .with_context(|| format!("reading spike log {spike_log_path:?}"))?;
+
+    let data = mmap.as_slice();
+    let mut bounds = vec![entry];
+    while let Some(&start) = bounds.last()
+        && start < data.len()
+    {
+        bounds.push(chunk_end(data, start, segment_size));
+    }
+    let line_counts = count_lines(&mmap, &bounds)?;
+
+    let mut pool = {
+        let mmap = mmap.clone();
+        let trace_path = pokedex_log_path.to_path_buf();
+        ChunkPool::new("segment-diff", move |job| {
+            diff_segment(&mmap, &trace_path, reset_pc, job)
+        })?
+    };
+
+    let segments = bounds.len() - 1;
+    let mut keyframe = None;
+    let mut next_keyframe = keyframes.next_keyframe()?;
+    let mut commits = 0;
+    let mut line_number = Lines::new(&data[..entry]).count();
+    for (i, (range, lines)) in bounds.windows(2).zip(line_counts).enumerate() {
+        // the latest keyframe at or before the segment
+        while let Some((state, _)) = &next_keyframe
+            && state.commits <= commits
+        {
+            keyframe = next_keyframe.take();
+            next_keyframe = keyframes.next_keyframe()?;
+        }
+
+        if pool.is_full()
+            && let Some(report) = pool.recv()?.transpose()?.flatten()
+        {
+            return Ok(report);
+        }
+        pool.submit(SegmentJob {
+            start: range[0],
+            end: range[1],
+            commits,
+            line_number,
+            lines: lines as u64,
+            keyframe: keyframe.clone(),
+            is_last: i + 1 == segments,
+        })?;
+        commits += lines as u64;
+        line_number += lines;
+    }
+
+    while let Some(result) = pool.recv()? {
+        if let Some(report) = result? {
+            return Ok(report);
+        }
+    }
+    unreachable!("the last segment runs until either side exits")
+}
+
+// Lines between each two bounds, counted on worker threads
+fn count_lines(mmap: &Arc<Mmap>, bounds: &[usize]) -> anyhow::Result<Vec<usize>> {
+    let mut pool = {
+        let mmap = mmap.clone();
+        ChunkPool::new("spike-count", move |(start, end): (usize, usize)| {
+            Lines::new(&mmap.as_slice()[start..end]).count()
+        })?
+    };
+
+    let mut counts = Vec::with_capacity(bounds.len());
+    for range in bounds.windows(2) {
+        if pool.is_full() {
+            counts.extend(pool.recv()?);
+        }
+        pool.submit((range[0], range[1]))?;
+    }
+    while let Some(count) = pool.recv()? {
+        counts.push(count);
+    }
+    Ok(counts)
+}
+
+// Returns None if the segment is the same on both sides
+fn diff_segment(
+    mmap: &Arc<Mmap>,
+    trace_path: &Path,
+    reset_pc: u32,
+    job: SegmentJob,
+) -> anyhow::Result<Option<DiffReport>> {
+    let SegmentJob {
+        start,
+        end,
+        commits,
+        line_number,
+        lines,
+        keyframe,
+        is_last,
+    } = job;
+
+    let cursor = TraceCursor::open_from(trace_path, keyframe, commits)
+        .with_context(|| format!("reading pokedex trace {}", trace_path.display()))?;
+    let state = seed_state(cursor.state())?;
+
+    let mut spike_log =
+        SpikeSegmentBackend::new(mmap.clone(), start, end, line_number, state.clone());
+    let mut pokedex_log = PokedexLogBackend::with_state(PokedexLogReader::Cursor(cursor), state);
+    if commits == 0 {
+        pokedex_log.diff_reset(reset_pc)?;
+    }
+
+    let limit = (!is_last).then_some(lines);
+    diff_steps(
+        &mut spike_log,
+        &mut pokedex_log,
+        limit,
+        SamePolicy::SuccessSource2,
+    )
+}
+
+// Replay state of a trace state, CSRs never written keep their reset values
+fn seed_state(arch: &ArchState) -> anyhow::Result<CpuState> {
+    anyhow::ensure!(
+        arch.vlen_byte() == VLEN_BYTE,
+        "VLEN of the pokedex trace differs"
+    );
+
+    let mut state = CpuState::new();
+    state.gpr = arch.xregs;
+    state.fpr = arch.fregs;
+    state.vregs.copy_from_slice(&arch.vregs);
+    state.pc = arch.last_pc;
+    state.inst = arch.last_inst;
+
+    // The trace keeps the last value of each name, and keeps a whole CSR consistent
+    // with its fields, so the whole one is applied last as the authority.
+    let (whole, fields): (Vec<_>, Vec<_>) = arch
+        .csrs
+        .iter()
+        .partition(|(name, _)| matches!(name.as_str(), "fcsr" | "vcsr"));
+
+    let mut dr = DiffRecord::default();
+    for (name, &value) in fields.into_iter().chain(whole) {
+        if state.write_csr(name, value, &mut dr).is_err() {
+            anyhow::bail!("pokedex replay error: CSR {name} = {value:#010x}");
+        }
+    }
+    Ok(state)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{fmt::Write as _, path::PathBuf};
+
+    use super::*;
+    use crate::{
+        difftest::{pokedex, run_diff, spike},
+        trace::test_trace::TestTrace,
+    };
+
+    const RESET_PC: u32 = 0x8000_0000;
+    const ADDI_X1: u32 = 0x0010_8093;
+
+    // Spike log and pokedex trace of a case incrementing x1, with FP CSR writes between.
+    // The model writes the whole fcsr where Spike writes fflags alone,
+    // which is the same only if frm is seeded right after a field write.
+    fn write_case(name: &str, insts: u32, diverge_at: Option<u32>) -> (PathBuf, PathBuf) {
+        let dir = std::env::temp_dir();
+        let spike_path = dir.join(format!("pokedex-segment-{name}-{}.log", std::process::id()));
+        let trace_path = dir.join(format!("pokedex-segment-{name}-{}.bin", std::process::id()));
+
+        let mut spike_log = String::new();
+        let mut trace = TestTrace::new(RESET_PC);
+        for i in 0..insts {
+            let pc = RESET_PC + 4 * i;
+            let (spike_csr, csrs): (_, &[_]) = match i {
+                10 => (Some(("c3_fcsr", 0x21)), &[(0x003, 0x21)]),
+                20 => (Some(("c2_frm", 0x2)), &[(0x002, 0x2)]),
+                30 => (Some(("c3_fcsr", 0xe0)), &[(0x003, 0xe0)]),
+                _ if i % 50 == 49 => (Some(("c1_fflags", 0x1)), &[(0x003, 0xe1)]),
+                _ => (None, &[]),
+            };
+
+            write!(
+                spike_log,
+                "core   0: 3 {pc:#010x} ({ADDI_X1:#010x}) x1  {:#010x}",
+                i + 1
+            )
+            .unwrap();
+            if let Some((name, value)) = spike_csr {
+                write!(spike_log, " {name} {value:#010x}").unwrap();
+            }
+            spike_log.push('\n');
+
+            let x1 = if diverge_at == Some(i) { 0xdead } else { i + 1 };
+            trace.commit(pc, ADDI_X1, &[(1, x1)], csrs);
+        }
+        trace.exit(0);
+
+        std::fs::write(&spike_path, spike_log).unwrap();
+        trace.write(&trace_path, 16);
+        (spike_path, trace_path)
+    }
+
+    fn diff_both_ways(name: &str, diverge_at: Option<u32>) -> DiffReport {
+        let (spike_path, trace_path) = write_case(name, 600, diverge_at);
+
+        let mut spike_log = spike::backend_from_log(&spike_path).unwrap();
+        let mut pokedex_log = pokedex::backend_from_log(&trace_path).unwrap();
+        let sequential = run_diff(
+            &mut spike_log,
+            &mut pokedex_log,
+            RESET_PC,
+            SamePolicy::SuccessSource2,
+        )
+        .unwrap();
+        // about 40 segments of 1KiB
+        let segmented = diff_segments_of_size(&spike_path, &trace_path, 1 << 10).unwrap();
+
+        assert_eq!(
+            serde_json::to_string(&segmented).unwrap(),
+            serde_json::to_string(&sequential).unwrap()
+        );
+
+        std::fs::remove_file(&spike_path).unwrap();
+        TestTrace::remove(&trace_path);
+        segmented
+    }
+
+    #[test]
+    fn test_segments_same_as_sequential() {
+        let report = diff_both_ways("same", None);
+        assert!(report.is_same);
+        assert_eq!((report.exit1, report.exit2), (Some(u32::MAX), Some(0)));
+
+        let report = diff_both_ways("differ", Some(400));
+        assert!(!report.is_same);
+    }
+}
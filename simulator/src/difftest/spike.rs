@@ -1,11 +1,17 @@
+use std::fs::File;
 use std::num::ParseIntError;
+use std::path::PathBuf;
 use std::slice::Iter;
+use std::sync::Arc;
 use std::{iter::Peekable, path::Path};
 
 use anyhow::{Context as _, bail};
 
-use crate::difftest::replay::{CpuState, DiffRecord};
+use crate::difftest::lookahead::{LogSource, Lookahead};
+use crate::difftest::parallel::{CHUNK_SIZE, ChunkError, ChunkPool, Lines, chunk_end};
+use crate::difftest::replay::{CpuState, DiffRecord, VLEN_BYTE};
 use crate::difftest::{DiffBackend, Status};
+use crate::util::{Mmap, memchr};
 
 #[derive(Debug, PartialEq, Eq, Clone)]
 pub enum Token<'a> {
@@ -36,41 +42,41 @@ fn is_hex(s: &str) -> bool {
 }
 
 pub struct SpikeLogBackend {
-    index: usize,
-    logs: Vec<Commit>,
+    logs: Lookahead<SpikeLogReader>,
 
     state: CpuState,
 }
 
 impl SpikeLogBackend {
-    pub fn new(logs: Vec<Commit>) -> Self {
+    pub fn new(reader: SpikeLogReader) -> Self {
         Self {
-            index: 0,
-            logs,
+            logs: Lookahead::new(reader),
             state: CpuState::new(),
         }
     }
 }
 
+// Spike always reset at its own bootrom.
+// We skip instructions in bootrom, until the real entry of testcase.
+const MAX_SKIP: usize = 16;
+
 impl DiffBackend for SpikeLogBackend {
     fn description(&self) -> String {
         "spike-log".into()
     }
 
     fn diff_reset(&mut self, expected_pc: u32) -> anyhow::Result<()> {
-        // Spike always reset at its own bootrom.
-        // We skip instructions in bootrom, until the real entry of testcase.
-        const MAX_SKIP: usize = 16;
-
         for _ in 0..MAX_SKIP {
-            match self.logs.get(self.index) {
+            match self.logs.peek()? {
                 None => bail!("unexpected eof in finding pc={expected_pc:#10x}"),
                 Some(commit) => {
                     if commit.pc == expected_pc as u64 {
                         return Ok(());
                     }
 
-                    self.index += 1;
+                    if let Some(commit) = self.logs.next()? {
+                        self.logs.source_mut().recycle(commit);
+                    }
                 }
             }
         }
@@ -79,7 +85,7 @@ impl DiffBackend for SpikeLogBackend {
     }
 
     fn diff_step(&mut self) -> anyhow::Result<Status> {
-        match self.logs.get(self.index) {
+        match self.logs.next()? {
             None => {
                 // Our testcases won't terminate normally in spike,
                 // instead it will enter an infinite loop when pass.
@@ -88,9 +94,9 @@ impl DiffBackend for SpikeLogBackend {
                 Ok(Status::Exit { code: u32::MAX })
             }
             Some(commit) => {
-                let dr = update_cpu_state(&mut self.state, commit);
-
-                self.index += 1;
+                let csrs = self.logs.source().csr_names();
+                let dr = update_cpu_state(&mut self.state, &commit, csrs);
+                self.logs.source_mut().recycle(commit);
                 Ok(Status::Running(dr))
             }
         }
@@ -102,35 +108,391 @@ impl DiffBackend for SpikeLogBackend {
 }
 
 pub fn backend_from_log(path: &Path) -> anyhow::Result<SpikeLogBackend> {
-    // FIXME: parse in stream
+    Ok(SpikeLogBackend::new(SpikeLogReader::open(path)?))
+}
+
+/// Replay a slice of a memory mapped Spike log, parsed on the calling thread,
+/// thus slices of a log are diffed in parallel
+pub struct SpikeSegmentBackend {
+    mmap: Arc<Mmap>,
+    // start of the next line, and end of the slice
+    pos: usize,
+    end: usize,
+    line_number: usize,
+
+    tokens: Vec<Token<'static>>,
+    csrs: CsrNames,
+    commit: Commit,
+
+    state: CpuState,
+}
+
+impl SpikeSegmentBackend {
+    /// The slice starts at a line, whose line number is only for errors.
+    /// The replay continues from state.
+    pub fn new(
+        mmap: Arc<Mmap>,
+        start: usize,
+        end: usize,
+        line_number: usize,
+        state: CpuState,
+    ) -> Self {
+        Self {
+            mmap,
+            pos: start,
+            end,
+            line_number,
+            tokens: Vec::new(),
+            csrs: CsrNames::new(),
+            commit: Commit::default(),
+            state,
+        }
+    }
+
+    // None at the end of slice
+    fn next_commit(&mut self) -> anyhow::Result<Option<&Commit>> {
+        if self.pos >= self.end {
+            return Ok(None);
+        }
+        let data = &self.mmap.as_slice()[self.pos..self.end];
+        let len = memchr(b'\n', data).unwrap_or(data.len());
+        let line = &data[..len];
+        let line = line.strip_suffix(b"\r").unwrap_or(line);
+        self.pos += len + 1;
+
+        let mut tokens = reuse_buffer(std::mem::take(&mut self.tokens));
+        let result = parse_line(line, &mut tokens, &mut self.csrs, &mut self.commit);
+        self.tokens = reuse_buffer(tokens);
+        result.with_context(|| format!("fail parse spike log, line {}", self.line_number))?;
+
+        self.line_number += 1;
+        Ok(Some(&self.commit))
+    }
+}
+
+impl DiffBackend for SpikeSegmentBackend {
+    fn description(&self) -> String {
+        "spike-log".into()
+    }
+
+    // the slice starts after the bootrom, see `find_entry`
+    fn diff_reset(&mut self, _pc: u32) -> anyhow::Result<()> {
+        Ok(())
+    }
+
+    fn diff_step(&mut self) -> anyhow::Result<Status> {
+        if self.next_commit()?.is_none() {
+            // the same as SpikeLogBackend at the end of log
+            return Ok(Status::Exit { code: u32::MAX });
+        }
+        let dr = update_cpu_state(&mut self.state, &self.commit, &self.csrs);
+        Ok(Status::Running(dr))
+    }
+
+    fn state(&self) -> &CpuState {
+        &self.state
+    }
+}
+
+/// Map a Spike log, which is parsed in place
+pub fn map_log(path: &Path) -> anyhow::Result<Arc<Mmap>> {
+    let file = File::open(path).with_context(|| format!("reading spike log {path:?}"))?;
+    let mmap = Mmap::open(&file).with_context(|| format!("mapping spike log {path:?}"))?;
+    Ok(Arc::new(mmap))
+}
+
+/// Replay a whole log on the calling thread, from the real entry of testcase.
+/// For diffing many cases at once, where cases rather than chunks run in parallel.
+pub fn serial_backend(mmap: Arc<Mmap>, expected_pc: u32) -> anyhow::Result<SpikeSegmentBackend> {
+    let entry = find_entry(&mmap, expected_pc)?;
+    let line_number = Lines::new(&mmap.as_slice()[..entry]).count();
+    let end = mmap.as_slice().len();
+    Ok(SpikeSegmentBackend::new(
+        mmap,
+        entry,
+        end,
+        line_number,
+        CpuState::new(),
+    ))
+}
+
+/// Offset of the line committing the real entry of testcase, after the bootrom
+pub fn find_entry(mmap: &Arc<Mmap>, expected_pc: u32) -> anyhow::Result<usize> {
+    let len = mmap.as_slice().len();
+    let mut segment = SpikeSegmentBackend::new(mmap.clone(), 0, len, 0, CpuState::new());
+    for _ in 0..MAX_SKIP {
+        let start = segment.pos;
+        match segment.next_commit()? {
+            None => bail!("unexpected eof in finding pc={expected_pc:#10x}"),
+            Some(commit) if commit.pc == expected_pc as u64 => return Ok(start),
+            Some(_) => {}
+        }
+    }
+
+    anyhow::bail!("not found pc={expected_pc:#10x} in following {MAX_SKIP} instructions")
+}
+
+// Pages consumed by the reader are released in steps of this size
+const RELEASE_STEP: usize = 64 << 20;
+
+/// Parse a memory mapped Spike commit log in chunks on worker threads.
+/// Token buffers and commits are reused, so a line is parsed without heap allocation
+/// once the buffers have grown.
+pub struct SpikeLogReader {
+    mmap: Arc<Mmap>,
+    path: PathBuf,
+    // start of the next chunk to parse
+    pos: usize,
+    released: usize,
+    // lines before the current chunk
+    line_number: usize,
+
+    pool: ChunkPool<SpikeJob, Result<SpikeChunk, ChunkError>>,
+    // commits of the current chunk, reversed
+    commits: Vec<Commit>,
+    csrs: CsrNames,
+    // commits handed back by the consumer
+    spare: Vec<Commit>,
+    // drained commit buffers of chunks
+    free: Vec<Vec<Commit>>,
+}
+
+struct SpikeJob {
+    start: usize,
+    end: usize,
+    // empty, parsed commits are pushed here
+    commits: Vec<Commit>,
+    spare: Vec<Commit>,
+}
+
+struct SpikeChunk {
+    end: usize,
+    lines: usize,
+    // reversed, thus popped in log order
+    commits: Vec<Commit>,
+    // spare commits left over
+    spare: Vec<Commit>,
+    // CSR names first seen by the worker
+    new_csrs: Vec<(u32, Box<str>)>,
+}
+
+impl SpikeLogReader {
+    pub fn open(path: &Path) -> anyhow::Result<Self> {
+        let mmap = map_log(path)?;
+
+        let mut worker = SpikeWorker::new(mmap.clone());
+        let pool = ChunkPool::new("spike-parse", move |job| worker.parse_chunk(job))?;
+
+        Ok(Self {
+            mmap,
+            path: path.to_path_buf(),
+            pos: 0,
+            released: 0,
+            line_number: 0,
+            pool,
+            commits: Vec::new(),
+            csrs: CsrNames::new(),
+            spare: Vec::new(),
+            free: Vec::new(),
+        })
+    }
+
+    /// Names of CSRs in parsed commits
+    pub fn csr_names(&self) -> &CsrNames {
+        &self.csrs
+    }
+
+    /// Give a consumed commit back for reuse
+    pub fn recycle(&mut self, commit: Commit) {
+        self.spare.push(commit);
+    }
 
-    let raw_str =
-        std::fs::read_to_string(path).with_context(|| format!("reading spike log {path:?}"))?;
+    fn submit_chunks(&mut self) -> anyhow::Result<()> {
+        let data = self.mmap.as_slice();
+        while !self.pool.is_full() && self.pos < data.len() {
+            let end = chunk_end(data, self.pos, CHUNK_SIZE);
+            self.pool.submit(SpikeJob {
+                start: self.pos,
+                end,
+                commits: self.free.pop().unwrap_or_default(),
+                spare: std::mem::take(&mut self.spare),
+            })?;
+            self.pos = end;
+        }
+        Ok(())
+    }
 
-    let mut spike_log = vec![];
-    for (line_number, line_str) in raw_str.lines().enumerate() {
-        let tokens = tokenize_spike_log_line(line_str);
+    fn receive_chunk(&mut self) -> anyhow::Result<bool> {
+        self.submit_chunks()?;
+        let Some(result) = self.pool.recv()? else {
+            return Ok(false);
+        };
+
+        let path = &self.path;
+        let mut chunk = result.map_err(|ChunkError { line, error }| {
+            let line_number = self.line_number + line;
+            error.context(format!("fail parse spike log {path:?}, line {line_number}"))
+        })?;
 
-        // Check for any Unknown tokens before starting.
-        for token in &tokens {
-            if let Token::Unknown { raw_token } = token {
-                bail!(
-                    "fail parse spike log {path:?}, line {line_number}: unknown token `{raw_token}`"
-                );
+        for (addr, name) in &chunk.new_csrs {
+            self.csrs.intern(*addr, name).map_err(|reason| {
+                anyhow::anyhow!("fail parse spike log {path:?}: {reason}, CSR {addr} `{name}`")
+            })?;
+        }
+        self.line_number += chunk.lines;
+        self.spare.append(&mut chunk.spare);
+        self.free
+            .push(std::mem::replace(&mut self.commits, chunk.commits));
+
+        if chunk.end - self.released >= RELEASE_STEP {
+            self.mmap.release(chunk.end);
+            self.released = chunk.end;
+        }
+        Ok(true)
+    }
+}
+
+impl LogSource for SpikeLogReader {
+    type Item = Commit;
+
+    fn next_item(&mut self) -> anyhow::Result<Option<Commit>> {
+        loop {
+            if let Some(commit) = self.commits.pop() {
+                return Ok(Some(commit));
+            }
+            if !self.receive_chunk()? {
+                return Ok(None);
             }
         }
+    }
+}
 
-        let commit = parse_single_commit(&tokens)
-            .with_context(|| format!("fail parse spike log {path:?}, line {line_number}"))?;
+// Parse state of a worker thread
+#[derive(Clone)]
+struct SpikeWorker {
+    mmap: Arc<Mmap>,
+    tokens: Vec<Token<'static>>,
+    csrs: CsrNames,
+}
 
-        spike_log.push(commit);
+impl SpikeWorker {
+    fn new(mmap: Arc<Mmap>) -> Self {
+        Self {
+            mmap,
+            tokens: Vec::new(),
+            csrs: CsrNames::new(),
+        }
+    }
+
+    fn parse_chunk(&mut self, job: SpikeJob) -> Result<SpikeChunk, ChunkError> {
+        let SpikeJob {
+            start,
+            end,
+            mut commits,
+            mut spare,
+        } = job;
+
+        let data = &self.mmap.as_slice()[start..end];
+        let mut tokens = reuse_buffer(std::mem::take(&mut self.tokens));
+        for (line, line_bytes) in Lines::new(data).enumerate() {
+            let mut commit = spare.pop().unwrap_or_default();
+            parse_line(line_bytes, &mut tokens, &mut self.csrs, &mut commit)
+                .map_err(|error| ChunkError { line, error })?;
+            commits.push(commit);
+        }
+        self.tokens = reuse_buffer(tokens);
+
+        commits.reverse();
+        Ok(SpikeChunk {
+            end,
+            lines: commits.len(),
+            commits,
+            spare,
+            new_csrs: self.csrs.take_new(),
+        })
+    }
+}
+
+fn parse_line<'a>(
+    line: &'a [u8],
+    tokens: &mut Vec<Token<'a>>,
+    csrs: &mut CsrNames,
+    commit: &mut Commit,
+) -> anyhow::Result<()> {
+    let line_str = std::str::from_utf8(line)?;
+    tokenize_spike_log_line(line_str, tokens);
+
+    // Check for any Unknown tokens before parsing.
+    for token in tokens.iter() {
+        if let Token::Unknown { raw_token } = token {
+            bail!("unknown token `{raw_token}`");
+        }
     }
 
-    Ok(SpikeLogBackend::new(spike_log))
+    parse_commit(tokens, csrs, commit)?;
+    Ok(())
 }
 
-/// Tokenizes a raw string from a Spike commit log.
-fn tokenize_spike_log_line(line: &str) -> Vec<Token<'_>> {
+// Reuse the allocation of a token buffer for tokens of another line
+fn reuse_buffer<'b>(mut tokens: Vec<Token<'_>>) -> Vec<Token<'b>> {
+    tokens.clear();
+    let mut tokens = std::mem::ManuallyDrop::new(tokens);
+    // SAFETY: the buffer is allocated by a Vec of the same layout, as lifetimes do not change
+    // the layout of Token, and the length is zero, thus no token of the old lifetime remains.
+    unsafe { Vec::from_raw_parts(tokens.as_mut_ptr().cast(), 0, tokens.capacity()) }
+}
+
+/// CSR names seen in a Spike log, interned by CSR address
+#[derive(Clone)]
+pub struct CsrNames {
+    names: Vec<Option<Box<str>>>,
+    // addresses interned since the last take_new
+    fresh: Vec<u32>,
+}
+
+impl CsrNames {
+    const CSR_COUNT: usize = 4096;
+
+    pub fn new() -> Self {
+        Self {
+            names: vec![None; Self::CSR_COUNT],
+            fresh: Vec::new(),
+        }
+    }
+
+    /// A CSR address should always come with the same name
+    fn intern(&mut self, addr: u32, name: &str) -> Result<(), &'static str> {
+        let slot = self
+            .names
+            .get_mut(addr as usize)
+            .ok_or("CSR address out of range")?;
+        match slot {
+            Some(interned) if **interned == *name => Ok(()),
+            Some(_) => Err("CSR name differs from previous writes"),
+            None => {
+                *slot = Some(name.into());
+                self.fresh.push(addr);
+                Ok(())
+            }
+        }
+    }
+
+    // Names interned since the last call
+    fn take_new(&mut self) -> Vec<(u32, Box<str>)> {
+        let names = &self.names;
+        self.fresh
+            .drain(..)
+            .map(|addr| (addr, names[addr as usize].clone().unwrap()))
+            .collect()
+    }
+
+    pub fn name_of(&self, addr: u32) -> Option<&str> {
+        self.names.get(addr as usize)?.as_deref()
+    }
+}
+
+/// Tokenizes a raw string from a Spike commit log into tokens, which is cleared first.
+fn tokenize_spike_log_line<'a>(line: &'a str, tokens: &mut Vec<Token<'a>>) {
     fn str_to_token(raw_token: &str) -> Token<'_> {
         match raw_token {
             "core" => Token::CoreLiteral,
@@ -177,7 +539,8 @@ fn tokenize_spike_log_line(line: &str) -> Vec<Token<'_>> {
         }
     }
 
-    line.split_whitespace().map(str_to_token).collect()
+    tokens.clear();
+    tokens.extend(line.split_ascii_whitespace().map(str_to_token));
 }
 
 #[derive(Debug, PartialEq, Eq)]
@@ -190,9 +553,9 @@ pub enum Modification {
         rd: u8,
         bits: u64,
     },
+    /// Name of the CSR is interned in `CsrNames`
     WriteCSR {
         rd: u32,
-        name: String,
         bits: u64,
     },
     WriteVecCtx {
@@ -203,7 +566,7 @@ pub enum Modification {
     },
     WriteVReg {
         idx: u8,
-        bytes: Vec<u8>,
+        bytes: [u8; VLEN_BYTE],
     },
     Load {
         addr: u64,
@@ -214,7 +577,7 @@ pub enum Modification {
     },
 }
 
-#[derive(Debug, PartialEq, Eq)]
+#[derive(Debug, Default, PartialEq, Eq)]
 pub struct Commit {
     pub core_id: u8,
     pub privilege: u8,
@@ -223,8 +586,9 @@ pub struct Commit {
     pub state_changes: Vec<Modification>,
 }
 
-fn update_cpu_state(state: &mut CpuState, commit: &Commit) -> DiffRecord {
+fn update_cpu_state(state: &mut CpuState, commit: &Commit, csrs: &CsrNames) -> DiffRecord {
     state.pc = commit.pc as u32;
+    state.inst = commit.instruction;
 
     let mut dr = DiffRecord::default();
 
@@ -238,14 +602,15 @@ fn update_cpu_state(state: &mut CpuState, commit: &Commit) -> DiffRecord {
             &WriteFReg { rd, bits } => {
                 state.write_fpr(rd as usize, bits as u32, &mut dr);
             }
-            &WriteCSR { rd: _, ref name, bits } => {
+            &WriteCSR { rd, bits } => {
                 let bits = bits as u32;
+                let name = csrs.name_of(rd).expect("CSR name interned while parsing");
 
                 // TODO: check rd/name correspondence
 
                 // FIXME: error handling
                 state
-                    .write_csr(name, bits)
+                    .write_csr(name, bits, &mut dr)
                     .unwrap_or_else(|_| panic!("spike replay error: CSR {name} = {bits:#010x}"));
             }
 
@@ -256,7 +621,7 @@ fn update_cpu_state(state: &mut CpuState, commit: &Commit) -> DiffRecord {
                 // TODO: check the vec ctx is in sync with cpu state.
             }
             &WriteVReg { idx, ref bytes } => {
-                state.write_vreg(idx as usize, bytes, &mut dr);
+                state.write_vreg(idx as usize, 0, bytes, &mut dr);
             }
 
             Load { .. } | Store { .. } => {
@@ -333,7 +698,21 @@ impl<'a, 'b> Parser<'a, 'b> {
 }
 
 /// Parses a single line of tokens into a Commit struct.
-pub fn parse_single_commit(tokens: &[Token<'_>]) -> Result<Commit, ParseError> {
+pub fn parse_single_commit(
+    tokens: &[Token<'_>],
+    csrs: &mut CsrNames,
+) -> Result<Commit, ParseError> {
+    let mut commit = Commit::default();
+    parse_commit(tokens, csrs, &mut commit)?;
+    Ok(commit)
+}
+
+/// Parses a single line of tokens into commit, reusing its buffer of state changes.
+fn parse_commit(
+    tokens: &[Token<'_>],
+    csrs: &mut CsrNames,
+    commit: &mut Commit,
+) -> Result<(), ParseError> {
     let mut token_iter = tokens.iter().peekable();
     let mut p = Parser::new(&mut token_iter);
 
@@ -388,7 +767,8 @@ pub fn parse_single_commit(tokens: &[Token<'_>]) -> Result<Commit, ParseError> {
         reason: e.to_string(),
     })?;
 
-    let mut state_changes = Vec::new();
+    let mut state_changes = std::mem::take(&mut commit.state_changes);
+    state_changes.clear();
 
     while let Some(token) = p.peek() {
         let modification = match token {
@@ -451,7 +831,14 @@ pub fn parse_single_commit(tokens: &[Token<'_>]) -> Result<Commit, ParseError> {
                         value: rd_str.to_string(),
                         reason: e.to_string(),
                     })?;
-                let name = parts.next().unwrap_or("").to_string();
+                let name = parts.next().unwrap_or("");
+                csrs.intern(rd, name)
+                    .map_err(|reason| ParseError::InvalidValue {
+                        pos: p.cursor,
+                        kind: "csr name",
+                        value: csr_str.to_string(),
+                        reason: reason.to_string(),
+                    })?;
                 p.consume(); // Consume Csr
 
                 let bits_str = p.expect("hex value for csr", |t| match t {
@@ -466,7 +853,7 @@ pub fn parse_single_commit(tokens: &[Token<'_>]) -> Result<Commit, ParseError> {
                         reason: e.to_string(),
                     })?;
 
-                Modification::WriteCSR { rd, name, bits }
+                Modification::WriteCSR { rd, bits }
             }
             Token::MemLiteral => {
                 p.consume(); // Consume MemLiteral
@@ -575,23 +962,23 @@ pub fn parse_single_commit(tokens: &[Token<'_>]) -> Result<Commit, ParseError> {
                     Token::Hexadecimal(s) => Some(s),
                     _ => None,
                 })?;
-                let bytes_seq: Vec<char> = hex_string.chars().collect();
-                if bytes_seq.len() % 8 != 0 {
+                if hex_string.len() != VLEN_BYTE * 2 {
                     return Err(ParseError::InvalidValue {
                         pos: p.cursor,
                         kind: "vrf value",
                         value: hex_string.to_string(),
-                        reason: "unaligned hex value".to_string(),
+                        reason: format!("expected {} hex digits", VLEN_BYTE * 2),
                     });
                 }
-                let bytes = bytes_seq
-                    .chunks(2)
+                // the hex string starts from the highest byte, the tokenizer checked the digits
+                let mut bytes = [0u8; VLEN_BYTE];
+                for (byte, pair) in bytes
+                    .iter_mut()
                     .rev()
-                    .map(|byte_char| {
-                        let byte: String = byte_char.iter().collect();
-                        u8::from_str_radix(&byte, 16).unwrap()
-                    })
-                    .collect();
+                    .zip(hex_string.as_bytes().chunks_exact(2))
+                {
+                    *byte = hex_value(pair[0]) << 4 | hex_value(pair[1]);
+                }
 
                 Modification::WriteVReg { idx, bytes }
             }
@@ -600,25 +987,210 @@ pub fn parse_single_commit(tokens: &[Token<'_>]) -> Result<Commit, ParseError> {
         state_changes.push(modification);
     }
 
-    Ok(Commit {
+    *commit = Commit {
         core_id,
         privilege,
         pc,
         instruction,
         state_changes,
-    })
+    };
+    Ok(())
+}
+
+fn hex_value(digit: u8) -> u8 {
+    match digit {
+        b'0'..=b'9' => digit - b'0',
+        b'a'..=b'f' => digit - b'a' + 10,
+        _ => digit - b'A' + 10,
+    }
 }
 
 #[cfg(test)]
 mod tests {
     use super::*;
+    use crate::difftest::parallel::CHUNK_SIZE;
 
     fn get_test_log() -> &'static str {
         include_str!("assets/example.spike.log")
     }
 
     fn tokenize_spike_log(raw_str: &str) -> Vec<Vec<Token<'_>>> {
-        raw_str.lines().map(tokenize_spike_log_line).collect()
+        raw_str
+            .lines()
+            .map(|line| {
+                let mut tokens = vec![];
+                tokenize_spike_log_line(line, &mut tokens);
+                tokens
+            })
+            .collect()
+    }
+
+    fn get_test_log_path() -> &'static Path {
+        Path::new(concat!(
+            env!("CARGO_MANIFEST_DIR"),
+            "/src/difftest/assets/example.spike.log"
+        ))
+    }
+
+    #[test]
+    fn test_stream_reader() {
+        let mut logs = Lookahead::new(SpikeLogReader::open(get_test_log_path()).unwrap());
+
+        let mut csrs = CsrNames::new();
+        for tokens in tokenize_spike_log(get_test_log()) {
+            let expected = parse_single_commit(&tokens, &mut csrs).unwrap();
+            assert_eq!(logs.peek().unwrap(), Some(&expected));
+            assert_eq!(logs.next().unwrap(), Some(expected));
+        }
+        assert_eq!(logs.next().unwrap(), None);
+    }
+
+    #[test]
+    fn test_chunked_reader() {
+        // long enough to be cut into several chunks
+        let repeat = 3 * CHUNK_SIZE / get_test_log().len() + 1;
+        let path = std::env::temp_dir().join(format!("spike-chunks-{}.log", std::process::id()));
+        std::fs::write(&path, get_test_log().repeat(repeat)).unwrap();
+
+        let mut csrs = CsrNames::new();
+        let expected: Vec<Commit> = tokenize_spike_log(get_test_log())
+            .iter()
+            .map(|tokens| parse_single_commit(tokens, &mut csrs).unwrap())
+            .collect();
+
+        let mut reader = SpikeLogReader::open(&path).unwrap();
+        for _ in 0..repeat {
+            for commit in &expected {
+                assert_eq!(reader.next_item().unwrap().as_ref(), Some(commit));
+            }
+        }
+        assert_eq!(reader.next_item().unwrap(), None);
+        assert_eq!(reader.csr_names().name_of(773), Some("mtvec"));
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn test_segments() {
+        let file = File::open(get_test_log_path()).unwrap();
+        let mmap = Arc::new(Mmap::open(&file).unwrap());
+        let data = mmap.as_slice();
+        let entry = find_entry(&mmap, 0x800000ac).unwrap();
+        assert_eq!(entry, 0);
+
+        let mut expected = SpikeLogBackend::new(SpikeLogReader::open(get_test_log_path()).unwrap());
+        expected.diff_reset(0x800000ac).unwrap();
+
+        // continuing from the state at the cut is the same as replaying the whole log
+        let cut = chunk_end(data, 0, data.len() / 2);
+        let lines = Lines::new(&data[..cut]).count();
+        let mut first = SpikeSegmentBackend::new(mmap.clone(), 0, cut, 0, CpuState::new());
+        for _ in 0..lines {
+            assert!(matches!(first.diff_step().unwrap(), Status::Running(_)));
+            expected.diff_step().unwrap();
+            assert!(first.state() == expected.state());
+        }
+        assert!(matches!(first.diff_step().unwrap(), Status::Exit { .. }));
+
+        let state = first.state().clone();
+        let mut second = SpikeSegmentBackend::new(mmap.clone(), cut, data.len(), lines, state);
+        while let Status::Running(_) = expected.diff_step().unwrap() {
+            assert!(matches!(second.diff_step().unwrap(), Status::Running(_)));
+            assert!(second.state() == expected.state());
+        }
+        assert!(matches!(second.diff_step().unwrap(), Status::Exit { .. }));
+    }
+
+    #[test]
+    fn test_map_fifo() {
+        let path = std::env::temp_dir().join(format!("spike-fifo-{}.log", std::process::id()));
+        let c_path = std::ffi::CString::new(path.as_os_str().as_encoded_bytes()).unwrap();
+        // SAFETY: a valid C string
+        assert_eq!(unsafe { libc::mkfifo(c_path.as_ptr(), 0o600) }, 0);
+
+        // a FIFO cannot be mapped, it is read into memory
+        let mmap = std::thread::scope(|s| {
+            s.spawn(|| std::fs::write(&path, get_test_log()).unwrap());
+            map_log(&path).unwrap()
+        });
+        std::fs::remove_file(&path).unwrap();
+        assert_eq!(mmap.as_slice(), get_test_log().as_bytes());
+        mmap.release(mmap.as_slice().len());
+
+        let mut expected = SpikeLogBackend::new(SpikeLogReader::open(get_test_log_path()).unwrap());
+        expected.diff_reset(0x800000ac).unwrap();
+        let mut backend = serial_backend(mmap, 0x800000ac).unwrap();
+        while let Status::Running(_) = expected.diff_step().unwrap() {
+            assert!(matches!(backend.diff_step().unwrap(), Status::Running(_)));
+            assert!(backend.state() == expected.state());
+        }
+        assert!(matches!(backend.diff_step().unwrap(), Status::Exit { .. }));
+    }
+
+    #[test]
+    fn test_reuse_buffer() {
+        let line = String::from("core   0: 3 0x80000000 (0x00000297) x5  0x80000000");
+        let mut tokens = vec![];
+        tokenize_spike_log_line(&line, &mut tokens);
+        let (ptr, capacity) = (tokens.as_ptr() as usize, tokens.capacity());
+
+        let tokens: Vec<Token<'static>> = reuse_buffer(tokens);
+        assert!(tokens.is_empty());
+        assert_eq!(
+            (tokens.as_ptr() as usize, tokens.capacity()),
+            (ptr, capacity)
+        );
+    }
+
+    #[test]
+    fn test_worker_no_alloc() {
+        use crate::util::alloc_counter::allocations;
+
+        let file = File::open(get_test_log_path()).unwrap();
+        let mmap = Arc::new(Mmap::open(&file).unwrap());
+        let end = mmap.as_slice().len();
+        let mut worker = SpikeWorker::new(mmap);
+
+        // the first pass grows buffers and interns CSR names
+        let job = SpikeJob {
+            start: 0,
+            end,
+            commits: vec![],
+            spare: vec![],
+        };
+        let Ok(chunk) = worker.parse_chunk(job) else {
+            panic!("fail parse test log");
+        };
+        let job = SpikeJob {
+            start: 0,
+            end,
+            commits: Vec::with_capacity(chunk.commits.len()),
+            spare: chunk.commits,
+        };
+
+        let before = allocations();
+        let Ok(chunk) = worker.parse_chunk(job) else {
+            panic!("fail parse test log");
+        };
+        assert_eq!(allocations(), before);
+        assert!(chunk.new_csrs.is_empty());
+    }
+
+    #[test]
+    fn test_csr_names() {
+        let mut csrs = CsrNames::new();
+        let mut tokens = vec![];
+        tokenize_spike_log_line(
+            "core   0: 3 0x80000000 (0x30529073) c773_mtvec 0x8000000c",
+            &mut tokens,
+        );
+        parse_single_commit(&tokens, &mut csrs).unwrap();
+        assert_eq!(csrs.name_of(0x305), Some("mtvec"));
+
+        tokenize_spike_log_line(
+            "core   0: 3 0x80000000 (0x30529073) c773_mepc 0x8000000c",
+            &mut tokens,
+        );
+        assert!(parse_single_commit(&tokens, &mut csrs).is_err());
     }
 
     #[test]
@@ -637,10 +1209,13 @@ mod tests {
         let raw_str = get_test_log();
         let tok_seq = tokenize_spike_log(&raw_str);
 
+        let mut csrs = CsrNames::new();
         let all_commits: Vec<Commit> = tok_seq
             .iter()
-            .map(|line| parse_single_commit(line).unwrap())
+            .map(|line| parse_single_commit(line, &mut csrs).unwrap())
             .collect();
+        assert_eq!(csrs.name_of(773), Some("mtvec"));
+        assert_eq!(csrs.name_of(8), Some("vstart"));
 
         use Modification::*;
         assert_eq!(
@@ -653,7 +1228,6 @@ mod tests {
                     instruction: 810717299,
                     state_changes: vec![WriteCSR {
                         rd: 773,
-                        name: "mtvec".to_string(),
                         bits: 2147483660,
                     },],
                 },
@@ -728,65 +1302,61 @@ mod tests {
                         },
                         WriteVReg {
                             idx: 0,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 1,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 2,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 3,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 4,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 5,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 6,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 7,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
-                        WriteCSR {
-                            rd: 8,
-                            name: "vstart".to_string(),
-                            bits: 0,
-                        },
+                        WriteCSR { rd: 8, bits: 0 },
                     ],
                 },
                 Commit {
@@ -801,63 +1371,59 @@ mod tests {
                             is_flmul: false,
                             vl: 256,
                         },
-                        WriteCSR {
-                            rd: 8,
-                            name: "vstart".to_string(),
-                            bits: 0,
-                        },
+                        WriteCSR { rd: 8, bits: 0 },
                         WriteVReg {
                             idx: 24,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 25,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 26,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 27,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 28,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 29,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 30,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
                         },
                         WriteVReg {
                             idx: 31,
-                            bytes: vec![
+                            bytes: [
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                                 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                             ],
@@ -878,17 +1444,13 @@ mod tests {
                         },
                         WriteVReg {
                             idx: 0,
-                            bytes: vec![
+                            bytes: [
                                 204, 140, 103, 173, 98, 212, 179, 177, 238, 48, 2, 163, 122, 81, 3,
                                 95, 172, 239, 101, 35, 237, 39, 207, 125, 39, 53, 186, 0, 248, 80,
                                 103, 10
                             ],
                         },
-                        WriteCSR {
-                            rd: 8,
-                            name: "vstart".to_string(),
-                            bits: 0,
-                        },
+                        WriteCSR { rd: 8, bits: 0 },
                         Load { addr: 2147556960 },
                         Load { addr: 2147556964 },
                         Load { addr: 2147556968 },
@@ -911,11 +1473,7 @@ mod tests {
                             is_flmul: true,
                             vl: 0,
                         },
-                        WriteCSR {
-                            rd: 8,
-                            name: "vstart".to_string(),
-                            bits: 0,
-                        },
+                        WriteCSR { rd: 8, bits: 0 },
                     ],
                 }
             ]
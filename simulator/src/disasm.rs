@@ -0,0 +1,675 @@
+//! Disassembler in the syntax of `objdump -M no-aliases`, e.g. "addi a0,a0,1"
+//!
+//! Mnemonics come from the encoding table in isa. The encoding data has no operand fields,
+//! so the operands of each pattern are derived once from its opcode, name and operand bits,
+//! and disassembling an instruction is a table lookup followed by field extraction,
+//! written into a caller provided buffer without `std::fmt`.
+
+use std::sync::OnceLock;
+
+use crate::{
+    isa::{InstPattern, InstTable},
+    pokedex::try_name_of_csr,
+    util::{push_dec, push_hex},
+};
+
+#[rustfmt::skip]
+const XREG_NAMES: &[&str; 32] = &[
+    "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+    "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+    "a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+    "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+];
+
+#[rustfmt::skip]
+const FREG_NAMES: &[&str; 32] = &[
+    "ft0", "ft1", "ft2", "ft3", "ft4", "ft5", "ft6", "ft7",
+    "fs0", "fs1", "fa0", "fa1", "fa2", "fa3", "fa4", "fa5",
+    "fa6", "fa7", "fs2", "fs3", "fs4", "fs5", "fs6", "fs7",
+    "fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11",
+];
+
+const RD: u32 = 0x1f << 7;
+const RS1: u32 = 0x1f << 15;
+const RS2: u32 = 0x1f << 20;
+const VM: u32 = 1 << 25;
+const AQRL: u32 = 0b11 << 25;
+const FUNCT3: u32 = 0b111 << 12;
+const NF: u32 = 0b111 << 29;
+
+// Register fields
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Reg {
+    Rd,
+    Rs1,
+    Rs2,
+    Rs3,
+    // compressed: rd/rs1 at [11:7], rs2 at [6:2]
+    CRd,
+    CRs2,
+    // compressed: x8-x15 at [4:2] and [9:7]
+    CRdP,
+    CRs1P,
+    Sp,
+}
+
+// Immediates printed in decimal
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Imm {
+    I,
+    S,
+    // unsigned rs1 field, of csrr*i, vsetivli and some OPIVI
+    Zimm,
+    // signed rs1 field of OPIVI
+    Simm5,
+    CI,
+    CAddi16sp,
+    CAddi4spn,
+    CLw,
+    CLwsp,
+    CSwsp,
+}
+
+// Immediates printed in hex
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Hex {
+    U,
+    Shamt,
+    CShamt,
+    CLui,
+}
+
+// PC relative offsets, printed as absolute addresses
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Target {
+    B,
+    J,
+    CB,
+    CJ,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Operand {
+    X(Reg),
+    F(Reg),
+    V(Reg),
+    Imm(Imm),
+    Hex(Hex),
+    Target(Target),
+    // imm(base)
+    Mem(Imm, Reg),
+    // (base)
+    Addr(Reg),
+    Csr,
+    // pred or succ of fence, the field starts at the given bit
+    Fence(u32),
+    // vtype of vsetvli and vsetivli, the field has the given width
+    Vtype(u32),
+    // rounding mode, nothing if dynamic
+    Rm,
+    // ",v0.t" if masked, nothing otherwise
+    VMask,
+    // v0 as carry or merge mask
+    V0,
+}
+
+struct Form {
+    mnemonic: String,
+    // Segment accesses share the encoding of vector loads and stores, with nf in inst[31:29],
+    // e.g. vle16.v is vlseg<nf+1>e16.v if nf is not zero, split as ("vlseg", "e16.v")
+    segment: Option<(String, String)>,
+    // AMO takes aq and rl in inst[26:25] as a suffix
+    aqrl: bool,
+    operands: Vec<Operand>,
+}
+
+impl Form {
+    fn new(p: &InstPattern) -> Self {
+        let mnemonic = p.name.replace('_', ".");
+        let opcode = p.bits() & 0x7f;
+        let vector_mem = matches!(opcode, 0b0000111 | 0b0100111) && mnemonic.starts_with('v');
+        let segment = if vector_mem && p.has_field(NF) {
+            // vle, vlse, vloxei and so on
+            let split = 2 + mnemonic[2..].find('e').expect("vector access has eew");
+            Some((
+                format!("{}seg", &mnemonic[..split]),
+                mnemonic[split..].to_string(),
+            ))
+        } else {
+            None
+        };
+
+        Self {
+            segment,
+            aqrl: opcode == 0b0101111 && p.has_field(AQRL),
+            operands: operands_of(p),
+            mnemonic,
+        }
+    }
+}
+
+pub struct Disassembler {
+    table: InstTable,
+    // indexed by InstPattern::id
+    forms: Vec<Form>,
+}
+
+impl Disassembler {
+    pub fn new() -> Self {
+        let table = InstTable::new();
+        let forms = table.patterns().iter().map(Form::new).collect();
+        Self { table, forms }
+    }
+
+    /// The tables are built on first use
+    pub fn global() -> &'static Self {
+        static DISASSEMBLER: OnceLock<Disassembler> = OnceLock::new();
+        DISASSEMBLER.get_or_init(Self::new)
+    }
+
+    /// Append the disassembly of the instruction at pc to out, "unknown" if it is not in the table.
+    /// A compressed instruction is given in the lower 16 bits.
+    pub fn disasm(&self, pc: u32, inst: u32, out: &mut Vec<u8>) {
+        let Some(pattern) = self.table.lookup(inst) else {
+            out.extend_from_slice(b"unknown");
+            return;
+        };
+        let form = &self.forms[pattern.id];
+
+        match &form.segment {
+            Some((prefix, rest)) if inst & NF != 0 => {
+                out.extend_from_slice(prefix.as_bytes());
+                push_dec(out, bits(inst, 31, 29) + 1);
+                out.extend_from_slice(rest.as_bytes());
+            }
+            _ => out.extend_from_slice(form.mnemonic.as_bytes()),
+        }
+        if form.aqrl {
+            let suffix: &[u8] = match bits(inst, 26, 25) {
+                0b00 => b"",
+                0b01 => b".rl",
+                0b10 => b".aq",
+                _ => b".aqrl",
+            };
+            out.extend_from_slice(suffix);
+        }
+
+        let mut first = true;
+        for &operand in &form.operands {
+            let omitted = match operand {
+                Operand::VMask => inst & VM != 0,
+                Operand::Rm => bits(inst, 14, 12) == 0b111,
+                _ => false,
+            };
+            if omitted {
+                continue;
+            }
+            out.push(if first { b' ' } else { b',' });
+            first = false;
+            push_operand(out, operand, pc, inst);
+        }
+    }
+
+    pub fn disasm_string(&self, pc: u32, inst: u32) -> String {
+        let mut out = vec![];
+        self.disasm(pc, inst, &mut out);
+        String::from_utf8(out).expect("disassembly is ascii")
+    }
+}
+
+fn operands_of(p: &InstPattern) -> Vec<Operand> {
+    use Operand::*;
+    use Reg::*;
+
+    let name = p.name.as_str();
+    if p.bits() & 0b11 != 0b11 {
+        return compressed_operands_of(name);
+    }
+
+    match p.bits() & 0x7f {
+        // OP
+        0b0110011 => vec![X(Rd), X(Rs1), X(Rs2)],
+        // OP-IMM
+        0b0010011 => match name {
+            "slli" | "srli" | "srai" => vec![X(Rd), X(Rs1), Hex(self::Hex::Shamt)],
+            _ => vec![X(Rd), X(Rs1), Imm(self::Imm::I)],
+        },
+        // LOAD, STORE
+        0b0000011 => vec![X(Rd), Mem(self::Imm::I, Rs1)],
+        0b0100011 => vec![X(Rs2), Mem(self::Imm::S, Rs1)],
+        // LOAD-FP, STORE-FP, shared by scalar float and vector
+        0b0000111 | 0b0100111 if name.starts_with('v') => vector_mem_operands_of(p),
+        0b0000111 => vec![F(Rd), Mem(self::Imm::I, Rs1)],
+        0b0100111 => vec![F(Rs2), Mem(self::Imm::S, Rs1)],
+        // BRANCH, JAL, JALR
+        0b1100011 => vec![X(Rs1), X(Rs2), Target(self::Target::B)],
+        0b1101111 => vec![X(Rd), Target(self::Target::J)],
+        0b1100111 => vec![X(Rd), Mem(self::Imm::I, Rs1)],
+        // LUI, AUIPC
+        0b0110111 | 0b0010111 => vec![X(Rd), Hex(self::Hex::U)],
+        // SYSTEM, ecall and friends have every bit fixed
+        0b1110011 if !p.has_field(RD) => vec![],
+        0b1110011 if p.bits() & (0b100 << 12) != 0 => vec![X(Rd), Csr, Imm(self::Imm::Zimm)],
+        0b1110011 => vec![X(Rd), Csr, X(Rs1)],
+        // MISC-MEM
+        0b0001111 if name == "fence" => vec![Fence(24), Fence(20)],
+        0b0001111 => vec![],
+        // AMO
+        0b0101111 if !p.has_field(RS2) => vec![X(Rd), Addr(Rs1)],
+        0b0101111 => vec![X(Rd), X(Rs2), Addr(Rs1)],
+        // OP-FP
+        0b1010011 => {
+            let rd = if name.starts_with("fcvt_w")
+                || matches!(name, "fmv_x_w" | "feq_s" | "flt_s" | "fle_s" | "fclass_s")
+            {
+                X(Rd)
+            } else {
+                F(Rd)
+            };
+            let rs1 = if name.starts_with("fcvt_s_w") || name == "fmv_w_x" {
+                X(Rs1)
+            } else {
+                F(Rs1)
+            };
+            let mut operands = vec![rd, rs1];
+            if p.has_field(RS2) {
+                operands.push(F(Rs2));
+            }
+            if p.has_field(FUNCT3) {
+                operands.push(Rm);
+            }
+            operands
+        }
+        // MADD, MSUB, NMSUB, NMADD
+        0b1000011 | 0b1000111 | 0b1001011 | 0b1001111 => {
+            vec![F(Rd), F(Rs1), F(Rs2), F(Rs3), Rm]
+        }
+        // OP-V
+        0b1010111 => vector_operands_of(p),
+        _ => vec![],
+    }
+}
+
+fn vector_mem_operands_of(p: &InstPattern) -> Vec<Operand> {
+    use Operand::*;
+    use Reg::*;
+
+    let mut operands = vec![V(Rd), Addr(Rs1)];
+    if p.has_field(RS2) {
+        // indexed accesses take an index vector, strided ones take a stride
+        operands.push(if p.name.contains("xei") {
+            V(Rs2)
+        } else {
+            X(Rs2)
+        });
+    }
+    if p.has_field(VM) {
+        operands.push(VMask);
+    }
+    operands
+}
+
+fn vector_operands_of(p: &InstPattern) -> Vec<Operand> {
+    use Operand::*;
+    use Reg::*;
+
+    let name = p.name.as_str();
+    match name {
+        "vsetvli" => return vec![X(Rd), X(Rs1), Vtype(11)],
+        "vsetivli" => return vec![X(Rd), Imm(self::Imm::Zimm), Vtype(10)],
+        "vsetvl" => return vec![X(Rd), X(Rs1), X(Rs2)],
+        _ => {}
+    }
+
+    let (root, suffix) = name.split_once('_').unwrap_or((name, ""));
+    let vd = match name {
+        "vcpop_m" | "vfirst_m" | "vmv_x_s" => X(Rd),
+        "vfmv_f_s" => F(Rd),
+        _ => V(Rd),
+    };
+    let src1 = match (p.bits() >> 12) & 0b111 {
+        // OPIVI
+        0b011 => {
+            let unsigned = matches!(
+                root,
+                "vsll"
+                    | "vsrl"
+                    | "vsra"
+                    | "vssrl"
+                    | "vssra"
+                    | "vnsrl"
+                    | "vnsra"
+                    | "vnclip"
+                    | "vnclipu"
+                    | "vslideup"
+                    | "vslidedown"
+                    | "vrgather"
+            );
+            Imm(if unsigned {
+                self::Imm::Zimm
+            } else {
+                self::Imm::Simm5
+            })
+        }
+        // OPIVX, OPMVX
+        0b100 | 0b110 => X(Rs1),
+        // OPFVF
+        0b101 => F(Rs1),
+        // OPIVV, OPFVV, OPMVV
+        _ => V(Rs1),
+    };
+
+    let mut operands = vec![vd];
+    // multiply-add takes the addend in vd, and vs1 or rs1 comes before vs2
+    let multiply_add = matches!(
+        root,
+        "vmacc"
+            | "vnmsac"
+            | "vmadd"
+            | "vnmsub"
+            | "vwmacc"
+            | "vwmaccu"
+            | "vwmaccsu"
+            | "vwmaccus"
+            | "vfmacc"
+            | "vfnmacc"
+            | "vfmsac"
+            | "vfnmsac"
+            | "vfmadd"
+            | "vfnmadd"
+            | "vfmsub"
+            | "vfnmsub"
+            | "vfwmacc"
+            | "vfwnmacc"
+            | "vfwmsac"
+            | "vfwnmsac"
+    );
+    if multiply_add {
+        operands.extend([src1, V(Rs2)]);
+    } else {
+        if p.has_field(RS2) {
+            operands.push(V(Rs2));
+        }
+        if p.has_field(RS1) {
+            operands.push(src1);
+        }
+    }
+
+    if matches!(suffix, "vvm" | "vxm" | "vim" | "vfm") {
+        operands.push(V0);
+    } else if p.has_field(VM) {
+        operands.push(VMask);
+    }
+    operands
+}
+
+fn compressed_operands_of(name: &str) -> Vec<Operand> {
+    use Operand::*;
+    use Reg::*;
+
+    match name {
+        "c_addi4spn" => vec![X(CRdP), X(Sp), Imm(self::Imm::CAddi4spn)],
+        "c_lw" | "c_sw" => vec![X(CRdP), Mem(self::Imm::CLw, CRs1P)],
+        "c_flw" | "c_fsw" => vec![F(CRdP), Mem(self::Imm::CLw, CRs1P)],
+        "c_addi" | "c_li" => vec![X(CRd), Imm(self::Imm::CI)],
+        "c_addi16sp" => vec![X(Sp), Imm(self::Imm::CAddi16sp)],
+        "c_lui" => vec![X(CRd), Hex(self::Hex::CLui)],
+        "c_srli" | "c_srai" => vec![X(CRs1P), Hex(self::Hex::CShamt)],
+        "c_andi" => vec![X(CRs1P), Imm(self::Imm::CI)],
+        "c_sub" | "c_xor" | "c_or" | "c_and" => vec![X(CRs1P), X(CRdP)],
+        "c_j" | "c_jal" => vec![Target(self::Target::CJ)],
+        "c_beqz" | "c_bnez" => vec![X(CRs1P), Target(self::Target::CB)],
+        "c_slli" => vec![X(CRd), Hex(self::Hex::CShamt)],
+        "c_lwsp" => vec![X(CRd), Mem(self::Imm::CLwsp, Sp)],
+        "c_flwsp" => vec![F(CRd), Mem(self::Imm::CLwsp, Sp)],
+        "c_swsp" => vec![X(CRs2), Mem(self::Imm::CSwsp, Sp)],
+        "c_fswsp" => vec![F(CRs2), Mem(self::Imm::CSwsp, Sp)],
+        "c_jr" | "c_jalr" => vec![X(CRd)],
+        "c_mv" | "c_add" => vec![X(CRd), X(CRs2)],
+        // c.nop, c.ebreak
+        _ => vec![],
+    }
+}
+
+// inst[hi:lo]
+fn bits(inst: u32, hi: u32, lo: u32) -> u32 {
+    (inst >> lo) & ((1 << (hi - lo + 1)) - 1)
+}
+
+fn sext(value: u32, width: u32) -> i32 {
+    ((value << (32 - width)) as i32) >> (32 - width)
+}
+
+fn reg(reg: Reg, inst: u32) -> usize {
+    let index = match reg {
+        Reg::Rd | Reg::CRd => bits(inst, 11, 7),
+        Reg::Rs1 => bits(inst, 19, 15),
+        Reg::Rs2 => bits(inst, 24, 20),
+        Reg::Rs3 => bits(inst, 31, 27),
+        Reg::CRs2 => bits(inst, 6, 2),
+        Reg::CRdP => 8 + bits(inst, 4, 2),
+        Reg::CRs1P => 8 + bits(inst, 9, 7),
+        Reg::Sp => 2,
+    };
+    index as usize
+}
+
+fn imm(imm: Imm, inst: u32) -> i32 {
+    let bit = |i| bits(inst, i, i);
+    match imm {
+        Imm::I => inst as i32 >> 20,
+        Imm::S => (inst as i32 >> 25) << 5 | bits(inst, 11, 7) as i32,
+        Imm::Zimm => bits(inst, 19, 15) as i32,
+        Imm::Simm5 => sext(bits(inst, 19, 15), 5),
+        Imm::CI => sext(bit(12) << 5 | bits(inst, 6, 2), 6),
+        Imm::CAddi16sp => sext(
+            bit(12) << 9 | bits(inst, 4, 3) << 7 | bit(5) << 6 | bit(2) << 5 | bit(6) << 4,
+            10,
+        ),
+        Imm::CAddi4spn => {
+            (bits(inst, 10, 7) << 6 | bits(inst, 12, 11) << 4 | bit(5) << 3 | bit(6) << 2) as i32
+        }
+        Imm::CLw => (bit(5) << 6 | bits(inst, 12, 10) << 3 | bit(6) << 2) as i32,
+        Imm::CLwsp => (bits(inst, 3, 2) << 6 | bit(12) << 5 | bits(inst, 6, 4) << 2) as i32,
+        Imm::CSwsp => (bits(inst, 8, 7) << 6 | bits(inst, 12, 9) << 2) as i32,
+    }
+}
+
+fn hex(hex: Hex, inst: u32) -> u32 {
+    match hex {
+        Hex::U => bits(inst, 31, 12),
+        Hex::Shamt => bits(inst, 24, 20),
+        Hex::CShamt => bits(inst, 12, 12) << 5 | bits(inst, 6, 2),
+        // as the upper 20 bits of a register
+        Hex::CLui => imm(Imm::CI, inst) as u32 & 0xfffff,
+    }
+}
+
+fn target(target: Target, inst: u32) -> i32 {
+    let bit = |i| bits(inst, i, i);
+    match target {
+        Target::B => sext(
+            bit(31) << 12 | bit(7) << 11 | bits(inst, 30, 25) << 5 | bits(inst, 11, 8) << 1,
+            13,
+        ),
+        Target::J => sext(
+            bit(31) << 20 | bits(inst, 19, 12) << 12 | bit(20) << 11 | bits(inst, 30, 21) << 1,
+            21,
+        ),
+        Target::CB => sext(
+            bit(12) << 8
+                | bits(inst, 6, 5) << 6
+                | bit(2) << 5
+                | bits(inst, 11, 10) << 3
+                | bits(inst, 4, 3) << 1,
+            9,
+        ),
+        Target::CJ => sext(
+            bit(12) << 11
+                | bit(8) << 10
+                | bits(inst, 10, 9) << 8
+                | bit(6) << 7
+                | bit(7) << 6
+                | bit(2) << 5
+                | bit(11) << 4
+                | bits(inst, 5, 3) << 1,
+            12,
+        ),
+    }
+}
+
+fn push_operand(out: &mut Vec<u8>, operand: Operand, pc: u32, inst: u32) {
+    match operand {
+        Operand::X(r) => out.extend_from_slice(XREG_NAMES[reg(r, inst)].as_bytes()),
+        Operand::F(r) => out.extend_from_slice(FREG_NAMES[reg(r, inst)].as_bytes()),
+        Operand::V(r) => {
+            out.push(b'v');
+            push_dec(out, reg(r, inst) as u32);
+        }
+        Operand::Imm(i) => push_signed(out, imm(i, inst)),
+        Operand::Hex(h) => push_hex_short(out, hex(h, inst)),
+        Operand::Target(t) => push_hex_short(out, pc.wrapping_add(target(t, inst) as u32)),
+        Operand::Mem(i, base) => {
+            push_signed(out, imm(i, inst));
+            push_operand(out, Operand::Addr(base), pc, inst);
+        }
+        Operand::Addr(base) => {
+            out.push(b'(');
+            out.extend_from_slice(XREG_NAMES[reg(base, inst)].as_bytes());
+            out.push(b')');
+        }
+        Operand::Csr => {
+            let csr = bits(inst, 31, 20);
+            match try_name_of_csr(csr as u16) {
+                Some(name) => out.extend_from_slice(name.as_bytes()),
+                None => push_hex_short(out, csr),
+            }
+        }
+        Operand::Fence(lo) => {
+            let set = bits(inst, lo + 3, lo);
+            if set == 0 {
+                out.push(b'0');
+            }
+            for (i, c) in b"iorw".iter().enumerate() {
+                if set & (0b1000 >> i) != 0 {
+                    out.push(*c);
+                }
+            }
+        }
+        Operand::Vtype(width) => push_vtype(out, bits(inst, 20 + width - 1, 20)),
+        Operand::Rm => {
+            const RM_NAMES: [&str; 8] = ["rne", "rtz", "rdn", "rup", "rmm", "0x5", "0x6", "dyn"];
+            out.extend_from_slice(RM_NAMES[bits(inst, 14, 12) as usize].as_bytes());
+        }
+        Operand::VMask => out.extend_from_slice(b"v0.t"),
+        Operand::V0 => out.extend_from_slice(b"v0"),
+    }
+}
+
+fn push_signed(out: &mut Vec<u8>, value: i32) {
+    if value < 0 {
+        out.push(b'-');
+    }
+    push_dec(out, value.unsigned_abs());
+}
+
+// hex without leading zeros, e.g. 0x80000010 or 0x1
+fn push_hex_short(out: &mut Vec<u8>, value: u32) {
+    let digits = (32 - value.leading_zeros()).div_ceil(4).max(1);
+    push_hex(out, value, digits as usize);
+}
+
+// e.g. "e32,m1,ta,ma", hex if reserved bits are set
+fn push_vtype(out: &mut Vec<u8>, vtype: u32) {
+    let vlmul = vtype & 0b111;
+    let vsew = (vtype >> 3) & 0b111;
+    if vtype >> 8 != 0 || vlmul == 0b100 || vsew > 0b011 {
+        push_hex_short(out, vtype);
+        return;
+    }
+
+    out.push(b'e');
+    push_dec(out, 8 << vsew);
+    let lmul: &[u8] = match vlmul {
+        0b000 => b",m1",
+        0b001 => b",m2",
+        0b010 => b",m4",
+        0b011 => b",m8",
+        0b101 => b",mf8",
+        0b110 => b",mf4",
+        _ => b",mf2",
+    };
+    out.extend_from_slice(lmul);
+    out.extend_from_slice(if vtype & (1 << 6) != 0 {
+        b",ta"
+    } else {
+        b",tu"
+    });
+    out.extend_from_slice(if vtype & (1 << 7) != 0 {
+        b",ma"
+    } else {
+        b",mu"
+    });
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_disasm() {
+        let d = Disassembler::new();
+        let pc = 0x8000_0000;
+        let cases: &[(u32, &str)] = &[
+            (0x00150513, "addi a0,a0,1"),
+            (0xffc12503, "lw a0,-4(sp)"),
+            (0x00112623, "sw ra,12(sp)"),
+            (0x00251513, "slli a0,a0,0x2"),
+            (0x12345537, "lui a0,0x12345"),
+            (0x00b50463, "beq a0,a1,0x80000008"),
+            (0xffdff0ef, "jal ra,0x7ffffffc"),
+            (0x30002573, "csrrs a0,mstatus,zero"),
+            (0x0ff0000f, "fence iorw,iorw"),
+            (0x10500073, "wfi"),
+            (0xc0057553, "fcvt.w.s a0,fa0"),
+            (0x00b50553, "fadd.s fa0,fa0,fa1,rne"),
+            (0x0cb5252f, "amoswap.w.aq a0,a1,(a0)"),
+            (0x0d0572d7, "vsetvli t0,a0,e32,m1,ta,ma"),
+            (0x02056407, "vle32.v v8,(a0)"),
+            (0x22056407, "vlseg2e32.v v8,(a0)"),
+            (0x022180d7, "vadd.vv v1,v2,v3"),
+            (0x002fb0d7, "vadd.vi v1,v2,-1,v0.t"),
+            (0xb63120d7, "vmacc.vv v1,v2,v3"),
+            (0x0505, "c.addi a0,1"),
+            (0x4512, "c.lwsp a0,4(sp)"),
+            (0xc501, "c.beqz a0,0x80000008"),
+            (0x0001, "c.nop"),
+            (0x9002, "c.ebreak"),
+            (0xffffffff, "unknown"),
+        ];
+        for &(inst, expected) in cases {
+            assert_eq!(d.disasm_string(pc, inst), expected, "inst={inst:#010x}");
+        }
+    }
+
+    // every operand field decodes without panicking
+    #[test]
+    fn test_disasm_all_patterns() {
+        let d = Disassembler::global();
+        let mut out = vec![];
+        for p in d.table.patterns() {
+            for operand_bits in [0, u32::MAX] {
+                let inst = p.bits() | (operand_bits & !fixed_mask(p));
+                out.clear();
+                d.disasm(0x8000_0000, inst, &mut out);
+                assert!(!out.is_empty());
+            }
+        }
+    }
+
+    fn fixed_mask(p: &InstPattern) -> u32 {
+        (0..32)
+            .filter(|&i| !p.has_field(1 << i))
+            .fold(0, |m, i| m | 1 << i)
+    }
+}
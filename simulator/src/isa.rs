@@ -0,0 +1,243 @@
+//! Instruction encoding table, generated by model/scripts/datagen.py from riscv-opcodes.
+//!
+//! assets/inst_encoding.json is a copy of model/data_files/full/inst_encoding.json,
+//! the full profile is a superset of other profiles.
+
+use serde::Deserialize;
+
+const INST_ENCODING_JSON: &str = include_str!("../assets/inst_encoding.json");
+
+#[derive(Deserialize)]
+struct EncodingFile {
+    inst_encoding: Vec<EncodingEntry>,
+    cinst_encoding: Vec<EncodingEntry>,
+}
+
+#[derive(Deserialize)]
+struct EncodingEntry {
+    name: String,
+    // MSB first, '-' for operand bits
+    encoding: String,
+    // comma separated, e.g. "rv_v"
+    extension: String,
+}
+
+pub struct InstPattern {
+    pub name: String,
+    // index into InstTable::patterns
+    pub id: usize,
+    mask: u32,
+    bits: u32,
+    // bitset of indices into InstTable::extensions
+    extensions: u64,
+}
+
+impl InstPattern {
+    pub fn matches(&self, inst: u32) -> bool {
+        inst & self.mask == self.bits
+    }
+
+    /// Fixed bits of the encoding, zero at operand bits
+    pub fn bits(&self) -> u32 {
+        self.bits
+    }
+
+    /// Whether all bits of the field are operand bits, e.g. 0x1f << 15 for rs1
+    pub fn has_field(&self, field: u32) -> bool {
+        self.mask & field == 0
+    }
+}
+
+/// Look up instructions by encoding.
+///
+/// Patterns are bucketed by major opcode inst[6:0] with funct3 inst[14:12] for 32-bit instructions,
+/// and quadrant with funct3 for compressed ones, thus a lookup only scans a handful of candidates.
+/// A pattern without a fixed funct3, e.g. jal, is put into every bucket of its opcode.
+/// Within a bucket, patterns with more fixed bits come first,
+/// so that c.nop is not taken as c.addi, nor c.ebreak as c.add.
+pub struct InstTable {
+    extensions: Vec<String>,
+    patterns: Vec<InstPattern>,
+    // indices into patterns
+    buckets: Vec<Vec<usize>>,
+    cbuckets: Vec<Vec<usize>>,
+}
+
+fn parse_encoding(encoding: &str) -> (u32, u32) {
+    let mut mask = 0;
+    let mut bits = 0;
+    for c in encoding.chars() {
+        mask <<= 1;
+        bits <<= 1;
+        match c {
+            '0' => mask |= 1,
+            '1' => {
+                mask |= 1;
+                bits |= 1;
+            }
+            '-' => {}
+            _ => panic!("invalid encoding {encoding:?}"),
+        }
+    }
+    (mask, bits)
+}
+
+fn bucket_index(inst: u32) -> usize {
+    ((inst >> 12) & 0b111) as usize * 128 + (inst & 0x7f) as usize
+}
+
+fn cbucket_index(inst: u32) -> usize {
+    (((inst >> 13) & 0b111) << 2 | (inst & 0b11)) as usize
+}
+
+impl InstTable {
+    pub fn new() -> Self {
+        let file: EncodingFile =
+            serde_json::from_str(INST_ENCODING_JSON).expect("invalid assets/inst_encoding.json");
+
+        let mut table = Self {
+            extensions: vec![],
+            patterns: vec![],
+            buckets: (0..1024).map(|_| vec![]).collect(),
+            cbuckets: (0..32).map(|_| vec![]).collect(),
+        };
+
+        for entry in file.inst_encoding {
+            assert_eq!(entry.encoding.len(), 32);
+            let pattern = table.make_pattern(entry);
+            assert_eq!(pattern.mask & 0x7f, 0x7f);
+            for funct3 in 0..8 {
+                let inst = pattern.bits & !(0b111 << 12) | funct3 << 12;
+                if pattern.matches(inst) {
+                    table.buckets[bucket_index(inst)].push(pattern.id);
+                }
+            }
+            table.patterns.push(pattern);
+        }
+        for entry in file.cinst_encoding {
+            assert_eq!(entry.encoding.len(), 16);
+            let pattern = table.make_pattern(entry);
+            assert_eq!(pattern.mask & 0xe003, 0xe003);
+            table.cbuckets[cbucket_index(pattern.bits)].push(pattern.id);
+            table.patterns.push(pattern);
+        }
+
+        let patterns = &table.patterns;
+        for bucket in table.buckets.iter_mut().chain(&mut table.cbuckets) {
+            // stable, thus patterns equally specific keep the file order
+            bucket.sort_by_key(|&id| std::cmp::Reverse(patterns[id].mask.count_ones()));
+        }
+
+        table
+    }
+
+    fn make_pattern(&mut self, entry: EncodingEntry) -> InstPattern {
+        let (mask, bits) = parse_encoding(&entry.encoding);
+
+        let mut extensions = 0;
+        for ext in entry.extension.split(',') {
+            let index = match self.extensions.iter().position(|e| e == ext) {
+                Some(index) => index,
+                None => {
+                    self.extensions.push(ext.to_string());
+                    self.extensions.len() - 1
+                }
+            };
+            assert!(index < 64, "too many extensions");
+            extensions |= 1 << index;
+        }
+
+        InstPattern {
+            name: entry.name,
+            id: self.patterns.len(),
+            mask,
+            bits,
+            extensions,
+        }
+    }
+
+    /// Instruction could be either a 32-bit one or a compressed one in the lower 16 bits
+    pub fn lookup(&self, inst: u32) -> Option<&InstPattern> {
+        let (bucket, inst) = if inst & 0b11 == 0b11 {
+            (&self.buckets[bucket_index(inst)], inst)
+        } else {
+            let inst = inst & 0xffff;
+            (&self.cbuckets[cbucket_index(inst)], inst)
+        };
+        bucket
+            .iter()
+            .map(|&id| &self.patterns[id])
+            .find(|p| p.matches(inst))
+    }
+
+    /// All patterns, indexed by InstPattern::id
+    pub fn patterns(&self) -> &[InstPattern] {
+        &self.patterns
+    }
+
+    /// Bitset of extensions of the instruction, zero if it is unknown
+    pub fn extensions_of(&self, inst: u32) -> u64 {
+        self.lookup(inst).map_or(0, |p| p.extensions)
+    }
+
+    /// Bitset of the named extensions, as returned by extensions_of
+    pub fn extension_set(&self, names: &[String]) -> anyhow::Result<u64> {
+        let mut set = 0;
+        for name in names {
+            let Some(index) = self.extensions.iter().position(|e| e == name) else {
+                anyhow::bail!(
+                    "unknown instruction extension {name:?}, available: {}",
+                    self.extensions.join(", ")
+                );
+            };
+            set |= 1 << index;
+        }
+        Ok(set)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_inst_lookup() {
+        let table = InstTable::new();
+
+        let name = |inst| table.lookup(inst).map(|p| p.name.as_str());
+        // addi a0, a0, 1
+        assert_eq!(name(0x00150513), Some("addi"));
+        // vadd.vv v1, v2, v3
+        assert_eq!(name(0x022180d7), Some("vadd_vv"));
+        // c.addi a0, 1
+        assert_eq!(name(0x0505), Some("c_addi"));
+        // wfi
+        assert_eq!(name(0x10500073), Some("wfi"));
+        // jal ra, 0 has no funct3
+        assert_eq!(name(0x000000ef), Some("jal"));
+        // more specific patterns win
+        assert_eq!(name(0x0001), Some("c_nop"));
+        assert_eq!(name(0x9002), Some("c_ebreak"));
+        assert_eq!(name(0x8082), Some("c_jr"));
+
+        let rv_v = table.extension_set(&["rv_v".into()]).unwrap();
+        assert_ne!(table.extensions_of(0x022180d7) & rv_v, 0);
+        assert_eq!(table.extensions_of(0x00150513) & rv_v, 0);
+        assert!(table.extension_set(&["rv_x".into()]).is_err());
+    }
+
+    // the copy in assets should be updated with the model data files
+    #[test]
+    fn test_inst_encoding_up_to_date() {
+        let model_copy = concat!(
+            env!("CARGO_MANIFEST_DIR"),
+            "/../model/data_files/full/inst_encoding.json"
+        );
+        if let Ok(content) = std::fs::read_to_string(model_copy) {
+            assert!(
+                content == INST_ENCODING_JSON,
+                "assets/inst_encoding.json is outdated, copy it from {model_copy}"
+            );
+        }
+    }
+}
@@ -5,9 +5,12 @@ use clap::{Parser, Subcommand};
 mod bus;
 mod common;
 mod difftest;
+mod disasm;
 mod gdb;
+mod isa;
 mod model;
 mod pokedex;
+mod trace;
 mod util;
 
 #[derive(clap::Parser)]
@@ -19,8 +22,11 @@ struct Args {
 #[derive(Subcommand)]
 enum Commands {
     Run(pokedex::RunArgs),
+    RunMany(pokedex::RunManyArgs),
     Debug(gdb::GdbArgs),
     Difftest(difftest::DiffTestArgs),
+    DifftestBatch(difftest::DiffTestBatchArgs),
+    Trace(trace::TraceArgs),
 }
 
 fn main() -> anyhow::Result<ExitCode> {
@@ -28,7 +34,10 @@ fn main() -> anyhow::Result<ExitCode> {
 
     match &args.command {
         Commands::Run(args) => pokedex::run_subcommand(args),
+        Commands::RunMany(args) => pokedex::run_many_subcommand(args),
         Commands::Debug(args) => gdb::run_subcommand(args),
         Commands::Difftest(args) => difftest::run_subcommand(args),
+        Commands::DifftestBatch(args) => difftest::run_batch_subcommand(args),
+        Commands::Trace(args) => trace::run_subcommand(args),
     }
 }
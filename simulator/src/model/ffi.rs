@@ -1,6 +1,7 @@
 use std::ffi::{CStr, CString, c_int, c_void};
 use std::marker::PhantomData;
 
+use anyhow::Context as _;
 use tracing::info;
 
 use super::{Inst, StepCode};
@@ -94,18 +95,22 @@ impl<T: super::PokedexCallbackMem> MakeVTable<T> {
         };
         model.amo_mem_u32(addr, op, value).try_write(ret)
     }
-    unsafe extern "C" fn lr_mem_4(model: *mut c_void, _addr: u32, _ret: *mut u32) -> c_int {
-        let _model = unsafe { &mut *(model as *mut T) };
-        todo!("LR instruction not implemented")
+    unsafe extern "C" fn lr_mem_4(model: *mut c_void, addr: u32, ret: *mut u32) -> c_int {
+        let model = unsafe { &mut *(model as *mut T) };
+        model.lr_mem_u32(addr).try_write(ret)
     }
     unsafe extern "C" fn sc_mem_4(
         model: *mut c_void,
-        _addr: u32,
-        _value: u32,
-        _ret: *mut u32,
+        addr: u32,
+        value: u32,
+        ret: *mut u32,
     ) -> c_int {
-        let _model = unsafe { &mut *(model as *mut T) };
-        todo!("SC instruction not implemented")
+        let model = unsafe { &mut *(model as *mut T) };
+        // 0 for success, 1 for failure, the same as the value written to rd
+        model
+            .sc_mem_u32(addr, value)
+            .map(|success| if success { 0 } else { 1 })
+            .try_write(ret)
     }
     const VTABLE: &raw::pokedex_mem_callback_vtable = &raw::pokedex_mem_callback_vtable {
         inst_fetch_2: Some(Self::inst_fetch_2),
@@ -132,24 +137,30 @@ pub struct Loader {
     pub(super) data: &'static raw::pokedex_model_export,
 }
 
-fn assert_abi_version(vtable: &'static raw::pokedex_model_export) {
+// SAFETY: the export table is immutable static data inside the model library
+unsafe impl Send for Loader {}
+unsafe impl Sync for Loader {}
+
+fn check_abi_version(vtable: &'static raw::pokedex_model_export) -> anyhow::Result<()> {
     // FIXME: it should be a direct CStr after bindgen generate_cstr issue fixed
     let abi_exe = CStr::from_bytes_with_nul(raw::POKEDEX_ABI_VERSION).unwrap();
     let abi_lib = unsafe { CStr::from_ptr(vtable.abi_version) };
-    assert!(
+    anyhow::ensure!(
         abi_exe == abi_lib,
         "ABI version mismatch, abi_exe={abi_exe:?}, abi_lib={abi_lib:?}"
     );
+    Ok(())
 }
 
 impl Loader {
-    pub fn from_dylib(so_path: &str) -> Self {
-        let so_path_cstr = CString::new(so_path).unwrap();
+    pub fn from_dylib(so_path: &str) -> anyhow::Result<Self> {
+        let so_path_cstr =
+            CString::new(so_path).with_context(|| format!("invalid dylib path {so_path:?}"))?;
         let so_lib =
             unsafe { libc::dlopen(so_path_cstr.as_ptr(), libc::RTLD_NOW | libc::RTLD_LOCAL) };
         if so_lib.is_null() {
             let err = unsafe { CStr::from_ptr(libc::dlerror()) };
-            panic!("dlopen failed: {err:?}")
+            anyhow::bail!("dlopen failed: {err:?}");
         }
 
         info!("MODEL LIB using dylib: {so_path}");
@@ -159,16 +170,32 @@ impl Loader {
         let entry = unsafe { libc::dlsym(so_lib, entry_name.as_ptr()) };
         let entry: raw::pokedex_get_model_export_t = unsafe { std::mem::transmute(entry) };
 
-        let entry = entry.unwrap_or_else(|| panic!("dlsym failed: {entry_name:?} not found"));
+        let entry = entry.with_context(|| format!("dlsym failed: {entry_name:?} not found"))?;
         let vtable: &'static raw::pokedex_model_export = unsafe { &*entry() };
 
-        assert_abi_version(vtable);
+        check_abi_version(vtable).with_context(|| format!("loading {so_path}"))?;
 
-        Self { data: vtable }
+        Ok(Self { data: vtable })
 
         // no dlclose intentionally, we want vtable has static lifetime
     }
 
+    // ASL model uses global variables, thus a dylib could only create one model instance.
+    // Loading a private copy of the dylib gives another set of globals.
+    pub fn from_dylib_copy(so_path: &str, copy_id: usize) -> anyhow::Result<Self> {
+        let copy_path =
+            std::env::temp_dir().join(format!("pokedex-model-{}-{copy_id}.so", std::process::id()));
+        std::fs::copy(so_path, &copy_path)
+            .with_context(|| format!("copying model dylib to {}", copy_path.display()))?;
+
+        let loader = Self::from_dylib(copy_path.to_str().expect("temp path is not UTF-8"));
+
+        // the mapping is still valid after the file is removed
+        std::fs::remove_file(&copy_path)?;
+
+        loader
+    }
+
     #[cfg(feature = "bundled-model-lib")]
     pub fn bundled() -> Self {
         info!("MODEL LIB using statically-linked version");
@@ -182,7 +209,7 @@ impl Loader {
         let _: raw::get_pokedex_vtable_t = Some(get_pokedex_vtable);
 
         // Seems no need to check abi version in static linking
-        // assert_abi_version(vtable);
+        // check_abi_version(vtable);
 
         Self {
             data: unsafe { &*get_pokedex_vtable() },
@@ -214,3 +241,16 @@ pub(super) fn detail_from_raw(code: u8, inst: u32) -> (StepCode, Option<Inst>) {
         _ => unreachable!("unexpected step return value ({code})"),
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_dylib_not_found() {
+        let missing = std::env::temp_dir().join("pokedex-no-such-model.so");
+        let err = Loader::from_dylib(missing.to_str().unwrap()).err().unwrap();
+        assert!(format!("{err:#}").contains("dlopen failed"), "{err:#}");
+        assert!(Loader::from_dylib_copy(missing.to_str().unwrap(), 1).is_err());
+    }
+}
@@ -7,6 +7,8 @@ use tracing::error;
 use crate::{bus::AtomicOp, util::Bitmap32};
 
 mod ffi;
+#[cfg(test)]
+pub mod stub;
 
 pub use ffi::Loader;
 
@@ -23,6 +25,9 @@ pub trait PokedexCallbackMem {
     fn write_mem_u32(&mut self, addr: u32, value: u32) -> Result<(), Self::CbMemError>;
     fn amo_mem_u32(&mut self, addr: u32, op: AtomicOp, value: u32)
     -> Result<u32, Self::CbMemError>;
+    fn lr_mem_u32(&mut self, addr: u32) -> Result<u32, Self::CbMemError>;
+    // return true if the store succeeds
+    fn sc_mem_u32(&mut self, addr: u32, value: u32) -> Result<bool, Self::CbMemError>;
 }
 
 #[derive(Debug, Default)]
@@ -91,6 +96,10 @@ pub struct ModelHandle {
     model_desc: ModelDesc,
 }
 
+// SAFETY: the model instance is only accessed through &mut self or &self of its handle,
+// it could be moved to another thread as long as it's not shared.
+unsafe impl Send for ModelHandle {}
+
 impl Drop for ModelHandle {
     fn drop(&mut self) {
         unsafe {
@@ -106,6 +115,10 @@ unsafe extern "C" fn model_debug_log(message: *const c_char) {
 
 impl ModelHandle {
     pub fn new(loader: Loader) -> Self {
+        Self::with_hartid(loader, 0)
+    }
+
+    pub fn with_hartid(loader: Loader, hartid: u32) -> Self {
         let vtable = loader.data;
 
         // ABI version check is already done in constructor
@@ -114,6 +127,7 @@ impl ModelHandle {
         let create_info = ffi::raw::pokedex_create_info {
             debug_log: Some(model_debug_log),
             debug_inst_issue: 0,
+            hartid,
         };
 
         let mut err_buf = [0u8; 256];
@@ -306,9 +320,26 @@ pub struct StepDetail<'a> {
     pub changes: CoreChange<'a>,
 }
 
+// Return one loader per hart, each has its own copy of model globals
+pub fn get_loaders(harts: usize) -> anyhow::Result<Vec<Loader>> {
+    if harts == 1 {
+        return Ok(vec![get_loader()?]);
+    }
+
+    let Ok(so_path) = std::env::var("POKEDEX_MODEL_DYLIB") else {
+        anyhow::bail!("multi-hart simulation requires env POKEDEX_MODEL_DYLIB");
+    };
+
+    let mut loaders = vec![Loader::from_dylib(&so_path)?];
+    for copy_id in 1..harts {
+        loaders.push(Loader::from_dylib_copy(&so_path, copy_id)?);
+    }
+    Ok(loaders)
+}
+
 pub fn get_loader() -> anyhow::Result<Loader> {
     match std::env::var("POKEDEX_MODEL_DYLIB") {
-        Ok(so_path) => Ok(Loader::from_dylib(&so_path)),
+        Ok(so_path) => Loader::from_dylib(&so_path),
         Err(_) => {
             #[cfg(not(feature = "bundled-model-lib"))]
             {
@@ -325,3 +356,17 @@ pub fn get_loader() -> anyhow::Result<Loader> {
         }
     }
 }
+
+// Models for tests as `get_loaders` gives, None if no model library is available.
+// Tests needing them are ignored, run them by `cargo test -- --ignored` with the env set.
+// A library has one set of globals and its copies share temporary paths,
+// the guard keeps tests from loading and running them at once.
+#[cfg(test)]
+pub fn test_loaders(count: usize) -> Option<(std::sync::MutexGuard<'static, ()>, Vec<Loader>)> {
+    static MODEL_LOCK: std::sync::Mutex<()> = std::sync::Mutex::new(());
+
+    // a failed test only poisons the lock, the model is reset by the next one
+    let guard = MODEL_LOCK.lock().unwrap_or_else(|e| e.into_inner());
+    let loaders = get_loaders(count).ok()?;
+    Some((guard, loaders))
+}
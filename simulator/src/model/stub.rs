@@ -0,0 +1,251 @@
+//! A model for tests without a model library, it commits scripted steps.
+//!
+//! Steps are fed through the same export table and `ModelHandle::step_trace` as a real model,
+//! so tracers see the same `StepDetail`. Staging a step does not allocate.
+
+use std::ffi::{c_char, c_void};
+
+use super::{Inst, Loader, ModelHandle, PokedexCallbackMem, StepDetail, ffi::raw};
+use crate::{bus::AtomicOp, trace::VLEN_BYTE};
+
+/// One step of the stub model, registers not written keep their values
+#[derive(Debug, Clone, Copy, Default)]
+pub struct StubStep<'a> {
+    pub pc: u32,
+    // None for a fetch exception, which must not write anything
+    pub inst: Option<Inst>,
+    pub xrf: &'a [(u8, u32)],
+    pub frf: &'a [(u8, u32)],
+    pub vrf: &'a [(u8, &'a [u8; VLEN_BYTE])],
+    pub csrs: &'a [(u16, u32)],
+}
+
+impl StubStep<'_> {
+    /// An uncompressed instruction without writes
+    pub fn commit(pc: u32, inst: u32) -> Self {
+        Self {
+            pc,
+            inst: Some(Inst::NC(inst)),
+            ..Default::default()
+        }
+    }
+}
+
+pub struct StubModel {
+    handle: ModelHandle,
+}
+
+impl StubModel {
+    pub fn new() -> Self {
+        Self {
+            handle: ModelHandle::new(Loader { data: &EXPORT.0 }),
+        }
+    }
+
+    /// Execute a step as a real model does on `ModelHandle::step_trace`
+    pub fn step(&mut self, step: &StubStep) -> StepDetail<'_> {
+        // SAFETY: the state is only accessed in calls through the handle, none is running now
+        let state = unsafe { state(self.handle.data.as_ptr()) };
+        state.stage(step);
+        self.handle.step_trace(&mut NoMem)
+    }
+}
+
+struct StubState {
+    description: raw::pokedex_model_description,
+    trace_buffer: raw::pokedex_trace_buffer,
+    pc: u32,
+    xregs: [u32; 32],
+    fregs: [u32; 32],
+    vregs: [[u8; VLEN_BYTE]; 32],
+    // CSRs written by the last step, others read as zero
+    csrs: [(u16, u32); raw::POKEDEX_MAX_CSR_WRITE as usize],
+}
+
+impl StubState {
+    fn new() -> Self {
+        Self {
+            description: raw::pokedex_model_description {
+                model_isa: c"rv32imafcv".as_ptr(),
+                model_priv: c"M".as_ptr(),
+                xlen: 32,
+                flen: 32,
+                vlen: VLEN_BYTE as u32 * 8,
+            },
+            trace_buffer: raw::pokedex_trace_buffer {
+                valid: 0,
+                step_status: 0,
+                csr_count: 0,
+                reserved: 0,
+                pc: 0,
+                inst: 0,
+                xreg_mask: 0,
+                freg_mask: 0,
+                vreg_mask: 0,
+                csr_indices: [0; raw::POKEDEX_MAX_CSR_WRITE as usize],
+            },
+            pc: 0,
+            xregs: [0; 32],
+            fregs: [0; 32],
+            vregs: [[0; VLEN_BYTE]; 32],
+            csrs: [(0, 0); raw::POKEDEX_MAX_CSR_WRITE as usize],
+        }
+    }
+
+    fn stage(&mut self, step: &StubStep) {
+        let (status, inst) = match step.inst {
+            None => (raw::POKEDEX_STEP_RESULT_FETCH_XCPT, 0),
+            Some(Inst::NC(inst)) => (raw::POKEDEX_STEP_RESULT_INST_COMMIT, inst),
+            Some(Inst::C(inst)) => (raw::POKEDEX_STEP_RESULT_INST_C_COMMIT, inst as u32),
+        };
+        assert!(step.csrs.len() < self.csrs.len());
+
+        let tb = &mut self.trace_buffer;
+        tb.valid = 1;
+        tb.step_status = status as u8;
+        tb.pc = step.pc;
+        tb.inst = inst;
+        tb.xreg_mask = 0;
+        tb.freg_mask = 0;
+        tb.vreg_mask = 0;
+        for &(rd, value) in step.xrf {
+            self.xregs[rd as usize] = value;
+            tb.xreg_mask |= 1 << rd;
+        }
+        for &(rd, value) in step.frf {
+            self.fregs[rd as usize] = value;
+            tb.freg_mask |= 1 << rd;
+        }
+        for &(rd, value) in step.vrf {
+            self.vregs[rd as usize] = *value;
+            tb.vreg_mask |= 1 << rd;
+        }
+        tb.csr_count = step.csrs.len() as u8;
+        for (i, &(csr, value)) in step.csrs.iter().enumerate() {
+            self.csrs[i] = (csr, value);
+            tb.csr_indices[i] = csr;
+        }
+
+        self.pc = step.pc;
+    }
+}
+
+// SAFETY: model is created by `create` below and not accessed elsewhere at the same time
+unsafe fn state<'a>(model: *mut c_void) -> &'a mut StubState {
+    unsafe { &mut *(model as *mut StubState) }
+}
+
+unsafe extern "C" fn create(
+    _info: *const raw::pokedex_create_info,
+    _err_buf: *mut c_char,
+    _err_buflen: usize,
+) -> *mut c_void {
+    Box::into_raw(Box::new(StubState::new())) as *mut c_void
+}
+
+unsafe extern "C" fn destroy(model: *mut c_void) {
+    drop(unsafe { Box::from_raw(model as *mut StubState) });
+}
+
+unsafe extern "C" fn get_description(model: *mut c_void) -> *const raw::pokedex_model_description {
+    unsafe { &state(model).description }
+}
+
+unsafe extern "C" fn reset(model: *mut c_void, initial_pc: u32) {
+    unsafe { state(model).pc = initial_pc };
+}
+
+unsafe extern "C" fn step(
+    model: *mut c_void,
+    _mem_callback_vtable: *const raw::pokedex_mem_callback_vtable,
+    _mem_callback_data: *mut c_void,
+) -> u8 {
+    unsafe { state(model).trace_buffer.step_status }
+}
+
+unsafe extern "C" fn get_trace_buffer(model: *mut c_void) -> *const raw::pokedex_trace_buffer {
+    unsafe { &state(model).trace_buffer }
+}
+
+unsafe extern "C" fn get_pc(model: *mut c_void, ret: *mut u64) {
+    unsafe { *ret = state(model).pc as u64 };
+}
+
+unsafe extern "C" fn get_xreg(model: *mut c_void, xs: u8, ret: *mut u64) {
+    unsafe { *ret = state(model).xregs[xs as usize] as u64 };
+}
+
+unsafe extern "C" fn get_freg(model: *mut c_void, fs: u8, ret: *mut u64) {
+    unsafe { *ret = state(model).fregs[fs as usize] as u64 };
+}
+
+unsafe extern "C" fn get_vreg(model: *mut c_void, vs: u8, buf: *mut u8, buflen: usize) {
+    let value = unsafe { &state(model).vregs[vs as usize] };
+    assert_eq!(buflen, value.len());
+    unsafe { std::ptr::copy_nonoverlapping(value.as_ptr(), buf, buflen) };
+}
+
+unsafe extern "C" fn get_csr(model: *mut c_void, csr: u16, ret: *mut u64) {
+    let csrs = unsafe { &state(model).csrs };
+    let value = csrs.iter().find(|&&(c, _)| c == csr).map_or(0, |&(_, v)| v);
+    unsafe { *ret = value as u64 };
+}
+
+struct Export(raw::pokedex_model_export);
+
+// SAFETY: immutable, as the export table of a model library
+unsafe impl Sync for Export {}
+
+static EXPORT: Export = Export(raw::pokedex_model_export {
+    abi_version: raw::POKEDEX_ABI_VERSION.as_ptr() as *const c_char,
+    create: Some(create),
+    destroy: Some(destroy),
+    get_description: Some(get_description),
+    reset: Some(reset),
+    step: Some(step),
+    step_trace: Some(step),
+    get_trace_buffer: Some(get_trace_buffer),
+    get_pc: Some(get_pc),
+    get_xreg: Some(get_xreg),
+    get_freg: Some(get_freg),
+    get_vreg: Some(get_vreg),
+    get_csr: Some(get_csr),
+});
+
+// Scripted steps do not access memory
+struct NoMem;
+
+impl PokedexCallbackMem for NoMem {
+    type CbMemError = ();
+
+    fn inst_fetch_2(&mut self, _addr: u32) -> Result<u16, ()> {
+        unreachable!()
+    }
+    fn read_mem_u8(&mut self, _addr: u32) -> Result<u8, ()> {
+        unreachable!()
+    }
+    fn read_mem_u16(&mut self, _addr: u32) -> Result<u16, ()> {
+        unreachable!()
+    }
+    fn read_mem_u32(&mut self, _addr: u32) -> Result<u32, ()> {
+        unreachable!()
+    }
+    fn write_mem_u8(&mut self, _addr: u32, _value: u8) -> Result<(), ()> {
+        unreachable!()
+    }
+    fn write_mem_u16(&mut self, _addr: u32, _value: u16) -> Result<(), ()> {
+        unreachable!()
+    }
+    fn write_mem_u32(&mut self, _addr: u32, _value: u32) -> Result<(), ()> {
+        unreachable!()
+    }
+    fn amo_mem_u32(&mut self, _addr: u32, _op: AtomicOp, _value: u32) -> Result<u32, ()> {
+        unreachable!()
+    }
+    fn lr_mem_u32(&mut self, _addr: u32) -> Result<u32, ()> {
+        unreachable!()
+    }
+    fn sc_mem_u32(&mut self, _addr: u32, _value: u32) -> Result<bool, ()> {
+        unreachable!()
+    }
+}
@@ -8,18 +8,26 @@ use std::{
 use anyhow::Context;
 use clap::Parser;
 use tracing::{Level, error, event, info};
-use tracing_subscriber::{EnvFilter, prelude::*};
+use tracing_subscriber::{EnvFilter, fmt::writer::BoxMakeWriter, prelude::*};
 
 use crate::{
     bus::Bus,
-    common::{CommitLog, PokedexLog, StateWrite},
+    common::{CommitLogRef, CommitWrites, PokedexLogRef},
     model::{Inst, StepDetail},
+    trace::{
+        AsyncTracer, BinaryTracer, StdoutTracer, TraceFilter, TraceFilterArgs, TraceOptions,
+        TraceSink, VLEN_BYTE,
+    },
 };
 
-use self::simulator::Simulator;
+use self::simulator::{IdleLoop, Simulator};
 
+mod multihart;
+mod run_many;
 pub mod simulator;
 
+pub use run_many::{RunManyArgs, run_many_subcommand};
+
 /// Simple program to greet a person
 #[derive(Parser, Debug)]
 #[command(version, about, long_about = None)]
@@ -35,17 +43,147 @@ pub struct RunArgs {
     #[arg(short, long, action = clap::ArgAction::Count)]
     verbose: u8,
 
-    /// Write trace json log to output path
+    /// Write trace log to output path, which could be a FIFO,
+    /// "-" for stdout, or "unix:<path>" to connect to a listening Unix socket
     #[arg(short = 'o', long)]
-    output_log_path: Option<PathBuf>,
+    output_log_path: Option<TraceSink>,
+
+    /// Format of the trace log written to output path
+    #[arg(long, value_enum, default_value_t = TraceFormat::Json)]
+    trace_format: TraceFormat,
+
+    /// Record only the changed bytes of vector register writes in the trace log
+    #[arg(long, requires = "output_log_path")]
+    trace_vrf_delta: bool,
+
+    /// Instructions between keyframes in the trace index "<output path>.idx", 0 for no index.
+    /// A trace filtered or limited to a range has no index.
+    #[arg(
+        long,
+        default_value_t = 1 << 16,
+        conflicts_with_all = [
+            "trace_start", "trace_stop", "trace_pc", "trace_symbol", "trace_class",
+            "trace_csr_only", "trace_sample",
+        ]
+    )]
+    trace_index_interval: u64,
+
+    /// Instructions between rolling state hashes in "<output path>.hash", 0 for no hashes.
+    /// `difftest --trace-a/--trace-b` compares them to find where two traces diverge
+    #[arg(long, default_value_t = 0, requires = "output_log_path")]
+    trace_hash_interval: u64,
+
+    /// Flow control over a Unix socket trace stream: at most this many frames
+    /// are sent before the consumer acknowledges them, 0 for no flow control
+    #[arg(long, default_value_t = 0)]
+    trace_stream_window: u32,
+
+    /// Compress the trace log in blocks on worker threads,
+    /// difftest and `pokedex trace` read it transparently
+    #[arg(long, requires = "output_log_path")]
+    trace_compress: bool,
+
+    /// Annotate each instruction with its disassembly,
+    /// in the JSON trace log and the --stdout trace
+    #[arg(long)]
+    trace_disasm: bool,
 
-    /// Write trace log to stdout in human readable format
+    /// Write trace log to stdout in human readable format, logs go to stderr then
     #[arg(long)]
     stdout: bool,
+
+    /// Number of harts, each hart runs on its own host thread over shared memory
+    #[arg(long, default_value_t = 1)]
+    harts: u32,
+
+    /// Instructions each hart executes between two synchronization points (multi-hart only).
+    /// MMIO accesses are not deferred to them, within a quantum they are ordered by host scheduling
+    #[arg(long, default_value_t = 10000)]
+    quantum: u64,
+
+    /// Stop when the program spins forever in a jump-to-self or wfi with interrupts disabled
+    #[arg(long)]
+    stop_on_idle: bool,
+
+    /// Exit code reported when the program is stopped on idle.
+    /// If not given, stopping on idle is a failure.
+    #[arg(long, requires = "stop_on_idle")]
+    idle_exit_code: Option<u32>,
+
+    /// Stop the simulation as a failure after executing this many instructions
+    #[arg(long)]
+    max_insns: Option<u64>,
+
+    /// Run without tracing until this point, given as an instruction count, or as "pc=<addr>"
+    #[arg(long)]
+    trace_start: Option<TracePoint>,
+
+    /// Stop tracing at this point, given as an instruction count, or as "pc=<addr>".
+    /// The simulation keeps running untraced.
+    #[arg(long)]
+    trace_stop: Option<TracePoint>,
+
+    #[command(flatten)]
+    trace_filter: TraceFilterArgs,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, clap::ValueEnum)]
+pub enum TraceFormat {
+    /// JSON lines, one record per line
+    Json,
+    /// Compact binary trace, could be converted to JSON lines by `pokedex trace convert`
+    Binary,
+}
+
+/// A point in execution where tracing starts or stops
+#[derive(Debug, Clone, Copy)]
+pub enum TracePoint {
+    // number of instructions executed so far
+    InsnCount(u64),
+    // the next instruction to execute is at pc
+    Pc(u32),
+}
+
+impl std::str::FromStr for TracePoint {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        if let Some(pc) = s.strip_prefix("pc=") {
+            let digits = pc.strip_prefix("0x").unwrap_or(pc);
+            u32::from_str_radix(digits, 16)
+                .map(Self::Pc)
+                .map_err(|e| format!("invalid pc {pc:?}: {e}"))
+        } else {
+            s.parse()
+                .map(Self::InsnCount)
+                .map_err(|e| format!("invalid instruction count {s:?}: {e}"))
+        }
+    }
+}
+
+impl TracePoint {
+    fn reached(self, sim: &Simulator) -> bool {
+        self.reached_at(sim.stats().step_count, || sim.core().read_pc())
+    }
+
+    // pc is only read for a pc point
+    fn reached_at(self, step_count: u64, read_pc: impl FnOnce() -> u32) -> bool {
+        match self {
+            Self::InsnCount(count) => step_count >= count,
+            Self::Pc(pc) => read_pc() == pc,
+        }
+    }
 }
 
-fn setup_logging(verbose: u8) {
+// Logs go to stderr when stdout carries the trace
+pub(crate) fn setup_logging(verbose: u8, to_stderr: bool) {
+    let writer = if to_stderr {
+        BoxMakeWriter::new(std::io::stderr)
+    } else {
+        BoxMakeWriter::new(std::io::stdout)
+    };
     let stdout_log_layer = tracing_subscriber::fmt::layer()
+        .with_writer(writer)
         .without_time()
         .with_ansi(true)
         .with_line_number(false)
@@ -65,19 +203,54 @@ fn setup_logging(verbose: u8) {
 }
 
 pub fn run_subcommand(args: &RunArgs) -> anyhow::Result<ExitCode> {
-    setup_logging(args.verbose);
+    let trace_to_stdout = args.stdout || matches!(args.output_log_path, Some(TraceSink::Stdout));
+    setup_logging(args.verbose, trace_to_stdout);
+
+    anyhow::ensure!(args.harts >= 1, "at least one hart is required");
+    if args.harts > 1 {
+        return multihart::run_multihart(args);
+    }
 
     let model_loader = crate::model::get_loader()?;
     let bus = Bus::load_from_config(&args.config_path)?;
     let config_reset_vector = bus.reset_vector();
 
+    // Untraced steps skip collecting state changes in the model
+    let trace_enabled = args.output_log_path.is_some() || args.stdout;
+    let mut trace_start = args.trace_start.filter(|_| trace_enabled);
+    let mut trace_stop = args.trace_stop.filter(|_| trace_enabled);
+    let mut tracing = trace_enabled && trace_start.is_none();
+
+    let mut filter = if trace_enabled {
+        TraceFilter::from_args(&args.trace_filter, &args.elf_path)?
+    } else {
+        None
+    };
+
+    // keyframes count instructions of the whole run, a partial trace has no index
+    let partial = filter.is_some() || trace_start.is_some() || trace_stop.is_some();
+
     let mut tracer_ = match &args.output_log_path {
-        Some(path) => {
-            AppTracer::json_log(path).with_context(|| format!("failed to open {path:?}"))?
+        // formatting and file I/O are offloaded to a writer thread
+        Some(sink) => {
+            let options = TraceOptions {
+                format: args.trace_format,
+                vrf_delta: args.trace_vrf_delta,
+                index_interval: if partial {
+                    0
+                } else {
+                    args.trace_index_interval
+                },
+                hash_interval: args.trace_hash_interval,
+                stream_window: args.trace_stream_window,
+                compress: args.trace_compress,
+                disasm: args.trace_disasm,
+            };
+            AppTracer::async_log(sink, options).with_context(|| format!("failed to open {sink}"))?
         }
         None => {
             if args.stdout {
-                AppTracer::stdout()
+                AppTracer::stdout(args.trace_disasm)
             } else {
                 AppTracer::noop()
             }
@@ -94,7 +267,12 @@ pub fn run_subcommand(args: &RunArgs) -> anyhow::Result<ExitCode> {
     let reset_vector = config_reset_vector.unwrap_or(elf_entry);
 
     sim.reset_core(reset_vector);
-    tracer.trace_reset(reset_vector);
+    if tracing {
+        tracer.trace_reset(reset_vector);
+    }
+
+    // tracer is notified once when a gap of untraced steps begins
+    let mut last_recorded = true;
 
     let exit_code;
     loop {
@@ -105,11 +283,70 @@ pub fn run_subcommand(args: &RunArgs) -> anyhow::Result<ExitCode> {
                 error!("simulation exit with exit code {code}");
             }
             exit_code = code;
-            tracer.trace_exit(code);
+            if tracing {
+                tracer.trace_exit(code);
+            }
+            break;
+        }
+        if args.stop_on_idle
+            && let Some(idle) = sim.poll_idle()
+        {
+            let IdleLoop { kind, pc } = idle;
+            match args.idle_exit_code {
+                Some(code) => {
+                    info!("simulation stopped on {kind:?} at pc={pc:#010x}, exit code {code}");
+                    exit_code = code;
+                    if tracing {
+                        tracer.trace_exit(code);
+                    }
+                }
+                None => {
+                    error!("simulation stopped on {kind:?} at pc={pc:#010x} without exit");
+                    exit_code = u32::MAX;
+                }
+            }
+            break;
+        }
+        if let Some(max_insns) = args.max_insns
+            && sim.stats().step_count >= max_insns
+        {
+            error!("simulation stopped after {max_insns} instructions without exit");
+            exit_code = u32::MAX;
             break;
         }
-        let step_result = sim.step_trace();
-        tracer.trace_step(step_result);
+
+        if let Some(point) = trace_start
+            && point.reached(&sim)
+        {
+            let (count, pc) = (sim.stats().step_count, sim.core().read_pc());
+            info!("start tracing at pc={pc:#010x} after {count} instructions");
+            trace_start = None;
+            tracing = true;
+        } else if tracing
+            && let Some(point) = trace_stop
+            && point.reached(&sim)
+        {
+            let (count, pc) = (sim.stats().step_count, sim.core().read_pc());
+            info!("stop tracing at pc={pc:#010x} after {count} instructions");
+            trace_stop = None;
+            tracing = false;
+        }
+
+        let selected = tracing && filter.as_mut().is_none_or(|f| f.select(&sim));
+        let mut recorded = false;
+        if selected {
+            let step_result = sim.step_trace();
+            if filter.as_ref().is_none_or(|f| f.accept(&step_result)) {
+                tracer.trace_step(step_result);
+                recorded = true;
+            }
+        } else {
+            sim.step();
+        }
+        if !recorded && last_recorded {
+            tracer.trace_skip();
+        }
+        last_recorded = recorded;
 
         // std::thread::sleep(std::time::Duration::from_millis(1000));
     }
@@ -119,8 +356,8 @@ pub fn run_subcommand(args: &RunArgs) -> anyhow::Result<ExitCode> {
     let stats = sim.stats();
     event!(Level::INFO, ?stats);
 
-    if let Some(log_path) = &args.output_log_path {
-        info!("trace log store in {}", log_path.display());
+    if let Some(sink) = &args.output_log_path {
+        info!("trace log store in {sink}");
     }
 
     if exit_code == 0 {
@@ -132,6 +369,8 @@ pub fn run_subcommand(args: &RunArgs) -> anyhow::Result<ExitCode> {
 
 pub enum AppTracer {
     JsonFile(JsonFileTracer),
+    BinaryFile(BinaryTracer),
+    Async(AsyncTracer),
     Stdout(StdoutTracer),
     None(NoopTracer),
 }
@@ -140,8 +379,14 @@ impl AppTracer {
     pub fn json_log(path: &Path) -> Result<Self, std::io::Error> {
         JsonFileTracer::open(path).map(Self::JsonFile)
     }
-    pub fn stdout() -> Self {
-        Self::Stdout(StdoutTracer)
+    pub fn binary_log(path: &Path) -> Result<Self, std::io::Error> {
+        BinaryTracer::open(path, false).map(Self::BinaryFile)
+    }
+    pub fn async_log(sink: &TraceSink, options: TraceOptions) -> Result<Self, std::io::Error> {
+        AsyncTracer::open(sink, options).map(Self::Async)
+    }
+    pub fn stdout(disasm: bool) -> Self {
+        Self::Stdout(StdoutTracer::new(disasm))
     }
     pub fn noop() -> Self {
         Self::None(NoopTracer)
@@ -150,6 +395,8 @@ impl AppTracer {
     pub fn as_tracer(&mut self) -> &mut dyn Tracer {
         match self {
             Self::JsonFile(tracer) => tracer,
+            Self::BinaryFile(tracer) => tracer,
+            Self::Async(tracer) => tracer,
             Self::Stdout(tracer) => tracer,
             Self::None(tracer) => tracer,
         }
@@ -161,6 +408,9 @@ pub trait Tracer {
     fn trace_exit(&mut self, exit_code: u32);
     fn trace_step(&mut self, detail: StepDetail);
     fn flush(&mut self);
+
+    /// Steps were executed without being traced since the last record
+    fn trace_skip(&mut self) {}
 }
 
 pub struct NoopTracer;
@@ -172,59 +422,11 @@ impl Tracer for NoopTracer {
     fn flush(&mut self) {}
 }
 
-pub struct StdoutTracer;
-
-impl Tracer for StdoutTracer {
-    fn trace_reset(&mut self, pc: u32) {
-        println!("[RESET] pc={pc:#010x}");
-    }
-
-    fn trace_exit(&mut self, exit_code: u32) {
-        println!("[EXIT]  code={exit_code}");
-    }
-
-    fn trace_step(&mut self, detail: StepDetail) {
-        let Some(inst) = detail.inst else {
-            assert!(detail.changes.is_empty_changes());
-            return;
-        };
-
-        print!("[INST]  pc={:#010x}", detail.pc);
-
-        match inst {
-            Inst::NC(i) => print!(" inst={i:#010x}"),
-            Inst::C(i) => print!(" inst={i:#06x}"),
-        };
-
-        // Print register changes
-        for (rd, value) in detail.changes.xreg_changes() {
-            print!(" x{rd}<-{value:#010x}");
-        }
-        for (rd, value) in detail.changes.freg_changes() {
-            print!(" f{rd}<-{value:#010x}");
-        }
-        for rd in detail.changes.vreg_change_indices() {
-            let mut value = vec![0u8; 32];
-            detail.changes.core.read_vreg(rd, &mut value);
-            print!(" v{rd}<-0x");
-            for byte in value.iter().rev() {
-                print!("{byte:02x}");
-            }
-        }
-        for csr in detail.changes.csr_change_indices() {
-            let value = detail.changes.core.read_csr(csr);
-            let name = name_of_csr(csr);
-            print!(" {name}<-{value:#010x}");
-        }
-
-        println!();
-    }
-
-    fn flush(&mut self) {}
-}
-
 pub struct JsonFileTracer {
     writer: BufWriter<File>,
+
+    // reused by every step to avoid allocation
+    writes: CommitWrites,
 }
 
 impl JsonFileTracer {
@@ -235,22 +437,36 @@ impl JsonFileTracer {
     pub fn from_file(file: File) -> Self {
         Self {
             writer: BufWriter::new(file),
+            writes: CommitWrites::default(),
         }
     }
 
-    fn write_json_line(&mut self, value: &PokedexLog) {
+    fn write_json_line(&mut self, value: &PokedexLogRef) {
         serde_json::to_writer(&mut self.writer, value).expect("json log serialize failed");
         self.writer.write_all(b"\n").unwrap();
     }
+
+    // write a commit with state writes collected in self.writes
+    fn write_commit(&mut self, pc: u32, instruction: u32, is_compressed: bool) {
+        let json = PokedexLogRef::Commit(CommitLogRef {
+            pc,
+            is_compressed,
+            instruction,
+            states_changed: &self.writes,
+            disasm: None,
+        });
+        serde_json::to_writer(&mut self.writer, &json).expect("json log serialize failed");
+        self.writer.write_all(b"\n").unwrap();
+    }
 }
 
 impl Tracer for JsonFileTracer {
     fn trace_reset(&mut self, pc: u32) {
-        self.write_json_line(&PokedexLog::Reset { pc });
+        self.write_json_line(&PokedexLogRef::Reset { pc });
     }
 
     fn trace_exit(&mut self, exit_code: u32) {
-        self.write_json_line(&PokedexLog::Exit { code: exit_code });
+        self.write_json_line(&PokedexLogRef::Exit { code: exit_code });
     }
 
     fn trace_step(&mut self, detail: StepDetail) {
@@ -259,31 +475,18 @@ impl Tracer for JsonFileTracer {
                 Inst::NC(inst) => (inst, false),
                 Inst::C(inst) => (inst as u32, true),
             };
-            let mut writes = vec![];
-            for (rd, value) in detail.changes.xreg_changes() {
-                writes.push(StateWrite::Xrf { rd, value });
-            }
-            for (rd, value) in detail.changes.freg_changes() {
-                writes.push(StateWrite::Frf { rd, value });
-            }
+            let writes = &mut self.writes;
+            writes.clear();
+            writes.xrf.extend(detail.changes.xreg_changes());
+            writes.frf.extend(detail.changes.freg_changes());
             for rd in detail.changes.vreg_change_indices() {
-                let mut value = vec![0; 32];
-                detail.changes.core.read_vreg(rd, &mut value);
-                writes.push(StateWrite::Vrf { rd, value });
+                let value = writes.push_vrf(rd, VLEN_BYTE);
+                detail.changes.core.read_vreg(rd, value);
             }
             for csr in detail.changes.csr_change_indices() {
-                writes.push(StateWrite::Csr {
-                    name: name_of_csr(csr).into(),
-                    value: detail.changes.core.read_csr(csr),
-                });
+                writes.csr.push((csr, detail.changes.core.read_csr(csr)));
             }
-            let json = PokedexLog::Commit(CommitLog {
-                pc: detail.pc,
-                instruction,
-                is_compressed,
-                states_changed: writes,
-            });
-            self.write_json_line(&json);
+            self.write_commit(detail.pc, instruction, is_compressed);
         } else {
             assert!(detail.changes.is_empty_changes())
         }
@@ -294,10 +497,15 @@ impl Tracer for JsonFileTracer {
     }
 }
 
-fn name_of_csr(csr: u16) -> &'static str {
+pub(crate) fn name_of_csr(csr: u16) -> &'static str {
+    try_name_of_csr(csr).unwrap_or_else(|| panic!("unknown csr {csr:#05x}"))
+}
+
+/// Name of a CSR the model implements, None for others
+pub(crate) fn try_name_of_csr(csr: u16) -> Option<&'static str> {
     assert!(csr <= 0xFFF);
 
-    match csr {
+    let name = match csr {
         // urw
         0x001 => "fflags",
         0x002 => "frm",
@@ -330,6 +538,57 @@ fn name_of_csr(csr: u16) -> &'static str {
         0xf14 => "mhartid",
         0xf15 => "mconfigptr",
 
-        _ => panic!("unknown csr {csr:#05x}"),
+        _ => return None,
+    };
+    Some(name)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_trace_point() {
+        assert!(matches!("1000".parse(), Ok(TracePoint::InsnCount(1000))));
+        assert!(matches!(
+            "pc=0x80000040".parse(),
+            Ok(TracePoint::Pc(0x8000_0040))
+        ));
+        assert!(matches!(
+            "pc=80000040".parse(),
+            Ok(TracePoint::Pc(0x8000_0040))
+        ));
+        assert!("pc=".parse::<TracePoint>().is_err());
+        assert!("pc=0x100000000".parse::<TracePoint>().is_err());
+        assert!("-1".parse::<TracePoint>().is_err());
+
+        let count = TracePoint::InsnCount(10);
+        assert!(!count.reached_at(9, || unreachable!()));
+        assert!(count.reached_at(10, || unreachable!()));
+
+        let pc = TracePoint::Pc(0x1000);
+        assert!(pc.reached_at(0, || 0x1000));
+        assert!(!pc.reached_at(u64::MAX, || 0x1004));
+    }
+
+    #[test]
+    fn test_partial_trace_index() {
+        let parse = |extra: &[&str]| {
+            let args = ["run", "a.elf", "-c", "a.kdl", "-o", "a.bin"];
+            RunArgs::try_parse_from(args.iter().chain(extra))
+        };
+
+        assert!(parse(&["--trace-index-interval", "100"]).is_ok());
+        assert!(parse(&["--trace-pc", "0-100"]).is_ok());
+        // an index of a partial trace would not count instructions of the run
+        for partial in [
+            ["--trace-pc", "0-100"],
+            ["--trace-start", "100"],
+            ["--trace-stop", "pc=0x100"],
+            ["--trace-sample", "2"],
+        ] {
+            let extra = [partial[0], partial[1], "--trace-index-interval", "100"];
+            assert!(parse(&extra).is_err(), "{partial:?}");
+        }
     }
 }
@@ -0,0 +1,204 @@
+use std::{
+    process::ExitCode,
+    sync::{Condvar, Mutex},
+};
+
+use tracing::{Level, error, event, info};
+
+use crate::{bus::Bus, pokedex::RunArgs};
+
+use super::simulator::Simulator;
+
+// Each hart runs on its own host thread and executes `quantum` instructions between
+// two synchronization points. Harts share SRAM through host atomics,
+// and the exit request is observed at synchronization points.
+//
+// MMIO is not ordered at synchronization points: every access takes the device mutex
+// when it is executed (see SharedDevice). Accesses of different harts within one quantum
+// are thus ordered by host scheduling, and a program where several harts touch the same
+// device in a quantum, e.g. printing or exiting, may see another order on every run.
+// Whether the run exits is still decided at synchronization points only.
+pub fn run_multihart(args: &RunArgs) -> anyhow::Result<ExitCode> {
+    let harts = args.harts as usize;
+    assert!(harts > 1);
+
+    if args.output_log_path.is_some() || args.stdout {
+        anyhow::bail!("tracing is not supported in multi-hart simulation");
+    }
+    if args.stop_on_idle || args.max_insns.is_some() {
+        anyhow::bail!("--stop-on-idle and --max-insns are not supported in multi-hart simulation");
+    }
+    anyhow::ensure!(args.quantum > 0, "quantum should be positive");
+
+    let loaders = crate::model::get_loaders(harts)?;
+    let mut buses = Bus::load_shared_from_config(&args.config_path, harts)?;
+    let config_reset_vector = buses[0].reset_vector();
+
+    info!("running case: {:?} with {harts} harts", args.elf_path);
+
+    // SRAM is shared, loading to any bus is visible for all harts
+    let elf_entry = buses[0].load_elf(&args.elf_path)?;
+    let reset_vector = config_reset_vector.unwrap_or(elf_entry);
+
+    let barrier = HartBarrier::new(harts);
+    let quantum = args.quantum;
+
+    // (step count, exit code) of each hart, None if the run is aborted by another hart
+    let results: Vec<Option<(u64, u32)>> = std::thread::scope(|s| {
+        let handles: Vec<_> = loaders
+            .into_iter()
+            .zip(buses)
+            .enumerate()
+            .map(|(hartid, (loader, bus))| {
+                let barrier = &barrier;
+                std::thread::Builder::new()
+                    .name(format!("hart{hartid}"))
+                    .spawn_scoped(s, move || {
+                        let _abort = AbortOnPanic(barrier);
+                        let mut sim = Simulator::with_hartid(loader, bus, hartid as u32);
+                        sim.reset_core(reset_vector);
+
+                        loop {
+                            for _ in 0..quantum {
+                                if sim.is_exited().is_some() {
+                                    break;
+                                }
+                                sim.step();
+                            }
+
+                            // All harts must agree on whether to stop,
+                            // thus the exit state is sampled between two barriers,
+                            // where no hart is stepping.
+                            if !barrier.wait() {
+                                return None;
+                            }
+                            let exited = sim.is_exited().is_some();
+                            if !barrier.wait() {
+                                return None;
+                            }
+
+                            if exited {
+                                break;
+                            }
+                        }
+
+                        let exit_code = sim.is_exited().unwrap();
+                        Some((sim.stats().step_count, exit_code))
+                    })
+                    .expect("failed to spawn hart thread")
+            })
+            .collect();
+
+        handles
+            .into_iter()
+            .map(|handle| handle.join().expect("hart thread panicked"))
+            .collect()
+    });
+    // harts only abort when another one panics, which is propagated by the join above
+    let results: Vec<(u64, u32)> = results
+        .into_iter()
+        .collect::<Option<_>>()
+        .expect("hart aborted without a panicking hart");
+
+    for (hartid, (step_count, _)) in results.iter().enumerate() {
+        event!(Level::INFO, hartid, step_count);
+    }
+
+    // exit state is shared by all buses, all harts observe the same code
+    let exit_code = results[0].1;
+    if exit_code == 0 {
+        info!("simulation exit with exit code {exit_code}");
+        Ok(ExitCode::SUCCESS)
+    } else {
+        error!("simulation exit with exit code {exit_code}");
+        Ok(ExitCode::FAILURE)
+    }
+}
+
+// A reusable barrier of all harts, which a panicking hart breaks,
+// so that the others are not left waiting for it forever
+struct HartBarrier {
+    harts: usize,
+    state: Mutex<BarrierState>,
+    cvar: Condvar,
+}
+
+#[derive(Default)]
+struct BarrierState {
+    arrived: usize,
+    generation: u64,
+    aborted: bool,
+}
+
+impl HartBarrier {
+    fn new(harts: usize) -> Self {
+        Self {
+            harts,
+            state: Mutex::default(),
+            cvar: Condvar::new(),
+        }
+    }
+
+    // Returns false if the barrier is aborted, the caller should stop running
+    fn wait(&self) -> bool {
+        let mut state = self.state.lock().unwrap();
+        if state.aborted {
+            return false;
+        }
+
+        state.arrived += 1;
+        if state.arrived == self.harts {
+            state.arrived = 0;
+            state.generation += 1;
+            self.cvar.notify_all();
+            return true;
+        }
+
+        let generation = state.generation;
+        while state.generation == generation && !state.aborted {
+            state = self.cvar.wait(state).unwrap();
+        }
+        state.generation != generation
+    }
+
+    fn abort(&self) {
+        // the lock is never held across a panic, but do not double panic if it is poisoned
+        let mut state = self.state.lock().unwrap_or_else(|e| e.into_inner());
+        state.aborted = true;
+        self.cvar.notify_all();
+    }
+}
+
+// Aborts the barrier when its hart unwinds
+struct AbortOnPanic<'a>(&'a HartBarrier);
+
+impl Drop for AbortOnPanic<'_> {
+    fn drop(&mut self) {
+        if std::thread::panicking() {
+            self.0.abort();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_barrier_abort_on_panic() {
+        let barrier = HartBarrier::new(2);
+        let joined = std::thread::scope(|s| {
+            let waiter = s.spawn(|| (0..3).map(|_| barrier.wait()).collect::<Vec<_>>());
+            let panicker = s.spawn(|| {
+                let _abort = AbortOnPanic(&barrier);
+                assert!(barrier.wait());
+                panic!("hart panic");
+            });
+            (waiter.join(), panicker.join())
+        });
+
+        // released once with the other hart, then aborted instead of hanging
+        assert_eq!(joined.0.unwrap(), [true, false, false]);
+        assert!(joined.1.is_err());
+    }
+}
@@ -0,0 +1,531 @@
+use std::{
+    collections::HashMap,
+    path::{Path, PathBuf},
+    process::ExitCode,
+    sync::{
+        Mutex,
+        atomic::{AtomicUsize, Ordering},
+    },
+    time::Instant,
+};
+
+use anyhow::Context as _;
+use serde::{Deserialize, Serialize};
+use tracing::{error, info, warn};
+
+use crate::{
+    bus::Bus,
+    model::Loader,
+    pokedex::{AppTracer, TraceFormat},
+};
+
+use super::simulator::{IdleKind, IdleLoop, Simulator};
+
+/// Run a list of cases in one process with a pool of workers
+#[derive(clap::Parser, Debug)]
+pub struct RunManyArgs {
+    /// Case list, one case per line, empty lines and lines started with '#' are ignored.
+    ///
+    /// A case is an ELF path relative to the list file,
+    /// or a case name (e.g. "vaadd.vv") when --case-dir is given.
+    case_list: PathBuf,
+
+    /// Directory of prebuilt ELFs, a case name is mapped to
+    /// <case-dir>/<name>.elf where non-alphanumeric characters in name are replaced with '_'
+    #[arg(long)]
+    case_dir: Option<PathBuf>,
+
+    /// Path to KDL configuration file
+    #[arg(short = 'c', long)]
+    config_path: PathBuf,
+
+    /// Output path of the JSON summary.
+    /// If it already exists, its timings are used to schedule the longest cases first.
+    #[arg(short = 'o', long)]
+    output_path: PathBuf,
+
+    /// Number of workers, defaults to the number of host cores
+    #[arg(short = 'j', long)]
+    jobs: Option<usize>,
+
+    /// Stop a case after executing this many instructions, it then times out.
+    /// A case which neither exits nor goes idle would otherwise hold its worker forever.
+    #[arg(long, default_value_t = DEFAULT_MAX_INSNS)]
+    max_insns: u64,
+
+    /// Stop a case when it spins forever in a jump-to-self or wfi with interrupts disabled
+    #[arg(long)]
+    stop_on_idle: bool,
+
+    /// Exit code reported when a case is stopped on idle.
+    /// If not given, stopping on idle is a failure.
+    #[arg(long, requires = "stop_on_idle")]
+    idle_exit_code: Option<u32>,
+
+    /// Write a trace log for each case into this directory
+    #[arg(long)]
+    trace_dir: Option<PathBuf>,
+
+    /// Format of the trace logs in trace directory
+    #[arg(long, value_enum, default_value_t = TraceFormat::Json)]
+    trace_format: TraceFormat,
+
+    /// Control verbosity of pokedex output
+    #[arg(short, long, action = clap::ArgAction::Count)]
+    verbose: u8,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum CaseStatus {
+    Exit,
+    Idle,
+    Timeout,
+    Error,
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+pub struct CaseResult {
+    pub name: String,
+    pub elf: PathBuf,
+    pub status: CaseStatus,
+    pub exit_code: Option<u32>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub idle: Option<IdleKind>,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub stop_pc: Option<u32>,
+    pub insns: u64,
+    pub seconds: f64,
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub error: Option<String>,
+}
+
+#[derive(Debug, Serialize, Deserialize)]
+pub struct RunManySummary {
+    pub workers: usize,
+    pub seconds: f64,
+    pub passed: usize,
+    pub failed: usize,
+    pub cases: Vec<CaseResult>,
+}
+
+enum CaseStop {
+    Exit(u32),
+    Idle(IdleLoop),
+    Timeout,
+}
+
+// Far beyond the longest case of the test suites
+const DEFAULT_MAX_INSNS: u64 = 1_000_000_000;
+
+struct Case {
+    name: String,
+    elf: PathBuf,
+    // previous runtime, None if unknown
+    last_seconds: Option<f64>,
+}
+
+impl Case {
+    // File name of the trace log without extension, a name may be a path with directories
+    fn trace_stem(&self) -> String {
+        underscorify(self.name.strip_suffix(".elf").unwrap_or(&self.name))
+    }
+}
+
+// Same as meson's str.underscorify()
+fn underscorify(name: &str) -> String {
+    name.chars()
+        .map(|c| if c.is_ascii_alphanumeric() { c } else { '_' })
+        .collect()
+}
+
+fn read_case_list(args: &RunManyArgs) -> anyhow::Result<Vec<Case>> {
+    let content = std::fs::read_to_string(&args.case_list)
+        .with_context(|| format!("failed to read {:?}", args.case_list))?;
+    let list_dir = args.case_list.parent().unwrap_or(Path::new("."));
+
+    let mut cases = vec![];
+    // case name and trace stem to its line, they key timings and trace files thus must be unique
+    let mut names: HashMap<String, &str> = HashMap::new();
+    let mut stems: HashMap<String, &str> = HashMap::new();
+    for line in content.lines() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+
+        let case = match &args.case_dir {
+            Some(case_dir) => {
+                let name = underscorify(line.strip_suffix(".S").unwrap_or(line));
+                let elf = case_dir.join(format!("{name}.elf"));
+                Case {
+                    name,
+                    elf,
+                    last_seconds: None,
+                }
+            }
+            None => Case {
+                name: line.to_string(),
+                elf: list_dir.join(line),
+                last_seconds: None,
+            },
+        };
+        if let Some(other) = names.insert(case.name.clone(), line) {
+            anyhow::bail!(
+                "{:?}: cases {other:?} and {line:?} are both named {:?}",
+                args.case_list,
+                case.name
+            );
+        }
+        if let Some(other) = stems.insert(case.trace_stem(), line) {
+            anyhow::bail!(
+                "{:?}: cases {other:?} and {line:?} both write the trace {:?}",
+                args.case_list,
+                case.trace_stem()
+            );
+        }
+        cases.push(case);
+    }
+
+    Ok(cases)
+}
+
+// Longest-processing-time-first: cases with unknown runtime are considered the longest.
+fn schedule_cases(cases: &mut [Case], summary_path: &Path) {
+    if let Ok(raw) = std::fs::read_to_string(summary_path) {
+        match serde_json::from_str::<RunManySummary>(&raw) {
+            Ok(last) => {
+                let timings: HashMap<String, f64> = last
+                    .cases
+                    .into_iter()
+                    .map(|case| (case.name, case.seconds))
+                    .collect();
+                for case in cases.iter_mut() {
+                    case.last_seconds = timings.get(&case.name).copied();
+                }
+            }
+            Err(e) => warn!("ignore timings in {summary_path:?}: {e}"),
+        }
+    }
+
+    cases.sort_by(|a, b| {
+        let a = a.last_seconds.unwrap_or(f64::INFINITY);
+        let b = b.last_seconds.unwrap_or(f64::INFINITY);
+        b.total_cmp(&a)
+    });
+}
+
+pub fn run_many_subcommand(args: &RunManyArgs) -> anyhow::Result<ExitCode> {
+    super::setup_logging(args.verbose, false);
+
+    let mut cases = read_case_list(args)?;
+    schedule_cases(&mut cases, &args.output_path);
+
+    if let Some(trace_dir) = &args.trace_dir {
+        std::fs::create_dir_all(trace_dir)
+            .with_context(|| format!("failed to create {trace_dir:?}"))?;
+    }
+
+    let jobs = args
+        .jobs
+        .unwrap_or_else(|| std::thread::available_parallelism().map_or(1, |n| n.get()));
+    let workers = jobs.clamp(1, cases.len().max(1));
+
+    info!("running {} cases with {workers} workers", cases.len());
+
+    let loaders = crate::model::get_loaders(workers)?;
+
+    let start = Instant::now();
+
+    // Workers take the next case from the shared cursor when they become idle,
+    // combined with the longest-first order, this balances the load as work stealing does.
+    let cursor = AtomicUsize::new(0);
+    let results = Mutex::new(Vec::with_capacity(cases.len()));
+
+    std::thread::scope(|s| -> anyhow::Result<()> {
+        let mut handles = vec![];
+        for (worker_id, loader) in loaders.into_iter().enumerate() {
+            let (cursor, results, cases) = (&cursor, &results, &cases);
+            let handle = std::thread::Builder::new()
+                .name(format!("worker{worker_id}"))
+                .spawn_scoped(s, move || -> anyhow::Result<()> {
+                    run_worker(args, loader, cases, cursor, results)
+                })?;
+            handles.push(handle);
+        }
+
+        for handle in handles {
+            handle.join().expect("worker thread panicked")?;
+        }
+        Ok(())
+    })?;
+
+    let mut results = results.into_inner().unwrap();
+    results.sort_by(|a, b| a.name.cmp(&b.name));
+
+    let passed = results.iter().filter(|r| r.exit_code == Some(0)).count();
+    let summary = RunManySummary {
+        workers,
+        seconds: start.elapsed().as_secs_f64(),
+        passed,
+        failed: results.len() - passed,
+        cases: results,
+    };
+
+    let raw_json = serde_json::to_string_pretty(&summary)?;
+    std::fs::write(&args.output_path, raw_json)
+        .with_context(|| format!("fail to write json: {:?}", args.output_path))?;
+
+    info!(
+        "{} passed, {} failed in {:.3}s, summary store in {}",
+        summary.passed,
+        summary.failed,
+        summary.seconds,
+        args.output_path.display()
+    );
+
+    if summary.failed == 0 {
+        Ok(ExitCode::SUCCESS)
+    } else {
+        Ok(ExitCode::FAILURE)
+    }
+}
+
+fn run_worker(
+    args: &RunManyArgs,
+    loader: Loader,
+    cases: &[Case],
+    cursor: &AtomicUsize,
+    results: &Mutex<Vec<CaseResult>>,
+) -> anyhow::Result<()> {
+    // model instance and bus are created once and reused by every case of this worker
+    let bus = Bus::load_from_config(&args.config_path)?;
+    let mut sim = Simulator::new(loader, bus);
+
+    loop {
+        let index = cursor.fetch_add(1, Ordering::Relaxed);
+        let Some(case) = cases.get(index) else {
+            return Ok(());
+        };
+
+        sim.recycle();
+
+        let start = Instant::now();
+        let outcome = run_case(args, &mut sim, case);
+        let seconds = start.elapsed().as_secs_f64();
+        let insns = sim.stats().step_count;
+
+        let mut result = CaseResult {
+            name: case.name.clone(),
+            elf: case.elf.clone(),
+            status: CaseStatus::Error,
+            exit_code: None,
+            idle: None,
+            stop_pc: None,
+            insns,
+            seconds,
+            error: None,
+        };
+        match outcome {
+            Ok(CaseStop::Exit(code)) => {
+                result.status = CaseStatus::Exit;
+                result.exit_code = Some(code);
+            }
+            Ok(CaseStop::Idle(idle)) => {
+                result.status = CaseStatus::Idle;
+                result.exit_code = args.idle_exit_code;
+                result.idle = Some(idle.kind);
+                result.stop_pc = Some(idle.pc);
+            }
+            Ok(CaseStop::Timeout) => result.status = CaseStatus::Timeout,
+            Err(e) => result.error = Some(format!("{e:#}")),
+        }
+
+        if result.exit_code == Some(0) {
+            info!("case {} exit in {:.3}s", case.name, seconds);
+        } else {
+            error!("case {} failed: {:?}", case.name, result);
+        }
+
+        results.lock().unwrap().push(result);
+    }
+}
+
+fn run_case(args: &RunManyArgs, sim: &mut Simulator, case: &Case) -> anyhow::Result<CaseStop> {
+    let config_reset_vector = sim.global.bus.reset_vector();
+    let elf_entry = sim.global.bus.load_elf(&case.elf)?;
+    let reset_vector = config_reset_vector.unwrap_or(elf_entry);
+
+    let mut tracer_ = match &args.trace_dir {
+        // workers are already parallel, traces are written synchronously
+        Some(trace_dir) => match args.trace_format {
+            TraceFormat::Json => {
+                let path = trace_dir.join(format!("{}.jsonl", case.trace_stem()));
+                AppTracer::json_log(&path).with_context(|| format!("failed to open {path:?}"))?
+            }
+            TraceFormat::Binary => {
+                let path = trace_dir.join(format!("{}.bin", case.trace_stem()));
+                AppTracer::binary_log(&path).with_context(|| format!("failed to open {path:?}"))?
+            }
+        },
+        None => AppTracer::noop(),
+    };
+    let tracer = tracer_.as_tracer();
+    let tracing = args.trace_dir.is_some();
+
+    sim.reset_core(reset_vector);
+    tracer.trace_reset(reset_vector);
+
+    let max_insns = args.max_insns;
+    let stop = loop {
+        if let Some(code) = sim.is_exited() {
+            tracer.trace_exit(code);
+            break CaseStop::Exit(code);
+        }
+        if args.stop_on_idle
+            && let Some(idle) = sim.poll_idle()
+        {
+            if let Some(code) = args.idle_exit_code {
+                tracer.trace_exit(code);
+            }
+            break CaseStop::Idle(idle);
+        }
+        if sim.stats().step_count >= max_insns {
+            break CaseStop::Timeout;
+        }
+
+        if tracing {
+            let step_result = sim.step_trace();
+            tracer.trace_step(step_result);
+        } else {
+            sim.step();
+        }
+    };
+
+    tracer.flush();
+
+    Ok(stop)
+}
+
+#[cfg(test)]
+mod tests {
+    use clap::Parser as _;
+
+    use super::*;
+
+    // Read a case list of the content, written to the temporary directory
+    fn read_list(content: &str, extra: &[&str]) -> anyhow::Result<Vec<Case>> {
+        static LISTS: AtomicUsize = AtomicUsize::new(0);
+        let n = LISTS.fetch_add(1, Ordering::Relaxed);
+        let path =
+            std::env::temp_dir().join(format!("pokedex-case-list-{}-{n}.txt", std::process::id()));
+        std::fs::write(&path, content).unwrap();
+
+        let mut argv = vec![
+            "run-many",
+            path.to_str().unwrap(),
+            "-c",
+            "c.kdl",
+            "-o",
+            "o.json",
+        ];
+        argv.extend(extra);
+        let cases = read_case_list(&RunManyArgs::parse_from(argv));
+        std::fs::remove_file(&path).unwrap();
+        cases
+    }
+
+    #[test]
+    fn test_underscorify() {
+        assert_eq!(underscorify("vaadd.vv"), "vaadd_vv");
+        assert_eq!(underscorify("rv32ui-p-add"), "rv32ui_p_add");
+        assert_eq!(underscorify("abc123"), "abc123");
+    }
+
+    #[test]
+    fn test_read_case_list() {
+        let cases = read_list(
+            "# comment\n\nvaadd.vv\n  add.S  \n",
+            &["--case-dir", "/elfs"],
+        )
+        .unwrap();
+        let names: Vec<_> = cases.iter().map(|c| c.name.as_str()).collect();
+        assert_eq!(names, ["vaadd_vv", "add"]);
+        assert_eq!(cases[0].elf, Path::new("/elfs/vaadd_vv.elf"));
+        assert_eq!(cases[1].elf, Path::new("/elfs/add.elf"));
+
+        // relative to the list file
+        let cases = read_list("a.elf\nsub/b.elf\n", &[]).unwrap();
+        assert_eq!(cases[1].name, "sub/b.elf");
+        assert_eq!(cases[1].elf, std::env::temp_dir().join("sub/b.elf"));
+        // traces are written flat into the trace directory
+        assert_eq!(cases[1].trace_stem(), "sub_b");
+        assert_eq!(cases[0].trace_stem(), "a");
+    }
+
+    #[test]
+    fn test_read_case_list_collision() {
+        // both map to vadd_vv.elf and would overwrite each other's results
+        let e = read_list("vadd.vv\nvadd-vv\n", &["--case-dir", "/elfs"]).unwrap_err();
+        assert!(e.to_string().contains("both named \"vadd_vv\""), "{e}");
+
+        assert!(read_list("a.elf\na.elf\n", &[]).is_err());
+
+        // distinct paths flattened into one trace file
+        let e = read_list("sub/b.elf\nsub_b.elf\n", &[]).unwrap_err();
+        assert!(
+            e.to_string().contains("both write the trace \"sub_b\""),
+            "{e}"
+        );
+    }
+
+    #[test]
+    fn test_max_insns_default() {
+        let argv = ["run-many", "cases.txt", "-c", "c.kdl", "-o", "o.json"];
+        let args = RunManyArgs::parse_from(argv);
+        assert_eq!(args.max_insns, DEFAULT_MAX_INSNS);
+    }
+
+    #[test]
+    fn test_schedule_cases() {
+        let case = |name: &str| Case {
+            name: name.into(),
+            elf: PathBuf::new(),
+            last_seconds: None,
+        };
+        let result = |name: &str, seconds| CaseResult {
+            name: name.into(),
+            elf: PathBuf::new(),
+            status: CaseStatus::Exit,
+            exit_code: Some(0),
+            idle: None,
+            stop_pc: None,
+            insns: 0,
+            seconds,
+            error: None,
+        };
+        let summary = RunManySummary {
+            workers: 1,
+            seconds: 0.0,
+            passed: 2,
+            failed: 0,
+            cases: vec![result("short", 1.0), result("long", 5.0)],
+        };
+        let summary_path =
+            std::env::temp_dir().join(format!("pokedex-schedule-{}.json", std::process::id()));
+        std::fs::write(&summary_path, serde_json::to_string(&summary).unwrap()).unwrap();
+
+        // unknown cases first, then the longest
+        let mut cases = vec![case("short"), case("long"), case("new")];
+        schedule_cases(&mut cases, &summary_path);
+        let names: Vec<_> = cases.iter().map(|c| c.name.as_str()).collect();
+        assert_eq!(names, ["new", "long", "short"]);
+
+        // an unreadable summary keeps the list order
+        std::fs::write(&summary_path, "not json").unwrap();
+        let mut cases = vec![case("a"), case("b")];
+        schedule_cases(&mut cases, &summary_path);
+        assert_eq!(cases[0].name, "a");
+        std::fs::remove_file(&summary_path).unwrap();
+    }
+}
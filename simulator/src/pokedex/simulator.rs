@@ -5,24 +5,108 @@ pub struct Simulator {
     core: ModelHandle,
 
     pub(crate) global: Global,
+
+    idle_probe: IdleProbe,
+}
+
+/// The hart is known to make no further progress
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct IdleLoop {
+    pub kind: IdleKind,
+    pub pc: u32,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, serde::Serialize, serde::Deserialize)]
+#[serde(rename_all = "snake_case")]
+pub enum IdleKind {
+    // an instruction jumps to itself, e.g. "j ."
+    SelfLoop,
+    // wfi is executed, while no interrupt could wake the hart up
+    Wfi,
+}
+
+// Snapshot taken by the last poll_idle
+#[derive(Debug, Default)]
+struct IdleProbe {
+    pc: u32,
+    // whether the last step committed an instruction
+    committed: bool,
+}
+
+const WFI_ENCODING: u32 = 0x10500073;
+const CSR_MSTATUS: u16 = 0x300;
+const CSR_MIE: u16 = 0x304;
+const MSTATUS_MIE: u32 = 1 << 3;
+const MIE_MSIE: u32 = 1 << 3;
+const MIE_MTIE: u32 = 1 << 7;
+const MIE_MEIE: u32 = 1 << 11;
+
+impl IdleProbe {
+    // Record pc after a step, returns the idle loop the step spins in, if any.
+    // The loop is (kind, pc of the looping instruction).
+    fn probe(&mut self, pc: u32, last_fetch: u32) -> Option<(IdleKind, u32)> {
+        let last_pc = std::mem::replace(&mut self.pc, pc);
+
+        if !self.committed {
+            return None;
+        }
+
+        if pc == last_pc {
+            Some((IdleKind::SelfLoop, last_pc))
+        } else if pc == last_pc.wrapping_add(4) && last_fetch == WFI_ENCODING {
+            Some((IdleKind::Wfi, last_pc))
+        } else {
+            None
+        }
+    }
+}
+
+impl IdleKind {
+    // Whether an interrupt could still break the hart out of the loop
+    fn can_wake(self, mstatus: u32, mie: u32) -> bool {
+        let enabled = mie & (MIE_MSIE | MIE_MTIE | MIE_MEIE) != 0;
+        match self {
+            // left only by trapping into a handler
+            IdleKind::SelfLoop => mstatus & MSTATUS_MIE != 0 && enabled,
+            // wfi resumes on a pending enabled interrupt, regardless of mstatus.MIE
+            IdleKind::Wfi => enabled,
+        }
+    }
 }
 
 impl Simulator {
     pub fn new(model_loader: Loader, bus: Bus) -> Self {
+        Self::with_hartid(model_loader, bus, 0)
+    }
+
+    pub fn with_hartid(model_loader: Loader, bus: Bus, hartid: u32) -> Self {
         let global = Global {
             bus,
+            last_fetch: 0,
+            write_log: None,
 
             stats: Statistic::new(),
         };
 
-        let core = ModelHandle::new(model_loader);
+        let core = ModelHandle::with_hartid(model_loader, hartid);
 
-        Simulator { core, global }
+        Simulator {
+            core,
+            global,
+            idle_probe: IdleProbe::default(),
+        }
     }
 
     pub fn stats(&self) -> &Statistic {
         &self.global.stats
     }
+
+    // Prepare to run another program: clear memory, devices and statistics.
+    // The core should be reset after the new program is loaded.
+    pub fn recycle(&mut self) {
+        self.global.bus.reset();
+        self.global.stats = Statistic::new();
+    }
 }
 
 impl Simulator {
@@ -30,6 +114,11 @@ impl Simulator {
         // may uncomment to debug issue inside model reset
         // debug!("reset core with pc={pc:#010x}");
 
+        self.global.bus.reservation().clear();
+        self.idle_probe = IdleProbe {
+            pc,
+            committed: false,
+        };
         self.core.reset(pc);
     }
 
@@ -37,14 +126,45 @@ impl Simulator {
         // pre-step book keeping
         self.global.stats.step_count += 1;
 
-        self.core.step(&mut self.global)
+        let code = self.core.step(&mut self.global);
+        Self::after_step(&mut self.idle_probe, &self.global, code);
+        code
     }
 
     pub fn step_trace(&mut self) -> StepDetail<'_> {
         // pre-step book keeping
         self.global.stats.step_count += 1;
 
-        self.core.step_trace(&mut self.global)
+        let detail = self.core.step_trace(&mut self.global);
+        Self::after_step(&mut self.idle_probe, &self.global, detail.code);
+        detail
+    }
+
+    // the detail of step_trace borrows the core, thus only the other fields are taken
+    fn after_step(idle_probe: &mut IdleProbe, global: &Global, code: StepCode) {
+        idle_probe.committed = matches!(code, StepCode::Committed);
+        // a trap breaks the LR/SC reservation, as in Spike
+        if !idle_probe.committed {
+            global.bus.reservation().clear();
+        }
+    }
+
+    // Check whether the last step leaves the hart spinning forever.
+    // It should be called between every two steps, since it compares pc with the previous call.
+    //
+    // Only the last committed instruction is inspected:
+    // a jump to itself, or a wfi, when no interrupt could break out.
+    pub fn poll_idle(&mut self) -> Option<IdleLoop> {
+        let pc = self.core.read_pc();
+        let (kind, pc) = self.idle_probe.probe(pc, self.global.last_fetch)?;
+
+        let mstatus = self.core.read_csr(CSR_MSTATUS);
+        let mie = self.core.read_csr(CSR_MIE);
+        if kind.can_wake(mstatus, mie) {
+            return None;
+        }
+
+        Some(IdleLoop { kind, pc })
     }
 
     pub fn is_exited(&self) -> Option<u32> {
@@ -54,13 +174,56 @@ impl Simulator {
     pub fn core(&self) -> &ModelHandle {
         &self.core
     }
+
+    /// Start recording memory writes, which are kept until clear_mem_writes
+    pub fn record_mem_writes(&mut self) {
+        self.global.write_log.get_or_insert_with(Vec::new);
+    }
+
+    /// None if memory writes are not recorded
+    pub fn mem_writes(&self) -> Option<&[MemWrite]> {
+        self.global.write_log.as_deref()
+    }
+
+    pub fn clear_mem_writes(&mut self) {
+        if let Some(log) = &mut self.global.write_log {
+            log.clear();
+        }
+    }
+}
+
+/// A memory write of the model, AMOs are recorded with the value they store
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct MemWrite {
+    pub addr: u32,
+    pub len: u8,
+    pub value: u32,
 }
 
 pub struct Global {
     pub(crate) bus: Bus,
+    // last two fetched halfwords, the upper one is the latest
+    pub(crate) last_fetch: u32,
+    // recorded only when comparing models in lockstep
+    pub(crate) write_log: Option<Vec<MemWrite>>,
     pub(crate) stats: Statistic,
 }
 
+impl Global {
+    fn log_write(&mut self, addr: u32, len: u8, value: u32) {
+        if let Some(log) = &mut self.write_log {
+            log.push(MemWrite { addr, len, value });
+        }
+    }
+
+    // Every store of the core, other harts lose their reservations on the written bytes
+    fn store(&mut self, addr: u32, len: usize, value: u32) -> BusResult<()> {
+        self.log_write(addr, len as u8, value);
+        self.bus.reservation().invalidate_others(addr, len);
+        self.bus.write(addr, &value.to_le_bytes()[..len])
+    }
+}
+
 impl PokedexCallbackMem for Global {
     type CbMemError = BusError;
 
@@ -70,9 +233,12 @@ impl PokedexCallbackMem for Global {
         self.stats.fetch_count += 1;
 
         let mut data = [0; 2];
-        self.bus
-            .read(addr, &mut data)
-            .map(|_| u16::from_le_bytes(data))
+        self.bus.read(addr, &mut data)?;
+        let value = u16::from_le_bytes(data);
+
+        self.last_fetch = (self.last_fetch >> 16) | ((value as u32) << 16);
+
+        Ok(value)
     }
 
     fn read_mem_u8(&mut self, addr: u32) -> BusResult<u8> {
@@ -101,29 +267,62 @@ impl PokedexCallbackMem for Global {
     }
 
     fn write_mem_u8(&mut self, addr: u32, value: u8) -> BusResult<()> {
-        self.bus.write(addr, &value.to_le_bytes())
+        self.store(addr, 1, value as u32)
     }
 
     fn write_mem_u16(&mut self, addr: u32, value: u16) -> BusResult<()> {
-        self.bus.write(addr, &value.to_le_bytes())
+        self.store(addr, 2, value as u32)
     }
 
     fn write_mem_u32(&mut self, addr: u32, value: u32) -> BusResult<()> {
-        self.bus.write(addr, &value.to_le_bytes())
+        self.store(addr, 4, value)
     }
 
     fn amo_mem_u32(&mut self, addr: u32, op: AtomicOp, value: u32) -> BusResult<u32> {
-        // TODO: currently we simulate AMO using read-modify-write.
-        // Consider forward it directly to bus later
+        assert!(addr % 4 == 0);
 
-        let mut read_bytes = [0; 4];
-        self.bus.read(addr, &mut read_bytes)?;
-        let read_value = u32::from_le_bytes(read_bytes);
+        self.bus.reservation().invalidate_others(addr, 4);
+        let old_value = self.bus.atomic(addr, op, value)?;
+        // the stored result, a wrong operation of the model must show up in the log
+        self.log_write(addr, 4, op.do_arith_u32(old_value, value));
+        Ok(old_value)
+    }
 
-        let write_value: u32 = op.do_arith_u32(read_value, value);
-        self.bus.write(addr, &write_value.to_le_bytes())?;
+    fn lr_mem_u32(&mut self, addr: u32) -> BusResult<u32> {
+        assert!(addr % 4 == 0);
 
-        Ok(read_value)
+        let mut data = [0; 4];
+        self.bus.read(addr, &mut data)?;
+        let value = u32::from_le_bytes(data);
+
+        self.bus.reservation().reserve(addr);
+
+        Ok(value)
+    }
+
+    fn sc_mem_u32(&mut self, addr: u32, value: u32) -> BusResult<bool> {
+        assert!(addr % 4 == 0);
+
+        // read before the reservation is taken, a store of another hart in between
+        // has broken it already, see ReservationSet
+        let mut data = [0; 4];
+        self.bus.read(addr, &mut data)?;
+        let expected = u32::from_le_bytes(data);
+
+        if !self.bus.reservation().take(addr) {
+            return Ok(false);
+        }
+
+        self.bus.reservation().invalidate_others(addr, 4);
+        let old_value = self
+            .bus
+            .atomic(addr, AtomicOp::CompareSwap { expected }, value)?;
+
+        let success = old_value == expected;
+        if success {
+            self.log_write(addr, 4, value);
+        }
+        Ok(success)
     }
 }
 
@@ -138,3 +337,74 @@ impl Statistic {
         Self::default()
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const ADDI: u32 = 0x00100093;
+
+    fn probe_step(probe: &mut IdleProbe, pc: u32, last_fetch: u32) -> Option<(IdleKind, u32)> {
+        probe.committed = true;
+        probe.probe(pc, last_fetch)
+    }
+
+    #[test]
+    fn test_probe_idle() {
+        let mut probe = IdleProbe {
+            pc: 0x1000,
+            committed: false,
+        };
+
+        // a step which did not commit never spins
+        assert_eq!(probe.probe(0x1000, ADDI), None);
+
+        assert_eq!(probe_step(&mut probe, 0x1004, ADDI), None);
+        assert_eq!(
+            probe_step(&mut probe, 0x1004, ADDI),
+            Some((IdleKind::SelfLoop, 0x1004))
+        );
+        assert_eq!(
+            probe_step(&mut probe, 0x1008, WFI_ENCODING),
+            Some((IdleKind::Wfi, 0x1004))
+        );
+        // a wfi trapping into a handler
+        assert_eq!(probe_step(&mut probe, 0x2000, WFI_ENCODING), None);
+    }
+
+    #[test]
+    fn test_idle_can_wake() {
+        for mie in [MIE_MSIE, MIE_MTIE, MIE_MEIE] {
+            assert!(IdleKind::Wfi.can_wake(0, mie));
+            assert!(IdleKind::Wfi.can_wake(MSTATUS_MIE, mie));
+            assert!(!IdleKind::SelfLoop.can_wake(0, mie));
+            assert!(IdleKind::SelfLoop.can_wake(MSTATUS_MIE, mie));
+        }
+
+        for kind in [IdleKind::Wfi, IdleKind::SelfLoop] {
+            assert!(!kind.can_wake(MSTATUS_MIE, 0));
+            // other bits of mie, e.g. supervisor interrupts, never reach M-mode only harts
+            assert!(!kind.can_wake(MSTATUS_MIE, 1 << 5));
+        }
+    }
+
+    #[test]
+    fn test_amo_logs_stored_value() {
+        let mut global = Global {
+            bus: Bus::load_from_default_config(),
+            last_fetch: 0,
+            write_log: Some(vec![]),
+            stats: Statistic::new(),
+        };
+        let addr = 0x8000_0000;
+        global.write_mem_u32(addr, 5).unwrap();
+
+        assert_eq!(global.amo_mem_u32(addr, AtomicOp::Add, 3).unwrap(), 5);
+        assert_eq!(global.amo_mem_u32(addr, AtomicOp::Max, 2).unwrap(), 8);
+        assert_eq!(global.amo_mem_u32(addr, AtomicOp::Xor, 1).unwrap(), 8);
+
+        let stored: Vec<u32> = global.write_log.unwrap().iter().map(|w| w.value).collect();
+        assert_eq!(stored, [5, 8, 8, 9]);
+        assert_eq!(global.read_mem_u32(addr).unwrap(), 9);
+    }
+}
@@ -0,0 +1,502 @@
+use std::{
+    io::{BufWriter, Write},
+    sync::mpsc::{Receiver, Sender, SyncSender},
+    thread::JoinHandle,
+    time::{Duration, Instant},
+};
+
+use anyhow::Context as _;
+use tracing::{error, info};
+
+use crate::{
+    common::{CommitLogRef, CommitWrites, PokedexLogRef},
+    disasm::Disassembler,
+    model::StepDetail,
+    pokedex::{TraceFormat, Tracer},
+};
+
+use super::{
+    HEADER_SIZE, TraceOptions,
+    block::BlockWriter,
+    hash::HashWriter,
+    index::IndexWriter,
+    reader::{Record, TraceDecoder},
+    stream::TraceSink,
+    writer::{TraceEncoder, file_header},
+};
+
+// A chunk is handed to the writer thread once it grows beyond this size
+pub(super) const CHUNK_SIZE: usize = 1 << 20;
+
+// One buffer is filled by the simulation, the others are queued or being written
+const BUFFER_COUNT: usize = 3;
+
+struct Chunk {
+    data: Vec<u8>,
+    // the writer should flush the file after this chunk
+    flush: bool,
+}
+
+/// Trace records are captured on the simulation thread in the binary encoding,
+/// which only copies raw values out of the model.
+/// Chunks of records are swapped to a writer thread, which does formatting and file I/O.
+///
+/// The number of buffers is fixed, the simulation blocks when all of them are in flight,
+/// and the blocked time is reported on flush, apart from the time flush waits for the writer.
+pub struct AsyncTracer {
+    encoder: TraceEncoder,
+    current: Vec<u8>,
+
+    // empty buffers returned by the writer and not reused yet
+    spare: Vec<Vec<u8>>,
+
+    chunk_tx: Option<SyncSender<Chunk>>,
+    empty_rx: Receiver<Vec<u8>>,
+
+    writer: Option<JoinHandle<anyhow::Result<()>>>,
+
+    // blocked on backpressure while running
+    stalled: Duration,
+    // waiting for the writer to drain in flush, after the run
+    drained: Duration,
+}
+
+impl AsyncTracer {
+    pub fn open(sink: &TraceSink, options: TraceOptions) -> Result<Self, std::io::Error> {
+        let output = match sink.open(options.stream_window)? {
+            output if options.compress => {
+                Output::Compressed(BlockWriter::new(output, compress_workers())?)
+            }
+            output => Output::Plain(BufWriter::new(output)),
+        };
+        let header = file_header(options.vrf_delta);
+        // a stream could not be seeked, thus has no index
+        let index = match (options.index_interval, sink.file_path()) {
+            (0, _) | (_, None) => None,
+            (interval, Some(path)) => Some(IndexWriter::create(path, interval)?),
+        };
+        // nor hashes, which are used together with the index
+        let hashes = match (options.hash_interval, sink.file_path()) {
+            (0, _) | (_, None) => None,
+            (interval, Some(path)) => Some(HashWriter::create(path, interval)?),
+        };
+        let format = options.format;
+        let disassembler = options.disasm.then(Disassembler::global);
+
+        let (chunk_tx, chunk_rx) = std::sync::mpsc::sync_channel(BUFFER_COUNT);
+        let (empty_tx, empty_rx) = std::sync::mpsc::channel();
+
+        let writer = std::thread::Builder::new()
+            .name("trace-writer".into())
+            .spawn(move || {
+                writer_loop(
+                    output,
+                    header,
+                    format,
+                    disassembler,
+                    index,
+                    hashes,
+                    chunk_rx,
+                    empty_tx,
+                )
+            })?;
+
+        Ok(Self {
+            encoder: TraceEncoder::new(options.vrf_delta),
+            current: Vec::with_capacity(CHUNK_SIZE * 2),
+            spare: (1..BUFFER_COUNT)
+                .map(|_| Vec::with_capacity(CHUNK_SIZE * 2))
+                .collect(),
+            chunk_tx: Some(chunk_tx),
+            empty_rx,
+            writer: Some(writer),
+            stalled: Duration::ZERO,
+            drained: Duration::ZERO,
+        })
+    }
+
+    fn recv_empty(&mut self) -> Vec<u8> {
+        match self.empty_rx.recv() {
+            Ok(buffer) => buffer,
+            Err(_) => self.writer_failed(),
+        }
+    }
+
+    fn send_current(&mut self, flush: bool) {
+        let empty = match self.spare.pop() {
+            Some(buffer) => buffer,
+            None => {
+                // backpressure: every buffer is in flight
+                let start = Instant::now();
+                let buffer = self.recv_empty();
+                self.stalled += start.elapsed();
+                buffer
+            }
+        };
+        let data = std::mem::replace(&mut self.current, empty);
+
+        let chunk_tx = self.chunk_tx.as_ref().unwrap();
+        if chunk_tx.send(Chunk { data, flush }).is_err() {
+            self.writer_failed();
+        }
+    }
+
+    // The writer thread exits early only on error, propagate it as a panic like other tracers
+    fn writer_failed(&mut self) -> ! {
+        self.chunk_tx = None;
+        let result = self.writer.take().unwrap().join();
+        match result {
+            Ok(Err(e)) => panic!("trace writer failed: {e:#}"),
+            _ => panic!("trace writer thread exited unexpectedly"),
+        }
+    }
+
+    fn after_record(&mut self) {
+        if self.current.len() >= CHUNK_SIZE {
+            self.send_current(false);
+        }
+    }
+}
+
+impl Tracer for AsyncTracer {
+    fn trace_reset(&mut self, pc: u32) {
+        self.encoder.encode_reset(&mut self.current, pc);
+        self.after_record();
+    }
+
+    fn trace_exit(&mut self, exit_code: u32) {
+        self.encoder.encode_exit(&mut self.current, exit_code);
+        self.after_record();
+    }
+
+    fn trace_step(&mut self, detail: StepDetail) {
+        self.encoder.encode_step(&mut self.current, detail);
+        self.after_record();
+    }
+
+    fn trace_skip(&mut self) {
+        self.encoder.skip();
+    }
+
+    fn flush(&mut self) {
+        self.send_current(true);
+
+        // all buffers come back once the writer has written and flushed them
+        let start = Instant::now();
+        while self.spare.len() < BUFFER_COUNT - 1 {
+            let buffer = self.recv_empty();
+            self.spare.push(buffer);
+        }
+        self.drained += start.elapsed();
+
+        info!(
+            "trace writer stalled simulation for {:.3}s, drained in {:.3}s on flush",
+            self.stalled.as_secs_f64(),
+            self.drained.as_secs_f64()
+        );
+    }
+}
+
+impl Drop for AsyncTracer {
+    fn drop(&mut self) {
+        if !self.current.is_empty() && self.chunk_tx.is_some() {
+            self.send_current(true);
+        }
+
+        // closing the channel stops the writer
+        self.chunk_tx = None;
+        if let Some(writer) = self.writer.take() {
+            match writer.join() {
+                Ok(Ok(())) => {}
+                Ok(Err(e)) => error!("trace writer failed: {e:#}"),
+                Err(_) => error!("trace writer thread panicked"),
+            }
+        }
+    }
+}
+
+// Compression keeps up with the writer thread with a few workers
+fn compress_workers() -> usize {
+    std::thread::available_parallelism().map_or(1, |n| n.get().min(4))
+}
+
+// The trace output, compressed in blocks or not
+enum Output {
+    Plain(BufWriter<Box<dyn Write + Send>>),
+    Compressed(BlockWriter<Box<dyn Write + Send>>),
+}
+
+impl Output {
+    // Following bytes start a new block, thus an index keyframe points to a block start
+    fn end_block(&mut self) -> std::io::Result<()> {
+        match self {
+            Self::Plain(_) => Ok(()),
+            Self::Compressed(writer) => writer.end_block(),
+        }
+    }
+
+    fn finish(&mut self) -> std::io::Result<()> {
+        match self {
+            Self::Plain(writer) => writer.flush(),
+            Self::Compressed(writer) => writer.finish(),
+        }
+    }
+}
+
+impl Write for Output {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        match self {
+            Self::Plain(writer) => writer.write(buf),
+            Self::Compressed(writer) => writer.write(buf),
+        }
+    }
+
+    fn write_all(&mut self, buf: &[u8]) -> std::io::Result<()> {
+        match self {
+            Self::Plain(writer) => writer.write_all(buf),
+            Self::Compressed(writer) => writer.write_all(buf),
+        }
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        match self {
+            Self::Plain(writer) => writer.flush(),
+            Self::Compressed(writer) => writer.flush(),
+        }
+    }
+}
+
+fn writer_loop(
+    mut writer: Output,
+    header: [u8; HEADER_SIZE],
+    format: TraceFormat,
+    disassembler: Option<&Disassembler>,
+    mut index: Option<IndexWriter>,
+    mut hashes: Option<HashWriter>,
+    chunk_rx: Receiver<Chunk>,
+    empty_tx: Sender<Vec<u8>>,
+) -> anyhow::Result<()> {
+    let mut decoder = TraceDecoder::from_header(&header)?;
+    let mut writes = CommitWrites::default();
+    // the JSON line of a record, its length is needed by the index
+    let mut line = Vec::with_capacity(4096);
+    let mut asm = Vec::with_capacity(64);
+    // offset of the next record in the uncompressed output
+    let mut offset = 0;
+    if format == TraceFormat::Binary {
+        writer.write_all(&header)?;
+        offset = header.len() as u64;
+    }
+
+    for Chunk { mut data, flush } in chunk_rx {
+        match format {
+            TraceFormat::Binary if index.is_none() && hashes.is_none() => {
+                writer.write_all(&data)?
+            }
+            // binary records are only decoded for the index and hashes
+            TraceFormat::Binary => {
+                let mut records = data.as_slice();
+                // bytes of data before this are written
+                let mut written = 0;
+                loop {
+                    if let Some(index) = &mut index
+                        && index.before_record(offset)?
+                    {
+                        let start = data.len() - records.len();
+                        writer.write_all(&data[written..start])?;
+                        writer.end_block()?;
+                        written = start;
+                    }
+                    let remaining = records.len();
+                    let Some(record) = decoder.decode_record(&mut records, &mut writes)? else {
+                        break;
+                    };
+                    offset += (remaining - records.len()) as u64;
+                    if let Some(index) = &mut index {
+                        index.apply_record(record, &writes);
+                    }
+                    if let Some(hashes) = &mut hashes {
+                        hashes.apply_record(record, &writes)?;
+                    }
+                }
+                writer.write_all(&data[written..])?;
+            }
+            TraceFormat::Json => {
+                let mut records = data.as_slice();
+                while let Some(record) = decoder.decode_record(&mut records, &mut writes)? {
+                    if let Some(index) = &mut index {
+                        if index.before_record(offset)? {
+                            writer.end_block()?;
+                        }
+                        index.apply_record(record, &writes);
+                    }
+                    if let Some(hashes) = &mut hashes {
+                        hashes.apply_record(record, &writes)?;
+                    }
+                    let log = match record {
+                        Record::Reset { pc } => PokedexLogRef::Reset { pc },
+                        Record::Exit { code } => PokedexLogRef::Exit { code },
+                        Record::Commit {
+                            pc,
+                            is_compressed,
+                            instruction,
+                        } => {
+                            let disasm = match disassembler {
+                                Some(d) => {
+                                    asm.clear();
+                                    d.disasm(pc, instruction, &mut asm);
+                                    Some(std::str::from_utf8(&asm).expect("disassembly is ascii"))
+                                }
+                                None => None,
+                            };
+                            PokedexLogRef::Commit(CommitLogRef {
+                                pc,
+                                is_compressed,
+                                instruction,
+                                states_changed: &writes,
+                                disasm,
+                            })
+                        }
+                    };
+                    line.clear();
+                    serde_json::to_writer(&mut line, &log).context("json log serialize")?;
+                    line.push(b'\n');
+                    writer.write_all(&line)?;
+                    offset += line.len() as u64;
+                }
+            }
+        }
+        if flush {
+            writer.flush()?;
+            if let Some(index) = &mut index {
+                index.flush()?;
+            }
+            if let Some(hashes) = &mut hashes {
+                hashes.flush()?;
+            }
+        }
+
+        data.clear();
+        // the tracer may have been dropped, the buffer is useless then
+        let _ = empty_tx.send(data);
+    }
+
+    writer.finish()?;
+    if let Some(index) = &mut index {
+        index.finish(offset)?;
+    }
+    if let Some(hashes) = &mut hashes {
+        hashes.finish()?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{
+        model::stub::{StubModel, StubStep},
+        trace::{TraceReader, VLEN_BYTE},
+        util::alloc_counter::allocations,
+    };
+
+    #[test]
+    fn test_capture_no_alloc() {
+        let path = std::env::temp_dir().join(format!("pokedex-alloc-test-{}", std::process::id()));
+        let mut tracer = AsyncTracer::open(
+            &TraceSink::Path(path.clone()),
+            TraceOptions {
+                format: TraceFormat::Binary,
+                vrf_delta: false,
+                index_interval: 0,
+                hash_interval: 0,
+                stream_window: 0,
+                compress: false,
+                disasm: false,
+            },
+        )
+        .unwrap();
+
+        let mut model = StubModel::new();
+        let v2 = [0x5a; VLEN_BYTE];
+        // 55 bytes a record
+        let step = StubStep {
+            xrf: &[(1, 1)],
+            vrf: &[(2, &v2)],
+            csrs: &[(0x300, 0x1800)],
+            ..StubStep::commit(0x8000_0000, 0x0000_0013)
+        };
+
+        // the first blocking wait on a channel may allocate its waker
+        tracer.trace_reset(0x8000_0000);
+        for _ in 0..1000 {
+            tracer.trace_step(model.step(&step));
+        }
+        tracer.flush();
+
+        // enough to swap buffers with the writer several times
+        let before = allocations();
+        for _ in 0..3 * CHUNK_SIZE / 55 + 1 {
+            tracer.trace_step(model.step(&step));
+        }
+        assert_eq!(allocations(), before, "trace capture should not allocate");
+        drop(tracer);
+        std::fs::remove_file(path).unwrap();
+    }
+
+    #[test]
+    fn test_round_trip() {
+        let dir = std::env::temp_dir();
+        let bin_path = dir.join(format!("pokedex-trace-test-{}.bin", std::process::id()));
+        let json_path = dir.join(format!("pokedex-trace-test-{}.jsonl", std::process::id()));
+
+        for (path, format) in [
+            (&bin_path, TraceFormat::Binary),
+            (&json_path, TraceFormat::Json),
+        ] {
+            let mut tracer = AsyncTracer::open(
+                &TraceSink::Path(path.clone()),
+                TraceOptions {
+                    format,
+                    vrf_delta: false,
+                    index_interval: 0,
+                    hash_interval: 0,
+                    stream_window: 0,
+                    compress: false,
+                    disasm: false,
+                },
+            )
+            .unwrap();
+            let mut model = StubModel::new();
+            tracer.trace_reset(0x8000_0000);
+            tracer.trace_step(model.step(&StubStep {
+                xrf: &[(1, 1)],
+                ..StubStep::commit(0x8000_0000, 0x0010_0093)
+            }));
+            tracer.trace_exit(3);
+            tracer.flush();
+        }
+
+        let mut reader = TraceReader::new(std::fs::File::open(&bin_path).unwrap()).unwrap();
+        let mut from_binary = String::new();
+        while let Some(log) = reader.next_log().unwrap() {
+            from_binary += &serde_json::to_string(&log).unwrap();
+            from_binary += "\n";
+        }
+        let from_json = std::fs::read_to_string(&json_path).unwrap();
+
+        assert_eq!(from_binary, from_json);
+        assert_eq!(
+            from_json,
+            concat!(
+                "{\"reset\":{\"pc\":2147483648}}\n",
+                "{\"commit\":{\"pc\":2147483648,\"is_compressed\":false,\"instruction\":1048723,",
+                "\"states_changed\":[{\"dest\":\"xrf\",\"rd\":1,\"value\":1}]}}\n",
+                "{\"exit\":{\"code\":3}}\n",
+            )
+        );
+
+        std::fs::remove_file(bin_path).unwrap();
+        std::fs::remove_file(json_path).unwrap();
+    }
+}
@@ -0,0 +1,589 @@
+//! Block compressed trace
+//!
+//! Wraps a binary or JSON lines trace, all integers are little endian.
+//!
+//! File header (16 bytes):
+//!
+//! | offset | size | field                          |
+//! |--------|------|--------------------------------|
+//! | 0      | 8    | magic `b"PDXBLOCK"`            |
+//! | 8      | 2    | format version                 |
+//! | 10     | 2    | codec, 2 for zstd frames       |
+//! | 12     | 4    | max uncompressed block size    |
+//!
+//! Followed by blocks, each of uncompressed length (u32), stored length (u32)
+//! and the stored bytes. If bit 31 of the stored length is set,
+//! the block is stored uncompressed, otherwise it is a single zstd frame.
+//! A block of zero uncompressed length ends the file.
+//!
+//! Blocks are compressed independently, thus in parallel.
+//! Offsets in the sidecar index are of the uncompressed trace,
+//! and the writer starts a new block at each keyframe.
+
+use std::{
+    collections::VecDeque,
+    ffi::{CStr, c_char, c_int, c_uint, c_void},
+    io::{ErrorKind, Read, Seek, SeekFrom, Write},
+    sync::{
+        Arc, Mutex,
+        mpsc::{Receiver, Sender, SyncSender},
+    },
+    thread::JoinHandle,
+};
+
+use super::HEADER_SIZE;
+
+pub const BLOCK_MAGIC: [u8; 8] = *b"PDXBLOCK";
+const BLOCK_VERSION: u16 = 1;
+// codec 1 was an LZ4 block format, no longer read
+const CODEC_ZSTD: u16 = 2;
+
+// A block is compressed once it grows beyond this size
+const BLOCK_SIZE: usize = 1 << 20;
+
+const STORED_FLAG: u32 = 1 << 31;
+
+struct Job {
+    data: Vec<u8>,
+    result_tx: SyncSender<Compressed>,
+}
+
+struct Compressed {
+    // returned for reuse
+    data: Vec<u8>,
+    len: usize,
+    // None if compression does not help
+    compressed: Option<Vec<u8>>,
+}
+
+/// Compress blocks on worker threads, blocks are written in order
+pub struct BlockWriter<W: Write> {
+    output: W,
+    block: Vec<u8>,
+    spare: Vec<Vec<u8>>,
+
+    // results of blocks being compressed, in file order
+    pending: VecDeque<Receiver<Compressed>>,
+    max_pending: usize,
+
+    job_tx: Option<Sender<Job>>,
+    workers: Vec<JoinHandle<()>>,
+}
+
+impl<W: Write> BlockWriter<W> {
+    pub fn new(mut output: W, workers: usize) -> std::io::Result<Self> {
+        assert!(workers > 0);
+
+        let mut header = [0u8; HEADER_SIZE];
+        header[0..8].copy_from_slice(&BLOCK_MAGIC);
+        header[8..10].copy_from_slice(&BLOCK_VERSION.to_le_bytes());
+        header[10..12].copy_from_slice(&CODEC_ZSTD.to_le_bytes());
+        header[12..16].copy_from_slice(&(BLOCK_SIZE as u32).to_le_bytes());
+        output.write_all(&header)?;
+
+        let (job_tx, job_rx) = std::sync::mpsc::channel::<Job>();
+        let job_rx = Arc::new(Mutex::new(job_rx));
+        let max_pending = 2 * workers;
+        let workers = (0..workers)
+            .map(|i| {
+                let job_rx = job_rx.clone();
+                std::thread::Builder::new()
+                    .name(format!("trace-compress{i}"))
+                    .spawn(move || compress_loop(&job_rx))
+            })
+            .collect::<Result<_, _>>()?;
+
+        Ok(Self {
+            output,
+            block: Vec::with_capacity(BLOCK_SIZE),
+            spare: vec![],
+            pending: VecDeque::new(),
+            max_pending,
+            job_tx: Some(job_tx),
+            workers,
+        })
+    }
+
+    /// Start a new block, the next byte is at the start of a block
+    pub fn end_block(&mut self) -> std::io::Result<()> {
+        if self.block.is_empty() {
+            return Ok(());
+        }
+        while self.pending.len() >= self.max_pending {
+            self.write_oldest()?;
+        }
+
+        let empty = self
+            .spare
+            .pop()
+            .unwrap_or_else(|| Vec::with_capacity(BLOCK_SIZE));
+        let data = std::mem::replace(&mut self.block, empty);
+        let (result_tx, result_rx) = std::sync::mpsc::sync_channel(1);
+        self.job_tx
+            .as_ref()
+            .unwrap()
+            .send(Job { data, result_tx })
+            .map_err(|_| std::io::Error::other("trace compress worker exited"))?;
+        self.pending.push_back(result_rx);
+        Ok(())
+    }
+
+    fn write_oldest(&mut self) -> std::io::Result<()> {
+        let result_rx = self.pending.pop_front().unwrap();
+        let Compressed {
+            mut data,
+            len,
+            compressed,
+        } = result_rx
+            .recv()
+            .map_err(|_| std::io::Error::other("trace compress worker panicked"))?;
+
+        self.output.write_all(&(len as u32).to_le_bytes())?;
+        match &compressed {
+            Some(compressed) => {
+                self.output
+                    .write_all(&(compressed.len() as u32).to_le_bytes())?;
+                self.output.write_all(compressed)?;
+            }
+            None => {
+                self.output
+                    .write_all(&(len as u32 | STORED_FLAG).to_le_bytes())?;
+                self.output.write_all(&data)?;
+            }
+        }
+
+        data.clear();
+        self.spare.push(data);
+        Ok(())
+    }
+
+    /// Write all blocks and the end of file, no more data could be written
+    pub fn finish(&mut self) -> std::io::Result<()> {
+        if self.job_tx.is_none() {
+            return Ok(());
+        }
+        self.flush()?;
+        // closing the channel stops workers
+        self.job_tx = None;
+        self.output.write_all(&[0; 8])?;
+        self.output.flush()
+    }
+}
+
+impl<W: Write> Write for BlockWriter<W> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        let len = buf.len().min(BLOCK_SIZE - self.block.len());
+        self.block.extend_from_slice(&buf[..len]);
+        if self.block.len() == BLOCK_SIZE {
+            self.end_block()?;
+        }
+        Ok(len)
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        self.end_block()?;
+        while !self.pending.is_empty() {
+            self.write_oldest()?;
+        }
+        self.output.flush()
+    }
+}
+
+impl<W: Write> Drop for BlockWriter<W> {
+    fn drop(&mut self) {
+        let _ = self.finish();
+        self.job_tx = None;
+        for worker in self.workers.drain(..) {
+            let _ = worker.join();
+        }
+    }
+}
+
+fn compress_loop(job_rx: &Mutex<Receiver<Job>>) {
+    let mut compressor = Compressor::new();
+    loop {
+        let job = job_rx.lock().unwrap().recv();
+        let Ok(Job { data, result_tx }) = job else {
+            break;
+        };
+
+        let mut compressed = vec![];
+        let compressed = compressor
+            .compress(&data, &mut compressed)
+            .then_some(compressed);
+
+        let len = data.len();
+        let _ = result_tx.send(Compressed {
+            data,
+            len,
+            compressed,
+        });
+    }
+}
+
+/// Read the uncompressed trace
+pub struct BlockReader<R: Read> {
+    inner: R,
+    decompressor: Decompressor,
+    stored: Vec<u8>,
+    block: Vec<u8>,
+    // read position in block
+    pos: usize,
+    // uncompressed offset of the start of block
+    block_start: u64,
+    finished: bool,
+}
+
+impl<R: Read> BlockReader<R> {
+    /// The magic should have been consumed
+    pub fn after_magic(mut inner: R) -> std::io::Result<Self> {
+        let mut header = [0u8; HEADER_SIZE - 8];
+        inner.read_exact(&mut header)?;
+        let version = u16::from_le_bytes([header[0], header[1]]);
+        let codec = u16::from_le_bytes([header[2], header[3]]);
+        if version != BLOCK_VERSION || codec != CODEC_ZSTD {
+            return Err(std::io::Error::new(
+                ErrorKind::InvalidData,
+                format!("unsupported compressed trace version {version} codec {codec}"),
+            ));
+        }
+        let block_size = u32::from_le_bytes([header[4], header[5], header[6], header[7]]);
+
+        Ok(Self {
+            inner,
+            decompressor: Decompressor::new(),
+            stored: vec![],
+            block: Vec::with_capacity(block_size as usize),
+            pos: 0,
+            block_start: 0,
+            finished: false,
+        })
+    }
+
+    pub fn new(mut inner: R) -> std::io::Result<Self> {
+        let mut magic = [0u8; 8];
+        inner.read_exact(&mut magic)?;
+        if magic != BLOCK_MAGIC {
+            return Err(std::io::Error::new(
+                ErrorKind::InvalidData,
+                "not a compressed pokedex trace",
+            ));
+        }
+        Self::after_magic(inner)
+    }
+
+    // Returns the uncompressed and stored length, None at the end of file
+    fn read_block_header(&mut self) -> std::io::Result<Option<(usize, u32)>> {
+        let mut header = [0u8; 8];
+        match self.inner.read_exact(&mut header) {
+            Ok(()) => {}
+            // a trace cut short is read up to the last complete block
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e),
+        }
+        let len = u32::from_le_bytes([header[0], header[1], header[2], header[3]]) as usize;
+        let stored = u32::from_le_bytes([header[4], header[5], header[6], header[7]]);
+        Ok((len != 0).then_some((len, stored)))
+    }
+
+    fn read_block_data(&mut self, len: usize, stored: u32) -> std::io::Result<()> {
+        self.block.clear();
+        self.pos = 0;
+        if stored & STORED_FLAG != 0 {
+            self.block.resize(len, 0);
+            self.inner.read_exact(&mut self.block)
+        } else {
+            self.stored.resize(stored as usize, 0);
+            self.inner.read_exact(&mut self.stored)?;
+            self.decompressor
+                .decompress(&self.stored, &mut self.block, len)
+        }
+    }
+
+    fn next_block(&mut self) -> std::io::Result<()> {
+        self.block_start += self.block.len() as u64;
+        self.block.clear();
+        self.pos = 0;
+        match self.read_block_header()? {
+            Some((len, stored)) => self.read_block_data(len, stored),
+            None => {
+                self.finished = true;
+                Ok(())
+            }
+        }
+    }
+}
+
+impl<R: Read> Read for BlockReader<R> {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        while self.pos == self.block.len() {
+            if self.finished || buf.is_empty() {
+                return Ok(0);
+            }
+            self.next_block()?;
+        }
+
+        let len = buf.len().min(self.block.len() - self.pos);
+        buf[..len].copy_from_slice(&self.block[self.pos..][..len]);
+        self.pos += len;
+        Ok(len)
+    }
+}
+
+/// Only seeking to an uncompressed offset from the start is supported.
+/// Blocks are skipped by their headers, thus only the target block is decompressed.
+impl<R: Read + Seek> Seek for BlockReader<R> {
+    fn seek(&mut self, pos: SeekFrom) -> std::io::Result<u64> {
+        let target = match pos {
+            SeekFrom::Start(target) => target,
+            SeekFrom::Current(0) => return Ok(self.block_start + self.pos as u64),
+            _ => {
+                return Err(std::io::Error::new(
+                    ErrorKind::Unsupported,
+                    "compressed trace only seeks from start",
+                ));
+            }
+        };
+
+        self.inner.seek(SeekFrom::Start(HEADER_SIZE as u64))?;
+        self.block.clear();
+        self.pos = 0;
+        self.block_start = 0;
+        self.finished = false;
+        loop {
+            let Some((len, stored)) = self.read_block_header()? else {
+                self.finished = true;
+                return Ok(self.block_start);
+            };
+            if target < self.block_start + len as u64 {
+                self.read_block_data(len, stored)?;
+                self.pos = (target - self.block_start) as usize;
+                return Ok(target);
+            }
+            let stored_len = if stored & STORED_FLAG != 0 {
+                len as u32
+            } else {
+                stored
+            };
+            self.inner.seek(SeekFrom::Current(stored_len as i64))?;
+            self.block_start += len as u64;
+        }
+    }
+}
+
+// zstd by the system library, see https://facebook.github.io/zstd/zstd_manual.html
+
+unsafe extern "C" {
+    fn ZSTD_createCCtx() -> *mut c_void;
+    fn ZSTD_freeCCtx(cctx: *mut c_void) -> usize;
+    fn ZSTD_compressCCtx(
+        cctx: *mut c_void,
+        dst: *mut c_void,
+        dst_capacity: usize,
+        src: *const c_void,
+        src_size: usize,
+        level: c_int,
+    ) -> usize;
+    fn ZSTD_createDCtx() -> *mut c_void;
+    fn ZSTD_freeDCtx(dctx: *mut c_void) -> usize;
+    fn ZSTD_decompressDCtx(
+        dctx: *mut c_void,
+        dst: *mut c_void,
+        dst_capacity: usize,
+        src: *const c_void,
+        src_size: usize,
+    ) -> usize;
+    fn ZSTD_isError(code: usize) -> c_uint;
+    fn ZSTD_getErrorName(code: usize) -> *const c_char;
+}
+
+// Fast enough for a few workers to keep up with the simulator
+const ZSTD_LEVEL: c_int = 3;
+
+fn zstd_error(code: usize) -> Option<&'static str> {
+    // SAFETY: error names are static strings
+    unsafe {
+        (ZSTD_isError(code) != 0).then(|| {
+            CStr::from_ptr(ZSTD_getErrorName(code))
+                .to_str()
+                .unwrap_or("?")
+        })
+    }
+}
+
+/// A compression context, reused for every block of a worker
+pub(super) struct Compressor(*mut c_void);
+
+impl Compressor {
+    pub fn new() -> Self {
+        let cctx = unsafe { ZSTD_createCCtx() };
+        assert!(!cctx.is_null(), "failed to create zstd context");
+        Self(cctx)
+    }
+
+    /// Compress input as a zstd frame into out.
+    /// Returns false if the frame is not smaller than input, out is not valid then.
+    pub fn compress(&mut self, input: &[u8], out: &mut Vec<u8>) -> bool {
+        let capacity = input.len().saturating_sub(1);
+        out.clear();
+        out.reserve(capacity);
+        // SAFETY: out has capacity bytes, of which the returned length is written
+        let len = unsafe {
+            ZSTD_compressCCtx(
+                self.0,
+                out.as_mut_ptr().cast(),
+                capacity,
+                input.as_ptr().cast(),
+                input.len(),
+                ZSTD_LEVEL,
+            )
+        };
+        // the frame does not fit in capacity for incompressible data
+        if zstd_error(len).is_some() {
+            return false;
+        }
+        unsafe { out.set_len(len) };
+        true
+    }
+}
+
+impl Drop for Compressor {
+    fn drop(&mut self) {
+        unsafe { ZSTD_freeCCtx(self.0) };
+    }
+}
+
+/// A decompression context, reused for every block of a reader
+pub(super) struct Decompressor(*mut c_void);
+
+// SAFETY: a zstd context is not tied to a thread, and it is only used through &mut self
+unsafe impl Send for Decompressor {}
+
+impl Decompressor {
+    pub fn new() -> Self {
+        let dctx = unsafe { ZSTD_createDCtx() };
+        assert!(!dctx.is_null(), "failed to create zstd context");
+        Self(dctx)
+    }
+
+    /// Decompress a zstd frame of len bytes into out
+    pub fn decompress(
+        &mut self,
+        input: &[u8],
+        out: &mut Vec<u8>,
+        len: usize,
+    ) -> std::io::Result<()> {
+        out.clear();
+        out.reserve(len);
+        // SAFETY: out has len bytes of capacity, of which the returned length is written
+        let written = unsafe {
+            ZSTD_decompressDCtx(
+                self.0,
+                out.as_mut_ptr().cast(),
+                len,
+                input.as_ptr().cast(),
+                input.len(),
+            )
+        };
+        if let Some(error) = zstd_error(written) {
+            return Err(std::io::Error::new(
+                ErrorKind::InvalidData,
+                format!("corrupted compressed trace block: {error}"),
+            ));
+        }
+        unsafe { out.set_len(written) };
+        if written != len {
+            return Err(std::io::Error::new(
+                ErrorKind::InvalidData,
+                "corrupted compressed trace block: length mismatch",
+            ));
+        }
+        Ok(())
+    }
+}
+
+impl Drop for Decompressor {
+    fn drop(&mut self) {
+        unsafe { ZSTD_freeDCtx(self.0) };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io::{Cursor, Read as _, Seek as _, SeekFrom, Write as _};
+
+    use super::*;
+
+    #[test]
+    fn test_block_compression() {
+        // trace-like data compresses, random data is stored
+        let mut data = vec![];
+        for i in 0..20_000u32 {
+            data.extend_from_slice(format!("{{\"pc\":{},\"inst\":19}}\n", i * 4).as_bytes());
+        }
+        let mut x = 1u32;
+        data.extend((0..5000).map(|_| {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            x as u8
+        }));
+
+        let (mut compressor, mut decompressor) = (Compressor::new(), Decompressor::new());
+        let mut compressed = vec![];
+        let mut decompressed = vec![];
+        assert!(compressor.compress(&data[..100_000], &mut compressed));
+        assert!(compressed.len() < 100_000 / 2);
+        decompressor
+            .decompress(&compressed, &mut decompressed, 100_000)
+            .unwrap();
+        assert_eq!(decompressed, data[..100_000]);
+        assert!(!compressor.compress(&data[data.len() - 5000..], &mut compressed));
+        assert!(!compressor.compress(&[], &mut compressed));
+
+        // a frame of another length, or corrupted, is an error
+        assert!(compressor.compress(&[7; 100], &mut compressed));
+        assert!(
+            decompressor
+                .decompress(&compressed, &mut decompressed, 99)
+                .is_err()
+        );
+        assert!(
+            decompressor
+                .decompress(&compressed, &mut decompressed, 101)
+                .is_err()
+        );
+        compressed[0] ^= 0xff;
+        assert!(
+            decompressor
+                .decompress(&compressed, &mut decompressed, 100)
+                .is_err()
+        );
+
+        let mut file = vec![];
+        {
+            let mut writer = BlockWriter::new(&mut file, 2).unwrap();
+            for (i, chunk) in data.chunks(3000).enumerate() {
+                writer.write_all(chunk).unwrap();
+                if i % 7 == 0 {
+                    writer.end_block().unwrap();
+                }
+            }
+            writer.finish().unwrap();
+        }
+        assert!(file.len() < data.len() / 2);
+
+        let mut reader = BlockReader::new(file.as_slice()).unwrap();
+        let mut read = vec![];
+        reader.read_to_end(&mut read).unwrap();
+        assert_eq!(read, data);
+
+        let mut reader = BlockReader::new(Cursor::new(&file)).unwrap();
+        for offset in [data.len() / 2, 3000 * 7, 10, data.len() - 1] {
+            reader.seek(SeekFrom::Start(offset as u64)).unwrap();
+            let mut byte = [0];
+            reader.read_exact(&mut byte).unwrap();
+            assert_eq!(byte[0], data[offset]);
+        }
+    }
+}
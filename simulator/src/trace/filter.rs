@@ -0,0 +1,161 @@
+use std::{ops::Range, path::Path};
+
+use anyhow::{Context as _, bail};
+use xmas_elf::{ElfFile, sections::SectionData, symbol_table::Entry as _};
+
+use crate::{isa::InstTable, model::StepDetail, pokedex::simulator::Simulator};
+
+/// Select which steps are traced, steps not traced take the untraced fast path
+#[derive(clap::Args, Debug, Default)]
+pub struct TraceFilterArgs {
+    /// Only trace instructions in the pc range "<start>-<end>" (hex, end exclusive), could repeat
+    #[arg(long, value_parser = parse_pc_range)]
+    trace_pc: Vec<Range<u32>>,
+
+    /// Only trace instructions inside the function or object of the ELF symbol, could repeat
+    #[arg(long)]
+    trace_symbol: Vec<String>,
+
+    /// Only trace instructions of these extensions in inst_encoding.json, e.g. "rv_v"
+    #[arg(long, value_delimiter = ',')]
+    trace_class: Vec<String>,
+
+    /// Only trace instructions writing any CSR
+    #[arg(long)]
+    trace_csr_only: bool,
+
+    /// Only trace one in every N selected instructions
+    #[arg(long, default_value_t = 1)]
+    trace_sample: u64,
+}
+
+fn parse_pc_range(s: &str) -> Result<Range<u32>, String> {
+    let parse = |s: &str| {
+        let digits = s.strip_prefix("0x").unwrap_or(s);
+        u32::from_str_radix(digits, 16).map_err(|e| format!("invalid address {s:?}: {e}"))
+    };
+
+    let Some((start, end)) = s.split_once('-') else {
+        return Err(format!("pc range {s:?} should be <start>-<end>"));
+    };
+    let range = parse(start)?..parse(end)?;
+    if range.is_empty() {
+        return Err(format!("pc range {s:?} is empty"));
+    }
+    Ok(range)
+}
+
+pub struct TraceFilter {
+    // empty for any pc
+    pc_ranges: Vec<Range<u32>>,
+
+    // instruction table and bitset of selected extensions
+    class: Option<(InstTable, u64)>,
+
+    csr_only: bool,
+
+    sample: u64,
+    // number of steps passed other conditions so far
+    candidates: u64,
+}
+
+impl TraceFilter {
+    /// Returns None if no filter is given
+    pub fn from_args(args: &TraceFilterArgs, elf_path: &Path) -> anyhow::Result<Option<Self>> {
+        anyhow::ensure!(args.trace_sample > 0, "trace sample should be positive");
+
+        let mut pc_ranges = args.trace_pc.clone();
+        if !args.trace_symbol.is_empty() {
+            pc_ranges.extend(resolve_symbols(elf_path, &args.trace_symbol)?);
+        }
+
+        let class = if args.trace_class.is_empty() {
+            None
+        } else {
+            let table = InstTable::new();
+            let set = table.extension_set(&args.trace_class)?;
+            Some((table, set))
+        };
+
+        let filter = Self {
+            pc_ranges,
+            class,
+            csr_only: args.trace_csr_only,
+            sample: args.trace_sample,
+            candidates: 0,
+        };
+
+        let is_noop = filter.pc_ranges.is_empty()
+            && filter.class.is_none()
+            && !filter.csr_only
+            && filter.sample == 1;
+        Ok((!is_noop).then_some(filter))
+    }
+
+    /// Decide whether the next step is traced before stepping
+    pub fn select(&mut self, sim: &Simulator) -> bool {
+        if !self.pc_ranges.is_empty() || self.class.is_some() {
+            let pc = sim.core().read_pc();
+
+            if !self.pc_ranges.is_empty() && !self.pc_ranges.iter().any(|r| r.contains(&pc)) {
+                return false;
+            }
+
+            if let Some((table, set)) = &self.class {
+                let mut inst = [0u8; 4];
+                if sim.global.bus.debugger_read(pc, &mut inst) < 2 {
+                    return false;
+                }
+                if table.extensions_of(u32::from_le_bytes(inst)) & set == 0 {
+                    return false;
+                }
+            }
+        }
+
+        if self.sample > 1 {
+            self.candidates += 1;
+            if (self.candidates - 1) % self.sample != 0 {
+                return false;
+            }
+        }
+
+        true
+    }
+
+    /// Decide whether a traced step is recorded, for conditions only known after stepping
+    pub fn accept(&self, detail: &StepDetail) -> bool {
+        !self.csr_only || detail.changes.csr_change_indices().next().is_some()
+    }
+}
+
+fn resolve_symbols(elf_path: &Path, names: &[String]) -> anyhow::Result<Vec<Range<u32>>> {
+    let buffer = std::fs::read(elf_path)
+        .with_context(|| format!("failed to read {}", elf_path.display()))?;
+    let elf_file = ElfFile::new(&buffer).map_err(|err| anyhow::anyhow!("invalid ELF: {err}"))?;
+
+    let mut ranges: Vec<Option<Range<u32>>> = vec![None; names.len()];
+    for section in elf_file.section_iter() {
+        let Ok(SectionData::SymbolTable32(entries)) = section.get_data(&elf_file) else {
+            continue;
+        };
+        for entry in entries {
+            let Ok(name) = entry.get_name(&elf_file) else {
+                continue;
+            };
+            let Some(index) = names.iter().position(|n| n == name) else {
+                continue;
+            };
+            if entry.size() == 0 {
+                bail!("symbol {name} has no size");
+            }
+            let start = entry.value() as u32;
+            ranges[index] = Some(start..start + entry.size() as u32);
+        }
+    }
+
+    names
+        .iter()
+        .zip(ranges)
+        .map(|(name, range)| range.with_context(|| format!("symbol {name} not found in ELF")))
+        .collect()
+}
@@ -0,0 +1,233 @@
+//! Sidecar stream of rolling state hashes of a trace, for finding where two traces diverge
+//!
+//! The hashes are written next to the trace as `<trace path>.hash`, all integers are little endian.
+//!
+//! File header (16 bytes):
+//!
+//! | offset | size | field                          |
+//! |--------|------|--------------------------------|
+//! | 0      | 8    | magic `b"PDXHASHS"`            |
+//! | 8      | 2    | format version                 |
+//! | 10     | 6    | reserved, must be zero         |
+//!
+//! Followed by entries, one every K committed instructions and one at the end of trace:
+//!
+//! - number of committed instructions (u64)
+//! - rolling hash of the trace up to the entry (u64), see `ArchState::hash`
+//!
+//! Since the hash rolls, entries of two traces differ from the first divergence on,
+//! thus it is found by a binary search over the entries,
+//! then by replaying at most K instructions of both traces from the index keyframes.
+
+use std::{
+    ffi::OsString,
+    fs::File,
+    io::{BufWriter, Write},
+    path::{Path, PathBuf},
+};
+
+use anyhow::{Context as _, ensure};
+
+use crate::common::CommitWrites;
+
+use super::{
+    HEADER_SIZE, VLEN_BYTE,
+    index::{ArchState, TraceCursor},
+    reader::Record,
+};
+
+const HASH_MAGIC: [u8; 8] = *b"PDXHASHS";
+const HASH_VERSION: u16 = 1;
+
+const ENTRY_SIZE: usize = 16;
+
+pub fn hash_path(trace_path: &Path) -> PathBuf {
+    let mut path = OsString::from(trace_path);
+    path.push(".hash");
+    path.into()
+}
+
+/// Writes hash entries while the trace is written, records should be fed in order
+pub struct HashWriter {
+    writer: BufWriter<File>,
+    interval: u64,
+    state: ArchState,
+}
+
+impl HashWriter {
+    pub fn create(trace_path: &Path, interval: u64) -> std::io::Result<Self> {
+        assert!(interval > 0);
+
+        let mut writer = BufWriter::new(File::create(hash_path(trace_path))?);
+        let mut header = [0u8; HEADER_SIZE];
+        header[0..8].copy_from_slice(&HASH_MAGIC);
+        header[8..10].copy_from_slice(&HASH_VERSION.to_le_bytes());
+        writer.write_all(&header)?;
+
+        Ok(Self {
+            writer,
+            interval,
+            state: ArchState::new(VLEN_BYTE),
+        })
+    }
+
+    pub fn apply_record(&mut self, record: Record, writes: &CommitWrites) -> std::io::Result<()> {
+        self.state.apply_record(record, writes);
+        if matches!(record, Record::Commit { .. }) && self.state.commits % self.interval == 0 {
+            self.write_entry()?;
+        }
+        Ok(())
+    }
+
+    fn write_entry(&mut self) -> std::io::Result<()> {
+        self.writer.write_all(&self.state.commits.to_le_bytes())?;
+        self.writer.write_all(&self.state.hash.to_le_bytes())
+    }
+
+    pub fn flush(&mut self) -> std::io::Result<()> {
+        self.writer.flush()
+    }
+
+    /// Write the entry of the end of trace, records after the last commit are hashed as well
+    pub fn finish(&mut self) -> std::io::Result<()> {
+        self.write_entry()?;
+        self.writer.flush()
+    }
+}
+
+// (committed instructions, hash) of each entry
+fn read_hashes(trace_path: &Path) -> anyhow::Result<Vec<(u64, u64)>> {
+    let path = hash_path(trace_path);
+    let raw = std::fs::read(&path).with_context(|| format!("failed to read {}", path.display()))?;
+    ensure!(
+        raw.len() >= HEADER_SIZE && raw[0..8] == HASH_MAGIC,
+        "{} is not a trace hash stream",
+        path.display()
+    );
+    let version = u16::from_le_bytes([raw[8], raw[9]]);
+    ensure!(
+        version == HASH_VERSION,
+        "unsupported trace hash version {version}, expected {HASH_VERSION}"
+    );
+
+    // a partial entry is left by a writer that did not finish
+    let entries = raw[HEADER_SIZE..]
+        .chunks_exact(ENTRY_SIZE)
+        .map(|entry| {
+            let (commits, hash) = entry.split_at(8);
+            (
+                u64::from_le_bytes(commits.try_into().unwrap()),
+                u64::from_le_bytes(hash.try_into().unwrap()),
+            )
+        })
+        .collect();
+    Ok(entries)
+}
+
+/// The first commit where two traces differ
+pub struct Divergence {
+    /// States of both traces after the commit.
+    /// If one trace ends earlier, its state is at the end of trace.
+    pub state_a: ArchState,
+    pub state_b: ArchState,
+}
+
+/// Find the first differing commit of two traces with hash sidecars.
+/// Returns None if the traces are the same.
+pub fn first_divergence(trace_a: &Path, trace_b: &Path) -> anyhow::Result<Option<Divergence>> {
+    let hashes_a = read_hashes(trace_a)?;
+    let hashes_b = read_hashes(trace_b)?;
+
+    // entries before the first divergence are the same, and all entries after it differ
+    let common = hashes_a.len().min(hashes_b.len());
+    let (mut lo, mut hi) = (0, common);
+    while lo < hi {
+        let mid = lo + (hi - lo) / 2;
+        if hashes_a[mid] == hashes_b[mid] {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if lo == common && hashes_a.len() == hashes_b.len() {
+        return Ok(None);
+    }
+
+    // replay both from the last entry in common
+    let (at, hash) = match lo {
+        0 => (0, ArchState::new(VLEN_BYTE).hash),
+        _ => hashes_a[lo - 1],
+    };
+    let mut cursor_a = TraceCursor::open_at(trace_a, at)
+        .with_context(|| format!("reading trace {}", trace_a.display()))?;
+    let mut cursor_b = TraceCursor::open_at(trace_b, at)
+        .with_context(|| format!("reading trace {}", trace_b.display()))?;
+    cursor_a.seed_hash(hash);
+    cursor_b.seed_hash(hash);
+
+    loop {
+        let more_a = cursor_a.next_commit()?;
+        let more_b = cursor_b.next_commit()?;
+        if more_a != more_b || cursor_a.state().hash != cursor_b.state().hash {
+            return Ok(Some(Divergence {
+                state_a: cursor_a.into_state(),
+                state_b: cursor_b.into_state(),
+            }));
+        }
+        ensure!(
+            more_a,
+            "hash streams differ but the traces are the same, is a hash stream stale?"
+        );
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::trace::test_trace::TestTrace;
+
+    // commit i writes x1 = i at the fall-through pc, except x1 = 0xdead at commit diverge
+    fn write_trace(name: &str, commits: u32, diverge: u32, exit_code: u32) -> PathBuf {
+        let path = std::env::temp_dir().join(format!(
+            "pokedex-hash-test-{name}-{}.bin",
+            std::process::id()
+        ));
+        let mut trace = TestTrace::new(0x8000_0000);
+        for i in 1..=commits {
+            let value = if i == diverge { 0xdead } else { i };
+            trace.commit(0x8000_0000 + 4 * (i - 1), 0x0000_0013, &[(1, value)], &[]);
+        }
+        trace.exit(exit_code);
+        trace.write_with_hashes(&path, 16, 8);
+        path
+    }
+
+    #[test]
+    fn test_hash_bisect() {
+        let base = write_trace("base", 100, 0, 0);
+        let same = write_trace("same", 100, 0, 0);
+        assert!(first_divergence(&base, &same).unwrap().is_none());
+
+        // x1 is overwritten by the next commit, the hash still differs at the next entry
+        let transient = write_trace("transient", 100, 37, 0);
+        let divergence = first_divergence(&base, &transient).unwrap().unwrap();
+        assert_eq!(divergence.state_a.commits, 37);
+        assert_eq!(divergence.state_b.commits, 37);
+        assert_eq!(divergence.state_a.xregs[1], 37);
+        assert_eq!(divergence.state_b.xregs[1], 0xdead);
+
+        let exit = write_trace("exit", 100, 0, 1);
+        let divergence = first_divergence(&base, &exit).unwrap().unwrap();
+        assert_eq!(divergence.state_a.commits, 100);
+        assert_eq!(divergence.state_b.commits, 100);
+
+        let short = write_trace("short", 90, 0, 0);
+        let divergence = first_divergence(&base, &short).unwrap().unwrap();
+        assert_eq!(divergence.state_a.commits, 91);
+        assert_eq!(divergence.state_b.commits, 90);
+
+        for path in [base, same, transient, exit, short] {
+            TestTrace::remove(&path);
+        }
+    }
+}
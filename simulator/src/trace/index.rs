@@ -0,0 +1,836 @@
+//! Sidecar index of a trace file, for random access by instruction number
+//!
+//! The index is written next to the trace as `<trace path>.idx`, all integers are little endian.
+//!
+//! File header (16 bytes):
+//!
+//! | offset | size | field                          |
+//! |--------|------|--------------------------------|
+//! | 0      | 8    | magic `b"PDXINDEX"`            |
+//! | 8      | 2    | format version                 |
+//! | 10     | 2    | reserved, must be zero         |
+//! | 12     | 2    | VLEN in bytes                  |
+//! | 14     | 2    | reserved, must be zero         |
+//!
+//! Followed by keyframes, one every K committed instructions:
+//!
+//! - number of committed instructions (u64)
+//! - byte offset of the next record in the trace file (u64),
+//!   of the uncompressed trace if it is block compressed
+//! - fall-through pc of the last record (u32)
+//! - pc and instruction of the last commit (u32 each)
+//! - XRF and FRF values (32 u32 each), VRF values (32 * VLEN bytes)
+//! - number of written CSRs (u16), then for each, name length (u8), name, value (u32)
+//!
+//! A keyframe still due after the last record points to the end of the trace.
+//! When the trace is finished, the keyframes are followed by a footer for binary search:
+//!
+//! - end of keyframes marker, `u64::MAX` in place of the number of instructions
+//! - for each keyframe, its number of instructions and its position in the index (u64 each)
+//! - number of keyframes (u64), then magic `b"PDXIDXFT"`
+//!
+//! An index of an interrupted run has no footer, and is scanned from the start.
+//! Version 1 indexes have neither the marker nor the footer.
+//!
+//! The state is reconstructed from the writes in the trace, starting from all zero,
+//! thus registers never written in the trace are zero.
+//!
+//! Keyframes do not record the rolling hash of the state, see `hash`.
+
+use std::{
+    collections::BTreeMap,
+    ffi::OsString,
+    fs::File,
+    io::{BufRead, BufReader, BufWriter, ErrorKind, Read, Seek, SeekFrom, Write},
+    path::{Path, PathBuf},
+};
+
+use anyhow::{Context as _, bail, ensure};
+
+use crate::{
+    common::{CommitWrites, PokedexLog, StateWrite, VrfWrite},
+    pokedex::name_of_csr,
+};
+
+use super::{
+    HEADER_SIZE, MAGIC, VLEN_BYTE,
+    block::{BLOCK_MAGIC, BlockReader},
+    reader::{Record, TraceDecoder, read_u8, read_u16, read_u32},
+};
+
+const INDEX_MAGIC: [u8; 8] = *b"PDXINDEX";
+const INDEX_VERSION: u16 = 2;
+const FOOTER_MAGIC: [u8; 8] = *b"PDXIDXFT";
+// in place of the number of instructions of a keyframe
+const END_OF_KEYFRAMES: u64 = u64::MAX;
+
+// FxHash constant, odd thus multiplying by it is a bijection
+const HASH_MULTIPLIER: u64 = 0x517c_c1b7_2722_0a95;
+
+// Separates kinds of values mixed into the rolling hash
+const HASH_TAG_RESET: u64 = 1 << 40;
+const HASH_TAG_EXIT: u64 = 2 << 40;
+const HASH_TAG_COMMIT: u64 = 3 << 40;
+const HASH_TAG_XRF: u64 = 4 << 40;
+const HASH_TAG_FRF: u64 = 5 << 40;
+const HASH_TAG_VRF: u64 = 6 << 40;
+const HASH_TAG_CSR: u64 = 7 << 40;
+
+pub fn index_path(trace_path: &Path) -> PathBuf {
+    let mut path = OsString::from(trace_path);
+    path.push(".idx");
+    path.into()
+}
+
+// Fields of a whole CSR: (whole, field, shift, mask)
+const CSR_FIELDS: [(&str, &str, u32, u32); 4] = [
+    ("fcsr", "fflags", 0, 0x1f),
+    ("fcsr", "frm", 5, 0x7),
+    ("vcsr", "vxsat", 0, 0x1),
+    ("vcsr", "vxrm", 1, 0x3),
+];
+
+/// Architectural state as recorded by a trace
+#[derive(Debug, Clone)]
+pub struct ArchState {
+    pub commits: u64,
+    // base of the pc delta of the next binary record
+    pub next_pc: u32,
+
+    pub last_pc: u32,
+    pub last_inst: u32,
+
+    pub xregs: [u32; 32],
+    pub fregs: [u32; 32],
+    pub vregs: Vec<u8>,
+    pub csrs: BTreeMap<String, u32>,
+
+    /// Rolling hash of the records applied so far, a vector register write
+    /// is hashed with the whole register, thus it does not depend on delta encoding.
+    /// Each step of the hash is a bijection of both the hash and the mixed value,
+    /// so once two traces differ their hashes stay different,
+    /// unless a later difference cancels it out, as unlikely as a 64-bit collision.
+    pub hash: u64,
+}
+
+impl ArchState {
+    pub fn new(vlen_byte: usize) -> Self {
+        Self {
+            commits: 0,
+            next_pc: 0,
+            last_pc: 0,
+            last_inst: 0,
+            xregs: [0; 32],
+            fregs: [0; 32],
+            vregs: vec![0; 32 * vlen_byte],
+            csrs: BTreeMap::new(),
+            hash: 0,
+        }
+    }
+
+    fn mix(&mut self, value: u64) {
+        self.hash = (self.hash.rotate_left(5) ^ value).wrapping_mul(HASH_MULTIPLIER);
+    }
+
+    fn mix_vreg(&mut self, rd: u8) {
+        self.mix(HASH_TAG_VRF | rd as u64);
+        let vlen_byte = self.vlen_byte();
+        let start = rd as usize * vlen_byte;
+        for i in (start..start + vlen_byte).step_by(8) {
+            let chunk = self.vregs[i..i + 8].try_into().unwrap();
+            self.mix(u64::from_le_bytes(chunk));
+        }
+    }
+
+    pub fn vlen_byte(&self) -> usize {
+        self.vregs.len() / 32
+    }
+
+    fn reset(&mut self, pc: u32) {
+        self.mix(HASH_TAG_RESET | pc as u64);
+        self.next_pc = pc;
+    }
+
+    fn write_xreg(&mut self, rd: u8, value: u32) {
+        self.mix(HASH_TAG_XRF | (rd as u64) << 32 | value as u64);
+        self.xregs[rd as usize] = value;
+    }
+
+    fn write_freg(&mut self, rd: u8, value: u32) {
+        self.mix(HASH_TAG_FRF | (rd as u64) << 32 | value as u64);
+        self.fregs[rd as usize] = value;
+    }
+
+    fn write_vreg(&mut self, rd: u8, offset: usize, value: &[u8]) {
+        let vlen_byte = self.vlen_byte();
+        self.vregs[rd as usize * vlen_byte + offset..][..value.len()].copy_from_slice(value);
+        self.mix_vreg(rd);
+    }
+
+    fn write_csr(&mut self, name: &str, value: u32) {
+        for chunk in name.as_bytes().chunks(8) {
+            let mut bytes = [0u8; 8];
+            bytes[..chunk.len()].copy_from_slice(chunk);
+            self.mix(u64::from_le_bytes(bytes));
+        }
+        self.mix(HASH_TAG_CSR | value as u64);
+
+        match self.csrs.get_mut(name) {
+            Some(slot) => *slot = value,
+            None => {
+                self.csrs.insert(name.to_string(), value);
+            }
+        }
+
+        // A whole CSR and its fields are kept consistent, only the last value of each
+        // name is kept, thus a stale field would otherwise override a newer whole CSR.
+        for &(whole, field, shift, mask) in &CSR_FIELDS {
+            if name == whole {
+                if let Some(slot) = self.csrs.get_mut(field) {
+                    *slot = value >> shift & mask;
+                }
+            } else if name == field
+                && let Some(slot) = self.csrs.get_mut(whole)
+            {
+                *slot = *slot & !(mask << shift) | (value & mask) << shift;
+            }
+        }
+    }
+
+    fn commit(&mut self, pc: u32, is_compressed: bool, instruction: u32) {
+        self.mix(HASH_TAG_COMMIT | is_compressed as u64);
+        self.mix((pc as u64) << 32 | instruction as u64);
+
+        self.commits += 1;
+        self.next_pc = pc.wrapping_add(if is_compressed { 2 } else { 4 });
+        self.last_pc = pc;
+        self.last_inst = instruction;
+    }
+
+    pub fn apply_record(&mut self, record: Record, writes: &CommitWrites) {
+        match record {
+            Record::Reset { pc } => self.reset(pc),
+            Record::Exit { code } => self.mix(HASH_TAG_EXIT | code as u64),
+            Record::Commit {
+                pc,
+                is_compressed,
+                instruction,
+            } => {
+                for &(rd, value) in &writes.xrf {
+                    self.write_xreg(rd, value);
+                }
+                for &(rd, value) in &writes.frf {
+                    self.write_freg(rd, value);
+                }
+                for (VrfWrite { rd, offset, .. }, value) in writes.vrf_writes() {
+                    self.write_vreg(rd, offset.unwrap_or(0) as usize, value);
+                }
+                for &(csr, value) in &writes.csr {
+                    self.write_csr(name_of_csr(csr), value);
+                }
+                self.commit(pc, is_compressed, instruction);
+            }
+        }
+    }
+
+    pub fn apply_log(&mut self, log: &PokedexLog) {
+        match log {
+            &PokedexLog::Reset { pc } => self.reset(pc),
+            &PokedexLog::Exit { code } => self.mix(HASH_TAG_EXIT | code as u64),
+            PokedexLog::Exception(_) => {}
+            PokedexLog::Commit(commit) => {
+                for write in &commit.states_changed {
+                    match write {
+                        &StateWrite::Xrf { rd, value } => self.write_xreg(rd, value),
+                        &StateWrite::Frf { rd, value } => self.write_freg(rd, value),
+                        StateWrite::Vrf { rd, value } => self.write_vreg(*rd, 0, value),
+                        StateWrite::VrfPatch { rd, offset, value } => {
+                            self.write_vreg(*rd, *offset as usize, value)
+                        }
+                        StateWrite::Csr { name, value } => self.write_csr(name, *value),
+                    }
+                }
+                self.commit(commit.pc, commit.is_compressed, commit.instruction);
+            }
+        }
+    }
+
+    fn write_keyframe(&self, writer: &mut impl Write, offset: u64) -> std::io::Result<()> {
+        writer.write_all(&self.commits.to_le_bytes())?;
+        writer.write_all(&offset.to_le_bytes())?;
+        for value in [self.next_pc, self.last_pc, self.last_inst] {
+            writer.write_all(&value.to_le_bytes())?;
+        }
+        for value in self.xregs.iter().chain(&self.fregs) {
+            writer.write_all(&value.to_le_bytes())?;
+        }
+        writer.write_all(&self.vregs)?;
+        writer.write_all(&(self.csrs.len() as u16).to_le_bytes())?;
+        for (name, value) in &self.csrs {
+            writer.write_all(&[name.len() as u8])?;
+            writer.write_all(name.as_bytes())?;
+            writer.write_all(&value.to_le_bytes())?;
+        }
+        Ok(())
+    }
+
+    // Returns the state and trace offset, None at the end of index
+    fn read_keyframe(
+        reader: &mut impl Read,
+        vlen_byte: usize,
+    ) -> anyhow::Result<Option<(Self, u64)>> {
+        let mut commits = [0u8; 8];
+        match reader.read_exact(&mut commits) {
+            Ok(()) => {}
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e.into()),
+        }
+        let commits = u64::from_le_bytes(commits);
+        if commits == END_OF_KEYFRAMES {
+            return Ok(None);
+        }
+
+        let mut state = Self::new(vlen_byte);
+        state.commits = commits;
+        let mut offset = [0u8; 8];
+        reader.read_exact(&mut offset)?;
+        state.next_pc = read_u32(reader)?;
+        state.last_pc = read_u32(reader)?;
+        state.last_inst = read_u32(reader)?;
+        for value in state.xregs.iter_mut().chain(&mut state.fregs) {
+            *value = read_u32(reader)?;
+        }
+        reader.read_exact(&mut state.vregs)?;
+        for _ in 0..read_u16(reader)? {
+            let mut name = vec![0u8; read_u8(reader)? as usize];
+            reader.read_exact(&mut name)?;
+            let name = String::from_utf8(name).context("invalid CSR name in index")?;
+            state.csrs.insert(name, read_u32(reader)?);
+        }
+
+        Ok(Some((state, u64::from_le_bytes(offset))))
+    }
+
+    pub fn print(&self) {
+        print!("{self}");
+    }
+}
+
+impl std::fmt::Display for ArchState {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        if self.commits == 0 {
+            writeln!(f, "before the first instruction")?;
+        } else {
+            writeln!(
+                f,
+                "after instruction {}: pc={:#010x} inst={:#010x}",
+                self.commits, self.last_pc, self.last_inst
+            )?;
+        }
+
+        for (prefix, regs) in [("x", &self.xregs), ("f", &self.fregs)] {
+            for row in 0..8 {
+                let line: Vec<_> = (row * 4..row * 4 + 4)
+                    .map(|i| format!("{:>3}={:#010x}", format!("{prefix}{i}"), regs[i]))
+                    .collect();
+                writeln!(f, "{}", line.join(" "))?;
+            }
+        }
+        for (i, value) in self.vregs.chunks_exact(self.vlen_byte()).enumerate() {
+            write!(f, "{:>3}=0x", format!("v{i}"))?;
+            for byte in value.iter().rev() {
+                write!(f, "{byte:02x}")?;
+            }
+            writeln!(f)?;
+        }
+        for (name, value) in &self.csrs {
+            writeln!(f, "{name}={value:#010x}")?;
+        }
+        Ok(())
+    }
+}
+
+/// Writes keyframes while the trace is written, records should be fed in order
+pub struct IndexWriter {
+    writer: BufWriter<File>,
+    interval: u64,
+    state: ArchState,
+    // a keyframe is due, written at the start of the next record
+    pending: bool,
+    // encoded keyframe, and (instructions, index position) of each written one for the footer
+    keyframe: Vec<u8>,
+    keyframes: Vec<(u64, u64)>,
+    position: u64,
+}
+
+impl IndexWriter {
+    pub fn create(trace_path: &Path, interval: u64) -> std::io::Result<Self> {
+        assert!(interval > 0);
+
+        let mut writer = BufWriter::new(File::create(index_path(trace_path))?);
+        let mut header = [0u8; HEADER_SIZE];
+        header[0..8].copy_from_slice(&INDEX_MAGIC);
+        header[8..10].copy_from_slice(&INDEX_VERSION.to_le_bytes());
+        header[12..14].copy_from_slice(&(VLEN_BYTE as u16).to_le_bytes());
+        writer.write_all(&header)?;
+
+        Ok(Self {
+            writer,
+            interval,
+            state: ArchState::new(VLEN_BYTE),
+            pending: false,
+            keyframe: vec![],
+            keyframes: vec![],
+            position: HEADER_SIZE as u64,
+        })
+    }
+
+    /// Called before each record, offset is where the record starts in the uncompressed trace.
+    /// Returns true if a keyframe is written for the record.
+    pub fn before_record(&mut self, offset: u64) -> std::io::Result<bool> {
+        if !self.pending {
+            return Ok(false);
+        }
+        self.pending = false;
+
+        self.keyframe.clear();
+        self.state.write_keyframe(&mut self.keyframe, offset)?;
+        self.writer.write_all(&self.keyframe)?;
+        self.keyframes.push((self.state.commits, self.position));
+        self.position += self.keyframe.len() as u64;
+        Ok(true)
+    }
+
+    pub fn apply_record(&mut self, record: Record, writes: &CommitWrites) {
+        self.state.apply_record(record, writes);
+        if matches!(record, Record::Commit { .. }) && self.state.commits % self.interval == 0 {
+            self.pending = true;
+        }
+    }
+
+    pub fn flush(&mut self) -> std::io::Result<()> {
+        self.writer.flush()
+    }
+
+    /// Called after the last record, offset is the end of the uncompressed trace
+    pub fn finish(&mut self, offset: u64) -> std::io::Result<()> {
+        self.before_record(offset)?;
+
+        self.writer.write_all(&END_OF_KEYFRAMES.to_le_bytes())?;
+        for &(commits, position) in &self.keyframes {
+            self.writer.write_all(&commits.to_le_bytes())?;
+            self.writer.write_all(&position.to_le_bytes())?;
+        }
+        self.writer
+            .write_all(&(self.keyframes.len() as u64).to_le_bytes())?;
+        self.writer.write_all(&FOOTER_MAGIC)?;
+        self.writer.flush()
+    }
+}
+
+/// Keyframes of a trace index, in trace order
+pub struct Keyframes {
+    reader: BufReader<File>,
+    vlen_byte: usize,
+    // not written by version 1, nor by an interrupted run
+    has_footer: bool,
+}
+
+impl Keyframes {
+    /// None if the trace has no index
+    pub fn open(trace_path: &Path) -> anyhow::Result<Option<Self>> {
+        let path = index_path(trace_path);
+        let file = match File::open(&path) {
+            Ok(file) => file,
+            Err(e) if e.kind() == ErrorKind::NotFound => return Ok(None),
+            Err(e) => return Err(e).with_context(|| format!("failed to open {}", path.display())),
+        };
+        let mut reader = BufReader::new(file);
+
+        let mut header = [0u8; HEADER_SIZE];
+        reader.read_exact(&mut header)?;
+        ensure!(
+            header[0..8] == INDEX_MAGIC,
+            "{} is not a trace index",
+            path.display()
+        );
+        let version = u16::from_le_bytes([header[8], header[9]]);
+        ensure!(
+            version == 1 || version == INDEX_VERSION,
+            "unsupported trace index version {version}, expected {INDEX_VERSION}"
+        );
+        let vlen_byte = u16::from_le_bytes([header[12], header[13]]) as usize;
+
+        Ok(Some(Self {
+            reader,
+            vlen_byte,
+            has_footer: version >= 2,
+        }))
+    }
+
+    /// The state and trace offset of the next keyframe, None at the end of index
+    pub fn next_keyframe(&mut self) -> anyhow::Result<Option<(ArchState, u64)>> {
+        ArchState::read_keyframe(&mut self.reader, self.vlen_byte)
+    }
+
+    /// The latest keyframe at or before the instruction,
+    /// binary searched in the footer, or scanned if the index has none
+    pub fn latest_at(&mut self, at: u64) -> anyhow::Result<Option<(ArchState, u64)>> {
+        let Some(table) = self.read_footer()? else {
+            self.reader.seek(SeekFrom::Start(HEADER_SIZE as u64))?;
+            let mut found = None;
+            while let Some((state, offset)) = self.next_keyframe()? {
+                if state.commits > at {
+                    break;
+                }
+                found = Some((state, offset));
+            }
+            return Ok(found);
+        };
+
+        let n = table.partition_point(|&(commits, _)| commits <= at);
+        if n == 0 {
+            return Ok(None);
+        }
+        self.reader.seek(SeekFrom::Start(table[n - 1].1))?;
+        self.next_keyframe()
+    }
+
+    // (instructions, index position) of each keyframe, None if there is no footer
+    fn read_footer(&mut self) -> anyhow::Result<Option<Vec<(u64, u64)>>> {
+        let len = self.reader.seek(SeekFrom::End(0))?;
+        if !self.has_footer || len < HEADER_SIZE as u64 + 24 {
+            return Ok(None);
+        }
+        self.reader.seek(SeekFrom::End(-16))?;
+        let mut trailer = [0u8; 16];
+        self.reader.read_exact(&mut trailer)?;
+        if trailer[8..] != FOOTER_MAGIC {
+            return Ok(None);
+        }
+
+        let count = u64::from_le_bytes(trailer[..8].try_into().unwrap());
+        let table_len = count
+            .checked_mul(16)
+            .filter(|&n| n <= len - HEADER_SIZE as u64 - 24)
+            .context("corrupted trace index footer")?;
+        self.reader.seek(SeekFrom::End(-16 - table_len as i64))?;
+        let mut raw = vec![0u8; table_len as usize];
+        self.reader.read_exact(&mut raw)?;
+
+        let table: Vec<(u64, u64)> = raw
+            .chunks_exact(16)
+            .map(|entry| {
+                let commits = u64::from_le_bytes(entry[..8].try_into().unwrap());
+                let position = u64::from_le_bytes(entry[8..].try_into().unwrap());
+                (commits, position)
+            })
+            .collect();
+        ensure!(
+            table.is_sorted_by_key(|&(commits, _)| commits),
+            "corrupted trace index footer"
+        );
+        Ok(Some(table))
+    }
+}
+
+// Latest keyframe at or before the instruction, None if there is no index
+fn find_keyframe(trace_path: &Path, at: u64) -> anyhow::Result<Option<(ArchState, u64)>> {
+    match Keyframes::open(trace_path)? {
+        Some(mut keyframes) => keyframes.latest_at(at),
+        None => Ok(None),
+    }
+}
+
+/// Reconstruct the state after the given number of committed instructions,
+/// starting from the nearest keyframe in the index if there is one
+pub fn state_at(trace_path: &Path, at: u64) -> anyhow::Result<ArchState> {
+    Ok(TraceCursor::open_at(trace_path, at)?.into_state())
+}
+
+/// Replays a trace one commit at a time, from a keyframe
+pub struct TraceCursor {
+    state: ArchState,
+    records: Records,
+}
+
+enum Records {
+    Binary {
+        reader: Box<dyn BufRead>,
+        decoder: TraceDecoder,
+        writes: CommitWrites,
+    },
+    Json {
+        reader: Box<dyn BufRead>,
+        line: String,
+    },
+}
+
+impl TraceCursor {
+    /// The cursor is at the state after the given number of committed instructions
+    pub fn open_at(trace_path: &Path, at: u64) -> anyhow::Result<Self> {
+        let keyframe = find_keyframe(trace_path, at)?;
+        Self::open_from(trace_path, keyframe, at)
+    }
+
+    /// Same as `open_at`, replaying from a keyframe at or before the instruction
+    pub fn open_from(
+        trace_path: &Path,
+        keyframe: Option<(ArchState, u64)>,
+        at: u64,
+    ) -> anyhow::Result<Self> {
+        let mut file = File::open(trace_path)
+            .with_context(|| format!("failed to open {}", trace_path.display()))?;
+        let mut magic = [0u8; 8];
+        let is_compressed = file.read_exact(&mut magic).is_ok() && magic == BLOCK_MAGIC;
+        file.rewind()?;
+
+        let mut cursor = if is_compressed {
+            Self::from_keyframe(BufReader::new(BlockReader::new(file)?), keyframe)?
+        } else {
+            Self::from_keyframe(BufReader::new(file), keyframe)?
+        };
+        cursor.advance_to(at)?;
+        Ok(cursor)
+    }
+
+    fn from_keyframe(
+        mut reader: impl BufRead + Seek + 'static,
+        keyframe: Option<(ArchState, u64)>,
+    ) -> anyhow::Result<Self> {
+        let is_binary = reader.fill_buf()?.starts_with(&MAGIC);
+
+        if is_binary {
+            let mut header = [0u8; HEADER_SIZE];
+            reader.read_exact(&mut header)?;
+            let mut decoder = TraceDecoder::from_header(&header)?;
+
+            let (state, offset) = keyframe
+                .unwrap_or_else(|| (ArchState::new(decoder.vlen_byte()), HEADER_SIZE as u64));
+            ensure!(
+                state.vlen_byte() == decoder.vlen_byte(),
+                "VLEN of index and trace differ"
+            );
+            reader.seek(SeekFrom::Start(offset))?;
+            decoder.resume(state.next_pc);
+
+            Ok(Self {
+                state,
+                records: Records::Binary {
+                    reader: Box::new(reader),
+                    decoder,
+                    writes: CommitWrites::default(),
+                },
+            })
+        } else {
+            let (state, offset) = keyframe.unwrap_or_else(|| (ArchState::new(VLEN_BYTE), 0));
+            reader.seek(SeekFrom::Start(offset))?;
+
+            Ok(Self {
+                state,
+                records: Records::Json {
+                    reader: Box::new(reader),
+                    line: String::new(),
+                },
+            })
+        }
+    }
+
+    pub fn state(&self) -> &ArchState {
+        &self.state
+    }
+
+    pub fn into_state(self) -> ArchState {
+        self.state
+    }
+
+    /// Continue the rolling hash from a known value,
+    /// since the hash of a keyframe is not recorded
+    pub fn seed_hash(&mut self, hash: u64) {
+        self.state.hash = hash;
+    }
+
+    fn advance_to(&mut self, at: u64) -> anyhow::Result<()> {
+        while self.state.commits < at {
+            if !self.next_commit()? {
+                bail!("trace ends after {} instructions", self.state.commits);
+            }
+        }
+        Ok(())
+    }
+
+    /// Apply the records up to the next commit, returns false at the end of trace
+    pub fn next_commit(&mut self) -> anyhow::Result<bool> {
+        let commits = self.state.commits;
+        while self.state.commits == commits {
+            if !self.next_record()? {
+                return Ok(false);
+            }
+        }
+        Ok(true)
+    }
+
+    /// The next record, which is applied to the state as well, None at the end of trace
+    pub fn next_log(&mut self) -> anyhow::Result<Option<PokedexLog>> {
+        let log = match &mut self.records {
+            Records::Binary {
+                reader, decoder, ..
+            } => decoder.decode(reader)?,
+            Records::Json { reader, line } => {
+                line.clear();
+                if reader.read_line(line)? == 0 {
+                    return Ok(None);
+                }
+                let log = serde_json::from_str(line).with_context(|| {
+                    format!("fail parse trace after {} instructions", self.state.commits)
+                })?;
+                Some(log)
+            }
+        };
+        if let Some(log) = &log {
+            self.state.apply_log(log);
+        }
+        Ok(log)
+    }
+
+    fn next_record(&mut self) -> anyhow::Result<bool> {
+        match &mut self.records {
+            Records::Binary {
+                reader,
+                decoder,
+                writes,
+            } => {
+                let Some(record) = decoder.decode_record(reader, writes)? else {
+                    return Ok(false);
+                };
+                self.state.apply_record(record, writes);
+            }
+            Records::Json { reader, line } => {
+                line.clear();
+                if reader.read_line(line)? == 0 {
+                    return Ok(false);
+                }
+                let log: PokedexLog = serde_json::from_str(line).with_context(|| {
+                    format!("fail parse trace after {} instructions", self.state.commits)
+                })?;
+                self.state.apply_log(&log);
+            }
+        }
+        Ok(true)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::trace::test_trace::TestTrace;
+
+    // commit i writes x1 = i, at the fall-through pc
+    fn counting_trace(commits: u32) -> TestTrace {
+        let mut trace = TestTrace::new(0x8000_0000);
+        for i in 1..=commits {
+            trace.commit(0x8000_0000 + 4 * (i - 1), 0x0000_0013, &[(1, i)], &[]);
+        }
+        trace
+    }
+
+    #[test]
+    fn test_trace_index_seek() {
+        let path =
+            std::env::temp_dir().join(format!("pokedex-index-test-{}.bin", std::process::id()));
+        let mut trace = counting_trace(10);
+        trace.exit(0);
+        trace.write(&path, 4);
+
+        for at in [0, 3, 4, 7, 8, 10] {
+            let state = state_at(&path, at).unwrap();
+            assert_eq!(state.commits, at);
+            assert_eq!(state.xregs[1], at as u32);
+            if at > 0 {
+                assert_eq!(state.last_pc, 0x8000_0000 + 4 * (at as u32 - 1));
+            }
+        }
+        assert!(state_at(&path, 11).is_err());
+
+        // a corrupted keyframe shows the index is used
+        let index_path = index_path(&path);
+        let mut raw = std::fs::read(&index_path).unwrap();
+        // x1 of the first keyframe, after commits, offset and three pcs
+        raw[HEADER_SIZE + 8 + 8 + 12 + 4] = 0xff;
+        std::fs::write(&index_path, raw).unwrap();
+        assert_eq!(state_at(&path, 5).unwrap().xregs[1], 5);
+        assert_eq!(state_at(&path, 4).unwrap().xregs[1], 0xff);
+
+        TestTrace::remove(&path);
+    }
+
+    #[test]
+    fn test_trace_index_footer() {
+        let path =
+            std::env::temp_dir().join(format!("pokedex-index-footer-{}.bin", std::process::id()));
+        // no exit, the keyframe due after the last commit is written by finish
+        let trace = counting_trace(12);
+        trace.write(&path, 4);
+        let trace_len = trace.bytes().len() as u64;
+
+        let mut keyframes = Keyframes::open(&path).unwrap().unwrap();
+        let mut found = vec![];
+        while let Some((state, offset)) = keyframes.next_keyframe().unwrap() {
+            found.push((state.commits, offset));
+        }
+        assert_eq!(found.last(), Some(&(12, trace_len)));
+        assert_eq!(found.len(), 3);
+
+        let binary_searched: Vec<_> = (0..=13)
+            .map(|at| keyframes.latest_at(at).unwrap().map(|(s, _)| s.commits))
+            .collect();
+        assert_eq!(state_at(&path, 12).unwrap().xregs[1], 12);
+
+        // without the footer, e.g. of an interrupted run, the keyframes are scanned
+        let index_path = index_path(&path);
+        let mut raw = std::fs::read(&index_path).unwrap();
+        raw.truncate(raw.len() - 8);
+        std::fs::write(&index_path, raw).unwrap();
+        let mut keyframes = Keyframes::open(&path).unwrap().unwrap();
+        let scanned: Vec<_> = (0..=13)
+            .map(|at| keyframes.latest_at(at).unwrap().map(|(s, _)| s.commits))
+            .collect();
+        assert_eq!(binary_searched, scanned);
+        assert_eq!(scanned[3], None);
+        assert_eq!(scanned[7], Some(4));
+        assert_eq!(scanned[13], Some(12));
+
+        TestTrace::remove(&path);
+    }
+
+    #[test]
+    fn test_keyframe_csr_fields() {
+        let path =
+            std::env::temp_dir().join(format!("pokedex-csr-fields-{}.bin", std::process::id()));
+        let mut trace = TestTrace::new(0x8000_0000);
+        // fcsr, then frm, then fcsr again
+        for (i, csr) in [(0x003, 0x21), (0x002, 0x2), (0x003, 0xe0), (0x001, 0x3)]
+            .into_iter()
+            .enumerate()
+        {
+            trace.commit(0x8000_0000 + 4 * i as u32, 0x0000_0013, &[], &[csr]);
+        }
+        trace.write(&path, 1);
+
+        let csrs_at = |at: u64| {
+            let state = state_at(&path, at).unwrap();
+            (
+                state.csrs.get("fcsr").copied(),
+                state.csrs.get("frm").copied(),
+                state.csrs.get("fflags").copied(),
+            )
+        };
+        assert_eq!(csrs_at(1), (Some(0x21), None, None));
+        assert_eq!(csrs_at(2), (Some(0x41), Some(0x2), None));
+        // the newer whole CSR updates the field written before it
+        assert_eq!(csrs_at(3), (Some(0xe0), Some(0x7), None));
+        assert_eq!(csrs_at(4), (Some(0xe3), Some(0x7), Some(0x3)));
+
+        TestTrace::remove(&path);
+    }
+}
@@ -0,0 +1,287 @@
+//! Binary commit trace
+//!
+//! A compact alternative to the JSON lines trace, all integers are little endian.
+//!
+//! File header (16 bytes):
+//!
+//! | offset | size | field                          |
+//! |--------|------|--------------------------------|
+//! | 0      | 8    | magic `b"PDXTRACE"`            |
+//! | 8      | 2    | format version                 |
+//! | 10     | 2    | flags                          |
+//! | 12     | 2    | VLEN in bytes                  |
+//! | 14     | 2    | reserved, must be zero         |
+//!
+//! Header flags: bit 0 set if VRF writes are delta encoded, other bits must be zero.
+//!
+//! Followed by records, each starts with a one byte tag:
+//!
+//! - `RESET`: pc (u32)
+//! - `EXIT`: exit code (u32)
+//! - `COMMIT`: a fixed-width header of
+//!   flags (u8, bit 0 set for compressed instruction),
+//!   and number of XRF, FRF, VRF and CSR writes (u8 each),
+//!   then the pc delta, the instruction (u16 if compressed, otherwise u32),
+//!   and the writes:
+//!   - XRF/FRF write: rd (u8), value (u32)
+//!   - VRF write: rd (u8), VLEN bytes of the register,
+//!     or if delta encoded, number of ranges (u8) and the ranges,
+//!     each of offset to the end of the previous range, length (varint), and the new bytes.
+//!     Bytes outside the ranges are the same as the last write of the register in the trace.
+//!     No range means the register is written with the same value.
+//!   - CSR write: CSR address (u16), value (u32)
+//!
+//! The pc delta is the difference to the fall-through pc of the previous commit
+//! (or the reset pc), encoded as a zigzag LEB128 varint,
+//! thus sequential instructions take a single byte.
+
+use std::{
+    fs::File,
+    io::{BufReader, BufWriter, Write as _},
+    path::PathBuf,
+    process::ExitCode,
+};
+
+use anyhow::Context as _;
+
+use crate::pokedex::TraceFormat;
+
+mod async_writer;
+mod block;
+mod filter;
+mod hash;
+mod index;
+mod reader;
+mod stream;
+mod text;
+mod writer;
+
+pub use async_writer::AsyncTracer;
+pub use filter::{TraceFilter, TraceFilterArgs};
+pub use hash::{Divergence, first_divergence};
+pub use index::{ArchState, Keyframes, TraceCursor};
+pub use reader::TraceReader;
+pub use stream::{TraceSink, open_input, read_magic};
+pub use text::StdoutTracer;
+pub use writer::BinaryTracer;
+
+pub const MAGIC: [u8; 8] = *b"PDXTRACE";
+pub const VERSION: u16 = 1;
+pub const HEADER_SIZE: usize = 16;
+
+const TAG_RESET: u8 = 1;
+const TAG_EXIT: u8 = 2;
+const TAG_COMMIT: u8 = 3;
+
+const HEADER_FLAG_VRF_DELTA: u16 = 1;
+
+const COMMIT_FLAG_COMPRESSED: u8 = 1;
+
+// same as the model, see also difftest::replay
+pub const VLEN_BYTE: usize = 32;
+
+/// Options of the trace written by `run -o`
+#[derive(Debug, Clone, Copy)]
+pub struct TraceOptions {
+    pub format: TraceFormat,
+    pub vrf_delta: bool,
+    // instructions between keyframes in the sidecar index, zero for no index
+    pub index_interval: u64,
+    // instructions between entries of the sidecar state hashes, zero for no hashes
+    pub hash_interval: u64,
+    // flow control window in frames of a socket stream, zero for no flow control
+    pub stream_window: u32,
+    // compress the output in blocks, see block
+    pub compress: bool,
+    // annotate commits of the JSON format with disassembly
+    pub disasm: bool,
+}
+
+/// Inspect trace files
+#[derive(clap::Parser, Debug)]
+pub struct TraceArgs {
+    #[command(subcommand)]
+    command: TraceCommands,
+}
+
+#[derive(clap::Subcommand, Debug)]
+enum TraceCommands {
+    /// Convert a binary trace to JSON lines, same as the output of `run -o`.
+    /// A block compressed trace is decompressed.
+    Convert {
+        /// Path to the binary trace, "-" for stdin, or "unix:<path>" to accept a stream
+        input_path: PathBuf,
+
+        /// Output path of the JSON lines trace
+        #[arg(short = 'o', long)]
+        output_path: PathBuf,
+    },
+
+    /// Print the architectural state after some instructions,
+    /// seeking from the nearest keyframe if the trace has an index
+    Show {
+        /// Path to the binary or JSON lines trace
+        trace_path: PathBuf,
+
+        /// Number of committed instructions
+        #[arg(long)]
+        at: u64,
+    },
+}
+
+pub fn run_subcommand(args: &TraceArgs) -> anyhow::Result<ExitCode> {
+    match &args.command {
+        TraceCommands::Convert {
+            input_path,
+            output_path,
+        } => {
+            let input = open_input(input_path)?;
+            let mut reader = TraceReader::new(BufReader::new(input))
+                .with_context(|| format!("reading binary trace {}", input_path.display()))?;
+
+            let output = File::create(output_path)
+                .with_context(|| format!("failed to create {}", output_path.display()))?;
+            let mut writer = BufWriter::new(output);
+
+            while let Some(log) = reader.next_log()? {
+                serde_json::to_writer(&mut writer, &log)?;
+                writer.write_all(b"\n")?;
+            }
+            writer.flush()?;
+
+            Ok(ExitCode::SUCCESS)
+        }
+        TraceCommands::Show { trace_path, at } => {
+            let state = index::state_at(trace_path, *at)
+                .with_context(|| format!("reading trace {}", trace_path.display()))?;
+            state.print();
+
+            Ok(ExitCode::SUCCESS)
+        }
+    }
+}
+
+fn zigzag_encode(value: i32) -> u32 {
+    ((value << 1) ^ (value >> 31)) as u32
+}
+
+fn zigzag_decode(value: u32) -> i32 {
+    ((value >> 1) as i32) ^ -((value & 1) as i32)
+}
+
+/// Binary traces encoded from steps of the stub model, with an index, for tests
+#[cfg(test)]
+pub mod test_trace {
+    use std::path::Path;
+
+    use super::*;
+    use crate::{
+        common::CommitWrites,
+        model::stub::{StubModel, StubStep},
+    };
+
+    pub struct TestTrace {
+        model: StubModel,
+        encoder: writer::TraceEncoder,
+        trace: Vec<u8>,
+    }
+
+    impl TestTrace {
+        pub fn new(reset_pc: u32) -> Self {
+            Self::with_vrf_delta(reset_pc, false)
+        }
+
+        pub fn with_vrf_delta(reset_pc: u32, vrf_delta: bool) -> Self {
+            let mut encoder = writer::TraceEncoder::new(vrf_delta);
+            let mut trace = writer::file_header(vrf_delta).to_vec();
+            encoder.encode_reset(&mut trace, reset_pc);
+            Self {
+                model: StubModel::new(),
+                encoder,
+                trace,
+            }
+        }
+
+        /// An uncompressed instruction writing XRF and CSRs, given by address
+        pub fn commit(&mut self, pc: u32, inst: u32, xrf: &[(u8, u32)], csrs: &[(u16, u32)]) {
+            self.step(&StubStep {
+                xrf,
+                csrs,
+                ..StubStep::commit(pc, inst)
+            });
+        }
+
+        pub fn step(&mut self, step: &StubStep) {
+            let detail = self.model.step(step);
+            self.encoder.encode_step(&mut self.trace, detail);
+        }
+
+        pub fn exit(&mut self, code: u32) {
+            self.encoder.encode_exit(&mut self.trace, code);
+        }
+
+        /// The file header followed by the records
+        pub fn bytes(&self) -> &[u8] {
+            &self.trace
+        }
+
+        /// Write the trace, and its index with a keyframe every interval instructions
+        pub fn write(&self, path: &Path, interval: u64) {
+            self.write_with_hashes(path, interval, 0);
+        }
+
+        /// Write the trace and its index, and also state hashes if hash_interval is not zero
+        pub fn write_with_hashes(&self, path: &Path, index_interval: u64, hash_interval: u64) {
+            std::fs::write(path, &self.trace).unwrap();
+
+            let trace = &self.trace;
+            let mut index = index::IndexWriter::create(path, index_interval).unwrap();
+            let mut hashes = (hash_interval != 0)
+                .then(|| hash::HashWriter::create(path, hash_interval).unwrap());
+            let header = trace[..HEADER_SIZE].try_into().unwrap();
+            let mut decoder = reader::TraceDecoder::from_header(header).unwrap();
+            let mut writes = CommitWrites::default();
+            let mut records = &trace[HEADER_SIZE..];
+            while !records.is_empty() {
+                index
+                    .before_record((trace.len() - records.len()) as u64)
+                    .unwrap();
+                let record = decoder.decode_record(&mut records, &mut writes).unwrap();
+                let record = record.unwrap();
+                index.apply_record(record, &writes);
+                if let Some(hashes) = &mut hashes {
+                    hashes.apply_record(record, &writes).unwrap();
+                }
+            }
+            index.finish(trace.len() as u64).unwrap();
+            if let Some(hashes) = &mut hashes {
+                hashes.finish().unwrap();
+            }
+        }
+
+        /// Remove a trace written above, and its index and hashes
+        pub fn remove(path: &Path) {
+            let hash_path = hash::hash_path(path);
+            if hash_path.exists() {
+                std::fs::remove_file(hash_path).unwrap();
+            }
+            std::fs::remove_file(index::index_path(path)).unwrap();
+            std::fs::remove_file(path).unwrap();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_zigzag() {
+        for value in [0, 1, -1, 2, -2, 4096, -4096, i32::MAX, i32::MIN] {
+            assert_eq!(zigzag_decode(zigzag_encode(value)), value);
+        }
+        assert_eq!(zigzag_encode(0), 0);
+        assert_eq!(zigzag_encode(-1), 1);
+        assert_eq!(zigzag_encode(1), 2);
+    }
+}
@@ -0,0 +1,397 @@
+use std::io::{ErrorKind, Read};
+
+use anyhow::{bail, ensure};
+
+use crate::{
+    common::{CommitLog, CommitWrites, PokedexLog, StateWrite, VrfWrite},
+    pokedex::{name_of_csr, try_name_of_csr},
+};
+
+use super::{
+    COMMIT_FLAG_COMPRESSED, HEADER_FLAG_VRF_DELTA, HEADER_SIZE, MAGIC, TAG_COMMIT, TAG_EXIT,
+    TAG_RESET, VERSION, zigzag_decode,
+};
+
+/// Read records of a binary trace as `PokedexLog`, the same as a JSON lines trace
+pub struct TraceReader<R> {
+    reader: R,
+    decoder: TraceDecoder,
+}
+
+impl<R: Read> TraceReader<R> {
+    pub fn new(mut reader: R) -> anyhow::Result<Self> {
+        let mut header = [0u8; HEADER_SIZE];
+        reader.read_exact(&mut header)?;
+        let decoder = TraceDecoder::from_header(&header)?;
+
+        Ok(Self { reader, decoder })
+    }
+
+    /// Returns None at the end of trace
+    pub fn next_log(&mut self) -> anyhow::Result<Option<PokedexLog>> {
+        self.decoder.decode(&mut self.reader)
+    }
+}
+
+/// Decode records following the file header,
+/// records could be fed in separate chunks as long as no record is split.
+pub struct TraceDecoder {
+    vlen_byte: usize,
+    vrf_delta: bool,
+    next_pc: u32,
+}
+
+impl TraceDecoder {
+    pub fn from_header(header: &[u8; HEADER_SIZE]) -> anyhow::Result<Self> {
+        ensure!(header[0..8] == MAGIC, "not a binary pokedex trace");
+        let version = u16::from_le_bytes([header[8], header[9]]);
+        ensure!(
+            version == VERSION,
+            "unsupported trace version {version}, expected {VERSION}"
+        );
+        let flags = u16::from_le_bytes([header[10], header[11]]);
+        ensure!(
+            flags & !HEADER_FLAG_VRF_DELTA == 0,
+            "unsupported trace flags {flags:#x}"
+        );
+        let vlen_byte = u16::from_le_bytes([header[12], header[13]]) as usize;
+
+        Ok(Self {
+            vlen_byte,
+            vrf_delta: flags & HEADER_FLAG_VRF_DELTA != 0,
+            next_pc: 0,
+        })
+    }
+
+    pub fn vlen_byte(&self) -> usize {
+        self.vlen_byte
+    }
+
+    /// Continue decoding from a record boundary, next_pc is the fall-through pc of the last record
+    pub fn resume(&mut self, next_pc: u32) {
+        self.next_pc = next_pc;
+    }
+
+    /// Returns None if reader reaches EOF at a record boundary
+    pub fn decode(&mut self, reader: &mut impl Read) -> anyhow::Result<Option<PokedexLog>> {
+        let mut writes = CommitWrites::default();
+        let Some(record) = self.decode_record(reader, &mut writes)? else {
+            return Ok(None);
+        };
+
+        let log = match record {
+            Record::Reset { pc } => PokedexLog::Reset { pc },
+            Record::Exit { code } => PokedexLog::Exit { code },
+            Record::Commit {
+                pc,
+                is_compressed,
+                instruction,
+            } => {
+                let mut states_changed = vec![];
+                for &(rd, value) in &writes.xrf {
+                    states_changed.push(StateWrite::Xrf { rd, value });
+                }
+                for &(rd, value) in &writes.frf {
+                    states_changed.push(StateWrite::Frf { rd, value });
+                }
+                for (VrfWrite { rd, offset, .. }, value) in writes.vrf_writes() {
+                    let value = value.to_vec();
+                    states_changed.push(match offset {
+                        None => StateWrite::Vrf { rd, value },
+                        Some(offset) => StateWrite::VrfPatch { rd, offset, value },
+                    });
+                }
+                for &(csr, value) in &writes.csr {
+                    let name = name_of_csr(csr).into();
+                    states_changed.push(StateWrite::Csr { name, value });
+                }
+                PokedexLog::Commit(CommitLog {
+                    pc,
+                    is_compressed,
+                    instruction,
+                    states_changed,
+                })
+            }
+        };
+
+        Ok(Some(log))
+    }
+
+    /// Decode a record without allocation, state writes of a commit are stored into writes
+    pub fn decode_record(
+        &mut self,
+        reader: &mut impl Read,
+        writes: &mut CommitWrites,
+    ) -> anyhow::Result<Option<Record>> {
+        let mut tag = [0u8];
+        match reader.read_exact(&mut tag) {
+            Ok(()) => {}
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e.into()),
+        }
+
+        let record = match tag[0] {
+            TAG_RESET => {
+                let pc = read_u32(reader)?;
+                self.next_pc = pc;
+                Record::Reset { pc }
+            }
+            TAG_EXIT => Record::Exit {
+                code: read_u32(reader)?,
+            },
+            TAG_COMMIT => self.decode_commit(reader, writes)?,
+            tag => bail!("unknown trace record tag {tag}"),
+        };
+
+        Ok(Some(record))
+    }
+
+    fn decode_commit(
+        &mut self,
+        reader: &mut impl Read,
+        writes: &mut CommitWrites,
+    ) -> anyhow::Result<Record> {
+        let mut header = [0u8; 5];
+        reader.read_exact(&mut header)?;
+        let [flags, n_xrf, n_frf, n_vrf, n_csr] = header;
+
+        let delta = zigzag_decode(read_varint(reader)?);
+        let pc = self.next_pc.wrapping_add(delta as u32);
+
+        let is_compressed = flags & COMMIT_FLAG_COMPRESSED != 0;
+        let instruction = if is_compressed {
+            read_u16(reader)? as u32
+        } else {
+            read_u32(reader)?
+        };
+        self.next_pc = pc.wrapping_add(if is_compressed { 2 } else { 4 });
+
+        writes.clear();
+        for _ in 0..n_xrf {
+            let rd = read_u8(reader)?;
+            let value = read_u32(reader)?;
+            writes.xrf.push((rd, value));
+        }
+        for _ in 0..n_frf {
+            let rd = read_u8(reader)?;
+            let value = read_u32(reader)?;
+            writes.frf.push((rd, value));
+        }
+        for _ in 0..n_vrf {
+            let rd = read_u8(reader)?;
+            if self.vrf_delta {
+                self.decode_vrf_delta(reader, rd, writes)?;
+            } else {
+                reader.read_exact(writes.push_vrf(rd, self.vlen_byte))?;
+            }
+        }
+        for _ in 0..n_csr {
+            let csr = read_u16(reader)?;
+            // decoded CSRs are known to the model, consumers may look up their names
+            ensure!(
+                csr <= 0xfff && try_name_of_csr(csr).is_some(),
+                "unknown CSR address {csr:#x}"
+            );
+            let value = read_u32(reader)?;
+            writes.csr.push((csr, value));
+        }
+
+        Ok(Record::Commit {
+            pc,
+            is_compressed,
+            instruction,
+        })
+    }
+}
+
+impl TraceDecoder {
+    // Each range becomes a patch write, a single range covering the register is a full write
+    fn decode_vrf_delta(
+        &self,
+        reader: &mut impl Read,
+        rd: u8,
+        writes: &mut CommitWrites,
+    ) -> anyhow::Result<()> {
+        let count = read_u8(reader)?;
+        if count == 0 {
+            // written with the same value
+            writes.push_vrf_patch(rd, 0, 0);
+            return Ok(());
+        }
+
+        let mut prev_end = 0;
+        for _ in 0..count {
+            let offset = prev_end + read_varint(reader)? as usize;
+            let len = read_varint(reader)? as usize;
+            ensure!(
+                offset + len <= self.vlen_byte,
+                "VRF delta out of register: offset {offset}, length {len}"
+            );
+            let slot = if count == 1 && offset == 0 && len == self.vlen_byte {
+                writes.push_vrf(rd, len)
+            } else {
+                writes.push_vrf_patch(rd, offset as u16, len)
+            };
+            reader.read_exact(slot)?;
+            prev_end = offset + len;
+        }
+        Ok(())
+    }
+}
+
+/// A decoded record, state writes of a commit are stored separately
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Record {
+    Reset {
+        pc: u32,
+    },
+    Exit {
+        code: u32,
+    },
+    Commit {
+        pc: u32,
+        is_compressed: bool,
+        instruction: u32,
+    },
+}
+
+pub(super) fn read_u8(reader: &mut impl Read) -> std::io::Result<u8> {
+    let mut buf = [0u8; 1];
+    reader.read_exact(&mut buf)?;
+    Ok(buf[0])
+}
+
+pub(super) fn read_u16(reader: &mut impl Read) -> std::io::Result<u16> {
+    let mut buf = [0u8; 2];
+    reader.read_exact(&mut buf)?;
+    Ok(u16::from_le_bytes(buf))
+}
+
+pub(super) fn read_u32(reader: &mut impl Read) -> std::io::Result<u32> {
+    let mut buf = [0u8; 4];
+    reader.read_exact(&mut buf)?;
+    Ok(u32::from_le_bytes(buf))
+}
+
+fn read_varint(reader: &mut impl Read) -> anyhow::Result<u32> {
+    let mut value = 0u32;
+    for shift in (0..35).step_by(7) {
+        let byte = read_u8(reader)?;
+        value |= ((byte & 0x7f) as u32) << shift;
+        if byte & 0x80 == 0 {
+            return Ok(value);
+        }
+    }
+    bail!("varint too long")
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{
+        common::{CommitLogRef, PokedexLogRef},
+        model::stub::StubStep,
+        trace::{VLEN_BYTE, test_trace::TestTrace},
+        util::alloc_counter::allocations,
+    };
+
+    fn decode_to_json(
+        decoder: &mut TraceDecoder,
+        mut records: &[u8],
+        writes: &mut CommitWrites,
+        json: &mut Vec<u8>,
+    ) {
+        json.clear();
+        while let Some(record) = decoder.decode_record(&mut records, writes).unwrap() {
+            let log = match record {
+                Record::Reset { pc } => PokedexLogRef::Reset { pc },
+                Record::Exit { code } => PokedexLogRef::Exit { code },
+                Record::Commit {
+                    pc,
+                    is_compressed,
+                    instruction,
+                } => PokedexLogRef::Commit(CommitLogRef {
+                    pc,
+                    is_compressed,
+                    instruction,
+                    states_changed: writes,
+                    disasm: None,
+                }),
+            };
+            serde_json::to_writer(&mut *json, &log).unwrap();
+        }
+    }
+
+    #[test]
+    fn test_decode_no_alloc() {
+        let v2: [u8; VLEN_BYTE] = std::array::from_fn(|i| i as u8);
+        let mut trace = TestTrace::new(0x190);
+        trace.step(&StubStep {
+            xrf: &[(1, 0x1234_5678)],
+            vrf: &[(2, &v2)],
+            csrs: &[(0x300, 0x1800)],
+            ..StubStep::commit(0x190, 0x0000_0013)
+        });
+        let (header, records) = trace.bytes().split_at(HEADER_SIZE);
+
+        let mut decoder = TraceDecoder::from_header(header.try_into().unwrap()).unwrap();
+        let mut writes = CommitWrites::default();
+        let mut json = Vec::with_capacity(1 << 16);
+
+        // warm up scratch buffers
+        decode_to_json(&mut decoder, records, &mut writes, &mut json);
+
+        let before = allocations();
+        for _ in 0..100 {
+            decode_to_json(&mut decoder, records, &mut writes, &mut json);
+        }
+        assert_eq!(
+            allocations(),
+            before,
+            "decode and serialize should not allocate"
+        );
+
+        // borrowed and owned logs produce the same JSON
+        let mut expected = serde_json::to_vec(&PokedexLog::Reset { pc: 0x190 }).unwrap();
+        let commit = PokedexLog::Commit(CommitLog {
+            pc: 0x190,
+            is_compressed: false,
+            instruction: 0x13,
+            states_changed: vec![
+                StateWrite::Xrf {
+                    rd: 1,
+                    value: 0x12345678,
+                },
+                StateWrite::Vrf {
+                    rd: 2,
+                    value: v2.to_vec(),
+                },
+                StateWrite::Csr {
+                    name: "mstatus".into(),
+                    value: 0x1800,
+                },
+            ],
+        });
+        expected.extend(serde_json::to_vec(&commit).unwrap());
+        assert_eq!(json, expected);
+    }
+
+    #[test]
+    fn test_decode_unknown_csr() {
+        // a commit writing one CSR after reset
+        let commit = |csr: u16| {
+            let mut trace = TestTrace::new(0);
+            trace.commit(0, 0x0000_0013, &[], &[(csr, 7)]);
+
+            let mut reader = TraceReader::new(trace.bytes()).unwrap();
+            reader.next_log().unwrap();
+            reader.next_log()
+        };
+
+        assert!(commit(0x300).is_ok());
+        // a CSR the model does not have is a decode error, not a panic
+        let e = commit(0x7c0).unwrap_err();
+        assert!(e.to_string().contains("unknown CSR"), "{e}");
+        assert!(commit(0x1000).is_err());
+    }
+}
@@ -0,0 +1,376 @@
+//! Streaming trace output
+//!
+//! Besides a regular file, `run -o` accepts a FIFO, `-` for stdout,
+//! or `unix:<path>` for a Unix domain socket the consumer listens on.
+//! The stream carries the same bytes as the trace file, thus a consumer
+//! could process the trace while the simulation is running.
+//!
+//! A pipe or socket already blocks the producer when the consumer falls behind,
+//! but the kernel may buffer megabytes of socket data.
+//! On a Unix socket the producer could ask for flow control,
+//! which bounds the unconsumed data to a window of frames.
+//! The stream then starts with a hello (16 bytes, little endian):
+//!
+//! | offset | size | field                              |
+//! |--------|------|------------------------------------|
+//! | 0      | 8    | magic `b"PDXFRAME"`                |
+//! | 8      | 2    | protocol version                   |
+//! | 10     | 2    | reserved, must be zero             |
+//! | 12     | 4    | window, max unacknowledged frames  |
+//!
+//! Followed by frames, each of length (u32) and the payload.
+//! A zero length frame ends the stream.
+//! The consumer writes one byte back for each frame it has consumed.
+//!
+//! Without flow control, the trace bytes are written as is.
+
+use std::{
+    fmt,
+    fs::File,
+    io::{Cursor, ErrorKind, Read, Write},
+    os::unix::{
+        fs::FileTypeExt as _,
+        net::{UnixListener, UnixStream},
+    },
+    path::{Path, PathBuf},
+    str::FromStr,
+    time::{Duration, Instant},
+};
+
+use anyhow::{Context as _, ensure};
+
+use super::block::{BLOCK_MAGIC, BlockReader};
+
+pub const FRAME_MAGIC: [u8; 8] = *b"PDXFRAME";
+pub const FRAME_VERSION: u16 = 1;
+const HELLO_SIZE: usize = 16;
+
+// A frame is sent once its payload grows beyond this size
+const FRAME_SIZE: usize = 1 << 16;
+
+const ACK: u8 = 0x06;
+
+// The consumer may start listening after the producer
+const CONNECT_TIMEOUT: Duration = Duration::from_secs(30);
+
+/// Where the trace of `run -o` is written
+#[derive(Debug, Clone)]
+pub enum TraceSink {
+    /// A regular file, or an existing FIFO
+    Path(PathBuf),
+    /// Standard output, given as "-"
+    Stdout,
+    /// Connect to a Unix domain socket, given as "unix:<path>"
+    Unix(PathBuf),
+}
+
+impl FromStr for TraceSink {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        if s == "-" {
+            Ok(Self::Stdout)
+        } else if let Some(path) = s.strip_prefix("unix:") {
+            if path.is_empty() {
+                return Err("empty Unix socket path".into());
+            }
+            Ok(Self::Unix(path.into()))
+        } else {
+            Ok(Self::Path(s.into()))
+        }
+    }
+}
+
+impl fmt::Display for TraceSink {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Self::Path(path) => write!(f, "{}", path.display()),
+            Self::Stdout => write!(f, "stdout"),
+            Self::Unix(path) => write!(f, "unix:{}", path.display()),
+        }
+    }
+}
+
+impl TraceSink {
+    /// Path of a regular file, which could have a sidecar index
+    pub fn file_path(&self) -> Option<&Path> {
+        match self {
+            Self::Path(path) if !is_fifo(path) => Some(path),
+            _ => None,
+        }
+    }
+
+    /// Open the sink for writing, window is the flow control window in frames,
+    /// zero for no flow control, and only applies to Unix sockets.
+    pub fn open(&self, window: u32) -> std::io::Result<Box<dyn Write + Send>> {
+        match self {
+            // opening a FIFO blocks until the consumer opens it
+            Self::Path(path) => Ok(Box::new(File::create(path)?)),
+            Self::Stdout => Ok(Box::new(std::io::stdout())),
+            Self::Unix(path) => {
+                let stream = connect(path)?;
+                if window == 0 {
+                    Ok(Box::new(stream))
+                } else {
+                    Ok(Box::new(FramedWriter::new(stream, window)?))
+                }
+            }
+        }
+    }
+}
+
+fn is_fifo(path: &Path) -> bool {
+    std::fs::metadata(path).is_ok_and(|m| m.file_type().is_fifo())
+}
+
+fn connect(path: &Path) -> std::io::Result<UnixStream> {
+    let start = Instant::now();
+    loop {
+        match UnixStream::connect(path) {
+            Ok(stream) => return Ok(stream),
+            Err(e)
+                if matches!(e.kind(), ErrorKind::NotFound | ErrorKind::ConnectionRefused)
+                    && start.elapsed() < CONNECT_TIMEOUT =>
+            {
+                std::thread::sleep(Duration::from_millis(10));
+            }
+            Err(e) => return Err(e),
+        }
+    }
+}
+
+/// Open a trace for reading: a file or FIFO path, "-" for stdin,
+/// or "unix:<path>" to listen on a Unix socket and accept one producer.
+/// A flow controlled stream is unframed, and a block compressed trace is decompressed,
+/// both transparently.
+pub fn open_input(path: &Path) -> anyhow::Result<Box<dyn Read + Send>> {
+    let spec = path.to_string_lossy();
+    let mut raw: Box<dyn Read + Send> = if spec == "-" {
+        Box::new(std::io::stdin())
+    } else if let Some(socket_path) = spec.strip_prefix("unix:") {
+        accept(Path::new(socket_path))?
+    } else {
+        let file =
+            File::open(path).with_context(|| format!("failed to open {}", path.display()))?;
+        Box::new(file)
+    };
+
+    let (magic, filled) = read_magic(raw.as_mut())?;
+    if filled == magic.len() && magic == BLOCK_MAGIC {
+        return Ok(Box::new(BlockReader::after_magic(raw)?));
+    }
+    Ok(Box::new(Cursor::new(magic[..filled].to_vec()).chain(raw)))
+}
+
+/// Read up to 8 bytes, fewer only at the end of input
+pub fn read_magic(reader: &mut dyn Read) -> std::io::Result<([u8; 8], usize)> {
+    let mut magic = [0u8; 8];
+    let mut filled = 0;
+    while filled < magic.len() {
+        match reader.read(&mut magic[filled..])? {
+            0 => break,
+            n => filled += n,
+        }
+    }
+    Ok((magic, filled))
+}
+
+fn accept(socket_path: &Path) -> anyhow::Result<Box<dyn Read + Send>> {
+    // a socket file left by a previous consumer refuses to bind
+    if std::fs::metadata(socket_path).is_ok_and(|m| m.file_type().is_socket()) {
+        std::fs::remove_file(socket_path)?;
+    }
+    let listener = UnixListener::bind(socket_path)
+        .with_context(|| format!("failed to listen on {}", socket_path.display()))?;
+    let (mut stream, _) = listener.accept()?;
+    drop(listener);
+    let _ = std::fs::remove_file(socket_path);
+
+    // sniff the hello, the trace itself never starts with it
+    let (magic, filled) = read_magic(&mut stream)?;
+    if filled < magic.len() || magic != FRAME_MAGIC {
+        return Ok(Box::new(
+            Cursor::new(magic[..filled].to_vec()).chain(stream),
+        ));
+    }
+
+    let mut rest = [0u8; HELLO_SIZE - 8];
+    stream.read_exact(&mut rest)?;
+    let version = u16::from_le_bytes([rest[0], rest[1]]);
+    ensure!(
+        version == FRAME_VERSION,
+        "unsupported trace stream version {version}, expected {FRAME_VERSION}"
+    );
+    Ok(Box::new(FramedReader::new(stream)))
+}
+
+/// Producer side of a flow controlled stream
+pub struct FramedWriter<S: Read + Write> {
+    stream: S,
+    frame: Vec<u8>,
+    window: u32,
+    // frames sent but not acknowledged yet
+    in_flight: u32,
+}
+
+impl<S: Read + Write> FramedWriter<S> {
+    pub fn new(mut stream: S, window: u32) -> std::io::Result<Self> {
+        assert!(window > 0);
+
+        let mut hello = [0u8; HELLO_SIZE];
+        hello[0..8].copy_from_slice(&FRAME_MAGIC);
+        hello[8..10].copy_from_slice(&FRAME_VERSION.to_le_bytes());
+        hello[12..16].copy_from_slice(&window.to_le_bytes());
+        stream.write_all(&hello)?;
+
+        Ok(Self {
+            stream,
+            frame: Vec::with_capacity(FRAME_SIZE * 2),
+            window,
+            in_flight: 0,
+        })
+    }
+
+    fn wait_ack(&mut self) -> std::io::Result<()> {
+        let mut acks = [0u8; 64];
+        let n = self.stream.read(&mut acks)?;
+        if n == 0 {
+            return Err(std::io::Error::new(
+                ErrorKind::UnexpectedEof,
+                "trace consumer closed the stream",
+            ));
+        }
+        self.in_flight = self.in_flight.saturating_sub(n as u32);
+        Ok(())
+    }
+
+    fn send_frame(&mut self) -> std::io::Result<()> {
+        if self.frame.is_empty() {
+            return Ok(());
+        }
+        while self.in_flight >= self.window {
+            self.wait_ack()?;
+        }
+
+        self.stream
+            .write_all(&(self.frame.len() as u32).to_le_bytes())?;
+        self.stream.write_all(&self.frame)?;
+        self.frame.clear();
+        self.in_flight += 1;
+        Ok(())
+    }
+}
+
+impl<S: Read + Write> Write for FramedWriter<S> {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        self.frame.extend_from_slice(buf);
+        if self.frame.len() >= FRAME_SIZE {
+            self.send_frame()?;
+        }
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        self.send_frame()?;
+        self.stream.flush()
+    }
+}
+
+impl<S: Read + Write> Drop for FramedWriter<S> {
+    fn drop(&mut self) {
+        // the end frame tells a complete trace from a crashed producer
+        let _ = self.send_frame();
+        let _ = self.stream.write_all(&0u32.to_le_bytes());
+        let _ = self.stream.flush();
+    }
+}
+
+/// Consumer side of a flow controlled stream, reads the payload of frames
+pub struct FramedReader<S: Read + Write> {
+    stream: S,
+    // bytes left in the current frame
+    remaining: usize,
+    // the current frame is consumed once the next one is requested
+    unacked: bool,
+    finished: bool,
+}
+
+impl<S: Read + Write> FramedReader<S> {
+    /// The hello should have been consumed
+    pub fn new(stream: S) -> Self {
+        Self {
+            stream,
+            remaining: 0,
+            unacked: false,
+            finished: false,
+        }
+    }
+}
+
+impl<S: Read + Write> Read for FramedReader<S> {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        if buf.is_empty() {
+            return Ok(0);
+        }
+        while self.remaining == 0 {
+            if self.finished {
+                return Ok(0);
+            }
+            if self.unacked {
+                self.stream.write_all(&[ACK])?;
+                self.unacked = false;
+            }
+            let mut len = [0u8; 4];
+            self.stream.read_exact(&mut len)?;
+            self.remaining = u32::from_le_bytes(len) as usize;
+            if self.remaining == 0 {
+                self.finished = true;
+            } else {
+                self.unacked = true;
+            }
+        }
+
+        let len = buf.len().min(self.remaining);
+        let n = self.stream.read(&mut buf[..len])?;
+        if n == 0 {
+            return Err(std::io::Error::new(
+                ErrorKind::UnexpectedEof,
+                "trace stream ends inside a frame",
+            ));
+        }
+        self.remaining -= n;
+        Ok(n)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_framed_stream() {
+        let (producer, mut consumer) = UnixStream::pair().unwrap();
+        let data: Vec<u8> = (0..300_000u32).map(|i| i as u8).collect();
+        let expected = data.clone();
+
+        // the producer blocks after two frames until the consumer catches up
+        let handle = std::thread::spawn(move || {
+            let mut writer = FramedWriter::new(producer, 2).unwrap();
+            for chunk in data.chunks(1000) {
+                writer.write_all(chunk).unwrap();
+            }
+        });
+
+        let mut hello = [0u8; 16];
+        consumer.read_exact(&mut hello).unwrap();
+        assert_eq!(hello[0..8], FRAME_MAGIC);
+        assert_eq!(hello[12..16], 2u32.to_le_bytes());
+
+        let mut received = vec![];
+        FramedReader::new(consumer)
+            .read_to_end(&mut received)
+            .unwrap();
+        handle.join().unwrap();
+        assert_eq!(received, expected);
+    }
+}
@@ -0,0 +1,230 @@
+//! Human readable trace of `run --stdout`
+//!
+//! Lines are formatted into a reused buffer without `std::fmt`,
+//! and the buffer is written to stdout in large chunks.
+
+use std::io::Write as _;
+
+use crate::{
+    disasm::Disassembler,
+    model::{Inst, StepDetail},
+    pokedex::{Tracer, name_of_csr},
+    util::{HEX_DIGITS, push_dec, push_hex},
+};
+
+use super::VLEN_BYTE;
+
+// The buffer is written to stdout once it grows beyond this size
+const FLUSH_SIZE: usize = 1 << 16;
+
+pub struct StdoutTracer {
+    buf: Vec<u8>,
+    disassembler: Option<&'static Disassembler>,
+}
+
+impl StdoutTracer {
+    /// Each instruction is followed by its disassembly if disasm is set
+    pub fn new(disasm: bool) -> Self {
+        Self {
+            buf: Vec::with_capacity(FLUSH_SIZE * 2),
+            disassembler: disasm.then(Disassembler::global),
+        }
+    }
+
+    fn after_line(&mut self) {
+        if self.buf.len() >= FLUSH_SIZE {
+            self.write_out();
+        }
+    }
+
+    fn write_out(&mut self) {
+        std::io::stdout()
+            .lock()
+            .write_all(&self.buf)
+            .expect("stdout trace write failed");
+        self.buf.clear();
+    }
+}
+
+impl Tracer for StdoutTracer {
+    fn trace_reset(&mut self, pc: u32) {
+        push_reset(&mut self.buf, pc);
+        self.after_line();
+    }
+
+    fn trace_exit(&mut self, exit_code: u32) {
+        push_exit(&mut self.buf, exit_code);
+        self.after_line();
+    }
+
+    fn trace_step(&mut self, detail: StepDetail) {
+        let Some(inst) = detail.inst else {
+            assert!(detail.changes.is_empty_changes());
+            return;
+        };
+
+        let buf = &mut self.buf;
+        push_inst(buf, detail.pc, inst);
+        if let Some(disassembler) = self.disassembler {
+            push_asm(buf, disassembler, detail.pc, inst);
+        }
+
+        // Print register changes
+        for (rd, value) in detail.changes.xreg_changes() {
+            push_reg(buf, b'x', rd, value);
+        }
+        for (rd, value) in detail.changes.freg_changes() {
+            push_reg(buf, b'f', rd, value);
+        }
+        for rd in detail.changes.vreg_change_indices() {
+            let mut value = [0u8; VLEN_BYTE];
+            detail.changes.core.read_vreg(rd, &mut value);
+            push_vreg(buf, rd, &value);
+        }
+        for csr in detail.changes.csr_change_indices() {
+            let value = detail.changes.core.read_csr(csr);
+            push_csr(buf, name_of_csr(csr), value);
+        }
+
+        buf.push(b'\n');
+        self.after_line();
+    }
+
+    fn flush(&mut self) {
+        self.write_out();
+        std::io::stdout()
+            .flush()
+            .expect("stdout trace flush failed");
+    }
+}
+
+impl Drop for StdoutTracer {
+    fn drop(&mut self) {
+        if !self.buf.is_empty() {
+            self.write_out();
+        }
+    }
+}
+
+/// `[RESET] pc=0x80000000`
+pub(super) fn push_reset(buf: &mut Vec<u8>, pc: u32) {
+    buf.extend_from_slice(b"[RESET] pc=");
+    push_hex(buf, pc, 8);
+    buf.push(b'\n');
+}
+
+/// `[EXIT]  code=0`
+pub(super) fn push_exit(buf: &mut Vec<u8>, code: u32) {
+    buf.extend_from_slice(b"[EXIT]  code=");
+    push_dec(buf, code);
+    buf.push(b'\n');
+}
+
+/// `[INST]  pc=0x80000000 inst=0x00000013`, register changes and newline follow
+pub(super) fn push_inst(buf: &mut Vec<u8>, pc: u32, inst: Inst) {
+    buf.extend_from_slice(b"[INST]  pc=");
+    push_hex(buf, pc, 8);
+    buf.extend_from_slice(b" inst=");
+    match inst {
+        Inst::NC(i) => push_hex(buf, i, 8),
+        Inst::C(i) => push_hex(buf, i as u32, 4),
+    }
+}
+
+/// ` asm="addi a0,a0,1"`
+pub(super) fn push_asm(buf: &mut Vec<u8>, disassembler: &Disassembler, pc: u32, inst: Inst) {
+    let inst = match inst {
+        Inst::NC(i) => i,
+        Inst::C(i) => i as u32,
+    };
+    buf.extend_from_slice(b" asm=\"");
+    disassembler.disasm(pc, inst, buf);
+    buf.push(b'"');
+}
+
+/// ` x1<-0x00000001`, prefix is b'x' or b'f'
+pub(super) fn push_reg(buf: &mut Vec<u8>, prefix: u8, rd: u8, value: u32) {
+    buf.extend_from_slice(&[b' ', prefix]);
+    push_dec(buf, rd as u32);
+    buf.extend_from_slice(b"<-");
+    push_hex(buf, value, 8);
+}
+
+/// ` v1<-0x...`, bytes of value from the highest
+pub(super) fn push_vreg(buf: &mut Vec<u8>, rd: u8, value: &[u8]) {
+    buf.extend_from_slice(b" v");
+    push_dec(buf, rd as u32);
+    buf.extend_from_slice(b"<-0x");
+    for &byte in value.iter().rev() {
+        buf.extend_from_slice(&[
+            HEX_DIGITS[(byte >> 4) as usize],
+            HEX_DIGITS[(byte & 0xf) as usize],
+        ]);
+    }
+}
+
+/// ` mstatus<-0x00001800`
+pub(super) fn push_csr(buf: &mut Vec<u8>, name: &str, value: u32) {
+    buf.push(b' ');
+    buf.extend_from_slice(name.as_bytes());
+    buf.extend_from_slice(b"<-");
+    push_hex(buf, value, 8);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_text_format() {
+        let mut buf = vec![];
+        push_reset(&mut buf, 0x8000_0000);
+        push_inst(&mut buf, 0x8000_0004, Inst::NC(0x0010_0093));
+        push_reg(&mut buf, b'x', 1, 1);
+        push_reg(&mut buf, b'f', 31, 0xdead_beef);
+        let vreg: Vec<u8> = (0..VLEN_BYTE as u8).map(|i| i.wrapping_mul(9)).collect();
+        push_vreg(&mut buf, 8, &vreg);
+        push_csr(&mut buf, "mstatus", 0x1800);
+        buf.push(b'\n');
+        push_inst(&mut buf, 0x8000_0008, Inst::C(0x4501));
+        buf.push(b'\n');
+        for code in [0, 7, 4_294_967_295] {
+            push_exit(&mut buf, code);
+        }
+
+        // same as the former print! based formatting
+        let mut expected = String::new();
+        expected += &format!("[RESET] pc={:#010x}\n", 0x8000_0000u32);
+        expected += &format!(
+            "[INST]  pc={:#010x} inst={:#010x}",
+            0x8000_0004u32, 0x0010_0093u32
+        );
+        expected += &format!(" x{}<-{:#010x}", 1, 1u32);
+        expected += &format!(" f{}<-{:#010x}", 31, 0xdead_beefu32);
+        expected += " v8<-0x";
+        for byte in vreg.iter().rev() {
+            expected += &format!("{byte:02x}");
+        }
+        expected += &format!(" mstatus<-{:#010x}\n", 0x1800u32);
+        expected += &format!(
+            "[INST]  pc={:#010x} inst={:#06x}\n",
+            0x8000_0008u32, 0x4501u16
+        );
+        for code in [0u32, 7, 4_294_967_295] {
+            expected += &format!("[EXIT]  code={code}\n");
+        }
+        assert_eq!(String::from_utf8(buf).unwrap(), expected);
+    }
+
+    #[test]
+    fn test_push_asm() {
+        let disassembler = Disassembler::global();
+        let mut buf = vec![];
+        push_asm(&mut buf, disassembler, 0x8000_0008, Inst::C(0x4501));
+        assert_eq!(buf, b" asm=\"c.li a0,0\"");
+
+        buf.clear();
+        push_asm(&mut buf, disassembler, 0x8000_0004, Inst::NC(0x0010_0093));
+        assert_eq!(buf, b" asm=\"addi ra,zero,1\"");
+    }
+}
@@ -0,0 +1,409 @@
+use std::{
+    fs::File,
+    io::{BufWriter, Write},
+    path::Path,
+};
+
+use crate::{
+    model::{Inst, StepDetail},
+    pokedex::Tracer,
+};
+
+use super::{
+    COMMIT_FLAG_COMPRESSED, HEADER_FLAG_VRF_DELTA, HEADER_SIZE, MAGIC, TAG_COMMIT, TAG_EXIT,
+    TAG_RESET, VERSION, VLEN_BYTE, zigzag_encode,
+};
+
+pub struct BinaryTracer {
+    writer: BufWriter<File>,
+    encoder: TraceEncoder,
+
+    // a record is assembled here, reused to avoid allocation per step
+    record: Vec<u8>,
+}
+
+impl BinaryTracer {
+    pub fn open(path: &Path, vrf_delta: bool) -> Result<Self, std::io::Error> {
+        File::create(path).and_then(|file| Self::from_file(file, vrf_delta))
+    }
+
+    pub fn from_file(file: File, vrf_delta: bool) -> Result<Self, std::io::Error> {
+        let mut writer = BufWriter::new(file);
+        writer.write_all(&file_header(vrf_delta))?;
+
+        Ok(Self {
+            writer,
+            encoder: TraceEncoder::new(vrf_delta),
+            record: Vec::with_capacity(256),
+        })
+    }
+
+    fn write_record(&mut self) {
+        self.writer
+            .write_all(&self.record)
+            .expect("trace write failed");
+        self.record.clear();
+    }
+}
+
+impl Tracer for BinaryTracer {
+    fn trace_reset(&mut self, pc: u32) {
+        self.encoder.encode_reset(&mut self.record, pc);
+        self.write_record();
+    }
+
+    fn trace_exit(&mut self, exit_code: u32) {
+        self.encoder.encode_exit(&mut self.record, exit_code);
+        self.write_record();
+    }
+
+    fn trace_step(&mut self, detail: StepDetail) {
+        self.encoder.encode_step(&mut self.record, detail);
+        self.write_record();
+    }
+
+    fn trace_skip(&mut self) {
+        self.encoder.skip();
+    }
+
+    fn flush(&mut self) {
+        self.writer.flush().expect("trace flush failed");
+    }
+}
+
+pub fn file_header(vrf_delta: bool) -> [u8; HEADER_SIZE] {
+    let flags = if vrf_delta { HEADER_FLAG_VRF_DELTA } else { 0 };
+
+    let mut header = [0u8; HEADER_SIZE];
+    header[0..8].copy_from_slice(&MAGIC);
+    header[8..10].copy_from_slice(&VERSION.to_le_bytes());
+    header[10..12].copy_from_slice(&flags.to_le_bytes());
+    header[12..14].copy_from_slice(&(VLEN_BYTE as u16).to_le_bytes());
+    header
+}
+
+/// Append binary trace records to a buffer
+pub struct TraceEncoder {
+    // fall-through pc of the last record, base of the next pc delta
+    next_pc: u32,
+
+    // some if VRF writes are delta encoded
+    vrf_shadow: Option<VrfShadow>,
+}
+
+/// Vector register values as seen by the trace reader
+struct VrfShadow {
+    vregs: Vec<u8>,
+    // bitmask of registers whose shadow may be outdated, they are written in full next time
+    stale: u32,
+}
+
+impl TraceEncoder {
+    pub fn new(vrf_delta: bool) -> Self {
+        Self {
+            next_pc: 0,
+            vrf_shadow: vrf_delta.then(|| VrfShadow {
+                vregs: vec![0; 32 * VLEN_BYTE],
+                stale: u32::MAX,
+            }),
+        }
+    }
+
+    /// Steps are executed without being encoded, the shadow VRF no longer follows the model
+    pub fn skip(&mut self) {
+        if let Some(shadow) = &mut self.vrf_shadow {
+            shadow.stale = u32::MAX;
+        }
+    }
+
+    pub fn encode_reset(&mut self, buf: &mut Vec<u8>, pc: u32) {
+        self.next_pc = pc;
+        self.skip();
+
+        buf.push(TAG_RESET);
+        buf.extend_from_slice(&pc.to_le_bytes());
+    }
+
+    pub fn encode_exit(&mut self, buf: &mut Vec<u8>, exit_code: u32) {
+        buf.push(TAG_EXIT);
+        buf.extend_from_slice(&exit_code.to_le_bytes());
+    }
+
+    pub fn encode_step(&mut self, buf: &mut Vec<u8>, detail: StepDetail) {
+        let Some(inst) = detail.inst else {
+            assert!(detail.changes.is_empty_changes());
+            return;
+        };
+
+        let changes = detail.changes;
+        let record_start = buf.len();
+
+        // counts are patched after the writes are collected
+        let (flags, inst_len) = match inst {
+            Inst::NC(_) => (0, 4),
+            Inst::C(_) => (COMMIT_FLAG_COMPRESSED, 2),
+        };
+        buf.extend_from_slice(&[TAG_COMMIT, flags, 0, 0, 0, 0]);
+
+        let delta = detail.pc.wrapping_sub(self.next_pc) as i32;
+        push_varint(buf, zigzag_encode(delta));
+        self.next_pc = detail.pc.wrapping_add(inst_len);
+
+        match inst {
+            Inst::NC(i) => buf.extend_from_slice(&i.to_le_bytes()),
+            Inst::C(i) => buf.extend_from_slice(&i.to_le_bytes()),
+        }
+
+        let mut counts = [0u8; 4];
+        for (rd, value) in changes.xreg_changes() {
+            buf.push(rd);
+            buf.extend_from_slice(&value.to_le_bytes());
+            counts[0] += 1;
+        }
+        for (rd, value) in changes.freg_changes() {
+            buf.push(rd);
+            buf.extend_from_slice(&value.to_le_bytes());
+            counts[1] += 1;
+        }
+        for rd in changes.vreg_change_indices() {
+            buf.push(rd);
+            match &mut self.vrf_shadow {
+                None => {
+                    let start = buf.len();
+                    buf.resize(start + VLEN_BYTE, 0);
+                    changes.core.read_vreg(rd, &mut buf[start..]);
+                }
+                Some(shadow) => {
+                    let mut value = [0u8; VLEN_BYTE];
+                    changes.core.read_vreg(rd, &mut value);
+
+                    let old = &mut shadow.vregs[rd as usize * VLEN_BYTE..][..VLEN_BYTE];
+                    if shadow.stale & (1 << rd) != 0 {
+                        shadow.stale &= !(1 << rd);
+                        push_vrf_full(buf, &value);
+                    } else {
+                        push_vrf_delta(buf, old, &value);
+                    }
+                    old.copy_from_slice(&value);
+                }
+            }
+            counts[2] += 1;
+        }
+        for csr in changes.csr_change_indices() {
+            buf.extend_from_slice(&csr.to_le_bytes());
+            buf.extend_from_slice(&changes.core.read_csr(csr).to_le_bytes());
+            counts[3] += 1;
+        }
+        buf[record_start + 2..][..4].copy_from_slice(&counts);
+    }
+}
+
+// Unchanged runs shorter than this are merged into the surrounding ranges,
+// since a new range costs at least two bytes
+const VRF_DELTA_MIN_GAP: usize = 3;
+
+// Delta encoded VRF write: number of ranges (u8),
+// then for each range, its offset to the end of the previous range, its length (varint),
+// and the new bytes
+pub(super) fn push_vrf_delta(buf: &mut Vec<u8>, old: &[u8], new: &[u8]) {
+    let count_at = buf.len();
+    buf.push(0);
+
+    let mut count = 0u8;
+    let mut prev_end = 0;
+    while let Some(start) = (prev_end..new.len()).find(|&i| old[i] != new[i]) {
+        let mut end = start + 1;
+        let mut i = end;
+        while i < new.len() && i < end + VRF_DELTA_MIN_GAP {
+            if old[i] != new[i] {
+                end = i + 1;
+            }
+            i += 1;
+        }
+
+        if count == u8::MAX {
+            // too scattered to count, the whole register is smaller anyway
+            buf.truncate(count_at);
+            push_vrf_full(buf, new);
+            return;
+        }
+        count += 1;
+        push_varint(buf, (start - prev_end) as u32);
+        push_varint(buf, (end - start) as u32);
+        buf.extend_from_slice(&new[start..end]);
+        prev_end = end;
+    }
+
+    buf[count_at] = count;
+}
+
+pub(super) fn push_vrf_full(buf: &mut Vec<u8>, value: &[u8]) {
+    buf.push(1);
+    push_varint(buf, 0);
+    push_varint(buf, value.len() as u32);
+    buf.extend_from_slice(value);
+}
+
+pub(super) fn push_varint(buf: &mut Vec<u8>, mut value: u32) {
+    while value >= 0x80 {
+        buf.push((value as u8) | 0x80);
+        value >>= 7;
+    }
+    buf.push(value as u8);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{
+        common::CommitWrites,
+        model::stub::{StubModel, StubStep},
+        trace::{
+            reader::{Record, TraceDecoder},
+            test_trace::TestTrace,
+        },
+        util::alloc_counter::allocations,
+    };
+
+    #[test]
+    fn test_encode_step_no_alloc() {
+        let v2 = [0x5a; VLEN_BYTE];
+        let mut v2_next = v2;
+        v2_next[7] = 1;
+        v2_next[20] = 2;
+        let steps = [
+            StubStep {
+                xrf: &[(1, 0x1234_5678), (31, 1)],
+                ..StubStep::commit(0x8000_0000, 0x0000_0013)
+            },
+            StubStep {
+                frf: &[(2, 0x3f80_0000)],
+                csrs: &[(0x001, 0x1), (0x003, 0x21)],
+                ..StubStep::commit(0x8000_0004, 0x0000_0053)
+            },
+            // v2 alternates between two values, delta encoded after its first write
+            StubStep {
+                vrf: &[(2, &v2)],
+                ..StubStep::commit(0x8000_0008, 0x5e00_3157)
+            },
+            StubStep {
+                vrf: &[(2, &v2_next)],
+                csrs: &[(0x300, 0x1800)],
+                ..StubStep::commit(0x8000_000c, 0x5e00_3157)
+            },
+            StubStep {
+                pc: 0x8000_0010,
+                inst: Some(Inst::C(0x4501)),
+                xrf: &[(10, 0)],
+                ..Default::default()
+            },
+            // a fetch exception has no record
+            StubStep {
+                pc: 0x8000_1000,
+                ..Default::default()
+            },
+        ];
+
+        for vrf_delta in [false, true] {
+            let mut model = StubModel::new();
+            let mut encoder = TraceEncoder::new(vrf_delta);
+            let mut trace = file_header(vrf_delta).to_vec();
+            trace.reserve(1 << 16);
+            encoder.encode_reset(&mut trace, 0x8000_0000);
+
+            let before = allocations();
+            for step in steps.iter().cycle().take(600) {
+                encoder.encode_step(&mut trace, model.step(step));
+            }
+            assert_eq!(allocations(), before, "encode_step should not allocate");
+
+            // commits decode to the writes of their steps
+            let (header, mut records) = trace.split_at(HEADER_SIZE);
+            let mut decoder = TraceDecoder::from_header(header.try_into().unwrap()).unwrap();
+            let mut writes = CommitWrites::default();
+            let mut vregs = [[0u8; VLEN_BYTE]; 32];
+            decoder.decode_record(&mut records, &mut writes).unwrap();
+            for step in steps.iter().filter(|s| s.inst.is_some()).cycle().take(500) {
+                let record = decoder.decode_record(&mut records, &mut writes).unwrap();
+                let (is_compressed, instruction) = match step.inst.unwrap() {
+                    Inst::NC(i) => (false, i),
+                    Inst::C(i) => (true, i as u32),
+                };
+                assert_eq!(
+                    record,
+                    Some(Record::Commit {
+                        pc: step.pc,
+                        is_compressed,
+                        instruction
+                    })
+                );
+                assert_eq!(writes.xrf, step.xrf);
+                assert_eq!(writes.frf, step.frf);
+                assert_eq!(writes.csr, step.csrs);
+                // a delta may be split into several patches of a register
+                let written = writes.vrf.iter().fold(0u32, |mask, w| mask | 1 << w.rd);
+                let expected = step.vrf.iter().fold(0u32, |mask, &(rd, _)| mask | 1 << rd);
+                assert_eq!(written, expected);
+                for (write, value) in writes.vrf_writes() {
+                    let offset = write.offset.unwrap_or(0) as usize;
+                    vregs[write.rd as usize][offset..][..value.len()].copy_from_slice(value);
+                }
+                for &(rd, value) in step.vrf {
+                    assert_eq!(&vregs[rd as usize], value);
+                }
+            }
+            assert!(records.is_empty());
+        }
+    }
+
+    #[test]
+    fn test_vrf_delta() {
+        let old: [u8; VLEN_BYTE] = std::array::from_fn(|i| i as u8);
+        let mut new = old;
+        // a short gap is merged, a long one splits ranges
+        new[1] = 0xaa;
+        new[3] = 0xbb;
+        new[20] = 0xcc;
+
+        let mut trace = TestTrace::with_vrf_delta(0, true);
+        for (i, value) in [&old, &new, &new].into_iter().enumerate() {
+            trace.step(&StubStep {
+                vrf: &[(5, value)],
+                ..StubStep::commit(4 * i as u32, 0x5e00_3157)
+            });
+        }
+
+        let (header, mut records) = trace.bytes().split_at(HEADER_SIZE);
+        let mut decoder = TraceDecoder::from_header(header.try_into().unwrap()).unwrap();
+        let mut writes = CommitWrites::default();
+        decoder.decode_record(&mut records, &mut writes).unwrap();
+        let mut next_patches = |records: &mut &[u8]| {
+            decoder.decode_record(records, &mut writes).unwrap();
+            let patches: Vec<_> = writes
+                .vrf_writes()
+                .map(|(w, value)| (w.rd, w.offset, value.to_vec()))
+                .collect();
+            (patches, serde_json::to_string(&writes).unwrap())
+        };
+
+        // the first write of a register is in full, the same as without delta encoding
+        let (patches, _) = next_patches(&mut records);
+        assert_eq!(patches, [(5, None, old.to_vec())]);
+
+        let len = records.len();
+        let (patches, _) = next_patches(&mut records);
+        assert_eq!(len - records.len(), 12 + 1 + 2 + 3 + 2 + 1);
+        assert_eq!(
+            patches,
+            [(5, Some(1), vec![0xaa, 2, 0xbb]), (5, Some(20), vec![0xcc])]
+        );
+
+        // rewritten with the same value
+        let (_, json) = next_patches(&mut records);
+        assert_eq!(
+            json,
+            r#"[{"dest":"vrfpatch","rd":5,"offset":0,"value":[]}]"#
+        );
+        assert!(records.is_empty());
+    }
+}
@@ -102,3 +102,205 @@ where
         (self.0)(f)
     }
 }
+
+pub const HEX_DIGITS: &[u8; 16] = b"0123456789abcdef";
+
+/// Same as format!("{value:#0width$x}"), where width includes the "0x" prefix,
+/// without going through std::fmt.
+pub fn push_hex(buf: &mut Vec<u8>, value: u32, digits: usize) {
+    buf.extend_from_slice(b"0x");
+    for i in (0..digits).rev() {
+        buf.push(HEX_DIGITS[(value >> (i * 4)) as usize & 0xf]);
+    }
+}
+
+/// Same as format!("{value}"), without going through std::fmt.
+pub fn push_dec(buf: &mut Vec<u8>, mut value: u32) {
+    let mut digits = [0u8; 10];
+    let mut start = digits.len();
+    loop {
+        start -= 1;
+        digits[start] = b'0' + (value % 10) as u8;
+        value /= 10;
+        if value == 0 {
+            break;
+        }
+    }
+    buf.extend_from_slice(&digits[start..]);
+}
+
+/// Position of the first `needle` in `haystack`, scanning a word at a time
+pub fn memchr(needle: u8, haystack: &[u8]) -> Option<usize> {
+    const LO: u64 = 0x0101_0101_0101_0101;
+    const HI: u64 = 0x8080_8080_8080_8080;
+
+    let pattern = LO * needle as u64;
+    let mut chunks = haystack.chunks_exact(8);
+    let mut offset = 0;
+    for chunk in &mut chunks {
+        let word = u64::from_le_bytes(chunk.try_into().unwrap()) ^ pattern;
+        // nonzero iff some byte of word is zero, the lowest flagged byte is exact
+        let found = word.wrapping_sub(LO) & !word & HI;
+        if found != 0 {
+            return Some(offset + (found.trailing_zeros() / 8) as usize);
+        }
+        offset += 8;
+    }
+    chunks
+        .remainder()
+        .iter()
+        .position(|&b| b == needle)
+        .map(|i| offset + i)
+}
+
+/// Read-only memory map of a whole file.
+/// A file which cannot be mapped, as a FIFO or a process substitution, is read into memory instead.
+pub struct Mmap {
+    ptr: *mut libc::c_void,
+    len: usize,
+    // the content of a file read instead of mapped
+    buffer: Option<Box<[u8]>>,
+}
+
+// SAFETY: the mapping is read-only and owned
+unsafe impl Send for Mmap {}
+unsafe impl Sync for Mmap {}
+
+impl Mmap {
+    /// The file is expected to be read sequentially
+    pub fn open(file: &std::fs::File) -> std::io::Result<Self> {
+        use std::{io::Read as _, os::fd::AsRawFd as _};
+
+        let metadata = file.metadata()?;
+        if !metadata.is_file() {
+            let mut buffer = vec![];
+            let mut file = file;
+            file.read_to_end(&mut buffer)?;
+            return Ok(Self {
+                ptr: std::ptr::null_mut(),
+                len: 0,
+                buffer: Some(buffer.into()),
+            });
+        }
+
+        let len = metadata.len() as usize;
+        if len == 0 {
+            // mmap refuses an empty length
+            return Ok(Self {
+                ptr: std::ptr::null_mut(),
+                len: 0,
+                buffer: None,
+            });
+        }
+
+        // SAFETY: a fresh private mapping, the file is not expected to change meanwhile
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+        // SAFETY: the range is the mapping above, failure is only a missed hint
+        unsafe {
+            libc::madvise(ptr, len, libc::MADV_SEQUENTIAL);
+        }
+        Ok(Self {
+            ptr,
+            len,
+            buffer: None,
+        })
+    }
+
+    pub fn as_slice(&self) -> &[u8] {
+        if let Some(buffer) = &self.buffer {
+            return buffer;
+        }
+        if self.len == 0 {
+            return &[];
+        }
+        // SAFETY: the mapping is valid until drop
+        unsafe { std::slice::from_raw_parts(self.ptr as *const u8, self.len) }
+    }
+
+    /// Drop the pages before `end` from the resident set,
+    /// they are read from the file again if accessed later.
+    /// A file read into memory keeps all of its content.
+    pub fn release(&self, end: usize) {
+        const PAGE_SIZE: usize = 4096;
+
+        let end = end.min(self.len) / PAGE_SIZE * PAGE_SIZE;
+        if end > 0 {
+            // SAFETY: the range is inside the mapping, which is backed by the file
+            unsafe {
+                libc::madvise(self.ptr, end, libc::MADV_DONTNEED);
+            }
+        }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        if self.len != 0 {
+            // SAFETY: the mapping is not borrowed anymore
+            unsafe {
+                libc::munmap(self.ptr, self.len);
+            }
+        }
+    }
+}
+
+// Count heap allocations per thread, for tests asserting a path does not allocate
+#[cfg(test)]
+pub mod alloc_counter {
+    use std::{
+        alloc::{GlobalAlloc, Layout, System},
+        cell::Cell,
+    };
+
+    struct CountingAllocator;
+
+    thread_local! {
+        static ALLOCATIONS: Cell<u64> = const { Cell::new(0) };
+    }
+
+    fn count() {
+        // may fail during thread teardown, such allocations are not interesting
+        let _ = ALLOCATIONS.try_with(|n| n.set(n.get() + 1));
+    }
+
+    unsafe impl GlobalAlloc for CountingAllocator {
+        unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+            count();
+            unsafe { System.alloc(layout) }
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+            unsafe { System.dealloc(ptr, layout) }
+        }
+
+        unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+            count();
+            unsafe { System.alloc_zeroed(layout) }
+        }
+
+        unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+            count();
+            unsafe { System.realloc(ptr, layout, new_size) }
+        }
+    }
+
+    #[global_allocator]
+    static GLOBAL: CountingAllocator = CountingAllocator;
+
+    /// Number of allocations made by the current thread so far
+    pub fn allocations() -> u64 {
+        ALLOCATIONS.with(|n| n.get())
+    }
+}
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+
+# Time each phase of the difftest pipeline over a set of cases, as `difftest.py`
+# runs them.
+#
+# Phases are measured per process: wall time, CPU time (user + system), peak RSS,
+# and bytes of the files the phase writes. The pokedex difftest is run twice,
+# with `--parse-only` it only replays both logs, the rest of a full run is diffing.
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from difftest import DifftestRunner
+
+PHASES = ["spike", "pokedex-run", "parse", "difftest"]
+
+
+def run_phase(argv: list[str], outputs: list[str]) -> dict:
+    start = time.perf_counter()
+    proc = subprocess.Popen(argv, stdout=subprocess.DEVNULL)
+    # wait4 gives the resource usage of this child alone
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.perf_counter() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        raise subprocess.CalledProcessError(proc.returncode, argv)
+
+    return {
+        "wall_seconds": wall,
+        "cpu_seconds": usage.ru_utime + usage.ru_stime,
+        # ru_maxrss is in KiB on Linux
+        "peak_rss_bytes": usage.ru_maxrss * 1024,
+        "bytes_written": sum(os.path.getsize(path) for path in outputs),
+    }
+
+
+def bench_case(runner: DifftestRunner, elf_path: str, work_dir: str) -> dict:
+    name = os.path.splitext(os.path.basename(elf_path))[0]
+    spike_log = os.path.join(work_dir, f"{name}_spike_commit.log")
+    pokedex_log = os.path.join(work_dir, f"{name}_pokedex_commit.jsonl")
+    parse_result = os.path.join(work_dir, f"{name}_parse_result.json")
+    diff_result = os.path.join(work_dir, f"{name}_diff_result.json")
+
+    difftest = [
+        runner.pokedex,
+        "difftest",
+        "--spike-log-path",
+        spike_log,
+        "--pokedex-log-path",
+        pokedex_log,
+    ]
+    phases = {
+        "spike": run_phase(
+            [runner.spike]
+            + runner.default_spike_args
+            + [f"--log={spike_log}", elf_path],
+            [spike_log],
+        ),
+        "pokedex-run": run_phase(
+            [runner.pokedex, "run"]
+            + runner.default_pokedex_args
+            + [f"--output-log-path={pokedex_log}", elf_path],
+            [pokedex_log],
+        ),
+        "parse": run_phase(
+            difftest + ["--parse-only", "--output-path", parse_result],
+            [parse_result],
+        ),
+        "difftest": run_phase(
+            difftest + ["--output-path", diff_result],
+            [diff_result],
+        ),
+    }
+    with open(diff_result, "rb") as result_file:
+        is_same = json.load(result_file)["is_same"]
+
+    return {"name": name, "elf": elf_path, "is_same": is_same, "phases": phases}
+
+
+def summarize(cases: list[dict]) -> dict:
+    total = {}
+    for phase in PHASES:
+        measures = [case["phases"][phase] for case in cases]
+        total[phase] = {
+            "wall_seconds": sum(m["wall_seconds"] for m in measures),
+            "cpu_seconds": sum(m["cpu_seconds"] for m in measures),
+            "peak_rss_bytes": max(
+                (m["peak_rss_bytes"] for m in measures), default=0
+            ),
+            "bytes_written": sum(m["bytes_written"] for m in measures),
+        }
+
+    # what the full difftest spends beyond replaying both logs
+    full, parse = total["difftest"], total["parse"]
+    total["diff"] = {
+        "wall_seconds": full["wall_seconds"] - parse["wall_seconds"],
+        "cpu_seconds": full["cpu_seconds"] - parse["cpu_seconds"],
+    }
+    return total
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("elfs", nargs="+", help="ELFs of the case set")
+    parser.add_argument(
+        "--output", help="path of the JSON results, stdout if not given"
+    )
+    parser.add_argument(
+        "--keep-dir",
+        help="keep the logs of each phase here instead of a temporary directory",
+    )
+    args = parser.parse_args()
+
+    runner = DifftestRunner()
+    with tempfile.TemporaryDirectory() as tmp_dir:
+        work_dir = args.keep_dir or tmp_dir
+        os.makedirs(work_dir, exist_ok=True)
+        cases = [bench_case(runner, elf, work_dir) for elf in args.elfs]
+
+    results = {"cases": cases, "total": summarize(cases)}
+    raw_json = json.dumps(results, indent=2)
+    if args.output:
+        with open(args.output, "w") as output:
+            output.write(raw_json)
+    else:
+        print(raw_json)
+
+    # a differing case is timed all the same, but is no baseline to track
+    if not all(case["is_same"] for case in cases):
+        print("Critical: some cases differ from spike!", file=sys.stderr)
+        exit(1)
+
+
+if __name__ == "__main__":
+    main()
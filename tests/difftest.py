@@ -2,8 +2,67 @@
 
 import subprocess
 import argparse
+import hashlib
 import os
 import json
+import tempfile
+from concurrent.futures import ThreadPoolExecutor
+
+
+# A simulator failed, raised rather than exiting so that callers on worker threads can report it
+class DifftestError(Exception):
+    pass
+
+
+def hash_file(path: str) -> bytes:
+    digest = hashlib.sha256()
+    with open(path, "rb") as file:
+        while chunk := file.read(1 << 20):
+            digest.update(chunk)
+    return digest.digest()
+
+
+# Results of cases keyed by everything a run depends on, looked up before Spike
+# and pokedex run. Only passing results are stored, a failing case always reruns
+# and leaves its logs for debugging.
+class ResultCache:
+    def __init__(self, cache_dir: str, runner: "DifftestRunner") -> None:
+        os.makedirs(cache_dir, exist_ok=True)
+        self.cache_dir = cache_dir
+
+        # shared by all cases: both simulators with their arguments, the model
+        # library pokedex loads instead of its bundled one, and this runner
+        dylib = os.environ.get("POKEDEX_MODEL_DYLIB")
+        digest = hashlib.sha256()
+        for path in [runner.spike, runner.pokedex, runner.pokedex_config, __file__]:
+            digest.update(hash_file(path))
+        if dylib:
+            digest.update(hash_file(dylib))
+        args = [runner.default_spike_args, runner.default_pokedex_args, dylib]
+        digest.update(json.dumps(args).encode())
+        self.base = digest
+
+    # single and batch results are of different shapes, each mode has its own keys
+    def key(self, elf_path: str, mode: str) -> str:
+        digest = self.base.copy()
+        digest.update(mode.encode())
+        digest.update(hash_file(elf_path))
+        return digest.hexdigest()
+
+    def get(self, key: str) -> dict | None:
+        try:
+            with open(os.path.join(self.cache_dir, f"{key}.json")) as entry:
+                return json.load(entry)
+        except (OSError, json.JSONDecodeError):
+            return None
+
+    def put(self, key: str, result: dict):
+        path = os.path.join(self.cache_dir, f"{key}.json")
+        # renamed into place, so concurrent readers never see a partial entry
+        tmp_path = f"{path}.tmp{os.getpid()}"
+        with open(tmp_path, "w") as entry:
+            json.dump(result, entry)
+        os.replace(tmp_path, path)
 
 
 class DifftestRunner:
@@ -11,13 +70,15 @@ class DifftestRunner:
     default_spike_args: list[str]
     pokedex: str
     default_pokedex_args: list[str]
+    pokedex_config: str
+    cache: ResultCache | None
 
     def __init__(self) -> None:
         self.spike = os.environ["SPIKE"]
         self.pokedex = os.environ["POKEDEX"]
 
         march = os.environ["MARCH"]
-        pokedex_config = os.environ["POKEDEX_CONFIG"]
+        self.pokedex_config = os.environ["POKEDEX_CONFIG"]
 
         self.default_spike_args = [
             f"--isa={march}",
@@ -29,41 +90,39 @@ class DifftestRunner:
             "-m0x80000000:0x20000000,0x40000000:0x1000",
         ]
 
-        self.default_pokedex_args = ["--config-path", pokedex_config]
+        self.default_pokedex_args = ["--config-path", self.pokedex_config]
+
+        self.cache = None
+        if cache_dir := os.environ.get("DIFFTEST_CACHE_DIR"):
+            self.cache = ResultCache(cache_dir, self)
 
     def run_spike(self, elf_path: str, log_path: str):
         try:
             subprocess.check_call(
                 [self.spike] + self.default_spike_args + [f"--log={log_path}", elf_path]
             )
-        except subprocess.CalledProcessError:
-            print("Critical: spike crash!")
-            exit(1)
+        except subprocess.CalledProcessError as e:
+            raise DifftestError("spike crash!") from e
 
-    def run_pokedex(self, elf_path: str, log_path: str):
+    def run_pokedex(
+        self, elf_path: str, log_path: str, extra_args: list[str] | None = None
+    ):
         try:
             subprocess.run(
                 [self.pokedex, "run"]
                 + self.default_pokedex_args
+                + (extra_args or [])
                 + [f"--output-log-path={log_path}", elf_path],
                 capture_output=True,
                 text=True,
             ).check_returncode()
         except subprocess.CalledProcessError as e:
-            print(f"Critical: pokedex crash!\nSTDOUT:\n{e.stdout}\nSTDERR:\n{e.stderr}")
-            exit(1)
+            raise DifftestError(
+                f"pokedex crash!\nSTDOUT:\n{e.stdout}\nSTDERR:\n{e.stderr}"
+            ) from e
 
-    def difftest(
-        self,
-        elf_path: str,
-        spike_log_path: str,
-        pokedex_log_path: str,
-        result_path: str,
-    ):
-        self.run_spike(elf_path, spike_log_path)
-        self.run_pokedex(elf_path, pokedex_log_path)
-        # run difftest
-        subprocess.check_call(
+    def run_differ(self, spike_log_path: str, pokedex_log_path: str, result_path: str):
+        return subprocess.Popen(
             [
                 self.pokedex,
                 "difftest",
@@ -76,6 +135,167 @@ class DifftestRunner:
             ]
         )
 
+    # A passing result of an unchanged case is reused without running anything,
+    # its logs are left empty then. Otherwise `run` writes the result.
+    def run_cached(self, elf_path: str, result_path: str, log_paths: list[str], run):
+        if self.cache is None:
+            run()
+            return
+
+        key = self.cache.key(elf_path, "single")
+        if (result := self.cache.get(key)) is not None:
+            print(f"{elf_path}: cached result")
+            for path in log_paths:
+                open(path, "w").close()
+            with open(result_path, "w") as result_file:
+                json.dump(result, result_file)
+            return
+
+        run()
+        with open(result_path) as result_file:
+            result = json.load(result_file)
+        if result["is_same"]:
+            self.cache.put(key, result)
+
+    # pokedex streams its trace to the differ over a Unix socket, no pokedex log is kept
+    def difftest_stream(self, elf_path: str, spike_log_path: str, result_path: str):
+        self.run_cached(
+            elf_path,
+            result_path,
+            [spike_log_path],
+            lambda: self._difftest_stream(elf_path, spike_log_path, result_path),
+        )
+
+    def _difftest_stream(self, elf_path: str, spike_log_path: str, result_path: str):
+        self.run_spike(elf_path, spike_log_path)
+        with tempfile.TemporaryDirectory() as tmp_dir:
+            socket = f"unix:{os.path.join(tmp_dir, 'pokedex.sock')}"
+            differ = self.run_differ(spike_log_path, socket, result_path)
+            try:
+                self.run_pokedex(
+                    elf_path,
+                    socket,
+                    ["--trace-format=binary", "--trace-stream-window=16"],
+                )
+                if differ.wait() != 0:
+                    raise subprocess.CalledProcessError(differ.returncode, differ.args)
+            finally:
+                if differ.poll() is None:
+                    differ.kill()
+
+    # Spike runs once per case, pokedex runs and diffs all cases in one process.
+    # Cases with a cached passing report run neither.
+    def difftest_batch(self, manifest_path: str, report_path: str) -> int:
+        base_dir = os.path.dirname(manifest_path)
+        with open(manifest_path) as manifest:
+            cases = [
+                line.split()
+                for line in manifest
+                if line.strip() and not line.lstrip().startswith("#")
+            ]
+
+        keys = {}
+        cached = []
+        if self.cache is not None:
+            for elf, spike_log in cases:
+                key = self.cache.key(os.path.join(base_dir, elf), "batch")
+                if (entry := self.cache.get(key)) is not None:
+                    cached.append({**entry, "cached": True})
+                else:
+                    keys[elf] = key
+            cases = [(elf, spike_log) for elf, spike_log in cases if elf in keys]
+
+        with ThreadPoolExecutor() as pool:
+            spikes = [
+                pool.submit(
+                    self.run_spike,
+                    os.path.join(base_dir, elf),
+                    os.path.join(base_dir, spike_log),
+                )
+                for elf, spike_log in cases
+            ]
+            # every case is waited for, all failures are reported at once
+            errors = [
+                f"{elf}: {spike.exception()}"
+                for (elf, _), spike in zip(cases, spikes)
+                if spike.exception() is not None
+            ]
+        if errors:
+            raise DifftestError("\n".join(errors))
+
+        if self.cache is None:
+            return subprocess.call(
+                [self.pokedex, "difftest-batch"]
+                + self.default_pokedex_args
+                + ["--output-path", report_path, manifest_path]
+            )
+
+        report = {"workers": 0, "seconds": 0.0, "passed": 0, "failed": 0, "cases": []}
+        if cases:
+            # a stale report must not pass for the one of a crashed run
+            if os.path.exists(report_path):
+                os.remove(report_path)
+            # the manifest of the uncached cases, next to the original one
+            # since its paths are relative to it
+            with tempfile.NamedTemporaryFile(
+                "w", dir=base_dir or ".", suffix=".txt"
+            ) as uncached:
+                uncached.writelines(f"{elf} {spike_log}\n" for elf, spike_log in cases)
+                uncached.flush()
+                returncode = subprocess.call(
+                    [self.pokedex, "difftest-batch"]
+                    + self.default_pokedex_args
+                    + ["--output-path", report_path, uncached.name]
+                )
+            # failing cases still write the report, a crash does not
+            try:
+                with open(report_path) as report_file:
+                    report = json.load(report_file)
+            except (OSError, json.JSONDecodeError):
+                return returncode or 1
+
+        for case in report["cases"]:
+            case["cached"] = False
+            if case["is_same"]:
+                self.cache.put(keys[case["name"]], case)
+
+        report["cases"] = sorted(report["cases"] + cached, key=lambda c: c["name"])
+        report["passed"] = sum(case["is_same"] for case in report["cases"])
+        report["failed"] = len(report["cases"]) - report["passed"]
+        with open(report_path, "w") as report_file:
+            json.dump(report, report_file, indent=2)
+        return 0 if report["failed"] == 0 else 1
+
+    def difftest(
+        self,
+        elf_path: str,
+        spike_log_path: str,
+        pokedex_log_path: str,
+        result_path: str,
+    ):
+        self.run_cached(
+            elf_path,
+            result_path,
+            [spike_log_path, pokedex_log_path],
+            lambda: self._difftest(
+                elf_path, spike_log_path, pokedex_log_path, result_path
+            ),
+        )
+
+    def _difftest(
+        self,
+        elf_path: str,
+        spike_log_path: str,
+        pokedex_log_path: str,
+        result_path: str,
+    ):
+        self.run_spike(elf_path, spike_log_path)
+        self.run_pokedex(elf_path, pokedex_log_path)
+        # run difftest
+        differ = self.run_differ(spike_log_path, pokedex_log_path, result_path)
+        if differ.wait() != 0:
+            raise subprocess.CalledProcessError(differ.returncode, differ.args)
+
 
 def main():
     parser = argparse.ArgumentParser()
@@ -84,6 +304,15 @@ def main():
     parser.add_argument("--pokedex-log")
     parser.add_argument("--diff-result")
     parser.add_argument("--check", action="store_true")
+    parser.add_argument(
+        "--stream",
+        action="store_true",
+        help="stream the pokedex trace to difftest instead of writing --pokedex-log",
+    )
+    parser.add_argument(
+        "--batch-manifest",
+        help="difftest each (ELF, Spike log) line of it, into one --diff-result",
+    )
     args = parser.parse_args()
 
     if args.check and args.diff_result:
@@ -95,11 +324,22 @@ def main():
 
     diff_runner = DifftestRunner()
 
-    if args.elf and args.diff_result and args.spike_log and args.pokedex_log:
-        diff_runner.difftest(
-            args.elf, args.spike_log, args.pokedex_log, args.diff_result
-        )
-        exit(0)
+    try:
+        if args.batch_manifest and args.diff_result:
+            exit(diff_runner.difftest_batch(args.batch_manifest, args.diff_result))
+
+        if args.stream and args.elf and args.diff_result and args.spike_log:
+            diff_runner.difftest_stream(args.elf, args.spike_log, args.diff_result)
+            exit(0)
+
+        if args.elf and args.diff_result and args.spike_log and args.pokedex_log:
+            diff_runner.difftest(
+                args.elf, args.spike_log, args.pokedex_log, args.diff_result
+            )
+            exit(0)
+    except DifftestError as e:
+        print(f"Critical: {e}")
+        exit(1)
 
     print("Critial: invalid argument combination!")
     exit(1)